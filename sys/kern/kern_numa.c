@@ -6,6 +6,10 @@
  * userspace and modifying the memory allocator to make allocation decisions
  * based on this information. The indicated APIs should support thread level
  * NUMA domain affinity.
+ *
+ * The code is written against FreeBSD 10, the base of the NUMANOR kernel
+ * configuration: cnt, vm_dom[], td_dom_rr_idx and pc_domain, without the
+ * domain allocation interfaces of later releases.
  * 
  * Last Edited: February 08, 2014
  */
@@ -14,7 +18,10 @@
 /* ----------- INCLUDES ----------- */
 #include <sys/cdefs.h>
 
-#include <asm/uaccess.h>
+#include "opt_acpi.h"
+#include "opt_compat.h"
+#include "opt_kdtrace.h"
+
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/systm.h>
@@ -36,12 +43,3149 @@
 #include <sys/libkern.h>
 #include <sys/limits.h>
 #include <sys/bus.h>
+#include <sys/counter.h>
+#include <sys/eventhandler.h>
+#include <sys/osd.h>
+#include <sys/pcpu.h>
+#include <sys/kthread.h>
+#include <sys/rwlock.h>
+#include <sys/sdt.h>
+#include <sys/sysctl.h>
+#include <sys/sysent.h>
+#include <sys/taskqueue.h>
+#include <sys/vmmeter.h>
+
+#include <sys/freebsdnuma.h>
+
+#include <vm/vm.h>
+#include <vm/vm_param.h>
+#include <vm/pmap.h>
+#include <vm/vm_map.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
+#include <vm/vm_phys.h>
+
+#if defined(__amd64__) || defined(__i386__)
+#include <machine/cpufunc.h>
+#include <machine/md_var.h>
+#include <machine/specialreg.h>
+#ifdef DEV_ACPI
+#include <contrib/dev/acpica/include/acpi.h>
+#include <dev/acpica/acpivar.h>
+#endif
+#endif
+
+#ifdef COMPAT_FREEBSD32
+#include <compat/freebsd32/freebsd32.h>
+#include <compat/freebsd32/freebsd32_proto.h>
+#endif
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * numa_weights_cache: The vm_ndomains x vm_ndomains distance matrix between
+ *      memory domains, row major.  Filled in once at boot from the ACPI
+ *      locality table (SLIT) and read only afterwards, so get_numa_weights()
+ *      copies it out without locking or allocating.
+ */
+static short numa_weights_cache[MAXMEMDOM * MAXMEMDOM];
+
+/*
+ * numa_tier_cache: The NUMA_TIER of every memory domain, NUMA_TIER_SLOW for
+ *      the domains no CPU belongs to.  Filled in once the CPUs are known and
+ *      read without locking afterwards.
+ */
+static int8_t numa_tier_cache[MAXMEMDOM];
+
+/*
+ * DTrace probes of the numa provider:
+ *      numa::syscall:entry (name)
+ *      numa::syscall:return (name, error, latency in ns)
+ *      numa::policy:place (pid, CPU domain, requested domain or -1 without
+ *          a policy, granted domain)
+ *      numa::page:migrate (pid, source domain, target domain, bytes)
+ * A disabled probe costs a test and a branch.  The syscall clock is only
+ * read while numa::syscall:return is enabled, which NUMA_TRACE_TIMED() tells
+ * from the probe's id as SDT_PROBE() itself does.
+ */
+SDT_PROVIDER_DEFINE(numa);
+SDT_PROBE_DEFINE1(numa, , syscall, entry, entry, "char *");
+SDT_PROBE_DEFINE3(numa, , syscall, return, return, "char *", "int",
+    "uint64_t");
+SDT_PROBE_DEFINE4(numa, , policy, place, place, "pid_t", "int", "int",
+    "int");
+SDT_PROBE_DEFINE4(numa, , page, migrate, migrate, "pid_t", "int", "int",
+    "size_t");
+SDT_PROBE_DEFINE4(numa, , sched, migrate, migrate, "pid_t", "lwpid_t", "int",
+    "int");
+
+#ifdef KDTRACE_HOOKS
+#define NUMA_TRACE_TIMED()      (sdt_numa__syscall_return->id != 0)
+#else
+#define NUMA_TRACE_TIMED()      0
+#endif
+
+#if (defined(__amd64__) || defined(__i386__)) && defined(DEV_ACPI)
+/*
+ * Copy the distances from the SLIT.  The VM numbers domains in ascending
+ * order of proximity domain and the SRAT code keeps that mapping to itself,
+ * so the table is only used when its rows are exactly the vm_ndomains
+ * domains, proximity domains 0 to vm_ndomains - 1.  Returns 0 if there is no
+ * such table.
+ */
+static int
+numa_weights_slit(void)
+{
+	ACPI_TABLE_SLIT *slit;
+	vm_paddr_t paddr;
+	int i, j, ok;
+
+	if ((paddr = acpi_find_table(ACPI_SIG_SLIT)) == 0)
+		return (0);
+	if ((slit = acpi_map_table(paddr, ACPI_SIG_SLIT)) == NULL)
+		return (0);
+	ok = slit->LocalityCount == vm_ndomains &&
+	    slit->Header.Length >= offsetof(ACPI_TABLE_SLIT, Entry) +
+	    vm_ndomains * vm_ndomains;
+	for (i = 0; ok && i < vm_ndomains; i++)
+		for (j = 0; j < vm_ndomains; j++)
+			numa_weights_cache[i * vm_ndomains + j] =
+			    slit->Entry[i * vm_ndomains + j];
+	acpi_unmap_table(slit);
+	return (ok);
+}
+#endif
+
+static void
+numa_weights_init(void *arg __unused)
+{
+	int i, j;
+
+#if (defined(__amd64__) || defined(__i386__)) && defined(DEV_ACPI)
+	if (numa_weights_slit())
+		return;
+#endif
+	/* No locality table, use the ACPI default distances. */
+	for (i = 0; i < vm_ndomains; i++)
+		for (j = 0; j < vm_ndomains; j++)
+			numa_weights_cache[i * vm_ndomains + j] = (i == j) ?
+			    NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+}
+SYSINIT(numa_weights, SI_SUB_VM_CONF, SI_ORDER_ANY, numa_weights_init, NULL);
+
+static void
+numa_tier_init(void *arg __unused)
+{
+	int c, d;
+
+	for (d = 0; d < vm_ndomains; d++)
+		numa_tier_cache[d] = NUMA_TIER_SLOW;
+	CPU_FOREACH(c)
+		numa_tier_cache[pcpu_find(c)->pc_domain] = NUMA_TIER_FAST;
+}
+SYSINIT(numa_tier, SI_SUB_SMP, SI_ORDER_ANY, numa_tier_init, NULL);
+
+/*
+ * Memory policies.  A policy set on a thread lives in the thread's OSD slot
+ * numa_policy_osd.  Policies set on a process or a cpuset are kept in
+ * numa_policy_hash, keyed by (which, id), and protected by numa_policy_lock.
+ * Every change bumps numa_policy_gen; a thread caches its effective policy
+ * together with the generation it was resolved at, so the page allocator
+ * only takes the lock after a change.
+ *
+ * The physical page allocator asks numa_page_domains() which domains a new
+ * page should come from; the NUMANOR kernel carries that hook as patches to
+ * vm_page.c, vm_phys.c and vm_reserv.c, see patches/.  The numa_sched
+ * thread is the fallback: it moves the pages of a process that sit outside
+ * its policy anyway, placed before the policy was set or on another domain
+ * once the allowed ones were exhausted, see numa_sched_period().
+ *
+ * Threads inherit the policy set on the creating thread, a forked process
+ * inherits the effective policy of the forking thread.
+ */
+#define NUMA_POLICY_HASHSIZE    64
+
+struct numa_policy_ent {
+	LIST_ENTRY(numa_policy_ent) npe_link;
+	cpuwhich_t	npe_which;	/* CPU_WHICH_PID or CPU_WHICH_CPUSET */
+	id_t		npe_id;
+	struct numa_policy npe_policy;
+};
+
+struct numa_td_policy {
+	int		ntp_own_set;	/* ntp_own was set on the thread */
+	struct numa_policy ntp_own;
+	u_int		ntp_gen;	/* generation of ntp_eff */
+	int		ntp_eff_set;	/* a policy applies, ntp_eff is it */
+	struct numa_policy ntp_eff;
+	struct numa_balance_stat ntp_balance;	/* sampled faults by page domain */
+	int		ntp_suggest;	/* domain suggested by the balancer + 1 */
+	struct numa_pstat *ntp_pstat;	/* statistics of the process */
+};
+
+static MALLOC_DEFINE(M_NUMA, "numa", "NUMA memory policies");
+static LIST_HEAD(, numa_policy_ent) numa_policy_hash[NUMA_POLICY_HASHSIZE];
+static struct rwlock numa_policy_lock;
+static volatile u_int numa_policy_gen = 1;
+static volatile u_int numa_policy_count;	/* entries in the hash */
+static u_int numa_policy_osd;
+
+#define NUMA_POLICY_HASH(which, id)                                     \
+        (&numa_policy_hash[((u_int)(id) * 31 + (which)) % NUMA_POLICY_HASHSIZE])
+
+static void
+numa_policy_default(struct numa_policy *np)
+{
+
+	np->np_policy = NUMA_POLICY_NEAREST;
+	CPU_ZERO(&np->np_mask);
+}
+
+static struct numa_policy_ent *
+numa_policy_lookup(cpuwhich_t which, id_t id)
+{
+	struct numa_policy_ent *npe;
+
+	rw_assert(&numa_policy_lock, RA_LOCKED);
+	LIST_FOREACH(npe, NUMA_POLICY_HASH(which, id), npe_link)
+		if (npe->npe_which == which && npe->npe_id == id)
+			return (npe);
+	return (NULL);
+}
+
+/*
+ * Attach np to (which, id), or detach any policy if np is NULL.  newent is a
+ * preallocated entry, consumed if it was needed.
+ */
+static void
+numa_policy_store(cpuwhich_t which, id_t id, const struct numa_policy *np,
+    struct numa_policy_ent **newent)
+{
+	struct numa_policy_ent *npe;
+
+	rw_wlock(&numa_policy_lock);
+	npe = numa_policy_lookup(which, id);
+	if (np == NULL) {
+		if (npe != NULL) {
+			LIST_REMOVE(npe, npe_link);
+			atomic_subtract_int(&numa_policy_count, 1);
+			*newent = npe;	/* Let the caller free it. */
+		}
+	} else {
+		if (npe == NULL) {
+			npe = *newent;
+			*newent = NULL;
+			npe->npe_which = which;
+			npe->npe_id = id;
+			LIST_INSERT_HEAD(NUMA_POLICY_HASH(which, id), npe,
+			    npe_link);
+			atomic_add_int(&numa_policy_count, 1);
+		}
+		npe->npe_policy = *np;
+	}
+	atomic_add_int(&numa_policy_gen, 1);
+	rw_wunlock(&numa_policy_lock);
+}
+
+/*
+ * Resolve the policy of a thread without its OSD cache: the thread's own
+ * policy, else its process's, else its cpuset's, else the default.  Returns
+ * 0 if the default applies because no policy was set.
+ */
+static int
+numa_policy_resolve(struct thread *td, const struct numa_td_policy *ntp,
+    struct numa_policy *np)
+{
+	struct numa_policy_ent *npe;
+
+	if (ntp != NULL && ntp->ntp_own_set) {
+		*np = ntp->ntp_own;
+		return (1);
+	}
+	rw_rlock(&numa_policy_lock);
+	npe = numa_policy_lookup(CPU_WHICH_PID, td->td_proc->p_pid);
+	if (npe == NULL)
+		npe = numa_policy_lookup(CPU_WHICH_CPUSET,
+		    td->td_cpuset->cs_id);
+	if (npe != NULL)
+		*np = npe->npe_policy;
+	else
+		numa_policy_default(np);
+	rw_runlock(&numa_policy_lock);
+	return (npe != NULL);
+}
+
+/*
+ * The OSD slot of td, created for curthread, which caches its effective
+ * policy.  Returns NULL for another thread without one or if memory is
+ * short.
+ */
+static struct numa_td_policy *
+numa_td_policy_get(struct thread *td)
+{
+	struct numa_td_policy *ntp;
+
+	ntp = osd_thread_get(td, numa_policy_osd);
+	if (ntp != NULL || td != curthread)
+		return (ntp);
+	ntp = malloc(sizeof(*ntp), M_NUMA, M_NOWAIT | M_ZERO);
+	if (ntp == NULL)
+		return (NULL);
+	if (osd_thread_set(td, numa_policy_osd, ntp) != 0) {
+		free(ntp, M_NUMA);
+		return (NULL);
+	}
+	return (ntp);
+}
+
+static void
+numa_td_policy_dtor(void *arg)
+{
+	struct numa_td_policy *ntp;
+
+	ntp = arg;
+	if (ntp->ntp_own_set)
+		atomic_add_int(&numa_policy_gen, 1);
+	free(ntp, M_NUMA);
+}
+
+static void
+numa_policy_thread_ctor(void *arg __unused, struct thread *td)
+{
+	struct numa_td_policy *parent, *ntp;
+
+	/* thread_alloc() runs in the context of the creating thread. */
+	parent = osd_thread_get(curthread, numa_policy_osd);
+	if (parent == NULL || !parent->ntp_own_set)
+		return;
+	ntp = malloc(sizeof(*ntp), M_NUMA, M_NOWAIT | M_ZERO);
+	if (ntp == NULL)
+		return;
+	ntp->ntp_own_set = 1;
+	ntp->ntp_own = parent->ntp_own;
+	if (osd_thread_set(td, numa_policy_osd, ntp) != 0)
+		free(ntp, M_NUMA);
+	else
+		atomic_add_int(&numa_policy_gen, 1);
+}
+
+static void
+numa_policy_fork(void *arg __unused, struct proc *p1 __unused,
+    struct proc *p2, int flags __unused)
+{
+	struct numa_policy_ent *npe;
+	struct numa_policy np;
+
+	numa_policy_resolve(curthread,
+	    osd_thread_get(curthread, numa_policy_osd), &np);
+	/*
+	 * Balancing and tier migration are not inherited, the child has to
+	 * opt in itself.  Fast tier first placement is.
+	 */
+	np.np_policy &= NUMA_POLICY_MASK | NUMA_POLICY_TIERED;
+	if (np.np_policy == NUMA_POLICY_NEAREST && CPU_EMPTY(&np.np_mask))
+		return;
+	npe = malloc(sizeof(*npe), M_NUMA, M_WAITOK | M_ZERO);
+	numa_policy_store(CPU_WHICH_PID, p2->p_pid, &np, &npe);
+	free(npe, M_NUMA);
+}
+
+static void
+numa_policy_exit(void *arg __unused, struct proc *p)
+{
+	struct numa_policy_ent *npe;
+
+	npe = NULL;
+	numa_policy_store(CPU_WHICH_PID, p->p_pid, NULL, &npe);
+	free(npe, M_NUMA);
+}
+
+static void
+numa_policy_init(void *arg __unused)
+{
+	int i;
+
+	for (i = 0; i < NUMA_POLICY_HASHSIZE; i++)
+		LIST_INIT(&numa_policy_hash[i]);
+	rw_init(&numa_policy_lock, "numa policy");
+	numa_policy_osd = osd_thread_register(numa_td_policy_dtor);
+	EVENTHANDLER_REGISTER(thread_ctor, numa_policy_thread_ctor, NULL,
+	    EVENTHANDLER_PRI_ANY);
+	EVENTHANDLER_REGISTER(process_fork, numa_policy_fork, NULL,
+	    EVENTHANDLER_PRI_ANY);
+	EVENTHANDLER_REGISTER(process_exit, numa_policy_exit, NULL,
+	    EVENTHANDLER_PRI_ANY);
+}
+SYSINIT(numa_policy, SI_SUB_VM_CONF, SI_ORDER_ANY, numa_policy_init, NULL);
+
+/*
+ * Range policies.  mbind() attaches a policy to a range of page indices of
+ * a VM object, so the pages of a shared memory segment or a file end up in
+ * the same place for every process mapping it.  Ranges of the same object
+ * never overlap; they live in numa_range_hash keyed by object and are
+ * protected by numa_range_lock.  numa_page_domains() places new pages of a
+ * range as its policy asks, mbind() moves the resident ones with NUMA_MOVE,
+ * and numa_sched_scan() moves those that were placed elsewhere when the
+ * allowed domains ran out.  While numa_range_count is zero neither looks
+ * ranges up at all.  An interleaved range deals its pages out by page index
+ * rather than by a thread's cursor, so the placement of a page does not
+ * depend on who touched it first.
+ *
+ * The entries hold no reference on their object, so they neither keep its
+ * memory alive nor stop it from being collapsed into its shadow.  Instead
+ * vm_object_destroy() calls numa_object_terminate() before the object is
+ * freed (see patches/vm_object.c.diff), which drops its ranges, so
+ * nr_object never points to a freed object.  numa_range_lock nests inside
+ * the object lock.
+ */
+#define NUMA_RANGE_HASHSIZE     64
+
+struct numa_range {
+	LIST_ENTRY(numa_range) nr_link;
+	vm_object_t	nr_object;
+	vm_pindex_t	nr_start;	/* first page index */
+	vm_pindex_t	nr_end;		/* first page index past the range */
+	struct numa_policy nr_policy;
+};
+
+LIST_HEAD(numa_range_list, numa_range);
+
+static struct numa_range_list numa_range_hash[NUMA_RANGE_HASHSIZE];
+static struct rwlock numa_range_lock;
+static volatile u_int numa_range_count;
+
+#define NUMA_RANGE_HASH(obj)                                            \
+        (&numa_range_hash[((uintptr_t)(obj) >> 8) % NUMA_RANGE_HASHSIZE])
+
+static struct numa_range *
+numa_range_lookup(vm_object_t obj, vm_pindex_t pindex)
+{
+	struct numa_range *nr;
+
+	rw_assert(&numa_range_lock, RA_LOCKED);
+	LIST_FOREACH(nr, NUMA_RANGE_HASH(obj), nr_link)
+		if (nr->nr_object == obj && nr->nr_start <= pindex &&
+		    pindex < nr->nr_end)
+			return (nr);
+	return (NULL);
+}
+
+static void
+numa_range_unlink(struct numa_range *nr, struct numa_range_list *dead)
+{
+
+	rw_assert(&numa_range_lock, RA_WLOCKED);
+	LIST_REMOVE(nr, nr_link);
+	LIST_INSERT_HEAD(dead, nr, nr_link);
+	atomic_subtract_int(&numa_range_count, 1);
+}
+
+/*
+ * Attach np to pages [start, end) of obj, or detach any policy there if np
+ * is NULL.  Ranges overlapping the new one are trimmed, split or removed.
+ * spare[0] and spare[1] are preallocated entries, for the new range and for
+ * the tail of a split one; used entries are set to NULL.  Removed entries
+ * are put on dead for numa_range_free().
+ */
+static void
+numa_range_store(vm_object_t obj, vm_pindex_t start, vm_pindex_t end,
+    const struct numa_policy *np, struct numa_range **spare,
+    struct numa_range_list *dead)
+{
+	struct numa_range *nr, *tail, *tmp;
+
+	rw_wlock(&numa_range_lock);
+	LIST_FOREACH_SAFE(nr, NUMA_RANGE_HASH(obj), nr_link, tmp) {
+		if (nr->nr_object != obj || nr->nr_end <= start ||
+		    nr->nr_start >= end)
+			continue;
+		if (nr->nr_start < start && nr->nr_end > end) {
+			tail = spare[1];
+			spare[1] = NULL;
+			*tail = *nr;
+			tail->nr_start = end;
+			LIST_INSERT_HEAD(NUMA_RANGE_HASH(obj), tail, nr_link);
+			atomic_add_int(&numa_range_count, 1);
+			nr->nr_end = start;
+		} else if (nr->nr_start < start)
+			nr->nr_end = start;
+		else if (nr->nr_end > end)
+			nr->nr_start = end;
+		else
+			numa_range_unlink(nr, dead);
+	}
+	if (np != NULL) {
+		nr = spare[0];
+		spare[0] = NULL;
+		nr->nr_object = obj;
+		nr->nr_start = start;
+		nr->nr_end = end;
+		nr->nr_policy = *np;
+		LIST_INSERT_HEAD(NUMA_RANGE_HASH(obj), nr, nr_link);
+		atomic_add_int(&numa_range_count, 1);
+	}
+	rw_wunlock(&numa_range_lock);
+}
+
+/*
+ * The domain an interleaved policy gives page pindex: the domains of the
+ * mask are dealt out in order, one page each.
+ */
+static int
+numa_range_interleave(const struct numa_policy *np, vm_pindex_t pindex)
+{
+	int d, k, n;
+
+	if (CPU_EMPTY(&np->np_mask))
+		return (pindex % vm_ndomains);
+	n = CPU_COUNT(&np->np_mask);
+	k = pindex % n;
+	for (d = 0; d < vm_ndomains; d++)
+		if (CPU_ISSET(d, &np->np_mask) && k-- == 0)
+			break;
+	return (d);
+}
+
+/*
+ * Copy the range policy covering pindex of obj to np.  Returns 0 if there is
+ * none.
+ */
+static int
+numa_range_policy(vm_object_t obj, vm_pindex_t pindex, struct numa_policy *np)
+{
+	struct numa_range *nr;
+
+	if (numa_range_count == 0 || obj == NULL)
+		return (0);
+	rw_rlock(&numa_range_lock);
+	nr = numa_range_lookup(obj, pindex);
+	if (nr != NULL)
+		*np = nr->nr_policy;
+	rw_runlock(&numa_range_lock);
+	return (nr != NULL);
+}
+
+/*
+ * Fill order with the domains a new page of index pindex should come from
+ * under np, for a thread on domain home, and return their number.  An
+ * interleaved page starts at the domain its index deals it to, as the
+ * scanner expects it there, and falls back by distance from that one.
+ */
+static int
+numa_policy_domains(const struct numa_policy *np, vm_pindex_t pindex,
+    int home, int *order)
+{
+	struct numa_policy near;
+	u_int rr;
+	int n;
+
+	near = *np;
+	if ((np->np_policy & NUMA_POLICY_MASK) == NUMA_POLICY_INTERLEAVE) {
+		near.np_policy = NUMA_POLICY_NEAREST;
+		home = numa_range_interleave(np, pindex);
+	}
+	rr = 0;
+	n = numa_policy_order(&near, vm_ndomains, numa_weights_cache, home,
+	    &rr, order);
+	if ((np->np_policy & NUMA_POLICY_TIERED) != 0)
+		numa_tier_order(numa_tier_cache, order,
+		    CPU_EMPTY(&np->np_mask) ? n : CPU_COUNT(&np->np_mask));
+	return (n);
+}
+
+/*
+ * The domain a page of index pindex, now on domain src, should move to under
+ * np, or -1 if it is where np wants it.  An interleaved page goes to the
+ * domain its index deals it to, any other page only moves if it sits outside
+ * the mask, to the first domain numa_policy_domains() gives it from src: the
+ * nearest allowed one, of the fast tier if there is one for a tiered policy.
+ */
+static int
+numa_policy_misplaced(const struct numa_policy *np, vm_pindex_t pindex,
+    int src)
+{
+	int order[MAXMEMDOM];
+	int dst;
+
+	if ((np->np_policy & NUMA_POLICY_MASK) == NUMA_POLICY_INTERLEAVE) {
+		dst = numa_range_interleave(np, pindex);
+		return (dst == src ? -1 : dst);
+	}
+	if (CPU_EMPTY(&np->np_mask) || CPU_ISSET(src, &np->np_mask))
+		return (-1);
+	(void)numa_policy_domains(np, pindex, src, order);
+	return (order[0]);
+}
+
+/*
+ * The domain page pindex of obj, now on domain src, should move to under
+ * its range policy, or -1 if it is where the policy wants it.
+ */
+static int
+numa_range_target(vm_object_t obj, vm_pindex_t pindex, int src)
+{
+	struct numa_policy np;
+
+	if (!numa_range_policy(obj, pindex, &np))
+		return (-1);
+	return (numa_policy_misplaced(&np, pindex, src));
+}
+
+/*
+ * Copy the policy a new page pindex of obj allocated by td follows to np:
+ * the range policy covering it, else the effective policy of td, cached in
+ * its OSD slot until the next policy change.  Returns 0 if none applies.
+ * Called with obj locked, so it must not sleep.
+ */
+static int
+numa_page_policy(struct thread *td, vm_object_t obj, vm_pindex_t pindex,
+    struct numa_policy *np)
+{
+	struct numa_td_policy *ntp;
+	u_int gen;
+
+	if (numa_range_policy(obj, pindex, np))
+		return (1);
+	ntp = osd_thread_get(td, numa_policy_osd);
+	if (numa_policy_count == 0 && (ntp == NULL || !ntp->ntp_own_set))
+		return (0);
+	if (ntp == NULL && (ntp = numa_td_policy_get(td)) == NULL)
+		return (numa_policy_resolve(td, NULL, np));
+	gen = numa_policy_gen;
+	if (ntp->ntp_gen != gen) {
+		ntp->ntp_eff_set = numa_policy_resolve(td, ntp, &ntp->ntp_eff);
+		ntp->ntp_gen = gen;
+	}
+	*np = ntp->ntp_eff;
+	return (ntp->ntp_eff_set);
+}
+
+/*
+ * The allocator hook: fill order with the domains page pindex of obj should
+ * come from when td faults it in, in the order vm_page_alloc() tries them.
+ * Returns 0 if no policy applies and vm_phys picks the domain as usual.
+ */
+int
+numa_page_domains(struct thread *td, vm_object_t obj, vm_pindex_t pindex,
+    int *order)
+{
+	struct numa_policy np;
+
+	if (vm_ndomains < 2 || obj == kernel_object || obj == kmem_object ||
+	    (td->td_proc->p_flag & P_SYSTEM) != 0)
+		return (0);
+	if (!numa_page_policy(td, obj, pindex, &np))
+		return (0);
+	return (numa_policy_domains(&np, pindex, PCPU_GET(domain), order));
+}
+
+/*
+ * Free the entries of dead.
+ */
+static void
+numa_range_free(struct numa_range_list *dead)
+{
+	struct numa_range *nr, *tmp;
+
+	LIST_FOREACH_SAFE(nr, dead, nr_link, tmp)
+		free(nr, M_NUMA);
+}
+
+void
+numa_object_terminate(vm_object_t obj)
+{
+	struct numa_range_list dead;
+	struct numa_range *nr, *tmp;
+
+	if (numa_range_count == 0)
+		return;
+	LIST_INIT(&dead);
+	rw_wlock(&numa_range_lock);
+	LIST_FOREACH_SAFE(nr, NUMA_RANGE_HASH(obj), nr_link, tmp)
+		if (nr->nr_object == obj)
+			numa_range_unlink(nr, &dead);
+	rw_wunlock(&numa_range_lock);
+	numa_range_free(&dead);
+}
+
+/*
+ * Whether the locked obj is private anonymous memory: referenced by one
+ * mapping only and shadowed by no other object.
+ */
+static int
+numa_object_private(vm_object_t obj)
+{
+
+	VM_OBJECT_ASSERT_LOCKED(obj);
+	return ((obj->type == OBJT_DEFAULT || obj->type == OBJT_SWAP) &&
+	    obj->shadow_count == 0 && obj->ref_count == 1);
+}
+
+static void
+numa_range_init(void *arg __unused)
+{
+	int i;
+
+	for (i = 0; i < NUMA_RANGE_HASHSIZE; i++)
+		LIST_INIT(&numa_range_hash[i]);
+	rw_init(&numa_range_lock, "numa range");
+}
+SYSINIT(numa_range, SI_SUB_VM_CONF, SI_ORDER_ANY, numa_range_init, NULL);
+
+/*
+ * Placement statistics.  numa_stat_domain counts events per domain with
+ * counter(9), so counting touches only per-CPU memory.  Per-process counts
+ * live in a numa_pstat hashed by pid.  It is created the first time a thread
+ * of the process allocates a page, or by the first batch that moves pages
+ * of the process, and freed when the process exits.  Every thread caches a
+ * pointer to it in its policy OSD, so the page allocation path looks it up
+ * once.
+ */
+#define NUMA_PSTAT_HASHSIZE     64
+
+struct numa_pstat {
+	LIST_ENTRY(numa_pstat) nps_link;
+	pid_t		nps_pid;
+	counter_u64_t	nps_count[NUMA_STAT_COUNT];
+};
+
+static SYSCTL_NODE(_kern, OID_AUTO, numa, CTLFLAG_RW, 0, "NUMA");
+static SYSCTL_NODE(_kern_numa, OID_AUTO, stats, CTLFLAG_RD, 0,
+    "NUMA placement statistics");
+
+static const char *numa_stat_names[NUMA_STAT_COUNT] = {
+	"local", "remote", "interleave", "fallback", "migrated",
+	"migrate_failed"
+};
+static const char *numa_stat_descr[NUMA_STAT_COUNT] = {
+	"Pages allocated on the domain of the allocating CPU",
+	"Pages allocated for a CPU of another domain",
+	"Pages placed on the domain picked by the interleave policy",
+	"Pages allocated after the preferred domain was full",
+	"Pages moved to the domain",
+	"Pages that could not be moved to the domain"
+};
+static counter_u64_t numa_stat_domain[MAXMEMDOM][NUMA_STAT_COUNT];
+static char numa_stat_dname[MAXMEMDOM][4];
+static struct sysctl_ctx_list numa_stat_ctx;
+static LIST_HEAD(, numa_pstat) numa_pstat_hash[NUMA_PSTAT_HASHSIZE];
+static struct rwlock numa_pstat_lock;
+RW_SYSINIT(numa_pstat, &numa_pstat_lock, "numa pstat");
+
+#define NUMA_PSTAT_HASH(pid)                                            \
+        (&numa_pstat_hash[(u_int)(pid) % NUMA_PSTAT_HASHSIZE])
+
+static struct numa_pstat *
+numa_pstat_lookup(pid_t pid)
+{
+	struct numa_pstat *nps;
+
+	rw_assert(&numa_pstat_lock, RA_LOCKED);
+	LIST_FOREACH(nps, NUMA_PSTAT_HASH(pid), nps_link)
+		if (nps->nps_pid == pid)
+			return (nps);
+	return (NULL);
+}
+
+static void
+numa_pstat_free(struct numa_pstat *nps)
+{
+	int i;
+
+	for (i = 0; i < NUMA_STAT_COUNT; i++)
+		if (nps->nps_count[i] != NULL)
+			counter_u64_free(nps->nps_count[i]);
+	free(nps, M_NUMA);
+}
+
+/*
+ * Return the statistics of pid, creating them.  May return NULL with
+ * M_NOWAIT.
+ */
+static struct numa_pstat *
+numa_pstat_get(pid_t pid, int how)
+{
+	struct numa_pstat *nps, *old;
+	int i;
+
+	rw_rlock(&numa_pstat_lock);
+	nps = numa_pstat_lookup(pid);
+	rw_runlock(&numa_pstat_lock);
+	if (nps != NULL)
+		return (nps);
+	if ((nps = malloc(sizeof(*nps), M_NUMA, how | M_ZERO)) == NULL)
+		return (NULL);
+	nps->nps_pid = pid;
+	for (i = 0; i < NUMA_STAT_COUNT; i++)
+		if ((nps->nps_count[i] = counter_u64_alloc(how)) == NULL) {
+			numa_pstat_free(nps);
+			return (NULL);
+		}
+	rw_wlock(&numa_pstat_lock);
+	if ((old = numa_pstat_lookup(pid)) == NULL)
+		LIST_INSERT_HEAD(NUMA_PSTAT_HASH(pid), nps, nps_link);
+	rw_wunlock(&numa_pstat_lock);
+	if (old != NULL) {
+		numa_pstat_free(nps);
+		nps = old;
+	}
+	return (nps);
+}
+
+/*
+ * Count page m, allocated by td for a user object, in the statistics of its
+ * domain and of the process of td, and fire numa::policy:place.  order holds
+ * the n domains numa_page_domains() asked for, none if no policy applies.
+ * The statistics of the process are only created while P_WEXIT is clear:
+ * the flag is set by the exiting thread itself once the others are gone, so
+ * numa_pstat_exit() has not run yet and frees them.
+ */
+void
+numa_page_alloc_stat(struct thread *td, const int *order, int n, vm_page_t m)
+{
+	struct numa_td_policy *ntp;
+	struct numa_policy np;
+	int d, i, ns, stat[3];
+
+	if (vm_ndomains < 2 || m->object == kernel_object ||
+	    m->object == kmem_object || (td->td_proc->p_flag & P_SYSTEM) != 0)
+		return;
+	d = vm_phys_domain(m) - vm_dom;
+	ns = 0;
+	stat[ns++] = d == PCPU_GET(domain) ? NUMA_STAT_LOCAL :
+	    NUMA_STAT_REMOTE;
+	if (n > 0 && d != order[0])
+		stat[ns++] = NUMA_STAT_FALLBACK;
+	else if (n > 0 && numa_page_policy(td, m->object, m->pindex, &np) &&
+	    (np.np_policy & NUMA_POLICY_MASK) == NUMA_POLICY_INTERLEAVE)
+		stat[ns++] = NUMA_STAT_INTERLEAVE;
+	for (i = 0; i < ns; i++)
+		counter_u64_add(numa_stat_domain[d][stat[i]], 1);
+	SDT_PROBE4(numa, , policy, place, td->td_proc->p_pid, PCPU_GET(domain),
+	    n > 0 ? order[0] : -1, d);
+
+	if ((ntp = numa_td_policy_get(td)) == NULL)
+		return;
+	if (ntp->ntp_pstat == NULL &&
+	    (td->td_proc->p_flag & P_WEXIT) == 0)
+		ntp->ntp_pstat = numa_pstat_get(td->td_proc->p_pid, M_NOWAIT);
+	if (ntp->ntp_pstat != NULL)
+		for (i = 0; i < ns; i++)
+			counter_u64_add(ntp->ntp_pstat->nps_count[stat[i]], 1);
+}
+
+/*
+ * Charge moved and failed pages of a page move to pid, creating its
+ * statistics.  They are created under the process lock while P_WEXIT is
+ * clear, so numa_pstat_exit() cannot have run yet and frees them.
+ */
+static void
+numa_pstat_moved(pid_t pid, int moved, int failed)
+{
+	struct numa_pstat *nps;
+	struct proc *p;
+
+	if (moved == 0 && failed == 0)
+		return;
+	if ((p = pfind(pid)) == NULL)
+		return;
+	if ((p->p_flag & (P_WEXIT | P_SYSTEM)) == 0 &&
+	    (nps = numa_pstat_get(pid, M_NOWAIT)) != NULL) {
+		counter_u64_add(nps->nps_count[NUMA_STAT_MIGRATED], moved);
+		counter_u64_add(nps->nps_count[NUMA_STAT_MIGRATE_FAILED],
+		    failed);
+	}
+	PROC_UNLOCK(p);
+}
+
+static void
+numa_pstat_exit(void *arg __unused, struct proc *p)
+{
+	struct numa_td_policy *ntp;
+	struct numa_pstat *nps;
+
+	rw_wlock(&numa_pstat_lock);
+	if ((nps = numa_pstat_lookup(p->p_pid)) != NULL)
+		LIST_REMOVE(nps, nps_link);
+	rw_wunlock(&numa_pstat_lock);
+	/* The exiting thread is the last one that may cache it. */
+	if ((ntp = osd_thread_get(curthread, numa_policy_osd)) != NULL)
+		ntp->ntp_pstat = NULL;
+	if (nps != NULL)
+		numa_pstat_free(nps);
+}
+
+/*
+ * kern.numa.stats.snapshot.<pid>: a struct numa_stats with every domain
+ * counter and the counters of pid, the calling process for 0, none for -1.
+ */
+static int
+sysctl_numa_stats_snapshot(SYSCTL_HANDLER_ARGS)
+{
+	struct numa_stats *st;
+	struct numa_pstat *nps;
+	struct proc *p;
+	pid_t pid;
+	int d, error, i;
+
+	if (arg2 != 1)
+		return (EINVAL);
+	pid = ((int *)arg1)[0];
+	if (pid == 0)
+		pid = req->td->td_proc->p_pid;
+	else if (pid > 0) {
+		error = pget(pid, PGET_CANSEE, &p);
+		if (error != 0)
+			return (error);
+		PROC_UNLOCK(p);
+	}
+
+	st = malloc(sizeof(*st), M_NUMA, M_WAITOK | M_ZERO);
+	st->ns_ndomains = vm_ndomains;
+	st->ns_pid = pid;
+	for (d = 0; d < vm_ndomains; d++)
+		for (i = 0; i < NUMA_STAT_COUNT; i++)
+			st->ns_domain[d][i] =
+			    counter_u64_fetch(numa_stat_domain[d][i]);
+	if (pid > 0) {
+		rw_rlock(&numa_pstat_lock);
+		if ((nps = numa_pstat_lookup(pid)) != NULL)
+			for (i = 0; i < NUMA_STAT_COUNT; i++)
+				st->ns_proc[i] =
+				    counter_u64_fetch(nps->nps_count[i]);
+		rw_runlock(&numa_pstat_lock);
+	}
+	error = SYSCTL_OUT(req, st, sizeof(*st));
+	free(st, M_NUMA);
+	return (error);
+}
+static SYSCTL_NODE(_kern_numa_stats, OID_AUTO, snapshot,
+    CTLFLAG_RD | CTLFLAG_MPSAFE, sysctl_numa_stats_snapshot,
+    "Domain and process counters, by pid");
+
+static void
+numa_stat_init(void *arg __unused)
+{
+	struct sysctl_oid *oid;
+	int d, i;
+
+	for (i = 0; i < NUMA_PSTAT_HASHSIZE; i++)
+		LIST_INIT(&numa_pstat_hash[i]);
+	sysctl_ctx_init(&numa_stat_ctx);
+	for (d = 0; d < vm_ndomains; d++) {
+		snprintf(numa_stat_dname[d], sizeof(numa_stat_dname[d]), "%d",
+		    d);
+		oid = SYSCTL_ADD_NODE(&numa_stat_ctx,
+		    SYSCTL_STATIC_CHILDREN(_kern_numa_stats), OID_AUTO,
+		    numa_stat_dname[d], CTLFLAG_RD, NULL, "Domain counters");
+		for (i = 0; i < NUMA_STAT_COUNT; i++) {
+			numa_stat_domain[d][i] = counter_u64_alloc(M_WAITOK);
+			SYSCTL_ADD_COUNTER_U64(&numa_stat_ctx,
+			    SYSCTL_CHILDREN(oid), OID_AUTO, numa_stat_names[i],
+			    CTLFLAG_RD, &numa_stat_domain[d][i],
+			    numa_stat_descr[i]);
+		}
+	}
+	EVENTHANDLER_REGISTER(process_exit, numa_pstat_exit, NULL,
+	    EVENTHANDLER_PRI_ANY);
+}
+SYSINIT(numa_stat, SI_SUB_VM_CONF, SI_ORDER_ANY, numa_stat_init, NULL);
+
+/*
+ * Topology page.  A struct numa_shared in the shared page, which is mapped
+ * read-only into every process, lets libnumanor read the topology without
+ * a syscall.  Updates make nsh_gen odd while the page is rewritten, so a
+ * reader that sees the same even generation before and after its copy has
+ * a consistent one.  On x86 TSC_AUX is loaded with the CPU id, so rdtscp
+ * also tells a thread where it runs.
+ */
+static struct numa_shared numa_shared_copy;
+static int numa_shared_off = -1;
+static struct mtx numa_shared_mtx;
+MTX_SYSINIT(numa_shared, &numa_shared_mtx, "numa shared", MTX_DEF);
+
+#if defined(__amd64__) || defined(__i386__)
+static void
+numa_shared_tscaux(void *arg __unused)
+{
+
+	wrmsr(MSR_TSC_AUX, PCPU_GET(cpuid));
+}
+
+/* TSC_AUX does not survive a suspend. */
+static void
+numa_shared_resume(void *arg __unused)
+{
+
+	smp_rendezvous(NULL, numa_shared_tscaux, NULL, NULL);
+}
+#endif
+
+void
+numa_shared_update(void)
+{
+	struct numa_shared *nsh;
+	const size_t skip = sizeof(nsh->nsh_gen);
+	int c, d, e;
+
+	if (numa_shared_off < 0)
+		return;
+	nsh = &numa_shared_copy;
+	mtx_lock(&numa_shared_mtx);
+	nsh->nsh_gen++;
+	shared_page_write(numa_shared_off, skip, (const void *)&nsh->nsh_gen);
+	wmb();
+	nsh->nsh_ndomains = vm_ndomains;
+	nsh->nsh_ncpus = MIN(mp_maxid + 1, NUMA_SHARED_MAXCPU);
+	memset(nsh->nsh_cpu_domain, -1, sizeof(nsh->nsh_cpu_domain));
+	CPU_FOREACH(c)
+		if (c < NUMA_SHARED_MAXCPU)
+			nsh->nsh_cpu_domain[c] = pcpu_find(c)->pc_domain;
+	for (d = 0; d < vm_ndomains; d++)
+		for (e = 0; e < vm_ndomains; e++)
+			nsh->nsh_weights[d * vm_ndomains + e] =
+			    MIN(numa_weights_cache[d * vm_ndomains + e],
+			    0xff);
+	shared_page_write(numa_shared_off + skip, sizeof(*nsh) - skip,
+	    (char *)nsh + skip);
+	wmb();
+	nsh->nsh_gen++;
+	shared_page_write(numa_shared_off, skip, (const void *)&nsh->nsh_gen);
+	mtx_unlock(&numa_shared_mtx);
+}
+
+static int
+sysctl_numa_shared(SYSCTL_HANDLER_ARGS)
+{
+	struct sysentvec *sv;
+	uint32_t addr32;
+	u_long addr;
+
+	sv = req->td->td_proc->p_sysent;
+	if (numa_shared_off < 0 || sv->sv_shared_page_obj == NULL)
+		return (ENOENT);
+	addr = sv->sv_shared_page_base + numa_shared_off;
+#ifdef SCTL_MASK32
+	if ((req->flags & SCTL_MASK32) != 0) {
+		addr32 = addr;
+		return (SYSCTL_OUT(req, &addr32, sizeof(addr32)));
+	}
+#endif
+	return (SYSCTL_OUT(req, &addr, sizeof(addr)));
+}
+SYSCTL_PROC(_kern_numa, OID_AUTO, shared,
+    CTLTYPE_ULONG | CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, 0, sysctl_numa_shared,
+    "LU", "Address of the NUMA topology page");
+
+static void
+numa_shared_init(void *arg __unused)
+{
+
+	/* Larger machines are left to get_numa_cpus() and friends. */
+	if (vm_ndomains > NUMA_SHARED_MAXDOM)
+		return;
+	numa_shared_off = shared_page_alloc(sizeof(struct numa_shared), 16);
+	if (numa_shared_off < 0)
+		return;
+#if defined(__amd64__) || defined(__i386__)
+	if ((amd_feature & AMDID_RDTSCP) != 0) {
+		smp_rendezvous(NULL, numa_shared_tscaux, NULL, NULL);
+		numa_shared_copy.nsh_flags |= NUMA_SHARED_RDTSCP;
+		EVENTHANDLER_REGISTER(power_resume, numa_shared_resume, NULL,
+		    EVENTHANDLER_PRI_ANY);
+	}
+#endif
+	numa_shared_update();
+}
+SYSINIT(numa_shared, SI_SUB_SMP, SI_ORDER_ANY, numa_shared_init, NULL);
+
+/*
+ * Page migration.  Pages are handled NUMA_MOVE_BATCH at a time.  A batch is
+ * sorted by VM object and page index so every object is locked once per
+ * phase, and the mappings of consecutive private pages are removed with one
+ * pmap_remove() call, i.e. one TLB shootdown per run instead of one per
+ * page.  Pages are exclusive busied while the object lock is dropped for the
+ * copy, which runs on a taskqueue bound to the CPUs of the target domain
+ * when enough pages go there, so copies to different domains proceed in
+ * parallel and read the destination from local memory.
+ */
+#define NUMA_MOVE_BATCH         512
+#define NUMA_COPY_MIN           16      /* pages worth handing to a taskqueue */
+
+struct numa_move_ent {
+	vm_offset_t	nme_addr;
+	int		nme_node;	/* target domain, -1 to query */
+	int		nme_status;	/* domain or negative errno */
+	int		nme_shared;
+	vm_object_t	nme_object;
+	vm_pindex_t	nme_pindex;
+	vm_page_t	nme_old;
+	vm_page_t	nme_new;
+};
+
+struct numa_move_ctx {
+	struct numa_move_ent nmc_ents[NUMA_MOVE_BATCH];
+	struct numa_move_ent *nmc_sorted[NUMA_MOVE_BATCH];
+	struct numa_move_ent *nmc_moved[NUMA_MOVE_BATCH];
+	void		*nmc_pages[NUMA_MOVE_BATCH];
+#ifdef COMPAT_FREEBSD32
+	uint32_t	nmc_pages32[NUMA_MOVE_BATCH];
+#endif
+	int		nmc_node[NUMA_MOVE_BATCH];
+	int		nmc_status[NUMA_MOVE_BATCH];
+	pid_t		nmc_pid;	/* process charged in the statistics */
+};
+
+struct numa_copy_work {
+	struct task	ncw_task;
+	struct numa_move_ent **ncw_ents;
+	int		ncw_count;
+	int		*ncw_pending;
+};
+
+static struct taskqueue *numa_copy_tq[MAXMEMDOM];
+static cpuset_t numa_copy_cpus[MAXMEMDOM];
+static struct task numa_copy_bind_task[MAXMEMDOM];
+static struct mtx numa_copy_mtx;
+MTX_SYSINIT(numa_copy, &numa_copy_mtx, "numa copy", MTX_DEF);
+
+static int
+numa_page_domain(vm_page_t m)
+{
+
+	return (vm_phys_domain(m) - vm_dom);
+}
+
+/*
+ * Bind the thread of a copy taskqueue to the CPUs of its domain.
+ */
+static void
+numa_copy_bind(void *arg, int pending __unused)
+{
+
+	(void)cpuset_setthread(curthread->td_tid, arg);
+}
+
+static void
+numa_copy_init(void *arg __unused)
+{
+	int c, d;
+
+	if (vm_ndomains < 2)
+		return;
+	CPU_FOREACH(c)
+		CPU_SET(c, &numa_copy_cpus[pcpu_find(c)->pc_domain]);
+	for (d = 0; d < vm_ndomains; d++) {
+		/* A CPU-less domain is copied to by the calling thread. */
+		if (CPU_EMPTY(&numa_copy_cpus[d]))
+			continue;
+		numa_copy_tq[d] = taskqueue_create("numa_copy", M_WAITOK,
+		    taskqueue_thread_enqueue, &numa_copy_tq[d]);
+		taskqueue_start_threads(&numa_copy_tq[d], 1, PVM,
+		    "numa_copy%d", d);
+		TASK_INIT(&numa_copy_bind_task[d], 0, numa_copy_bind,
+		    &numa_copy_cpus[d]);
+		taskqueue_enqueue(numa_copy_tq[d], &numa_copy_bind_task[d]);
+	}
+}
+SYSINIT(numa_copy, SI_SUB_SMP, SI_ORDER_ANY, numa_copy_init, NULL);
+
+static void
+numa_copy_pages(struct numa_move_ent **ents, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		pmap_copy_page(ents[i]->nme_old, ents[i]->nme_new);
+}
+
+static void
+numa_copy_task(void *arg, int pending __unused)
+{
+	struct numa_copy_work *ncw;
+
+	ncw = arg;
+	numa_copy_pages(ncw->ncw_ents, ncw->ncw_count);
+	mtx_lock(&numa_copy_mtx);
+	if (--*ncw->ncw_pending == 0)
+		wakeup(ncw->ncw_pending);
+	mtx_unlock(&numa_copy_mtx);
+}
+
+static int
+numa_move_cmp_dst(const void *a, const void *b)
+{
+	const struct numa_move_ent *ea, *eb;
+
+	ea = *(struct numa_move_ent * const *)a;
+	eb = *(struct numa_move_ent * const *)b;
+	return (ea->nme_node - eb->nme_node);
+}
+
+/*
+ * Copy every page of ents, sorted by target domain first.  Runs of at least
+ * NUMA_COPY_MIN pages are queued to the target domain's taskqueue, the rest
+ * is copied by the calling thread while the queued work runs.
+ */
+static void
+numa_copy_batch(struct numa_move_ent **ents, int n)
+{
+	struct numa_copy_work work[MAXMEMDOM];
+	int i, j, nwork, pending;
+
+	qsort(ents, n, sizeof(*ents), numa_move_cmp_dst);
+	nwork = 0;
+	pending = 0;
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && ents[j]->nme_node == ents[i]->nme_node;
+		    j++)
+			;
+		if (j - i < NUMA_COPY_MIN ||
+		    numa_copy_tq[ents[i]->nme_node] == NULL) {
+			numa_copy_pages(&ents[i], j - i);
+			continue;
+		}
+		TASK_INIT(&work[nwork].ncw_task, 0, numa_copy_task,
+		    &work[nwork]);
+		work[nwork].ncw_ents = &ents[i];
+		work[nwork].ncw_count = j - i;
+		work[nwork].ncw_pending = &pending;
+		mtx_lock(&numa_copy_mtx);
+		pending++;
+		mtx_unlock(&numa_copy_mtx);
+		taskqueue_enqueue(numa_copy_tq[ents[i]->nme_node],
+		    &work[nwork].ncw_task);
+		nwork++;
+	}
+	mtx_lock(&numa_copy_mtx);
+	while (pending != 0)
+		msleep(&pending, &numa_copy_mtx, PVM, "numacp", 0);
+	mtx_unlock(&numa_copy_mtx);
+}
+
+static int
+numa_move_cmp_obj(const void *a, const void *b)
+{
+	const struct numa_move_ent *ea, *eb;
+
+	ea = *(struct numa_move_ent * const *)a;
+	eb = *(struct numa_move_ent * const *)b;
+	if (ea->nme_object != eb->nme_object)
+		return ((uintptr_t)ea->nme_object < (uintptr_t)eb->nme_object ?
+		    -1 : 1);
+	if (ea->nme_pindex != eb->nme_pindex)
+		return (ea->nme_pindex < eb->nme_pindex ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Find the object and page index backing nme_addr.  Only pages of the top
+ * object of an anonymous mapping are candidates; pages still shared through
+ * a backing object are reported as not present.  Returns with a reference
+ * on nme_object, or with nme_status set.
+ */
+static void
+numa_move_resolve(vm_map_t map, struct numa_move_ent *e, int flags)
+{
+	vm_map_entry_t entry;
+	vm_object_t obj;
+
+	e->nme_object = NULL;
+	if (!vm_map_lookup_entry(map, trunc_page(e->nme_addr), &entry) ||
+	    (entry->eflags & MAP_ENTRY_IS_SUB_MAP) != 0 ||
+	    (obj = entry->object.vm_object) == NULL) {
+		e->nme_status = -EFAULT;
+		return;
+	}
+	VM_OBJECT_RLOCK(obj);
+	e->nme_shared = !numa_object_private(obj);
+	if (e->nme_shared && e->nme_node >= 0 &&
+	    (flags & NUMA_MOVE_ALL) == 0) {
+		VM_OBJECT_RUNLOCK(obj);
+		e->nme_status = -EACCES;
+		return;
+	}
+	vm_object_reference_locked(obj);
+	VM_OBJECT_RUNLOCK(obj);
+	e->nme_object = obj;
+	e->nme_pindex = OFF_TO_IDX(trunc_page(e->nme_addr) - entry->start +
+	    entry->offset);
+}
+
+/*
+ * Move or query the first n entries of nmc_ents in map.  Every entry gets
+ * nme_status set
+ * to the domain now holding the page, or to a negative errno: ENOENT if the
+ * page is not resident, EFAULT if the address is not mapped, EACCES if the
+ * page is shared and NUMA_MOVE_ALL was not given, EBUSY if the page is busy
+ * or wired, ENOMEM if the target domain has no free page.  Returns the
+ * number of pages moved.  Moved and failed pages are counted for their
+ * target domain and for nmc_pid.
+ */
+static int
+numa_move_batch(vm_map_t map, struct numa_move_ctx *ctx, int n, int flags)
+{
+	struct numa_move_ent **sorted, **moved, *ents, *e;
+	vm_object_t obj;
+	vm_offset_t start;
+	vm_page_t m;
+	int failed, i, j, k, nsorted, nmoved, src;
+
+	ents = ctx->nmc_ents;
+	sorted = ctx->nmc_sorted;
+	moved = ctx->nmc_moved;
+	nsorted = 0;
+	vm_map_lock_read(map);
+	for (i = 0; i < n; i++) {
+		numa_move_resolve(map, &ents[i], flags);
+		if (ents[i].nme_object != NULL)
+			sorted[nsorted++] = &ents[i];
+	}
+	qsort(sorted, nsorted, sizeof(*sorted), numa_move_cmp_obj);
+
+	/* Phase 1: pick the pages to move, unmap them. */
+	nmoved = 0;
+	for (i = 0; i < nsorted; i = j) {
+		obj = sorted[i]->nme_object;
+		VM_OBJECT_WLOCK(obj);
+		for (j = i; j < nsorted && sorted[j]->nme_object == obj; j++) {
+			e = sorted[j];
+			e->nme_old = NULL;
+			m = vm_page_lookup(obj, e->nme_pindex);
+			if (m == NULL) {
+				e->nme_status = -ENOENT;
+				continue;
+			}
+			src = numa_page_domain(m);
+			e->nme_status = src;
+			if (e->nme_node < 0 || e->nme_node == src)
+				continue;
+			if (vm_page_busied(m) || m->wire_count > 0) {
+				e->nme_status = -EBUSY;
+				continue;
+			}
+			e->nme_new = vm_page_alloc_domain(NULL, 0,
+			    e->nme_node, VM_ALLOC_NORMAL | VM_ALLOC_NOOBJ);
+			if (e->nme_new == NULL) {
+				e->nme_status = -ENOMEM;
+				continue;
+			}
+			vm_page_xbusy(m);
+			e->nme_old = m;
+			moved[nmoved++] = e;
+		}
+		/* One shootdown per run of consecutive private pages. */
+		for (k = i; k < j; k++) {
+			e = sorted[k];
+			if (e->nme_old == NULL)
+				continue;
+			if (e->nme_shared) {
+				pmap_remove_all(e->nme_old);
+				continue;
+			}
+			start = trunc_page(e->nme_addr);
+			while (k + 1 < j && sorted[k + 1]->nme_old != NULL &&
+			    !sorted[k + 1]->nme_shared &&
+			    trunc_page(sorted[k + 1]->nme_addr) ==
+			    trunc_page(sorted[k]->nme_addr) + PAGE_SIZE)
+				k++;
+			pmap_remove(vm_map_pmap(map), start,
+			    trunc_page(sorted[k]->nme_addr) + PAGE_SIZE);
+		}
+		VM_OBJECT_WUNLOCK(obj);
+	}
+	vm_map_unlock_read(map);
+
+	/* Phase 2: copy without holding any object lock. */
+	if (nmoved > 0)
+		numa_copy_batch(moved, nmoved);
+
+	/* Phase 3: swap the copies into their objects. */
+	for (i = 0; i < nsorted; i = j) {
+		obj = sorted[i]->nme_object;
+		VM_OBJECT_WLOCK(obj);
+		for (j = i; j < nsorted && sorted[j]->nme_object == obj; j++) {
+			e = sorted[j];
+			if ((m = e->nme_old) == NULL)
+				continue;
+			e->nme_new->dirty = m->dirty;
+			e->nme_new->valid = m->valid;
+			/* vm_page_replace() wants the old page off the queues. */
+			vm_page_lock(m);
+			vm_page_remque(m);
+			vm_page_unlock(m);
+			vm_page_replace(e->nme_new, obj, e->nme_pindex);
+			vm_page_lock(e->nme_new);
+			vm_page_activate(e->nme_new);
+			vm_page_unlock(e->nme_new);
+			SDT_PROBE4(numa, , page, migrate, ctx->nmc_pid,
+			    numa_page_domain(m), e->nme_node, PAGE_SIZE);
+			vm_page_lock(m);
+			vm_page_free(m);
+			vm_page_unlock(m);
+			e->nme_status = e->nme_node;
+			counter_u64_add(
+			    numa_stat_domain[e->nme_node][NUMA_STAT_MIGRATED], 1);
+		}
+		VM_OBJECT_WUNLOCK(obj);
+		vm_object_deallocate(obj);
+	}
+	failed = 0;
+	for (i = 0; i < n; i++)
+		if (ents[i].nme_node >= 0 && ents[i].nme_status < 0) {
+			counter_u64_add(numa_stat_domain[ents[i].nme_node]
+			    [NUMA_STAT_MIGRATE_FAILED], 1);
+			failed++;
+		}
+	numa_pstat_moved(ctx->nmc_pid, nmoved, failed);
+	return (nmoved);
+}
+
+/*
+ * Asynchronous process migration.  migrate_pages() only queues a request;
+ * the numa_migrate kernel thread scans the process's map numa_migrate_chunk
+ * resident pages at a time, moves them with numa_move_batch() and sleeps as
+ * needed to stay under numa_migrate_bw.  Requests are served round-robin one
+ * chunk at a time.  A page found modified since the previous pass is left
+ * alone and retried on the next pass, up to NUMA_MIGRATE_PASSES passes, so
+ * pages under active writes are not copied repeatedly.
+ */
+#define NUMA_MIGRATE_PASSES     3
+#define NUMA_MIGRATE_MASKLEN    howmany(MAXMEMDOM, NBBY * sizeof(u_long))
+
+struct numa_migrate_req {
+	TAILQ_ENTRY(numa_migrate_req) nmr_link;
+	pid_t		nmr_pid;
+	struct vmspace	*nmr_vm;
+	int		nmr_map[MAXMEMDOM];	/* target per source, or -1 */
+	int		nmr_pass;
+	vm_offset_t	nmr_cursor;
+	int		nmr_cancel;
+	int		nmr_ticks;		/* start of the migration */
+	struct numa_migrate_status nmr_status;
+};
+
+static u_int numa_migrate_bw = 512;
+SYSCTL_UINT(_kern_numa, OID_AUTO, migrate_bw, CTLFLAG_RW, &numa_migrate_bw,
+    0, "Bandwidth cap of background page migration in MB/s, 0 for none");
+static u_int numa_migrate_chunk = 256;
+SYSCTL_UINT(_kern_numa, OID_AUTO, migrate_chunk, CTLFLAG_RW,
+    &numa_migrate_chunk, 0, "Pages moved per background migration step");
+
+static TAILQ_HEAD(, numa_migrate_req) numa_migrate_queue =
+    TAILQ_HEAD_INITIALIZER(numa_migrate_queue);
+static TAILQ_HEAD(, numa_migrate_req) numa_migrate_done =
+    TAILQ_HEAD_INITIALIZER(numa_migrate_done);
+static struct mtx numa_migrate_mtx;
+MTX_SYSINIT(numa_migrate, &numa_migrate_mtx, "numa migrate", MTX_DEF);
+
+static struct numa_migrate_req *
+numa_migrate_find(pid_t pid)
+{
+	struct numa_migrate_req *req;
+
+	mtx_assert(&numa_migrate_mtx, MA_OWNED);
+	TAILQ_FOREACH(req, &numa_migrate_queue, nmr_link)
+		if (req->nmr_pid == pid)
+			return (req);
+	TAILQ_FOREACH(req, &numa_migrate_done, nmr_link)
+		if (req->nmr_pid == pid)
+			return (req);
+	return (NULL);
+}
+
+/*
+ * Collect up to max resident pages at or after nmr_cursor that sit on a
+ * source domain of req.  Pages modified since the last pass get their
+ * modified bit cleared and are skipped until the next pass.  Returns the
+ * number of entries filled in; nmr_cursor is left past the last page
+ * examined, or at 0 once the end of the map was reached.
+ */
+static int
+numa_migrate_scan(struct numa_migrate_req *req, struct numa_move_ctx *ctx,
+    int max)
+{
+	struct numa_move_ent *e;
+	vm_map_t map;
+	vm_map_entry_t entry;
+	vm_object_t obj;
+	vm_pindex_t first, last;
+	vm_page_t m;
+	int dst, n, skipped;
+
+	map = &req->nmr_vm->vm_map;
+	n = skipped = 0;
+	vm_map_lock_read(map);
+	if (!vm_map_lookup_entry(map, req->nmr_cursor, &entry))
+		entry = entry->next;
+	for (; entry != &map->header && n < max; entry = entry->next) {
+		if ((entry->eflags & MAP_ENTRY_IS_SUB_MAP) != 0 ||
+		    (obj = entry->object.vm_object) == NULL)
+			continue;
+		first = OFF_TO_IDX(entry->offset +
+		    (MAX(req->nmr_cursor, entry->start) - entry->start));
+		last = OFF_TO_IDX(entry->offset + (entry->end - entry->start));
+		req->nmr_cursor = entry->end;
+		VM_OBJECT_WLOCK(obj);
+		for (m = vm_page_find_least(obj, first);
+		    m != NULL && m->pindex < last;
+		    m = TAILQ_NEXT(m, listq)) {
+			if (n == max) {
+				req->nmr_cursor = entry->start +
+				    IDX_TO_OFF(m->pindex) - entry->offset;
+				break;
+			}
+			dst = req->nmr_map[numa_page_domain(m)];
+			if (dst < 0)
+				continue;
+			if (req->nmr_pass < NUMA_MIGRATE_PASSES - 1 &&
+			    pmap_is_modified(m) && vm_page_tryxbusy(m)) {
+				vm_page_dirty(m);
+				pmap_clear_modify(m);
+				vm_page_xunbusy(m);
+				skipped++;
+				continue;
+			}
+			e = &ctx->nmc_ents[n++];
+			e->nme_addr = entry->start + IDX_TO_OFF(m->pindex) -
+			    entry->offset;
+			e->nme_node = dst;
+		}
+		VM_OBJECT_WUNLOCK(obj);
+	}
+	if (entry == &map->header && n < max)
+		req->nmr_cursor = 0;
+	vm_map_unlock_read(map);
+
+	mtx_lock(&numa_migrate_mtx);
+	req->nmr_status.nms_queued += n;
+	req->nmr_status.nms_skipped += skipped;
+	mtx_unlock(&numa_migrate_mtx);
+	return (n);
+}
+
+static void
+numa_migrate_finish(struct numa_migrate_req *req, int state)
+{
+
+	mtx_assert(&numa_migrate_mtx, MA_OWNED);
+	TAILQ_REMOVE(&numa_migrate_queue, req, nmr_link);
+	TAILQ_INSERT_TAIL(&numa_migrate_done, req, nmr_link);
+	req->nmr_status.nms_state = state;
+	wakeup(req);
+}
+
+static void
+numa_migrate_worker(void *arg __unused)
+{
+	struct numa_migrate_req *req;
+	struct numa_move_ctx *ctx;
+	struct vmspace *vm;
+	uint64_t debt, paid, rate, wait;
+	u_int bw;
+	int elapsed, i, last, moved, n, now, want;
+
+	ctx = malloc(sizeof(*ctx), M_NUMA, M_WAITOK);
+	debt = 0;
+	last = ticks;
+	for (;;) {
+		mtx_lock(&numa_migrate_mtx);
+		while ((req = TAILQ_FIRST(&numa_migrate_queue)) == NULL)
+			msleep(&numa_migrate_queue, &numa_migrate_mtx, PVM,
+			    "numamw", 0);
+		if (req->nmr_cancel) {
+			/* The process exited, nobody is left to ask. */
+			TAILQ_REMOVE(&numa_migrate_queue, req, nmr_link);
+			wakeup(req);
+			mtx_unlock(&numa_migrate_mtx);
+			vmspace_free(req->nmr_vm);
+			free(req, M_NUMA);
+			continue;
+		}
+		req->nmr_status.nms_state = NUMA_MIGRATE_RUNNING;
+		mtx_unlock(&numa_migrate_mtx);
+
+		want = MAX(1, MIN(numa_migrate_chunk, NUMA_MOVE_BATCH));
+		n = numa_migrate_scan(req, ctx, want);
+		ctx->nmc_pid = req->nmr_pid;
+		moved = n > 0 ? numa_move_batch(&req->nmr_vm->vm_map, ctx, n,
+		    NUMA_MOVE) : 0;
+
+		mtx_lock(&numa_migrate_mtx);
+		req->nmr_status.nms_moved += moved;
+		for (i = 0; i < n; i++)
+			if (ctx->nmc_ents[i].nme_status !=
+			    ctx->nmc_ents[i].nme_node)
+				req->nmr_status.nms_failed++;
+		elapsed = MAX(ticks - req->nmr_ticks, 1);
+		req->nmr_status.nms_bytes_per_sec =
+		    req->nmr_status.nms_moved * PAGE_SIZE * hz / elapsed;
+		/*
+		 * A request cancelled meanwhile stays at the head and is freed
+		 * on the next iteration.
+		 */
+		vm = NULL;
+		if (!req->nmr_cancel && req->nmr_cursor == 0 &&
+		    ++req->nmr_pass >= NUMA_MIGRATE_PASSES) {
+			vm = req->nmr_vm;
+			req->nmr_vm = NULL;
+			numa_migrate_finish(req, NUMA_MIGRATE_DONE);
+		} else if (!req->nmr_cancel) {
+			/* Round-robin: go to the back of the queue. */
+			TAILQ_REMOVE(&numa_migrate_queue, req, nmr_link);
+			TAILQ_INSERT_TAIL(&numa_migrate_queue, req, nmr_link);
+		}
+		mtx_unlock(&numa_migrate_mtx);
+		if (vm != NULL)
+			vmspace_free(vm);
+
+		/*
+		 * Keep the copy rate under the cap.  debt is what was copied
+		 * beyond what the cap allowed since last, carried from step
+		 * to step, so steps shorter than a tick add up instead of
+		 * being rounded away.
+		 */
+		now = ticks;
+		bw = numa_migrate_bw;
+		if (bw == 0)
+			debt = 0;
+		else {
+			rate = (uint64_t)bw << 20;
+			paid = (uint64_t)(now - last) * rate / hz;
+			debt = (debt > paid ? debt - paid : 0) +
+			    (uint64_t)moved * PAGE_SIZE;
+			wait = debt * hz / rate;
+			if (wait > 0)
+				pause("numabw", MIN(wait, INT_MAX));
+		}
+		last = now;
+	}
+}
+
+static void
+numa_migrate_exit(void *arg __unused, struct proc *p)
+{
+	struct numa_migrate_req *req;
+
+	mtx_lock(&numa_migrate_mtx);
+	req = numa_migrate_find(p->p_pid);
+	if (req != NULL && req->nmr_vm == NULL) {
+		TAILQ_REMOVE(&numa_migrate_done, req, nmr_link);
+		mtx_unlock(&numa_migrate_mtx);
+		free(req, M_NUMA);
+		return;
+	}
+	if (req != NULL)
+		req->nmr_cancel = 1;
+	mtx_unlock(&numa_migrate_mtx);
+}
+
+static void
+numa_migrate_init(void *arg __unused)
+{
+
+	EVENTHANDLER_REGISTER(process_exit, numa_migrate_exit, NULL,
+	    EVENTHANDLER_PRI_ANY);
+	kthread_add(numa_migrate_worker, NULL, NULL, NULL, 0, 0,
+	    "numa_migrate");
+}
+SYSINIT(numa_migrate, SI_SUB_KTHREAD_IDLE, SI_ORDER_ANY, numa_migrate_init,
+    NULL);
+
+/*
+ * Automatic balancing.  For every process that set NUMA_POLICY_BALANCE the
+ * numa_balance kernel thread unmaps a sample of resident pages each
+ * kern.numa.balance.interval milliseconds.  The next access to such a page
+ * is a soft fault, which vm_fault() reports to numa_balance_fault() (see
+ * patches/vm_fault.c.diff).  The fault is credited to the domain of the
+ * faulting CPU in the statistics of the page, and to the domain of the page
+ * in the statistics of the faulting thread, so a use is pinned on the thread
+ * and CPU that made it.  At the end of a period numa_balance_decide() judges
+ * every sampled page: pages a remote domain keeps faulting on are moved
+ * there with numa_move_batch(), pages that took no fault are dropped from
+ * the sample, the rest are unmapped again together with balance.sample new
+ * pages.  Threads whose faults keep landing on one remote domain get that
+ * domain recorded as a placement hint; the thread itself is not moved.
+ *
+ * Memory tiers ride on the same sampling.  For a process that set
+ * NUMA_POLICY_TIERED, numa_tier_decide() runs ahead of numa_balance_decide():
+ * a sampled page on a slow (CPU-less) domain that faults in tier.hot periods
+ * in a row is promoted to the fast domain faulting on it most, and a page on
+ * a fast domain under tier.pressure that took no fault for tier.cold periods
+ * is demoted to the nearest slow domain.  Slow pages that just faulted and
+ * cold fast pages under pressure stay in the sample, so their streaks keep
+ * counting.
+ */
+#define NUMA_BALANCE_SLOTS      1024    /* power of 2 */
+
+struct numa_balance_slot {
+	vm_page_t	nbsl_page;
+	vm_offset_t	nbsl_addr;
+	int		nbsl_domain;	/* domain of nbsl_page */
+	struct numa_balance_stat nbsl_stat;
+};
+
+struct numa_balance_proc {
+	LIST_ENTRY(numa_balance_proc) nbp_link;
+	pid_t		nbp_pid;
+	struct vmspace	*nbp_vm;
+	int		nbp_cancel;
+	vm_offset_t	nbp_cursor;
+	int		nbp_policy;	/* BALANCE and TIERED flags */
+	struct mtx	nbp_mtx;	/* protects nbp_slots */
+	struct numa_balance_slot nbp_slots[NUMA_BALANCE_SLOTS];
+	struct numa_balance_slot nbp_next[NUMA_BALANCE_SLOTS];
+};
+
+static SYSCTL_NODE(_kern_numa, OID_AUTO, balance, CTLFLAG_RW, 0,
+    "Automatic NUMA balancing");
+static u_int numa_balance_interval = 1000;
+SYSCTL_UINT(_kern_numa_balance, OID_AUTO, interval, CTLFLAG_RW,
+    &numa_balance_interval, 0, "Sampling period in milliseconds");
+static u_int numa_balance_sample = 256;
+SYSCTL_UINT(_kern_numa_balance, OID_AUTO, sample, CTLFLAG_RW,
+    &numa_balance_sample, 0, "New pages sampled per process and period");
+static struct numa_balance_tun numa_balance_page_tun = { 1, 200, 2 };
+SYSCTL_UINT(_kern_numa_balance, OID_AUTO, min_faults, CTLFLAG_RW,
+    &numa_balance_page_tun.nbt_min_faults, 0,
+    "Decayed faults a page needs before it is moved");
+SYSCTL_UINT(_kern_numa_balance, OID_AUTO, ratio, CTLFLAG_RW,
+    &numa_balance_page_tun.nbt_ratio, 0,
+    "Remote faults per 100 local faults needed to move a page");
+SYSCTL_UINT(_kern_numa_balance, OID_AUTO, hysteresis, CTLFLAG_RW,
+    &numa_balance_page_tun.nbt_hysteresis, 0,
+    "Periods a remote domain must win before a page is moved");
+static struct numa_balance_tun numa_balance_thread_tun = { 64, 300, 3 };
+SYSCTL_UINT(_kern_numa_balance, OID_AUTO, thread_min_faults, CTLFLAG_RW,
+    &numa_balance_thread_tun.nbt_min_faults, 0,
+    "Decayed faults a thread needs before a domain is suggested");
+SYSCTL_UINT(_kern_numa_balance, OID_AUTO, thread_ratio, CTLFLAG_RW,
+    &numa_balance_thread_tun.nbt_ratio, 0,
+    "Remote faults per 100 local faults needed to suggest a domain");
+SYSCTL_UINT(_kern_numa_balance, OID_AUTO, thread_hysteresis, CTLFLAG_RW,
+    &numa_balance_thread_tun.nbt_hysteresis, 0,
+    "Periods a remote domain must win before it is suggested");
+static u_long numa_balance_promoted;
+SYSCTL_ULONG(_kern_numa_balance, OID_AUTO, promoted, CTLFLAG_RD,
+    &numa_balance_promoted, 0, "Pages moved by the balancer");
+static u_long numa_balance_hints;
+SYSCTL_ULONG(_kern_numa_balance, OID_AUTO, thread_hints, CTLFLAG_RD,
+    &numa_balance_hints, 0, "Thread placement hints recorded");
+
+static SYSCTL_NODE(_kern_numa, OID_AUTO, tier, CTLFLAG_RW, 0,
+    "Memory tiers");
+static struct numa_tier_tun numa_tier_tun = { 2, 2, NUMA_PRESSURE_LOW };
+SYSCTL_UINT(_kern_numa_tier, OID_AUTO, hot, CTLFLAG_RW,
+    &numa_tier_tun.ntt_hot, 0,
+    "Periods in a row with a fault before a slow tier page is promoted");
+SYSCTL_UINT(_kern_numa_tier, OID_AUTO, cold, CTLFLAG_RW,
+    &numa_tier_tun.ntt_cold, 0,
+    "Idle periods before a fast tier page may be demoted");
+SYSCTL_INT(_kern_numa_tier, OID_AUTO, pressure, CTLFLAG_RW,
+    &numa_tier_tun.ntt_pressure, 0,
+    "Fast domain pressure level (1 low, 2 high) at which pages are demoted");
+static u_long numa_tier_promoted;
+SYSCTL_ULONG(_kern_numa_tier, OID_AUTO, promoted, CTLFLAG_RD,
+    &numa_tier_promoted, 0, "Pages promoted to the fast tier");
+static u_long numa_tier_demoted;
+SYSCTL_ULONG(_kern_numa_tier, OID_AUTO, demoted, CTLFLAG_RD,
+    &numa_tier_demoted, 0, "Pages demoted to the slow tier");
+
+static void numa_meminfo_fill(int d, struct numa_meminfo *mi);
+
+static LIST_HEAD(, numa_balance_proc) numa_balance_procs =
+    LIST_HEAD_INITIALIZER(numa_balance_procs);
+static volatile u_int numa_balance_nprocs;
+static struct rwlock numa_balance_lock;
+RW_SYSINIT(numa_balance, &numa_balance_lock, "numa balance");
+
+#define NUMA_BALANCE_HASH(m)                                            \
+        (((uintptr_t)(m) / sizeof(struct vm_page)) & (NUMA_BALANCE_SLOTS - 1))
+
+static struct numa_balance_proc *
+numa_balance_find(pid_t pid)
+{
+	struct numa_balance_proc *nbp;
+
+	rw_assert(&numa_balance_lock, RA_LOCKED);
+	LIST_FOREACH(nbp, &numa_balance_procs, nbp_link)
+		if (nbp->nbp_pid == pid)
+			return (nbp);
+	return (NULL);
+}
+
+static struct numa_balance_slot *
+numa_balance_slot(struct numa_balance_slot *slots, vm_page_t m, int insert)
+{
+	struct numa_balance_slot *sl;
+	u_int h, i;
+
+	h = NUMA_BALANCE_HASH(m);
+	for (i = 0; i < NUMA_BALANCE_SLOTS; i++) {
+		sl = &slots[(h + i) & (NUMA_BALANCE_SLOTS - 1)];
+		if (sl->nbsl_page == m)
+			return (sl);
+		if (sl->nbsl_page == NULL)
+			return (insert ? sl : NULL);
+	}
+	return (NULL);
+}
+
+void
+numa_balance_fault(struct thread *td, vm_page_t m)
+{
+	struct numa_balance_proc *nbp;
+	struct numa_balance_slot *sl;
+	struct numa_td_policy *ntp;
+	int hit;
+
+	if (numa_balance_nprocs == 0)
+		return;
+	hit = 0;
+	rw_rlock(&numa_balance_lock);
+	nbp = numa_balance_find(td->td_proc->p_pid);
+	if (nbp != NULL) {
+		mtx_lock(&nbp->nbp_mtx);
+		sl = numa_balance_slot(nbp->nbp_slots, m, 0);
+		if (sl != NULL) {
+			numa_balance_record(&sl->nbsl_stat, PCPU_GET(domain));
+			hit = 1;
+		}
+		mtx_unlock(&nbp->nbp_mtx);
+	}
+	rw_runlock(&numa_balance_lock);
+	if (hit && (ntp = numa_td_policy_get(td)) != NULL)
+		numa_balance_record(&ntp->ntp_balance, numa_page_domain(m));
+}
+
+/*
+ * The resident page mapped at addr in map, or NULL.  Wired and unmanaged
+ * pages cannot be unmapped for sampling and are skipped.  The map is read
+ * locked; returns with the object of the page write locked.
+ */
+static vm_page_t
+numa_balance_lookup(vm_map_t map, vm_offset_t addr, vm_object_t *objp)
+{
+	vm_map_entry_t entry;
+	vm_object_t obj;
+	vm_page_t m;
+
+	if (!vm_map_lookup_entry(map, addr, &entry) ||
+	    (entry->eflags & MAP_ENTRY_IS_SUB_MAP) != 0 ||
+	    (obj = entry->object.vm_object) == NULL)
+		return (NULL);
+	VM_OBJECT_WLOCK(obj);
+	m = vm_page_lookup(obj, OFF_TO_IDX(entry->offset + addr -
+	    entry->start));
+	if (m == NULL || m->wire_count > 0 ||
+	    (m->oflags & VPO_UNMANAGED) != 0) {
+		VM_OBJECT_WUNLOCK(obj);
+		return (NULL);
+	}
+	*objp = obj;
+	return (m);
+}
+
+/*
+ * Unmap the n pages of slots, one pmap_remove() per run of consecutive
+ * addresses.
+ */
+static void
+numa_balance_unmap(vm_map_t map, const struct numa_balance_slot *slots, int n)
+{
+	int i, j;
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && slots[j].nbsl_addr ==
+		    slots[j - 1].nbsl_addr + PAGE_SIZE; j++)
+			;
+		pmap_remove(vm_map_pmap(map), slots[i].nbsl_addr,
+		    slots[j - 1].nbsl_addr + PAGE_SIZE);
+	}
+}
+
+/*
+ * Start the next sample of nbp: the nkeep entries at the head of nbp_next,
+ * then up to max new resident pages from nbp_cursor on.  The sample is
+ * installed in nbp_slots before its pages are unmapped, so no fault on them
+ * goes unrecorded.
+ */
+static void
+numa_balance_resample(struct numa_balance_proc *nbp, int nkeep, int max)
+{
+	struct numa_balance_slot *sl;
+	vm_map_t map;
+	vm_map_entry_t entry;
+	vm_object_t obj;
+	vm_pindex_t first, last;
+	vm_page_t m;
+	int i, n;
+
+	map = &nbp->nbp_vm->vm_map;
+	n = 0;
+	vm_map_lock_read(map);
+	for (i = 0; i < nkeep; i++) {
+		sl = &nbp->nbp_next[i];
+		if ((m = numa_balance_lookup(map, sl->nbsl_addr, &obj)) ==
+		    NULL)
+			continue;
+		nbp->nbp_next[n] = *sl;
+		nbp->nbp_next[n].nbsl_page = m;
+		nbp->nbp_next[n].nbsl_domain = numa_page_domain(m);
+		n++;
+		VM_OBJECT_WUNLOCK(obj);
+	}
+
+	max += n;
+	if (!vm_map_lookup_entry(map, nbp->nbp_cursor, &entry))
+		entry = entry->next;
+	for (; entry != &map->header && n < max; entry = entry->next) {
+		if ((entry->eflags & MAP_ENTRY_IS_SUB_MAP) != 0 ||
+		    (obj = entry->object.vm_object) == NULL)
+			continue;
+		first = OFF_TO_IDX(entry->offset +
+		    (MAX(nbp->nbp_cursor, entry->start) - entry->start));
+		last = OFF_TO_IDX(entry->offset + (entry->end - entry->start));
+		nbp->nbp_cursor = entry->end;
+		VM_OBJECT_WLOCK(obj);
+		for (m = vm_page_find_least(obj, first);
+		    m != NULL && m->pindex < last;
+		    m = TAILQ_NEXT(m, listq)) {
+			if (n == max) {
+				nbp->nbp_cursor = entry->start +
+				    IDX_TO_OFF(m->pindex) - entry->offset;
+				break;
+			}
+			if (m->wire_count > 0 ||
+			    (m->oflags & VPO_UNMANAGED) != 0)
+				continue;
+			sl = &nbp->nbp_next[n++];
+			bzero(sl, sizeof(*sl));
+			sl->nbsl_page = m;
+			sl->nbsl_addr = entry->start + IDX_TO_OFF(m->pindex) -
+			    entry->offset;
+			sl->nbsl_domain = numa_page_domain(m);
+			sl->nbsl_stat.nbs_candidate = -1;
+		}
+		VM_OBJECT_WUNLOCK(obj);
+	}
+	if (entry == &map->header && n < max)
+		nbp->nbp_cursor = 0;
+
+	mtx_lock(&nbp->nbp_mtx);
+	bzero(nbp->nbp_slots, sizeof(nbp->nbp_slots));
+	for (i = 0; i < n; i++) {
+		sl = numa_balance_slot(nbp->nbp_slots,
+		    nbp->nbp_next[i].nbsl_page, 1);
+		if (sl != NULL)
+			*sl = nbp->nbp_next[i];
+	}
+	mtx_unlock(&nbp->nbp_mtx);
+	numa_balance_unmap(map, nbp->nbp_next, n);
+	vm_map_unlock_read(map);
+}
+
+/*
+ * One balancing period of nbp: judge the pages sampled in the previous
+ * period and the threads of the process, move the pages that should move
+ * and start the next sample.
+ */
+static void
+numa_balance_period(struct numa_balance_proc *nbp, struct numa_move_ctx *ctx)
+{
+	struct numa_balance_slot *sl;
+	struct numa_balance_stat *st;
+	struct numa_move_ent *e;
+	struct numa_td_policy *ntp;
+	struct numa_meminfo mi;
+	struct thread *td;
+	struct proc *p;
+	vm_map_t map;
+	int pressure[MAXMEMDOM];
+	int d, i, moved, nb, nkeep, nt, t, tiered;
+
+	tiered = (nbp->nbp_policy & NUMA_POLICY_TIERED) != 0;
+	if (tiered)
+		for (d = 0; d < vm_ndomains; d++) {
+			numa_meminfo_fill(d, &mi);
+			pressure[d] = mi.nmi_pressure;
+		}
+
+	/*
+	 * Tier moves are queued from the head of nmc_ents, balancing moves
+	 * from its tail, so each kind is moved and counted on its own.
+	 */
+	nt = nb = nkeep = 0;
+	mtx_lock(&nbp->nbp_mtx);
+	for (i = 0; i < NUMA_BALANCE_SLOTS; i++) {
+		sl = &nbp->nbp_slots[i];
+		if (sl->nbsl_page == NULL)
+			continue;
+		st = &sl->nbsl_stat;
+		t = tiered ? numa_tier_decide(st, vm_ndomains, numa_tier_cache,
+		    numa_weights_cache, pressure, sl->nbsl_domain,
+		    &numa_tier_tun) : -1;
+		/* Run even if the tier decided, it ages the statistics. */
+		d = numa_balance_decide(st, vm_ndomains, sl->nbsl_domain,
+		    &numa_balance_page_tun);
+		if (t >= 0)
+			d = t;
+		else if ((nbp->nbp_policy & NUMA_POLICY_BALANCE) == 0)
+			d = -1;
+		if (d >= 0 && nt + nb < NUMA_MOVE_BATCH) {
+			e = t >= 0 ? &ctx->nmc_ents[nt++] :
+			    &ctx->nmc_ents[NUMA_MOVE_BATCH - ++nb];
+			e->nme_addr = sl->nbsl_addr;
+			e->nme_node = d;
+		} else if (d < 0 && (st->nbs_candidate >= 0 ||
+		    st->nbs_faults[sl->nbsl_domain] > 0 || (tiered &&
+		    (st->nbs_busy > 0 || pressure[sl->nbsl_domain] >=
+		    numa_tier_tun.ntt_pressure))))
+			/* Still warm, or cold under pressure: sample it again. */
+			nbp->nbp_next[nkeep++] = *sl;
+	}
+	mtx_unlock(&nbp->nbp_mtx);
+
+	ctx->nmc_pid = nbp->nbp_pid;
+	map = &nbp->nbp_vm->vm_map;
+	if (nt > 0) {
+		moved = numa_move_batch(map, ctx, nt, NUMA_MOVE);
+		atomic_add_long(&numa_balance_promoted, moved);
+		for (i = 0; i < nt; i++) {
+			e = &ctx->nmc_ents[i];
+			if (e->nme_status != e->nme_node)
+				continue;
+			if (numa_tier_cache[e->nme_node] == NUMA_TIER_FAST)
+				atomic_add_long(&numa_tier_promoted, 1);
+			else
+				atomic_add_long(&numa_tier_demoted, 1);
+		}
+	}
+	if (nb > 0) {
+		bcopy(&ctx->nmc_ents[NUMA_MOVE_BATCH - nb], ctx->nmc_ents,
+		    nb * sizeof(ctx->nmc_ents[0]));
+		moved = numa_move_batch(map, ctx, nb, NUMA_MOVE);
+		atomic_add_long(&numa_balance_promoted, moved);
+	}
+
+	if ((p = pfind(nbp->nbp_pid)) != NULL) {
+		FOREACH_THREAD_IN_PROC(p, td) {
+			ntp = osd_thread_get(td, numa_policy_osd);
+			if (ntp == NULL || td->td_lastcpu == NOCPU)
+				continue;
+			d = numa_balance_decide(&ntp->ntp_balance, vm_ndomains,
+			    pcpu_find(td->td_lastcpu)->pc_domain,
+			    &numa_balance_thread_tun);
+			if (d >= 0) {
+				ntp->ntp_suggest = d + 1;
+				atomic_add_long(&numa_balance_hints, 1);
+			}
+		}
+		PROC_UNLOCK(p);
+	}
+
+	/* Keep the table at most half full so probing stays short. */
+	nkeep = MIN(nkeep, NUMA_BALANCE_SLOTS / 2);
+	numa_balance_resample(nbp, nkeep,
+	    MIN(numa_balance_sample, NUMA_BALANCE_SLOTS / 2 - nkeep));
+}
+
+static void
+numa_balance_worker(void *arg __unused)
+{
+	struct numa_balance_proc *nbp, *tmp;
+	struct numa_move_ctx *ctx;
+
+	ctx = malloc(sizeof(*ctx), M_NUMA, M_WAITOK);
+	for (;;) {
+		rw_wlock(&numa_balance_lock);
+		while (LIST_EMPTY(&numa_balance_procs))
+			rw_sleep(&numa_balance_procs, &numa_balance_lock, PVM,
+			    "numabw", 0);
+		/* Reap the processes that exited or opted out. */
+		LIST_FOREACH_SAFE(nbp, &numa_balance_procs, nbp_link, tmp) {
+			if (!nbp->nbp_cancel)
+				continue;
+			LIST_REMOVE(nbp, nbp_link);
+			atomic_subtract_int(&numa_balance_nprocs, 1);
+			rw_wunlock(&numa_balance_lock);
+			vmspace_free(nbp->nbp_vm);
+			mtx_destroy(&nbp->nbp_mtx);
+			free(nbp, M_NUMA);
+			rw_wlock(&numa_balance_lock);
+			tmp = LIST_FIRST(&numa_balance_procs);
+		}
+		rw_wunlock(&numa_balance_lock);
+
+		/*
+		 * Entries are only freed by this thread, so the list can be
+		 * walked without the lock held across a period.
+		 */
+		rw_rlock(&numa_balance_lock);
+		nbp = LIST_FIRST(&numa_balance_procs);
+		rw_runlock(&numa_balance_lock);
+		while (nbp != NULL) {
+			if (!nbp->nbp_cancel)
+				numa_balance_period(nbp, ctx);
+			rw_rlock(&numa_balance_lock);
+			nbp = LIST_NEXT(nbp, nbp_link);
+			rw_runlock(&numa_balance_lock);
+		}
+		pause("numabp", MAX(1, (int)((uint64_t)numa_balance_interval *
+		    hz / 1000)));
+	}
+}
+
+/*
+ * Switch balancing of the process pid on or off, as the BALANCE and TIERED
+ * flags of policy say.  vm is a reference on the process's vmspace and nbp
+ * a preallocated entry, both are consumed or released.
+ */
+static void
+numa_balance_set(pid_t pid, int policy, struct vmspace *vm,
+    struct numa_balance_proc *nbp)
+{
+	struct numa_balance_proc *old;
+
+	policy &= NUMA_POLICY_BALANCE | NUMA_POLICY_TIERED;
+	rw_wlock(&numa_balance_lock);
+	old = numa_balance_find(pid);
+	if (old != NULL && !old->nbp_cancel) {
+		if (policy == 0)
+			old->nbp_cancel = 1;
+		else
+			old->nbp_policy = policy;
+	} else if (policy != 0) {
+		nbp->nbp_pid = pid;
+		nbp->nbp_policy = policy;
+		nbp->nbp_vm = vm;
+		mtx_init(&nbp->nbp_mtx, "numa balance proc", NULL, MTX_DEF);
+		LIST_INSERT_HEAD(&numa_balance_procs, nbp, nbp_link);
+		atomic_add_int(&numa_balance_nprocs, 1);
+		wakeup(&numa_balance_procs);
+		vm = NULL;
+		nbp = NULL;
+	}
+	rw_wunlock(&numa_balance_lock);
+	if (vm != NULL)
+		vmspace_free(vm);
+	free(nbp, M_NUMA);
+}
+
+static void
+numa_balance_exit(void *arg __unused, struct proc *p)
+{
+	struct numa_balance_proc *nbp;
+
+	if (numa_balance_nprocs == 0)
+		return;
+	rw_wlock(&numa_balance_lock);
+	nbp = numa_balance_find(p->p_pid);
+	if (nbp != NULL)
+		nbp->nbp_cancel = 1;
+	rw_wunlock(&numa_balance_lock);
+}
+
+static void
+numa_balance_init(void *arg __unused)
+{
+
+	EVENTHANDLER_REGISTER(process_exit, numa_balance_exit, NULL,
+	    EVENTHANDLER_PRI_ANY);
+	kthread_add(numa_balance_worker, NULL, NULL, NULL, 0, 0,
+	    "numa_balance");
+}
+SYSINIT(numa_balance, SI_SUB_KTHREAD_IDLE, SI_ORDER_ANY, numa_balance_init,
+    NULL);
+
+/*
+ * Scheduling hints.  ULE balances load without looking at memory, so the
+ * threads of a process that set a memory policy get a home domain:
+ * sched_pickcpu() prefers its CPUs and tdq_idled() only steals a thread away
+ * from it when the load difference reaches kern.numa.sched.imbalance (see
+ * patches/sched_ule.c.diff).  The home follows the domain holding most of
+ * the process's resident pages.  The numa_sched kernel thread counts them by
+ * domain, sched.scan_pages pages per process and period, resuming where the
+ * last period stopped, and runs numa_sched_rehome() on every complete pass.
+ * A balancer hint for a thread (ntp_suggest) is specific to the thread and
+ * wins over the home of its process.
+ *
+ * Homes are published in numa_sched_homes, one (tid << 8 | domain + 1) word
+ * per slot indexed by tid, which the scheduler reads without a lock under
+ * the thread lock.  Two threads sharing a slot only lose a hint until the
+ * next period.
+ *
+ * The same pass is the fallback behind numa_page_domains().  A page placed
+ * before its policy was set, or on another domain because the allowed ones
+ * were exhausted, stays where it is until it moves.  Private pages the
+ * policy does not want where they are, see numa_policy_misplaced(), are
+ * queued while they are counted and moved with numa_move_batch() at the end
+ * of the period.  Pages covered by a range policy follow the range instead,
+ * shared ones included when the process maps them writable.
+ *
+ * The threads of a process share its pages, so the scanner only enforces
+ * the policy of the process, else the one of its cpuset.  The own policy of
+ * a thread is left to numa_page_domains() and never turns into moves of
+ * pages other threads of the process share.  A process is scanned once a
+ * policy is set on it or on its cpuset, or it calls mbind(), and a process
+ * forked with a policy is scanned from its birth.
+ */
+#define NUMA_SCHED_HOMES        4096    /* power of 2 */
+
+struct numa_sched_proc {
+	LIST_ENTRY(numa_sched_proc) nsp_link;
+	pid_t		nsp_pid;
+	struct vmspace	*nsp_vm;
+	int		nsp_cancel;
+	vm_offset_t	nsp_cursor;
+	int		nsp_home;		/* -1 before the first pass */
+	u_int		nsp_gen;		/* numa_policy_gen of nsp_policy */
+	struct numa_policy nsp_policy;		/* policy enforced */
+	u_long		nsp_scan[MAXMEMDOM];	/* pass in progress */
+	u_long		nsp_pages[MAXMEMDOM];	/* last complete pass */
+};
+
+static SYSCTL_NODE(_kern_numa, OID_AUTO, sched, CTLFLAG_RW, 0,
+    "NUMA scheduling hints");
+static int numa_sched_enable = 1;
+SYSCTL_INT(_kern_numa_sched, OID_AUTO, enable, CTLFLAG_RW,
+    &numa_sched_enable, 0, "Prefer the CPUs of a thread's home domain");
+static u_int numa_sched_interval = 1000;
+SYSCTL_UINT(_kern_numa_sched, OID_AUTO, interval, CTLFLAG_RW,
+    &numa_sched_interval, 0, "Home update period in milliseconds");
+static u_int numa_sched_scan_pages = 4096;
+SYSCTL_UINT(_kern_numa_sched, OID_AUTO, scan_pages, CTLFLAG_RW,
+    &numa_sched_scan_pages, 0, "Resident pages counted per process and period");
+static struct numa_sched_tun numa_sched_tun = { 2, 150 };
+SYSCTL_UINT(_kern_numa_sched, OID_AUTO, imbalance, CTLFLAG_RW,
+    &numa_sched_tun.nst_imbalance, 0,
+    "Load difference needed to run a thread outside its home domain");
+SYSCTL_UINT(_kern_numa_sched, OID_AUTO, home_ratio, CTLFLAG_RW,
+    &numa_sched_tun.nst_home_ratio, 0,
+    "Pages elsewhere per 100 home pages needed to move the home");
+static counter_u64_t numa_sched_cross;
+SYSCTL_COUNTER_U64(_kern_numa_sched, OID_AUTO, migrations, CTLFLAG_RD,
+    &numa_sched_cross, "Migrations between domains");
+static counter_u64_t numa_sched_local;
+SYSCTL_COUNTER_U64(_kern_numa_sched, OID_AUTO, local_migrations, CTLFLAG_RD,
+    &numa_sched_local, "Migrations within a domain");
+static counter_u64_t numa_sched_left;
+SYSCTL_COUNTER_U64(_kern_numa_sched, OID_AUTO, left_home, CTLFLAG_RD,
+    &numa_sched_left, "Migrations away from the home domain");
+static counter_u64_t numa_sched_returned;
+SYSCTL_COUNTER_U64(_kern_numa_sched, OID_AUTO, returned_home, CTLFLAG_RD,
+    &numa_sched_returned, "Migrations back to the home domain");
+static counter_u64_t numa_sched_away_picks;
+SYSCTL_COUNTER_U64(_kern_numa_sched, OID_AUTO, away_picks, CTLFLAG_RD,
+    &numa_sched_away_picks, "Placements outside the home domain");
+static counter_u64_t numa_sched_denied;
+SYSCTL_COUNTER_U64(_kern_numa_sched, OID_AUTO, steals_denied, CTLFLAG_RD,
+    &numa_sched_denied, "Steals across domains refused");
+static u_long numa_sched_rehomed;
+SYSCTL_ULONG(_kern_numa_sched, OID_AUTO, rehomed, CTLFLAG_RD,
+    &numa_sched_rehomed, 0, "Home domain changes");
+static u_long numa_sched_enforced;
+SYSCTL_ULONG(_kern_numa_sched, OID_AUTO, enforced, CTLFLAG_RD,
+    &numa_sched_enforced, 0, "Pages moved to follow a memory policy");
+
+static volatile u_long numa_sched_homes[NUMA_SCHED_HOMES];
+static cpuset_t numa_sched_cpus[MAXMEMDOM];
+static LIST_HEAD(, numa_sched_proc) numa_sched_procs =
+    LIST_HEAD_INITIALIZER(numa_sched_procs);
+static struct rwlock numa_sched_lock;
+RW_SYSINIT(numa_sched, &numa_sched_lock, "numa sched");
+
+#define NUMA_SCHED_SLOT(tid)                                            \
+        (&numa_sched_homes[(u_int)(tid) & (NUMA_SCHED_HOMES - 1)])
+
+static struct numa_sched_proc *
+numa_sched_find(pid_t pid)
+{
+	struct numa_sched_proc *nsp;
+
+	rw_assert(&numa_sched_lock, RA_LOCKED);
+	LIST_FOREACH(nsp, &numa_sched_procs, nsp_link)
+		if (nsp->nsp_pid == pid)
+			return (nsp);
+	return (NULL);
+}
+
+int
+numa_sched_home(struct thread *td, cpuset_t *mask)
+{
+	u_long v;
+	int home;
+
+	if (!numa_sched_enable)
+		return (-1);
+	v = *NUMA_SCHED_SLOT(td->td_tid);
+	if ((v >> 8) != (u_long)td->td_tid)
+		return (-1);
+	home = (int)(v & 0xff) - 1;
+	if (mask != NULL)
+		*mask = numa_sched_cpus[home];
+	return (home);
+}
+
+int
+numa_sched_pickcpu(struct thread *td, int home_cpu, u_int home_load, int cpu,
+    u_int load)
+{
+
+	if (home_cpu < 0)
+		return (cpu);
+	if (cpu < 0 || cpu == home_cpu ||
+	    !numa_sched_away(home_load, load, &numa_sched_tun))
+		return (home_cpu);
+	counter_u64_add(numa_sched_away_picks, 1);
+	return (cpu);
+}
+
+int
+numa_sched_steal(struct thread *td, int src, u_int src_load, int dst,
+    u_int dst_load)
+{
+
+	if (numa_sched_may_steal(numa_sched_home(td, NULL),
+	    pcpu_find(src)->pc_domain, pcpu_find(dst)->pc_domain, src_load,
+	    dst_load, &numa_sched_tun))
+		return (1);
+	counter_u64_add(numa_sched_denied, 1);
+	return (0);
+}
+
+void
+numa_sched_migrated(struct thread *td, int from, int to)
+{
+	int dfrom, dto, home;
+
+	if (from == NOCPU || from == to)
+		return;
+	dfrom = pcpu_find(from)->pc_domain;
+	dto = pcpu_find(to)->pc_domain;
+	if (dfrom == dto) {
+		counter_u64_add(numa_sched_local, 1);
+		return;
+	}
+	counter_u64_add(numa_sched_cross, 1);
+	home = numa_sched_home(td, NULL);
+	if (home == dfrom)
+		counter_u64_add(numa_sched_left, 1);
+	else if (home == dto)
+		counter_u64_add(numa_sched_returned, 1);
+	SDT_PROBE4(numa, , sched, migrate, td->td_proc->p_pid, td->td_tid,
+	    dfrom, dto);
+}
+
+/*
+ * The policy enforced on the process of nsp, resolved again after a policy
+ * change.  Returns 0 if there is nothing to enforce.
+ */
+static int
+numa_sched_policy(struct numa_sched_proc *nsp)
+{
+	struct numa_policy *np;
+	struct proc *p;
+	u_int gen;
+
+	np = &nsp->nsp_policy;
+	gen = numa_policy_gen;
+	if (nsp->nsp_gen != gen && (p = pfind(nsp->nsp_pid)) != NULL) {
+		nsp->nsp_gen = gen;
+		/* Without the OSD slot only the process and cpuset count. */
+		numa_policy_resolve(FIRST_THREAD_IN_PROC(p), NULL, np);
+		PROC_UNLOCK(p);
+	}
+	return ((np->np_policy & NUMA_POLICY_MASK) == NUMA_POLICY_INTERLEAVE ||
+	    !CPU_EMPTY(&np->np_mask));
+}
+
+/*
+ * Count up to max resident pages of nsp by domain from nsp_cursor on.  The
+ * pages a range policy wants elsewhere are queued in ctx, shared ones only
+ * if nsp maps them writable, and if enforce is set so are the private pages
+ * nsp_policy wants elsewhere.  The count stops early once ctx is full;
+ * *nmove is set to the number of entries queued and *shared to whether one
+ * of them is a shared page.  Returns 1 if the pass reached the end of the
+ * address space.
+ */
+static int
+numa_sched_scan(struct numa_sched_proc *nsp, int max, int enforce,
+    struct numa_move_ctx *ctx, int *nmove, int *shared)
+{
+	struct numa_move_ent *e;
+	struct numa_policy np;
+	vm_map_t map;
+	vm_map_entry_t entry;
+	vm_object_t obj;
+	vm_pindex_t first, last;
+	vm_page_t m;
+	int d, done, dst, n, nm, private, writable;
+
+	map = &nsp->nsp_vm->vm_map;
+	n = nm = *shared = 0;
+	vm_map_lock_read(map);
+	if (!vm_map_lookup_entry(map, nsp->nsp_cursor, &entry))
+		entry = entry->next;
+	for (; entry != &map->header && n < max && nm < NUMA_MOVE_BATCH;
+	    entry = entry->next) {
+		if ((entry->eflags & MAP_ENTRY_IS_SUB_MAP) != 0 ||
+		    (obj = entry->object.vm_object) == NULL)
+			continue;
+		first = OFF_TO_IDX(entry->offset +
+		    (MAX(nsp->nsp_cursor, entry->start) - entry->start));
+		last = OFF_TO_IDX(entry->offset + (entry->end - entry->start));
+		nsp->nsp_cursor = entry->end;
+		VM_OBJECT_RLOCK(obj);
+		/* As numa_move_resolve() judges it for NUMA_MOVE. */
+		private = numa_object_private(obj);
+		writable = (entry->eflags & MAP_ENTRY_COW) == 0 &&
+		    (entry->max_protection & VM_PROT_WRITE) != 0;
+		for (m = vm_page_find_least(obj, first);
+		    m != NULL && m->pindex < last;
+		    m = TAILQ_NEXT(m, listq)) {
+			if (n == max || nm == NUMA_MOVE_BATCH) {
+				nsp->nsp_cursor = entry->start +
+				    IDX_TO_OFF(m->pindex) - entry->offset;
+				break;
+			}
+			d = numa_page_domain(m);
+			nsp->nsp_scan[d]++;
+			n++;
+			if (numa_range_policy(obj, m->pindex, &np)) {
+				if (!private && !writable)
+					continue;
+				dst = numa_policy_misplaced(&np, m->pindex, d);
+			} else if (enforce && private)
+				dst = numa_policy_misplaced(&nsp->nsp_policy,
+				    m->pindex, d);
+			else
+				continue;
+			if (dst < 0)
+				continue;
+			if (!private)
+				*shared = 1;
+			e = &ctx->nmc_ents[nm++];
+			e->nme_addr = entry->start + IDX_TO_OFF(m->pindex) -
+			    entry->offset;
+			e->nme_node = dst;
+		}
+		VM_OBJECT_RUNLOCK(obj);
+	}
+	done = entry == &map->header;
+	if (done)
+		nsp->nsp_cursor = 0;
+	vm_map_unlock_read(map);
+	*nmove = nm;
+	return (done);
+}
+
+/*
+ * One period of nsp: continue the page count, move the pages its policy
+ * wants elsewhere, move the home after a complete pass and publish the home
+ * of every thread.
+ */
+static void
+numa_sched_period(struct numa_sched_proc *nsp, struct numa_move_ctx *ctx)
+{
+	struct numa_td_policy *ntp;
+	struct thread *td;
+	struct proc *p;
+	int d, done, moved, n, shared;
+
+	done = numa_sched_scan(nsp, MAX(1, numa_sched_scan_pages),
+	    numa_sched_policy(nsp), ctx, &n, &shared);
+	if (n > 0) {
+		ctx->nmc_pid = nsp->nsp_pid;
+		moved = numa_move_batch(&nsp->nsp_vm->vm_map, ctx, n,
+		    shared ? NUMA_MOVE_ALL : NUMA_MOVE);
+		atomic_add_long(&numa_sched_enforced, moved);
+	}
+	if (done) {
+		bcopy(nsp->nsp_scan, nsp->nsp_pages, sizeof(nsp->nsp_pages));
+		bzero(nsp->nsp_scan, sizeof(nsp->nsp_scan));
+		d = numa_sched_rehome(nsp->nsp_pages, vm_ndomains,
+		    nsp->nsp_home, &numa_sched_tun);
+		if (d >= 0 && d != nsp->nsp_home) {
+			if (nsp->nsp_home >= 0)
+				atomic_add_long(&numa_sched_rehomed, 1);
+			nsp->nsp_home = d;
+		}
+	}
+	if (!numa_sched_enable || (p = pfind(nsp->nsp_pid)) == NULL)
+		return;
+	FOREACH_THREAD_IN_PROC(p, td) {
+		ntp = osd_thread_get(td, numa_policy_osd);
+		d = ntp != NULL && ntp->ntp_suggest > 0 ?
+		    ntp->ntp_suggest - 1 : nsp->nsp_home;
+		if (d >= 0)
+			atomic_store_rel_long(NUMA_SCHED_SLOT(td->td_tid),
+			    (u_long)td->td_tid << 8 | (d + 1));
+	}
+	PROC_UNLOCK(p);
+}
+
+static void
+numa_sched_worker(void *arg __unused)
+{
+	struct numa_sched_proc *nsp, *tmp;
+	struct numa_move_ctx *ctx;
 
-#include <sys/freebsdnuma.h>
+	ctx = malloc(sizeof(*ctx), M_NUMA, M_WAITOK);
+	for (;;) {
+		rw_wlock(&numa_sched_lock);
+		while (LIST_EMPTY(&numa_sched_procs))
+			rw_sleep(&numa_sched_procs, &numa_sched_lock, PVM,
+			    "numasw", 0);
+		LIST_FOREACH_SAFE(nsp, &numa_sched_procs, nsp_link, tmp) {
+			if (!nsp->nsp_cancel)
+				continue;
+			LIST_REMOVE(nsp, nsp_link);
+			rw_wunlock(&numa_sched_lock);
+			vmspace_free(nsp->nsp_vm);
+			free(nsp, M_NUMA);
+			rw_wlock(&numa_sched_lock);
+			tmp = LIST_FIRST(&numa_sched_procs);
+		}
+		rw_wunlock(&numa_sched_lock);
 
+		/* As for numa_balance, only this thread frees entries. */
+		rw_rlock(&numa_sched_lock);
+		nsp = LIST_FIRST(&numa_sched_procs);
+		rw_runlock(&numa_sched_lock);
+		while (nsp != NULL) {
+			if (!nsp->nsp_cancel)
+				numa_sched_period(nsp, ctx);
+			rw_rlock(&numa_sched_lock);
+			nsp = LIST_NEXT(nsp, nsp_link);
+			rw_runlock(&numa_sched_lock);
+		}
+		pause("numasp", MAX(1, (int)((uint64_t)numa_sched_interval *
+		    hz / 1000)));
+	}
+}
 
-/* ---------- DEFINITIONS --------- */
+/*
+ * Scan pid: enforce its policy and give its threads a home domain.  vm is a
+ * reference on the process's vmspace and nsp a preallocated entry, both are
+ * consumed or released.
+ */
+static void
+numa_sched_add(pid_t pid, struct vmspace *vm, struct numa_sched_proc *nsp)
+{
+	struct numa_sched_proc *old;
+
+	rw_wlock(&numa_sched_lock);
+	old = numa_sched_find(pid);
+	if (old == NULL || old->nsp_cancel) {
+		nsp->nsp_pid = pid;
+		nsp->nsp_vm = vm;
+		nsp->nsp_home = -1;
+		LIST_INSERT_HEAD(&numa_sched_procs, nsp, nsp_link);
+		wakeup(&numa_sched_procs);
+		vm = NULL;
+		nsp = NULL;
+	}
+	rw_wunlock(&numa_sched_lock);
+	if (vm != NULL)
+		vmspace_free(vm);
+	free(nsp, M_NUMA);
+}
+
+/*
+ * Scan every process with a thread in cpuset id, whose policy was just set,
+ * that the caller may schedule.
+ */
+static void
+numa_sched_add_cpuset(id_t id)
+{
+	struct numa_sched_proc *nsp;
+	struct vmspace *vm;
+	struct thread *td;
+	struct proc *p;
+	pid_t pid;
+
+	nsp = NULL;
+	sx_slock(&allproc_lock);
+	FOREACH_PROC_IN_SYSTEM(p) {
+		if (nsp == NULL)
+			nsp = malloc(sizeof(*nsp), M_NUMA, M_WAITOK | M_ZERO);
+		vm = NULL;
+		PROC_LOCK(p);
+		if (p->p_state == PRS_NORMAL && (p->p_flag & P_SYSTEM) == 0 &&
+		    p_cansched(curthread, p) == 0)
+			FOREACH_THREAD_IN_PROC(p, td)
+				if (td->td_cpuset->cs_id == id) {
+					vm = vmspace_acquire_ref(p);
+					break;
+				}
+		pid = p->p_pid;
+		PROC_UNLOCK(p);
+		if (vm != NULL) {
+			numa_sched_add(pid, vm, nsp);
+			nsp = NULL;
+		}
+	}
+	sx_sunlock(&allproc_lock);
+	free(nsp, M_NUMA);
+}
+
+static void
+numa_sched_fork(void *arg __unused, struct proc *p1 __unused,
+    struct proc *p2, int flags __unused)
+{
+	struct numa_sched_proc *nsp;
+	struct numa_policy np;
+	struct vmspace *vm;
+
+	/* The child inherits this policy, see numa_policy_fork(). */
+	numa_policy_resolve(curthread,
+	    osd_thread_get(curthread, numa_policy_osd), &np);
+	if ((np.np_policy & NUMA_POLICY_MASK) != NUMA_POLICY_INTERLEAVE &&
+	    CPU_EMPTY(&np.np_mask))
+		return;
+	nsp = malloc(sizeof(*nsp), M_NUMA, M_WAITOK | M_ZERO);
+	if ((vm = vmspace_acquire_ref(p2)) != NULL)
+		numa_sched_add(p2->p_pid, vm, nsp);
+	else
+		free(nsp, M_NUMA);
+}
+
+static void
+numa_sched_exit(void *arg __unused, struct proc *p)
+{
+	struct numa_sched_proc *nsp;
+
+	rw_wlock(&numa_sched_lock);
+	if ((nsp = numa_sched_find(p->p_pid)) != NULL)
+		nsp->nsp_cancel = 1;
+	rw_wunlock(&numa_sched_lock);
+}
+
+static void
+numa_sched_thread_dtor(void *arg __unused, struct thread *td)
+{
+	volatile u_long *slot;
+	u_long v;
+
+	slot = NUMA_SCHED_SLOT(td->td_tid);
+	v = *slot;
+	if ((v >> 8) == (u_long)td->td_tid)
+		atomic_cmpset_long(slot, v, 0);
+}
+
+static void
+numa_sched_init(void *arg __unused)
+{
+	int c;
+
+	CPU_FOREACH(c)
+		CPU_SET(c, &numa_sched_cpus[pcpu_find(c)->pc_domain]);
+	numa_sched_cross = counter_u64_alloc(M_WAITOK);
+	numa_sched_local = counter_u64_alloc(M_WAITOK);
+	numa_sched_left = counter_u64_alloc(M_WAITOK);
+	numa_sched_returned = counter_u64_alloc(M_WAITOK);
+	numa_sched_away_picks = counter_u64_alloc(M_WAITOK);
+	numa_sched_denied = counter_u64_alloc(M_WAITOK);
+	EVENTHANDLER_REGISTER(process_fork, numa_sched_fork, NULL,
+	    EVENTHANDLER_PRI_ANY);
+	EVENTHANDLER_REGISTER(process_exit, numa_sched_exit, NULL,
+	    EVENTHANDLER_PRI_ANY);
+	EVENTHANDLER_REGISTER(thread_dtor, numa_sched_thread_dtor, NULL,
+	    EVENTHANDLER_PRI_ANY);
+	kthread_add(numa_sched_worker, NULL, NULL, NULL, 0, 0, "numa_sched");
+}
+SYSINIT(numa_sched, SI_SUB_KTHREAD_IDLE, SI_ORDER_ANY, numa_sched_init, NULL);
+
+/*
+ * The root and the base set of set, referenced, as kern_cpuset.c finds them
+ * for CPU_LEVEL_ROOT and CPU_LEVEL_CPUSET.
+ */
+static struct cpuset *
+numa_cpuset_refroot(struct cpuset *set)
+{
+
+	for (; set->cs_parent != NULL; set = set->cs_parent)
+		if ((set->cs_flags & CPU_SET_ROOT) != 0)
+			break;
+	return (cpuset_ref(set));
+}
+
+static struct cpuset *
+numa_cpuset_refbase(struct cpuset *set)
+{
+
+	if (set->cs_id == CPUSET_INVALID)
+		set = set->cs_parent;
+	return (cpuset_ref(set));
+}
+
+/*
+ * Check that the caller may change the policy of the cpuset set, as
+ * cpuset_modify() does before changing a shared or root set.
+ */
+static int
+numa_cpuset_modify(struct cpuset *set)
+{
+	int error;
+
+	error = priv_check(curthread, PRIV_SCHED_CPUSET);
+	if (error != 0)
+		return (error);
+	/* A jail may change its child sets, but not its own root set. */
+	if (jailed(curthread->td_ucred) && (set->cs_flags & CPU_SET_ROOT) != 0)
+		return (EPERM);
+	return (0);
+}
+
+/*
+ * Find the policy target named by (level, which, id).  On success *tdp is
+ * set for a thread target, otherwise *whichp and *idp name the hash key.
+ * Returns with the process of a thread or process target locked in *pp.
+ * If modify is set, a cpuset target must pass numa_cpuset_modify().
+ */
+static int
+numa_policy_target(cpulevel_t level, cpuwhich_t which, id_t id, int modify,
+    struct proc **pp, struct thread **tdp, cpuwhich_t *whichp, id_t *idp)
+{
+	struct cpuset *set, *nset;
+	struct thread *ttd;
+	struct proc *p;
+	int error;
+
+	error = cpuset_which(which, id, &p, &ttd, &set);
+	if (error != 0)
+		return (error);
+	*pp = p;
+	*tdp = NULL;
+	switch (level) {
+	case CPU_LEVEL_ROOT:
+	case CPU_LEVEL_CPUSET:
+		switch (which) {
+		case CPU_WHICH_TID:
+		case CPU_WHICH_PID:
+			thread_lock(ttd);
+			set = cpuset_ref(ttd->td_cpuset);
+			thread_unlock(ttd);
+			break;
+		case CPU_WHICH_CPUSET:
+		case CPU_WHICH_JAIL:
+			break;
+		default:
+			error = EINVAL;
+			goto out;
+		}
+		if (level == CPU_LEVEL_ROOT)
+			nset = numa_cpuset_refroot(set);
+		else
+			nset = numa_cpuset_refbase(set);
+		*whichp = CPU_WHICH_CPUSET;
+		*idp = nset->cs_id;
+		if (modify)
+			error = numa_cpuset_modify(nset);
+		cpuset_rel(nset);
+		cpuset_rel(set);
+		if (error == 0)
+			return (0);
+		set = NULL;
+		goto out;
+	case CPU_LEVEL_WHICH:
+		switch (which) {
+		case CPU_WHICH_TID:
+			*tdp = ttd;
+			return (0);
+		case CPU_WHICH_PID:
+			*whichp = CPU_WHICH_PID;
+			*idp = p->p_pid;
+			return (0);
+		case CPU_WHICH_CPUSET:
+		case CPU_WHICH_JAIL:
+			*whichp = CPU_WHICH_CPUSET;
+			*idp = set->cs_id;
+			if (modify && (error = numa_cpuset_modify(set)) != 0)
+				break;
+			cpuset_rel(set);
+			return (0);
+		default:
+			error = EINVAL;
+			break;
+		}
+		break;
+	default:
+		error = EINVAL;
+		break;
+	}
+out:
+	if (set != NULL && (which == CPU_WHICH_CPUSET || which == CPU_WHICH_JAIL))
+		cpuset_rel(set);
+	if (p != NULL)
+		PROC_UNLOCK(p);
+	*pp = NULL;
+	return (error);
+}
+
+
+/*
+ * Validate the policy and domain mask given for a set.  The mask is clipped
+ * to the existing domains and stored as the empty "all" mask when it names
+ * every domain.
+ */
+static int
+numa_policy_check(const cpuset_t *mask, int policy, struct numa_policy *np)
+{
+	cpuset_t all;
+	int d;
+
+	if ((policy & ~(NUMA_POLICY_MASK | NUMA_POLICY_BALANCE |
+	    NUMA_POLICY_TIERED)) != 0 ||
+	    ((policy & NUMA_POLICY_MASK) != NUMA_POLICY_NEAREST &&
+	    (policy & NUMA_POLICY_MASK) != NUMA_POLICY_INTERLEAVE))
+		return (EINVAL);
+	/* Interleaving over both tiers contradicts fast tier first. */
+	if ((policy & NUMA_POLICY_TIERED) != 0 &&
+	    (policy & NUMA_POLICY_MASK) != NUMA_POLICY_NEAREST)
+		return (EINVAL);
+	np->np_policy = policy;
+	np->np_mask = *mask;
+	CPU_ZERO(&all);
+	for (d = 0; d < vm_ndomains; d++)
+		CPU_SET(d, &all);
+	CPU_AND(&np->np_mask, &all);
+	if (CPU_EMPTY(&np->np_mask))
+		return (EINVAL);
+	if (CPU_CMP(&np->np_mask, &all) == 0)
+		CPU_ZERO(&np->np_mask);
+	return (0);
+}
+
+/*
+ * Report the empty "all" mask as the mask of every domain.
+ */
+static void
+numa_policy_expand(struct numa_policy *np)
+{
+	int d;
+
+	if (CPU_EMPTY(&np->np_mask))
+		for (d = 0; d < vm_ndomains; d++)
+			CPU_SET(d, &np->np_mask);
+}
+
+/*
+ * Give ttd its own policy np.  The process of ttd is locked, which keeps
+ * ttd alive.  *spare is a preallocated OSD slot value, consumed if ttd has
+ * none yet; EAGAIN means one is needed.  The caller bumps numa_policy_gen.
+ */
+static int
+numa_policy_set_thread(struct thread *ttd, const struct numa_policy *np,
+    struct numa_td_policy **spare)
+{
+	struct numa_td_policy *cur;
+
+	PROC_LOCK_ASSERT(ttd->td_proc, MA_OWNED);
+	if ((cur = osd_thread_get(ttd, numa_policy_osd)) == NULL) {
+		if (*spare == NULL)
+			return (EAGAIN);
+		if (osd_thread_set(ttd, numa_policy_osd, *spare) != 0)
+			return (ENOMEM);
+		cur = *spare;
+		*spare = NULL;
+	}
+	cur->ntp_own = *np;
+	cur->ntp_own_set = 1;
+	return (0);
+}
+
+static int
+numa_get_affinity(cpulevel_t level, cpuwhich_t which, id_t id,
+    struct numa_policy *np)
+{
+	struct numa_policy_ent *npe;
+	struct thread *ttd;
+	struct proc *p;
+	int error;
+
+	error = numa_policy_target(level, which, id, 0, &p, &ttd, &which,
+	    &id);
+	if (error != 0)
+		return (error);
+	if (ttd != NULL) {
+		numa_policy_resolve(ttd, osd_thread_get(ttd, numa_policy_osd),
+		    np);
+		PROC_UNLOCK(p);
+	} else {
+		if (p != NULL)
+			PROC_UNLOCK(p);
+		rw_rlock(&numa_policy_lock);
+		npe = numa_policy_lookup(which, id);
+		if (npe != NULL)
+			*np = npe->npe_policy;
+		else
+			numa_policy_default(np);
+		rw_runlock(&numa_policy_lock);
+	}
+	numa_policy_expand(np);
+	return (0);
+}
+
+/*
+ * Set the policy np, checked by numa_policy_check(), on (level, which, id).
+ */
+static int
+numa_set_affinity(cpulevel_t level, cpuwhich_t which, id_t id,
+    const struct numa_policy *np)
+{
+	struct numa_balance_proc *nbp;
+	struct numa_sched_proc *nsp;
+	struct numa_policy_ent *npe;
+	struct numa_td_policy *ntp;
+	struct vmspace *svm, *vm;
+	struct thread *ttd;
+	struct proc *p;
+	pid_t pid;
+	int balance, error;
+
+	balance = (np->np_policy &
+	    (NUMA_POLICY_BALANCE | NUMA_POLICY_TIERED)) != 0;
+	npe = malloc(sizeof(*npe), M_NUMA, M_WAITOK | M_ZERO);
+	ntp = malloc(sizeof(*ntp), M_NUMA, M_WAITOK | M_ZERO);
+	nbp = balance ? malloc(sizeof(*nbp), M_NUMA, M_WAITOK | M_ZERO) : NULL;
+	nsp = malloc(sizeof(*nsp), M_NUMA, M_WAITOK | M_ZERO);
+	vm = svm = NULL;
+	error = numa_policy_target(level, which, id, 1, &p, &ttd, &which,
+	    &id);
+	if (error != 0)
+		goto out;
+	/*
+	 * Balancing is a property of the address space: a thread target
+	 * switches it on for its process, a process target on or off.
+	 */
+	pid = p != NULL && (ttd != NULL || which == CPU_WHICH_PID) ?
+	    p->p_pid : 0;
+	if (pid != 0 && balance)
+		vm = vmspace_acquire_ref(p);
+	/* A process policy has the process scanned, a thread's does not. */
+	if (pid != 0 && ttd == NULL)
+		svm = vmspace_acquire_ref(p);
+	if (ttd != NULL) {
+		error = numa_policy_set_thread(ttd, np, &ntp);
+		if (error == 0)
+			atomic_add_int(&numa_policy_gen, 1);
+		PROC_UNLOCK(p);
+	} else {
+		if (p != NULL)
+			PROC_UNLOCK(p);
+		numa_policy_store(which, id, np, &npe);
+		if (which == CPU_WHICH_CPUSET)
+			numa_sched_add_cpuset(id);
+	}
+	if (error == 0 && pid != 0 && (vm != NULL || ttd == NULL)) {
+		numa_balance_set(pid, np->np_policy, vm, nbp);
+		vm = NULL;
+		nbp = NULL;
+	}
+	if (error == 0 && svm != NULL) {
+		numa_sched_add(pid, svm, nsp);
+		svm = NULL;
+		nsp = NULL;
+	}
+out:
+	if (vm != NULL)
+		vmspace_free(vm);
+	if (svm != NULL)
+		vmspace_free(svm);
+	free(nsp, M_NUMA);
+	free(nbp, M_NUMA);
+	free(ntp, M_NUMA);
+	free(npe, M_NUMA);
+	return (error);
+}
 
+/*
+ * Vectored get and set.  Entries are handled NUMA_AFFINITY_BATCH at a time.
+ * A thread entry (CPU_LEVEL_WHICH, CPU_WHICH_TID) whose thread belongs to
+ * the process locked for the previous entry is found in the TID hash and
+ * served without dropping the process lock, so re-pinning all threads of a
+ * process costs one lock round trip and one policy generation bump.  The
+ * per-thread policy storage those sets may need is allocated up front, one
+ * per thread entry, so no entry ever drops the lock to allocate.  Other
+ * entries, and sets that change balancing, go through the single-object
+ * path.
+ */
+#define NUMA_AFFINITY_BATCH     64
+#define NUMA_AFFINITY_MAX       (1 << 20)
+
+/*
+ * Find thread tid of the locked process p, or NULL.
+ */
+static struct thread *
+numa_tdfind_locked(struct proc *p, lwpid_t tid)
+{
+	struct thread *td;
+
+	PROC_LOCK_ASSERT(p, MA_OWNED);
+	if (tid == -1)
+		tid = curthread->td_tid;
+	rw_rlock(&tidhash_lock);
+	LIST_FOREACH(td, TIDHASH(tid), td_hash)
+		if (td->td_tid == tid)
+			break;
+	rw_runlock(&tidhash_lock);
+	return (td != NULL && td->td_proc == p ? td : NULL);
+}
+
+static void
+numa_affinity_batch(int op, struct numa_affinity_req *reqs, int n)
+{
+	struct numa_td_policy *spare, *spares[NUMA_AFFINITY_BATCH];
+	struct numa_affinity_req *r;
+	struct numa_policy np;
+	struct cpuset *set;
+	struct thread *ttd;
+	struct proc *p;
+	int changed, i, nspare;
+
+	KASSERT(n <= NUMA_AFFINITY_BATCH, ("numa_affinity_batch: %d entries",
+	    n));
+	/*
+	 * One OSD slot value for every thread entry a set may reach below,
+	 * allocated before any process is locked.
+	 */
+	nspare = 0;
+	if (op == NUMA_AFFINITY_SET)
+		for (i = 0; i < n; i++)
+			if (reqs[i].nar_level == CPU_LEVEL_WHICH &&
+			    reqs[i].nar_which == CPU_WHICH_TID)
+				spares[nspare++] = malloc(sizeof(**spares),
+				    M_NUMA, M_WAITOK | M_ZERO);
+	p = NULL;
+	spare = NULL;
+	changed = 0;
+	for (i = 0; i < n; i++) {
+		r = &reqs[i];
+		if (op == NUMA_AFFINITY_SET && (r->nar_error =
+		    numa_policy_check(&r->nar_mask, r->nar_policy, &np)) != 0)
+			continue;
+		if (r->nar_level != CPU_LEVEL_WHICH ||
+		    r->nar_which != CPU_WHICH_TID ||
+		    (op == NUMA_AFFINITY_SET &&
+		    (np.np_policy &
+		    (NUMA_POLICY_BALANCE | NUMA_POLICY_TIERED)) != 0)) {
+			if (p != NULL) {
+				PROC_UNLOCK(p);
+				p = NULL;
+			}
+			if (op == NUMA_AFFINITY_SET) {
+				r->nar_error = numa_set_affinity(r->nar_level,
+				    r->nar_which, r->nar_id, &np);
+				continue;
+			}
+			r->nar_error = numa_get_affinity(r->nar_level,
+			    r->nar_which, r->nar_id, &np);
+			if (r->nar_error == 0) {
+				r->nar_mask = np.np_mask;
+				r->nar_policy = np.np_policy;
+			}
+			continue;
+		}
+
+		ttd = NULL;
+		if (p != NULL &&
+		    (ttd = numa_tdfind_locked(p, r->nar_id)) == NULL) {
+			PROC_UNLOCK(p);
+			p = NULL;
+		}
+		if (ttd == NULL) {
+			r->nar_error = cpuset_which(CPU_WHICH_TID, r->nar_id,
+			    &p, &ttd, &set);
+			if (r->nar_error != 0) {
+				p = NULL;
+				continue;
+			}
+		}
+		if (op == NUMA_AFFINITY_GET) {
+			numa_policy_resolve(ttd,
+			    osd_thread_get(ttd, numa_policy_osd), &np);
+			numa_policy_expand(&np);
+			r->nar_mask = np.np_mask;
+			r->nar_policy = np.np_policy;
+			r->nar_error = 0;
+			continue;
+		}
+		if (spare == NULL && nspare > 0)
+			spare = spares[--nspare];
+		r->nar_error = numa_policy_set_thread(ttd, &np, &spare);
+		KASSERT(r->nar_error != EAGAIN,
+		    ("numa_affinity_batch: out of spares"));
+		if (r->nar_error == 0)
+			changed = 1;
+	}
+	if (p != NULL)
+		PROC_UNLOCK(p);
+	if (changed)
+		atomic_add_int(&numa_policy_gen, 1);
+	free(spare, M_NUMA);
+	while (nspare > 0)
+		free(spares[--nspare], M_NUMA);
+}
+
+/*
+ * Collect up to NUMA_MOVE_BATCH resident pages of [*cursor, end) in map that
+ * sit on a domain their range policy does not want, with the domain each
+ * should go to.  Returns the number of entries filled in; *cursor is left
+ * past the last page examined.
+ */
+static int
+numa_range_scan(vm_map_t map, vm_offset_t *cursor, vm_offset_t end,
+    struct numa_move_ctx *ctx)
+{
+	struct numa_move_ent *e;
+	vm_map_entry_t entry;
+	vm_object_t obj;
+	vm_pindex_t first, last;
+	vm_page_t m;
+	int dst, n;
+
+	n = 0;
+	vm_map_lock_read(map);
+	if (!vm_map_lookup_entry(map, *cursor, &entry))
+		entry = entry->next;
+	for (; entry != &map->header && entry->start < end &&
+	    n < NUMA_MOVE_BATCH; entry = entry->next) {
+		if ((entry->eflags & MAP_ENTRY_IS_SUB_MAP) != 0 ||
+		    (obj = entry->object.vm_object) == NULL)
+			continue;
+		first = OFF_TO_IDX(entry->offset +
+		    (MAX(*cursor, entry->start) - entry->start));
+		last = OFF_TO_IDX(entry->offset +
+		    (MIN(end, entry->end) - entry->start));
+		*cursor = MIN(end, entry->end);
+		VM_OBJECT_RLOCK(obj);
+		for (m = vm_page_find_least(obj, first);
+		    m != NULL && m->pindex < last;
+		    m = TAILQ_NEXT(m, listq)) {
+			if (n == NUMA_MOVE_BATCH) {
+				*cursor = entry->start +
+				    IDX_TO_OFF(m->pindex) - entry->offset;
+				break;
+			}
+			dst = numa_range_target(obj, m->pindex,
+			    numa_page_domain(m));
+			if (dst < 0)
+				continue;
+			e = &ctx->nmc_ents[n++];
+			e->nme_addr = entry->start + IDX_TO_OFF(m->pindex) -
+			    entry->offset;
+			e->nme_node = dst;
+		}
+		VM_OBJECT_RUNLOCK(obj);
+	}
+	if (n < NUMA_MOVE_BATCH)
+		*cursor = end;
+	vm_map_unlock_read(map);
+	return (n);
+}
 
 /* ------- SYSCALL INTERFACE ------ */
 
@@ -63,38 +3207,23 @@
  *      stored in the space provided by mask. Also retrieves the memory
  *      allocation policy of the specified object and stores the value in policy
  */
-int 
-sys_cpuset_get_memory_affinity(struct thread *td, struct cpuset_get_memory_affinity_args *uap)
+static int
+numa_cpuset_get_memory_affinity(struct thread *td, struct cpuset_get_memory_affinity_args *uap)
 {
-    struct cpuset_get_memory_affinity_args * argsptr;
-    unsigned long bytes_not_copied;
-
-    //get args from userspace
-    argsptr = (*cpuset_get_memory_affinity_args) kmalloc(sizeof(cpuset_get_memory_affinity_args));
-    bytes_not_copied = copy_from_user(argsptr,uap,sizeof(cpuset_get_memory_affinity_args));
-    
-    //check to make sure we got everything
-    if (bytes_not_copied > 0)
-    {
-        //some bytes weren't copied, bail
-        return 89;
-    }
+	struct numa_policy np;
+	int error;
 
-    //data validation for cpulevel_t
-    if ((argsptr->level > 3) || (argsptr->cpulevel < 1))
-    {
-        //invalid level; return errno 33
-        return 33;
-    }
-
-    //data validation for cpuwhich_t
-    if ((argsptr->cpuwhich > 5) || (argsptr->cpuwhich < 1))
-    {
-        //invalid which; return errno 33
-        return 33;
-    }
-
-    return 0;
+	if (uap->setsize < sizeof(cpuset_t) ||
+	    uap->setsize > CPU_MAXSIZE / NBBY)
+		return (ERANGE);
+	error = numa_get_affinity(uap->level, uap->which, uap->id, &np);
+	if (error != 0)
+		return (error);
+	error = copyout(&np.np_mask, uap->mask, sizeof(np.np_mask));
+	if (error == 0)
+		error = copyout(&np.np_policy, uap->policy,
+		    sizeof(np.np_policy));
+	return (error);
 }
 
 /* Function: cpuset_set_memory_affinity()
@@ -112,39 +3241,149 @@ sys_cpuset_get_memory_affinity(struct thread *td, struct cpuset_get_memory_affin
  * Summary: Sets the memory affinity and allocation policy of the object
  *      specified by level,which and id to the value stored in mask and policy.
  */
-int 
-sys_cpuset_set_memory_affinity(struct thread *td, struct cpuset_set_memory_affinity_args *uap)
+static int
+numa_cpuset_set_memory_affinity(struct thread *td, struct cpuset_set_memory_affinity_args *uap)
 {
-    struct cpuset_set_memory_affinity_args * argsptr;
-    unsigned long bytes_not_copied;
-    //get args from userspace
-    argsptr = (*cpuset_set_memory_affinity_args) kmalloc(sizeof(cpuset_set_memory_affinity_args));
-    bytes_not_copied = copy_from_user(argsptr,uap,sizeof(cpuset_set_memory_affinity_args));
-    
-    //check to make sure we got everything
-    if (bytes_not_copied > 0)
-    {
-        //some bytes weren't copied, bail
-        return 89;
-    }
+	struct numa_policy np;
+	cpuset_t mask;
+	int error;
 
-    //data validation for cpulevel_t
-    if ((argsptr->level > 3) || (argsptr->cpulevel < 1))
-    {
-        //invalid level; return errno 33
-        return 33;
-    }
+	if (uap->setsize < sizeof(cpuset_t) ||
+	    uap->setsize > CPU_MAXSIZE / NBBY)
+		return (ERANGE);
+	error = copyin(uap->mask, &mask, sizeof(mask));
+	if (error != 0)
+		return (error);
+	error = numa_policy_check(&mask, uap->policy, &np);
+	if (error != 0)
+		return (error);
+	return (numa_set_affinity(uap->level, uap->which, uap->id, &np));
+}
 
-    //data validation for cpuwhich_t
-    if ((argsptr->cpuwhich > 5) || (argsptr->cpuwhich < 1))
-    {
-        //invalid which; return errno 33
-        return 33;
-    }
+/* Function: cpuset_memory_affinity_vec()
+ * Input:
+ *      int op: NUMA_AFFINITY_GET or NUMA_AFFINITY_SET.
+ *      struct numa_affinity_req *reqs: The objects and, for
+ *          NUMA_AFFINITY_SET, their new masks and policies.
+ *      u_int count: The number of entries of reqs.
+ * Output: Returns 0 for success. Returns -1 for failure.
+ * Summary: cpuset_get_memory_affinity() or cpuset_set_memory_affinity() for
+ *      every entry in one kernel entry, with the outcome of each in
+ *      nar_error. Runs of thread entries of the same process are served
+ *      under a single acquisition of the process lock.
+ */
+static int
+numa_cpuset_memory_affinity_vec(struct thread *td,
+    struct cpuset_memory_affinity_vec_args *uap)
+{
+	struct numa_affinity_req *reqs;
+	u_int done, n;
+	int error;
 
-    return 0;
+	if (uap->op != NUMA_AFFINITY_GET && uap->op != NUMA_AFFINITY_SET)
+		return (EINVAL);
+	if (uap->count > NUMA_AFFINITY_MAX)
+		return (E2BIG);
+	reqs = malloc(NUMA_AFFINITY_BATCH * sizeof(*reqs), M_NUMA, M_WAITOK);
+	error = 0;
+	for (done = 0; done < uap->count; done += n) {
+		n = MIN(uap->count - done, NUMA_AFFINITY_BATCH);
+		error = copyin(uap->reqs + done, reqs, n * sizeof(*reqs));
+		if (error != 0)
+			break;
+		numa_affinity_batch(uap->op, reqs, n);
+		error = copyout(reqs, uap->reqs + done, n * sizeof(*reqs));
+		if (error != 0)
+			break;
+	}
+	free(reqs, M_NUMA);
+	return (error);
 }
 
+/*
+ * The body of move_pages().  pages32 is set when pages is an array of 32-bit
+ * pointers, for freebsd32_move_pages().
+ */
+static int
+numa_move_pages_common(struct thread *td, pid_t upid, u_long count,
+    const void *pages, int pages32, const int *node, int *status,
+    int move_flag)
+{
+	struct numa_move_ctx *ctx;
+	struct vmspace *vm;
+	struct proc *p;
+	u_long done, n;
+	pid_t pid;
+	int error, i;
+
+	if (move_flag != NUMA_MOVE && move_flag != NUMA_MOVE_ALL)
+		return (EINVAL);
+	if (move_flag == NUMA_MOVE_ALL) {
+		error = priv_check(td, PRIV_SCHED_CPUSET);
+		if (error != 0)
+			return (error);
+	}
+	if (upid == 0) {
+		p = td->td_proc;
+		PROC_LOCK(p);
+	} else {
+		error = pget(upid, PGET_CANDEBUG | PGET_NOTWEXIT, &p);
+		if (error != 0)
+			return (error);
+	}
+	pid = p->p_pid;
+	vm = vmspace_acquire_ref(p);
+	PROC_UNLOCK(p);
+	if (vm == NULL)
+		return (ESRCH);
+
+	ctx = malloc(sizeof(*ctx), M_NUMA, M_WAITOK);
+	ctx->nmc_pid = pid;
+	error = 0;
+	for (done = 0; done < count; done += n) {
+		n = MIN(count - done, NUMA_MOVE_BATCH);
+#ifdef COMPAT_FREEBSD32
+		if (pages32) {
+			error = copyin((const uint32_t *)pages + done,
+			    ctx->nmc_pages32, n * sizeof(*ctx->nmc_pages32));
+			for (i = 0; error == 0 && i < n; i++)
+				ctx->nmc_pages[i] = PTRIN(ctx->nmc_pages32[i]);
+		} else
+#endif
+		error = copyin((void * const *)pages + done, ctx->nmc_pages,
+		    n * sizeof(*ctx->nmc_pages));
+		if (error == 0 && node != NULL)
+			error = copyin(node + done, ctx->nmc_node,
+			    n * sizeof(*ctx->nmc_node));
+		if (error != 0)
+			break;
+		for (i = 0; i < n; i++) {
+			ctx->nmc_ents[i].nme_addr =
+			    (vm_offset_t)ctx->nmc_pages[i];
+			ctx->nmc_ents[i].nme_node = -1;
+			if (node == NULL)
+				continue;
+			if (ctx->nmc_node[i] < 0 ||
+			    ctx->nmc_node[i] >= vm_ndomains) {
+				error = ENODEV;
+				break;
+			}
+			ctx->nmc_ents[i].nme_node = ctx->nmc_node[i];
+		}
+		if (error != 0)
+			break;
+		(void)numa_move_batch(&vm->vm_map, ctx, n, move_flag);
+		for (i = 0; i < n; i++)
+			ctx->nmc_status[i] = ctx->nmc_ents[i].nme_status;
+		error = copyout(ctx->nmc_status, status + done,
+		    n * sizeof(*ctx->nmc_status));
+		if (error != 0)
+			break;
+	}
+	free(ctx, M_NUMA);
+	vmspace_free(vm);
+	return (error);
+}
 
 /* Function: move_pages()
  * Input:
@@ -160,11 +3399,97 @@ sys_cpuset_set_memory_affinity(struct thread *td, struct cpuset_set_memory_affin
  *          other processes is also to be moved (NUMA_MOVE or NUMA_MOVE_ALL).
  * Output: Returns 0 for success.  Returns -1 for failure.
  * Summary: Used to move specific pages on specified nodes to new NUMA nodes.
+ *      After the call status[i] holds the node page i is on, or a negative
+ *      errno: -ENOENT (not resident), -EFAULT (not mapped), -EACCES (shared
+ *      and NUMA_MOVE given), -EBUSY (busy or wired) or -ENOMEM (target node
+ *      full). Passing a null node only fills status with the current
+ *      placement of every page. Pages are processed in batches, each batch
+ *      locking every VM object once and flushing the TLB once per run of
+ *      consecutive pages.
+ */
+static int
+numa_move_pages(struct thread *td, struct move_pages_args *uap)
+{
+
+	return (numa_move_pages_common(td, uap->pid, uap->count, uap->pages, 0,
+	    uap->node, uap->status, uap->move_flag));
+}
+
+/*
+ * The body of migrate_pages(), with both node masks copied in.
  */
-int 
-sys_move_pages(struct thread *td, struct move_pages_args *uap)
+static int
+numa_migrate_pages_common(struct thread *td, pid_t pid, const u_long *oldmask,
+    const u_long *newmask)
 {
-    return 0;
+	struct numa_migrate_req *req, *old;
+	struct proc *p;
+	int from[MAXMEMDOM], to[MAXMEMDOM];
+	int d, error, nfrom, nto;
+
+	/* The i-th old node goes to the i-th new node, cycling. */
+	nfrom = nto = 0;
+	for (d = 0; d < vm_ndomains; d++) {
+		if (oldmask[d / (NBBY * sizeof(u_long))] &
+		    (1UL << (d % (NBBY * sizeof(u_long)))))
+			from[nfrom++] = d;
+		if (newmask[d / (NBBY * sizeof(u_long))] &
+		    (1UL << (d % (NBBY * sizeof(u_long)))))
+			to[nto++] = d;
+	}
+	if (nfrom == 0 || nto == 0)
+		return (EINVAL);
+
+	req = malloc(sizeof(*req), M_NUMA, M_WAITOK | M_ZERO);
+	for (d = 0; d < MAXMEMDOM; d++)
+		req->nmr_map[d] = -1;
+	for (d = 0; d < nfrom; d++)
+		if (from[d] != to[d % nto])
+			req->nmr_map[from[d]] = to[d % nto];
+
+	if (pid == 0) {
+		p = td->td_proc;
+		PROC_LOCK(p);
+	} else {
+		error = pget(pid, PGET_CANDEBUG | PGET_NOTWEXIT, &p);
+		if (error != 0) {
+			free(req, M_NUMA);
+			return (error);
+		}
+	}
+	req->nmr_pid = p->p_pid;
+	req->nmr_vm = vmspace_acquire_ref(p);
+	PROC_UNLOCK(p);
+	if (req->nmr_vm == NULL) {
+		free(req, M_NUMA);
+		return (ESRCH);
+	}
+	req->nmr_ticks = ticks;
+	req->nmr_status.nms_pid = req->nmr_pid;
+	req->nmr_status.nms_state = NUMA_MIGRATE_QUEUED;
+
+	/* A new request replaces a finished one and waits for a running one. */
+	mtx_lock(&numa_migrate_mtx);
+	while ((old = numa_migrate_find(req->nmr_pid)) != NULL) {
+		if (old->nmr_vm == NULL) {
+			TAILQ_REMOVE(&numa_migrate_done, old, nmr_link);
+			free(old, M_NUMA);
+			continue;
+		}
+		error = msleep(old, &numa_migrate_mtx, PVM | PCATCH,
+		    "numamq", 0);
+		if (error != 0) {
+			mtx_unlock(&numa_migrate_mtx);
+			vmspace_free(req->nmr_vm);
+			free(req, M_NUMA);
+			return (error);
+		}
+	}
+	TAILQ_INSERT_TAIL(&numa_migrate_queue, req, nmr_link);
+	wakeup(&numa_migrate_queue);
+	mtx_unlock(&numa_migrate_mtx);
+	td->td_retval[0] = 0;
+	return (0);
 }
 
 /* Function: migrate_pages()
@@ -176,12 +3501,73 @@ sys_move_pages(struct thread *td, struct move_pages_args *uap)
  *      const unsigned long *new_nodes: The bitmask representing the new nodes.
  * Output: Returns 0 for success.  Returns -1 for failure.
  * Summary: Attempts to move all pages of a process in specified nodes to
- *      specified new NUMA nodes.
+ *      specified new NUMA nodes. The n-th node of old_nodes maps to the n-th
+ *      node of new_nodes, wrapping around new_nodes. The call only queues
+ *      the work: a kernel thread migrates the pages in chunks of
+ *      kern.numa.migrate_chunk pages at no more than kern.numa.migrate_bw
+ *      MB/s, leaving pages that are being written for later passes. Progress
+ *      is reported by migrate_pages_status(). A new request for the same
+ *      process waits for a running one to finish.
  */
-int
-sys_migrate_pages(struct thread *td, struct migrate_pages_args *uap)
+static int
+numa_migrate_pages(struct thread *td, struct migrate_pages_args *uap)
+{
+	u_long oldmask[NUMA_MIGRATE_MASKLEN], newmask[NUMA_MIGRATE_MASKLEN];
+	size_t len;
+	int error;
+
+	if (uap->maxnode == 0)
+		return (EINVAL);
+	len = howmany(MIN(uap->maxnode, MAXMEMDOM), NBBY * sizeof(u_long)) *
+	    sizeof(u_long);
+	bzero(oldmask, sizeof(oldmask));
+	bzero(newmask, sizeof(newmask));
+	error = copyin(uap->old_nodes, oldmask, len);
+	if (error == 0)
+		error = copyin(uap->new_nodes, newmask, len);
+	if (error != 0)
+		return (error);
+	return (numa_migrate_pages_common(td, uap->pid, oldmask, newmask));
+}
+
+/* Function: migrate_pages_status()
+ * Input:
+ *      int pid: The process ID given to migrate_pages(). 0 refers to the
+ *          calling process.
+ *      struct numa_migrate_status *status: Filled with the progress of the
+ *          last migration of pid.
+ * Output: Returns 0 for success.  Returns -1 for failure.
+ * Summary: Reports the progress of the asynchronous migration started by
+ *      migrate_pages(). Fails with ESRCH if none was requested for pid or
+ *      if pid is not visible to the caller.
+ */
+static int
+numa_migrate_pages_status(struct thread *td,
+    struct migrate_pages_status_args *uap)
 {
-    return 0;
+	struct numa_migrate_status st;
+	struct numa_migrate_req *req;
+	struct proc *p;
+	pid_t pid;
+	int error;
+
+	if (uap->pid == 0)
+		pid = td->td_proc->p_pid;
+	else {
+		error = pget(uap->pid, PGET_CANSEE, &p);
+		if (error != 0)
+			return (error);
+		pid = p->p_pid;
+		PROC_UNLOCK(p);
+	}
+	mtx_lock(&numa_migrate_mtx);
+	req = numa_migrate_find(pid);
+	if (req != NULL)
+		st = req->nmr_status;
+	mtx_unlock(&numa_migrate_mtx);
+	if (req == NULL)
+		return (ESRCH);
+	return (copyout(&st, uap->status, sizeof(st)));
 }
  
 /* Function: get_numa_cpus()
@@ -190,14 +3576,34 @@ sys_migrate_pages(struct thread *td, struct migrate_pages_args *uap)
  *      size_t length: The length of the array in bytes.
  * Output: Returns the count of NUMA nodes and fills buff with an array of
  *      cpusets. Passing a null buff and length of 0 will simply return the
- *      count of NUMA nodes.
+ *      count of NUMA nodes. Returns -1 with errno set to EINVAL if length is
+ *      too small for every node.
  * Summary: Allows processes to know what cpus belong to each NUMA node. This is
- *      useful in assigning memory affinity and policies. 
+ *      useful in assigning memory affinity and policies. A memory-only node
+ *      gets an empty set; get_numa_meminfo() reports it as NUMA_TIER_SLOW.
  */
-int 
-sys_get_numa_cpus(struct thread *td, struct get_numa_cpus_args *uap)
+static int
+numa_get_numa_cpus(struct thread *td, struct get_numa_cpus_args *uap)
 {
-    return 0;
+	cpuset_t sets[MAXMEMDOM];
+	size_t len;
+	int c, d, error;
+
+	len = sizeof(sets[0]) * vm_ndomains;
+	if (uap->buff != NULL) {
+		if (uap->length < len)
+			return (EINVAL);
+		/* A domain without CPUs gets an empty set. */
+		for (d = 0; d < vm_ndomains; d++)
+			CPU_ZERO(&sets[d]);
+		CPU_FOREACH(c)
+			CPU_SET(c, &sets[pcpu_find(c)->pc_domain]);
+		error = copyout(sets, uap->buff, len);
+		if (error != 0)
+			return (error);
+	}
+	td->td_retval[0] = vm_ndomains;
+	return (0);
 }
 
 /* Function: get_numa_weights()
@@ -206,51 +3612,438 @@ sys_get_numa_cpus(struct thread *td, struct get_numa_cpus_args *uap)
  *          the indexes are relative IDs.
  *      size_t length: The length of the array in bytes.
  * Output: Returns the count of NUMA nodes and fills buff with a 2 dimensional
- *      array of weights between NUMA nodes. Passing a null buff and length of 0
- *      will simply return the count of NUMA nodes.
+ *      array of weights between NUMA nodes. Passing a null buff will simply
+ *      return the count of NUMA nodes, so a caller can size buff as count *
+ *      count shorts in one round trip. Returns -1 with errno set to EINVAL if
+ *      length is too small for the whole matrix.
  * Summary: Allows processes to know about relative latency between NUMA nodes. 
  *      Weight between two NUMA nodes can be found by accessing the value at
- *      buff[a][b] where a and b are memory node IDs.
+ *      buff[a * count + b] where a and b are memory node IDs. The weights are
+ *      the firmware locality distances: NUMA_LOCAL_DISTANCE for a node to
+ *      itself and larger values for more distant nodes.
  */
-int
-sys_get_numa_weights(struct thread *td, struct get_numa_weights_args *uap)
+static int
+numa_get_numa_weights(struct thread *td, struct get_numa_weights_args *uap)
 {
-	int fail;
-	short *domain_map;
-	if(uap->length < vm_ndomains * vm_ndomains)
-	{
-		// Not enough space
-		return (vm_ndomains);
+	size_t len;
+	int error;
+
+	len = sizeof(short) * vm_ndomains * vm_ndomains;
+	if (uap->buff != NULL) {
+		if (uap->length < len)
+			return (EINVAL);
+		error = copyout(numa_weights_cache, uap->buff, len);
+		if (error != 0)
+			return (error);
 	}
+	td->td_retval[0] = vm_ndomains;
+	return (0);
+}
+
+/*
+ * Fill mi for domain d.  The global page daemon thresholds are scaled to the
+ * domain's share of memory.
+ */
+static void
+numa_meminfo_fill(int d, struct numa_meminfo *mi)
+{
+	struct vm_domain *vmd;
+	uint64_t min, target;
 
-	domain_map = (*short)kmalloc(sizeof(short) * vm_domains * vm_domains);
+	vmd = &vm_dom[d];
+	mi->nmi_total = vmd->vmd_page_count;
+	mi->nmi_free = vmd->vmd_free_count;
+	mi->nmi_active = vmd->vmd_pagequeues[PQ_ACTIVE].pq_cnt;
+	mi->nmi_inactive = vmd->vmd_pagequeues[PQ_INACTIVE].pq_cnt;
+	min = (uint64_t)cnt.v_free_min * vmd->vmd_page_count /
+	    MAX(cnt.v_page_count, 1);
+	target = (uint64_t)cnt.v_free_target * vmd->vmd_page_count /
+	    MAX(cnt.v_page_count, 1);
+	if (mi->nmi_free < min)
+		mi->nmi_pressure = NUMA_PRESSURE_HIGH;
+	else if (mi->nmi_free < target)
+		mi->nmi_pressure = NUMA_PRESSURE_LOW;
+	else
+		mi->nmi_pressure = NUMA_PRESSURE_NONE;
+	mi->nmi_tier = numa_tier_cache[d];
+}
+
+/* Function: get_numa_meminfo()
+ * Input:
+ *      struct numa_meminfo *buff: An array to be filled with one entry per
+ *          NUMA node.
+ *      size_t length: The length of the array in bytes.
+ * Output: Returns the count of NUMA nodes and fills buff. Passing a null buff
+ *      will simply return the count of NUMA nodes. Returns -1 with errno set
+ *      to EINVAL if length is too small for every node.
+ * Summary: Free, active, inactive and total pages and the pressure level of
+ *      every node, copied out at once.
+ */
+static int
+numa_get_numa_meminfo(struct thread *td, struct get_numa_meminfo_args *uap)
+{
+	struct numa_meminfo mi[MAXMEMDOM];
+	size_t len;
+	int d, error;
 
-	if(!domain_map) // Cannot allocate memory
-	{
-		return (vm_ndomains);
+	len = sizeof(mi[0]) * vm_ndomains;
+	if (uap->buff != NULL) {
+		if (uap->length < len)
+			return (EINVAL);
+		for (d = 0; d < vm_ndomains; d++)
+			numa_meminfo_fill(d, &mi[d]);
+		error = copyout(mi, uap->buff, len);
+		if (error != 0)
+			return (error);
 	}
+	td->td_retval[0] = vm_ndomains;
+	return (0);
+}
 
-	for(int i = 0; i < vm_ndomains; i++)
-	{
-		for(int j = 0, j < vm_ndomains, j++)
-		{
-			// Fill with sample data	
-			if(i == j)
-			{
-				domain_map[i][j] = 0;
-			}
-			else
-			{
-				domain_map[i][j] = 1;
-			}
+/* Function: mbind()
+ * Input:
+ *      void *addr: The start of the range, rounded down to a page.
+ *      size_t len: The length of the range in bytes.
+ *      int policy: NUMA_POLICY_NEAREST or NUMA_POLICY_INTERLEAVE, or 0 to
+ *          remove the range policy.
+ *      size_t setsize: The size of the set.
+ *      const cpuset_t *mask: The domains pages of the range should come
+ *          from.
+ *      int flags: 0 to leave the resident pages to the numa_sched scanner,
+ *          NUMA_MOVE or NUMA_MOVE_ALL to move them now, as for move_pages().
+ * Output: Returns 0 for success. Returns -1 for failure.
+ * Summary: Attaches the policy to the objects mapped at the range rather
+ *      than to the calling thread, so the pages of a shared memory segment
+ *      or file are placed alike for every process mapping it. Interleaved
+ *      pages are dealt out by their offset in the object. The calling
+ *      process is scanned from then on; the scanner moves shared pages of
+ *      the range only through mappings that may write them. Fails with
+ *      EFAULT if part of the range is not mapped and with EINVAL if part of
+ *      it has no backing object yet. Private copies made on write follow
+ *      the policy of the process.
+ */
+static int
+numa_mbind(struct thread *td, struct mbind_args *uap)
+{
+	struct numa_range *spare[2];
+	struct numa_range_list dead;
+	struct numa_sched_proc *nsp;
+	struct numa_move_ctx *ctx;
+	struct numa_policy np;
+	struct vmspace *vm;
+	vm_map_t map;
+	vm_map_entry_t entry;
+	vm_offset_t cursor, end, start;
+	cpuset_t mask;
+	int error, n;
+
+	if (uap->flags != 0 && uap->flags != NUMA_MOVE &&
+	    uap->flags != NUMA_MOVE_ALL)
+		return (EINVAL);
+	if (uap->flags == NUMA_MOVE_ALL) {
+		error = priv_check(td, PRIV_SCHED_CPUSET);
+		if (error != 0)
+			return (error);
+	}
+	start = trunc_page((vm_offset_t)uap->addr);
+	end = round_page((vm_offset_t)uap->addr + uap->len);
+	if (uap->len == 0 || end <= start)
+		return (EINVAL);
+	if (uap->policy != 0) {
+		if (uap->setsize < sizeof(cpuset_t) ||
+		    uap->setsize > CPU_MAXSIZE / NBBY)
+			return (ERANGE);
+		error = copyin(uap->mask, &mask, sizeof(mask));
+		if (error != 0)
+			return (error);
+		error = numa_policy_check(&mask, uap->policy, &np);
+		if (error != 0)
+			return (error);
+		if ((np.np_policy & NUMA_POLICY_BALANCE) != 0)
+			return (EINVAL);
+	}
+
+	map = &td->td_proc->p_vmspace->vm_map;
+	spare[0] = malloc(sizeof(*spare[0]), M_NUMA, M_WAITOK);
+	spare[1] = malloc(sizeof(*spare[1]), M_NUMA, M_WAITOK);
+	LIST_INIT(&dead);
+	error = 0;
+	vm_map_lock_read(map);
+	/* Check the whole range before changing any of it. */
+	if (!vm_map_lookup_entry(map, start, &entry))
+		error = EFAULT;
+	for (cursor = start; error == 0 && cursor < end;
+	    cursor = entry->end, entry = entry->next) {
+		if (entry == &map->header || entry->start != cursor)
+			error = EFAULT;
+		else if ((entry->eflags & MAP_ENTRY_IS_SUB_MAP) != 0 ||
+		    entry->object.vm_object == NULL)
+			error = EINVAL;
+	}
+	if (error == 0)
+		(void)vm_map_lookup_entry(map, start, &entry);
+	for (cursor = start; error == 0 && cursor < end;
+	    cursor = entry->end, entry = entry->next) {
+		if (spare[0] == NULL)
+			spare[0] = malloc(sizeof(*spare[0]), M_NUMA, M_WAITOK);
+		if (spare[1] == NULL)
+			spare[1] = malloc(sizeof(*spare[1]), M_NUMA, M_WAITOK);
+		numa_range_store(entry->object.vm_object,
+		    OFF_TO_IDX(entry->offset + (cursor - entry->start)),
+		    OFF_TO_IDX(entry->offset + (MIN(end, entry->end) -
+		    entry->start)), uap->policy != 0 ? &np : NULL, spare,
+		    &dead);
+	}
+	vm_map_unlock_read(map);
+	numa_range_free(&dead);
+	free(spare[0], M_NUMA);
+	free(spare[1], M_NUMA);
+	if (error != 0 || uap->policy == 0)
+		return (error);
+
+	nsp = malloc(sizeof(*nsp), M_NUMA, M_WAITOK | M_ZERO);
+	if ((vm = vmspace_acquire_ref(td->td_proc)) != NULL)
+		numa_sched_add(td->td_proc->p_pid, vm, nsp);
+	else
+		free(nsp, M_NUMA);
+	if (uap->flags == 0)
+		return (0);
+
+	ctx = malloc(sizeof(*ctx), M_NUMA, M_WAITOK);
+	ctx->nmc_pid = td->td_proc->p_pid;
+	for (cursor = start; cursor < end;)
+		if ((n = numa_range_scan(map, &cursor, end, ctx)) > 0)
+			(void)numa_move_batch(map, ctx, n, uap->flags);
+	free(ctx, M_NUMA);
+	return (0);
+}
+
+/* Function: mbind_info()
+ * Input:
+ *      void *addr: The start of the range, rounded down to a page.
+ *      size_t len: The length of the range in bytes.
+ *      struct numa_range_info *info: Filled with the policy and the
+ *          placement of the range.
+ * Output: Returns 0 for success. Returns -1 for failure.
+ * Summary: Reports the range policy at addr and counts the resident pages
+ *      of the whole range by domain, so the placement of a shared segment
+ *      can be checked from any process mapping it. Fails with EFAULT if addr
+ *      is not mapped.
+ */
+static int
+numa_mbind_info(struct thread *td, struct mbind_info_args *uap)
+{
+	struct numa_range_info *info;
+	struct numa_policy np;
+	vm_map_t map;
+	vm_map_entry_t entry;
+	vm_object_t obj;
+	vm_offset_t end, start;
+	vm_pindex_t first, last;
+	vm_page_t m;
+	uint64_t resident;
+	int d, error;
+
+	start = trunc_page((vm_offset_t)uap->addr);
+	end = round_page((vm_offset_t)uap->addr + uap->len);
+	if (uap->len == 0 || end <= start)
+		return (EINVAL);
+	info = malloc(sizeof(*info), M_NUMA, M_WAITOK | M_ZERO);
+	map = &td->td_proc->p_vmspace->vm_map;
+	resident = 0;
+	error = 0;
+	vm_map_lock_read(map);
+	if (!vm_map_lookup_entry(map, start, &entry))
+		error = EFAULT;
+	else if ((entry->eflags & MAP_ENTRY_IS_SUB_MAP) == 0 &&
+	    (obj = entry->object.vm_object) != NULL) {
+		if (numa_range_policy(obj, OFF_TO_IDX(entry->offset +
+		    (start - entry->start)), &np)) {
+			numa_policy_expand(&np);
+			info->nri_policy = np.np_policy;
+			info->nri_mask = np.np_mask;
+		}
+	}
+	for (; error == 0 && entry != &map->header && entry->start < end;
+	    entry = entry->next) {
+		if ((entry->eflags & MAP_ENTRY_IS_SUB_MAP) != 0 ||
+		    (obj = entry->object.vm_object) == NULL)
+			continue;
+		first = OFF_TO_IDX(entry->offset +
+		    (MAX(start, entry->start) - entry->start));
+		last = OFF_TO_IDX(entry->offset +
+		    (MIN(end, entry->end) - entry->start));
+		VM_OBJECT_RLOCK(obj);
+		for (m = vm_page_find_least(obj, first);
+		    m != NULL && m->pindex < last;
+		    m = TAILQ_NEXT(m, listq)) {
+			d = numa_page_domain(m);
+			if (d < NUMA_STAT_MAXDOM)
+				info->nri_pages[d]++;
+			resident++;
 		}
+		VM_OBJECT_RUNLOCK(obj);
 	}
-	
-	// Copy memory to userspace
-	fail = copy_to_user(uap->buff, domain_map, sizeof(short) * vm_domains * vm_domains);
+	vm_map_unlock_read(map);
+	if (error == 0) {
+		info->nri_absent = OFF_TO_IDX(end - start) - resident;
+		error = copyout(info, uap->info, sizeof(*info));
+	}
+	free(info, M_NUMA);
+	return (error);
+}
+
+/*
+ * Syscall entry points.  Every syscall runs through NUMA_SYSCALL so the
+ * numa::syscall probes see each return path.
+ */
+static sbintime_t
+numa_trace_enter(const char *name)
+{
+
+	SDT_PROBE1(numa, , syscall, entry, name);
+	return (NUMA_TRACE_TIMED() ? sbinuptime() : 0);
+}
 
-	// if(fail) // unable to copy to userspace
-	free(domain_map);
+static void
+numa_trace_return(const char *name, sbintime_t start, int error)
+{
+
+	if (start != 0)
+		SDT_PROBE3(numa, , syscall, return, name, error,
+		    sbttons(sbinuptime() - start));
+}
+
+#define NUMA_SYSCALL(name)                                              \
+int                                                                     \
+sys_##name(struct thread *td, struct name##_args *uap)                  \
+{                                                                       \
+	sbintime_t start;                                               \
+	int error;                                                      \
+									\
+	start = numa_trace_enter(#name);                                \
+	error = numa_##name(td, uap);                                   \
+	numa_trace_return(#name, start, error);                         \
+	return (error);                                                 \
+}
+
+NUMA_SYSCALL(cpuset_get_memory_affinity)
+NUMA_SYSCALL(cpuset_set_memory_affinity)
+NUMA_SYSCALL(cpuset_memory_affinity_vec)
+NUMA_SYSCALL(move_pages)
+NUMA_SYSCALL(migrate_pages)
+NUMA_SYSCALL(migrate_pages_status)
+NUMA_SYSCALL(get_numa_cpus)
+NUMA_SYSCALL(get_numa_weights)
+NUMA_SYSCALL(get_numa_meminfo)
+NUMA_SYSCALL(mbind)
+NUMA_SYSCALL(mbind_info)
+
+#ifdef COMPAT_FREEBSD32
+/*
+ * 32-bit entry points for the syscalls taking an id_t, which a 32-bit
+ * process passes as two words, or arrays of pointers or u_longs.  The
+ * structures of the others have the same layout in both ABIs.
+ */
+#if BYTE_ORDER == BIG_ENDIAN
+#define NUMA_PAIR32TO64(type, name) ((name ## 2) | ((type)(name ## 1) << 32))
+#else
+#define NUMA_PAIR32TO64(type, name) ((name ## 1) | ((type)(name ## 2) << 32))
+#endif
+
+static int
+numa_freebsd32_cpuset_get_memory_affinity(struct thread *td,
+    struct freebsd32_cpuset_get_memory_affinity_args *uap)
+{
+	struct cpuset_get_memory_affinity_args ap;
+
+	ap.level = uap->level;
+	ap.which = uap->which;
+	ap.id = NUMA_PAIR32TO64(id_t, uap->id);
+	ap.setsize = uap->setsize;
+	ap.mask = uap->mask;
+	ap.policy = uap->policy;
+	return (numa_cpuset_get_memory_affinity(td, &ap));
+}
+
+static int
+numa_freebsd32_cpuset_set_memory_affinity(struct thread *td,
+    struct freebsd32_cpuset_set_memory_affinity_args *uap)
+{
+	struct cpuset_set_memory_affinity_args ap;
+
+	ap.level = uap->level;
+	ap.which = uap->which;
+	ap.id = NUMA_PAIR32TO64(id_t, uap->id);
+	ap.setsize = uap->setsize;
+	ap.mask = uap->mask;
+	ap.policy = uap->policy;
+	return (numa_cpuset_set_memory_affinity(td, &ap));
+}
+
+static int
+numa_freebsd32_move_pages(struct thread *td,
+    struct freebsd32_move_pages_args *uap)
+{
+
+	return (numa_move_pages_common(td, uap->pid, uap->count, uap->pages, 1,
+	    uap->node, uap->status, uap->move_flag));
+}
+
+/*
+ * Copy in a node mask of 32-bit words for maxnode nodes.  mask is zeroed.
+ */
+static int
+numa_copyin_mask32(const uint32_t *umask, uint32_t maxnode, u_long *mask)
+{
+	uint32_t mask32[howmany(MAXMEMDOM, 32)];
+	int error, i, n;
+
+	n = howmany(MIN(maxnode, MAXMEMDOM), 32);
+	error = copyin(umask, mask32, n * sizeof(*mask32));
+	if (error != 0)
+		return (error);
+	for (i = 0; i < n; i++)
+		mask[i * 32 / (NBBY * sizeof(u_long))] |=
+		    (u_long)mask32[i] << (i * 32 % (NBBY * sizeof(u_long)));
+	return (0);
+}
+
+static int
+numa_freebsd32_migrate_pages(struct thread *td,
+    struct freebsd32_migrate_pages_args *uap)
+{
+	u_long oldmask[NUMA_MIGRATE_MASKLEN], newmask[NUMA_MIGRATE_MASKLEN];
+	int error;
+
+	if (uap->maxnode == 0)
+		return (EINVAL);
+	bzero(oldmask, sizeof(oldmask));
+	bzero(newmask, sizeof(newmask));
+	error = numa_copyin_mask32(uap->old_nodes, uap->maxnode, oldmask);
+	if (error == 0)
+		error = numa_copyin_mask32(uap->new_nodes, uap->maxnode,
+		    newmask);
+	if (error != 0)
+		return (error);
+	return (numa_migrate_pages_common(td, uap->pid, oldmask, newmask));
+}
 
-	return (vm_ndomains);
+#define NUMA_SYSCALL32(name)                                            \
+int                                                                     \
+freebsd32_##name(struct thread *td, struct freebsd32_##name##_args *uap) \
+{                                                                       \
+	sbintime_t start;                                               \
+	int error;                                                      \
+									\
+	start = numa_trace_enter(#name);                                \
+	error = numa_freebsd32_##name(td, uap);                         \
+	numa_trace_return(#name, start, error);                         \
+	return (error);                                                 \
 }
+
+NUMA_SYSCALL32(cpuset_get_memory_affinity)
+NUMA_SYSCALL32(cpuset_set_memory_affinity)
+NUMA_SYSCALL32(move_pages)
+NUMA_SYSCALL32(migrate_pages)
+#endif
@@ -47,7 +47,9 @@
 
 #include <sys/cpuset.h>
 #include <sys/param.h>
+#ifdef _KERNEL
 #include <sys/systm.h>
+#endif
 
 
 /* ---------- DEFINITIONS --------- */
@@ -62,6 +64,18 @@
 #define NUMA_POLICY_NEAREST     1
 #define NUMA_POLICY_INTERLEAVE  2
 
+/* BALANCE: Or'ed into a process or thread policy, lets the kernel sample the
+ *      process's page accesses and move hot pages to the domain using them.
+ * TIERED: Or'ed into a NUMA_POLICY_NEAREST policy, lets the kernel demote
+ *      the process's cold pages to the slow memory tier while the fast tier
+ *      is short of memory, and promote slow tier pages back once they are
+ *      hot again.
+ * Summary: Policy flags for cpuset_set_memory_affinity().
+ */
+#define NUMA_POLICY_MASK        0xff
+#define NUMA_POLICY_BALANCE     0x100
+#define NUMA_POLICY_TIERED      0x200
+
 /* NUMA_MOVE: Move all pages not including ones shared with other processes.
  * NUMA_MOVE_ALL: Moves all pages including ones shared with other processes.
  * Summary: The NUMA move flag is used to specify the behaviour of move_pages().
@@ -69,6 +83,567 @@
 #define NUMA_MOVE       1
 #define NUMA_MOVE_ALL   2
 
+/* LOCAL_DISTANCE: Weight of a node to itself.
+ * REMOTE_DISTANCE: Weight between nodes when firmware gives no distances.
+ * Summary: Default weights reported by get_numa_weights(), following the ACPI
+ *      SLIT convention.
+ */
+#define NUMA_LOCAL_DISTANCE     10
+#define NUMA_REMOTE_DISTANCE    20
+
+/* np_policy: NUMA_POLICY_NEAREST or NUMA_POLICY_INTERLEAVE.
+ * np_mask: The domains pages should come from. An empty mask allows all.
+ * Summary: A memory policy as attached to a thread, process or cpuset by
+ *      cpuset_set_memory_affinity().
+ */
+struct numa_policy {
+	int		np_policy;
+	cpuset_t	np_mask;
+};
+
+
+/* NUMA_MIGRATE_QUEUED: The request waits for the migration thread.
+ * NUMA_MIGRATE_RUNNING: Pages are being moved.
+ * NUMA_MIGRATE_DONE: Every pass over the address space completed.
+ * NUMA_MIGRATE_FAILED: The process exited before the migration completed.
+ * Summary: States reported in nms_state by migrate_pages_status().
+ */
+#define NUMA_MIGRATE_QUEUED     1
+#define NUMA_MIGRATE_RUNNING    2
+#define NUMA_MIGRATE_DONE       3
+#define NUMA_MIGRATE_FAILED     4
+
+/* nms_queued: Pages found on an old node and handed to the mover.
+ * nms_moved: Pages now on their new node.
+ * nms_failed: Pages that could not be moved (busy, wired, node full).
+ * nms_skipped: Times a page was postponed because it was being written.
+ * nms_bytes_per_sec: Average migration rate since the request started.
+ * Summary: Progress of a migrate_pages() request.
+ */
+struct numa_migrate_status {
+	int		nms_pid;
+	int		nms_state;
+	uint64_t	nms_queued;
+	uint64_t	nms_moved;
+	uint64_t	nms_failed;
+	uint64_t	nms_skipped;
+	uint64_t	nms_bytes_per_sec;
+};
+
+/* NUMA_STAT_LOCAL: Pages allocated on the domain of the allocating CPU.
+ * NUMA_STAT_REMOTE: Pages allocated on a domain other than the one of the
+ *      allocating CPU.
+ * NUMA_STAT_INTERLEAVE: Pages placed on the domain picked by
+ *      NUMA_POLICY_INTERLEAVE.
+ * NUMA_STAT_FALLBACK: Pages that came from a later domain of the policy
+ *      order because the preferred one was full.
+ * NUMA_STAT_MIGRATED: Pages moved by move_pages(), migrate_pages(), the
+ *      balancer or the policy scanner.
+ * NUMA_STAT_MIGRATE_FAILED: Pages a move was requested for that could not
+ *      be moved.
+ * Summary: Placement counters. Allocations of user pages are counted for
+ *      the domain the page came from, moves for their target domain.
+ */
+#define NUMA_STAT_LOCAL                 0
+#define NUMA_STAT_REMOTE                1
+#define NUMA_STAT_INTERLEAVE            2
+#define NUMA_STAT_FALLBACK              3
+#define NUMA_STAT_MIGRATED              4
+#define NUMA_STAT_MIGRATE_FAILED        5
+#define NUMA_STAT_COUNT                 6
+#define NUMA_STAT_MAXDOM                64
+
+/* ns_ndomains: The number of valid rows of ns_domain.
+ * ns_pid: The process ns_proc belongs to, or -1 for none.
+ * ns_domain: The counters of every domain, indexed by NUMA_STAT_*.
+ * ns_proc: The counters of the process ns_pid over all domains.
+ * Summary: Snapshot read from the sysctl kern.numa.stats.snapshot.<pid>.
+ *      The per-domain counters are also kern.numa.stats.<domain>.<name>.
+ */
+struct numa_stats {
+	int		ns_ndomains;
+	int		ns_pid;
+	uint64_t	ns_domain[NUMA_STAT_MAXDOM][NUMA_STAT_COUNT];
+	uint64_t	ns_proc[NUMA_STAT_COUNT];
+};
+
+/* NUMA_PRESSURE_NONE: The domain has more free pages than its share of the
+ *      page daemon's free target.
+ * NUMA_PRESSURE_LOW: Below that target, the page daemon reclaims pages.
+ * NUMA_PRESSURE_HIGH: Below the domain's share of the free minimum.
+ *      NUMA_POLICY_NEAREST allocations are about to fall back to other
+ *      domains.
+ * Summary: Levels reported in nmi_pressure by get_numa_meminfo().
+ */
+#define NUMA_PRESSURE_NONE      0
+#define NUMA_PRESSURE_LOW       1
+#define NUMA_PRESSURE_HIGH      2
+
+/* NUMA_TIER_FAST: Domains with CPUs.
+ * NUMA_TIER_SLOW: Domains with memory only, such as CXL memory expanders or
+ *      persistent memory used as RAM.
+ * Summary: Memory tiers reported in nmi_tier by get_numa_meminfo().
+ */
+#define NUMA_TIER_FAST          0
+#define NUMA_TIER_SLOW          1
+
+/* nmi_total: Pages managed by the domain.
+ * nmi_free: Free pages.
+ * nmi_active: Pages on the active queue.
+ * nmi_inactive: Pages on the inactive queue.
+ * nmi_pressure: NUMA_PRESSURE_NONE, NUMA_PRESSURE_LOW or NUMA_PRESSURE_HIGH.
+ * nmi_tier: NUMA_TIER_FAST or NUMA_TIER_SLOW.
+ * Summary: Capacity of one domain as reported by get_numa_meminfo(). The
+ *      counts are sampled without locking and may be slightly stale.
+ */
+struct numa_meminfo {
+	uint64_t	nmi_total;
+	uint64_t	nmi_free;
+	uint64_t	nmi_active;
+	uint64_t	nmi_inactive;
+	int		nmi_pressure;
+	int		nmi_tier;
+};
+
+/* NUMA_SHARED_MAXDOM: Domains the topology page can describe.
+ * NUMA_SHARED_MAXCPU: CPUs the topology page can describe.
+ * NUMA_SHARED_RDTSCP: The kernel keeps the CPU id in TSC_AUX, so rdtscp
+ *      tells a thread which CPU it runs on without a syscall.
+ * Summary: Limits and flags of struct numa_shared.
+ */
+#define NUMA_SHARED_MAXDOM      16
+#define NUMA_SHARED_MAXCPU      256
+#define NUMA_SHARED_RDTSCP      0x1
+
+/* nsh_gen: Generation, odd while the kernel rewrites the page. A reader
+ *      copies the fields and retries unless nsh_gen was even and unchanged
+ *      around the copy. A new even value means the topology changed.
+ * nsh_ndomains: The number of domains.
+ * nsh_ncpus: One more than the highest CPU id described.
+ * nsh_flags: NUMA_SHARED_* flags.
+ * nsh_cpu_domain: The domain of every CPU, -1 for absent CPUs.
+ * nsh_weights: The nsh_ndomains x nsh_ndomains distance matrix, row major,
+ *      as returned by get_numa_weights().
+ * Summary: Topology published in the shared page, mapped read-only into
+ *      every process. Its address in the calling process is the u_long
+ *      sysctl kern.numa.shared. Not published on machines with more than
+ *      NUMA_SHARED_MAXDOM domains.
+ */
+struct numa_shared {
+	volatile uint32_t nsh_gen;
+	uint16_t	nsh_ndomains;
+	uint16_t	nsh_ncpus;
+	uint32_t	nsh_flags;
+	int8_t		nsh_cpu_domain[NUMA_SHARED_MAXCPU];
+	uint8_t		nsh_weights[NUMA_SHARED_MAXDOM * NUMA_SHARED_MAXDOM];
+};
+
+/* NUMA_AFFINITY_GET: Read the mask and policy of every entry.
+ * NUMA_AFFINITY_SET: Apply the mask and policy of every entry.
+ * Summary: Operations of cpuset_memory_affinity_vec().
+ */
+#define NUMA_AFFINITY_GET       1
+#define NUMA_AFFINITY_SET       2
+
+/* nar_level, nar_which, nar_id: The object, as for
+ *      cpuset_set_memory_affinity().
+ * nar_policy, nar_mask: The policy to set, or the policy read.
+ * nar_error: Set to 0 or the errno the entry failed with.
+ * Summary: One entry of a cpuset_memory_affinity_vec() request.
+ */
+struct numa_affinity_req {
+	cpulevel_t	nar_level;
+	cpuwhich_t	nar_which;
+	id_t		nar_id;
+	int		nar_policy;
+	int		nar_error;
+	cpuset_t	nar_mask;
+};
+
+/* nri_policy: The range policy at the start of the range, 0 if none is set
+ *      and the policy of the mapping process applies.
+ * nri_mask: The domains of that range policy.
+ * nri_pages: Resident pages of the range on every domain.
+ * nri_absent: Pages of the range that are not resident.
+ * Summary: Policy and placement of an address range as reported by
+ *      mbind_info().
+ */
+struct numa_range_info {
+	int		nri_policy;
+	int		nri_spare;
+	cpuset_t	nri_mask;
+	uint64_t	nri_pages[NUMA_STAT_MAXDOM];
+	uint64_t	nri_absent;
+};
+
+/* ------- POLICY SELECTION ------- */
+
+/* Function: numa_policy_order()
+ * Input:
+ *      const struct numa_policy *np: The policy in effect.
+ *      int ndomains: The number of NUMA domains.
+ *      const short *weights: The ndomains x ndomains distance matrix as
+ *          returned by get_numa_weights().
+ *      int home: The domain of the CPU the allocation is made from.
+ *      u_int *rr: The interleave cursor, i.e. the domain handed out last.
+ *          Advanced for NUMA_POLICY_INTERLEAVE.
+ *      int *order: An array of ndomains entries filled with the domains in
+ *          the order they should be tried.
+ * Output: Returns the number of domains stored in order.
+ * Summary: Decides where a page comes from. NUMA_POLICY_INTERLEAVE picks the
+ *      next allowed domain after *rr round-robin; NUMA_POLICY_NEAREST picks
+ *      the allowed domain closest to home. The remaining allowed domains
+ *      follow by increasing distance from that first choice, and the domains
+ *      outside the mask come last so an allocation can still be satisfied
+ *      once every allowed domain is exhausted. The decision only depends on
+ *      the arguments, so the kernel and userspace simulations share it.
+ */
+static __inline int
+numa_policy_order(const struct numa_policy *np, int ndomains,
+    const short *weights, int home, u_int *rr, int *order)
+{
+	const short *row;
+	int allowed, all, d, first, i, j, k, n;
+
+	all = CPU_EMPTY(&np->np_mask);
+	first = -1;
+	if ((np->np_policy & NUMA_POLICY_MASK) == NUMA_POLICY_INTERLEAVE) {
+		for (k = 1; k <= ndomains; k++) {
+			d = (*rr + k) % ndomains;
+			if (all || CPU_ISSET(d, &np->np_mask)) {
+				first = d;
+				*rr = d;
+				break;
+			}
+		}
+	}
+	row = &weights[(first >= 0 ? first : home) * ndomains];
+
+	n = 0;
+	if (first >= 0)
+		order[n++] = first;
+	for (allowed = 1; allowed >= 0; allowed--) {
+		k = n;
+		for (d = 0; d < ndomains; d++)
+			if (d != first &&
+			    (all || CPU_ISSET(d, &np->np_mask)) == allowed)
+				order[n++] = d;
+		/* Insertion sort by distance, ties keep domain order. */
+		for (i = k + 1; i < n; i++) {
+			d = order[i];
+			for (j = i; j > k && row[order[j - 1]] > row[d]; j--)
+				order[j] = order[j - 1];
+			order[j] = d;
+		}
+	}
+	return (n);
+}
+
+/* Function: numa_tier_order()
+ * Input:
+ *      const int8_t *tiers: The NUMA_TIER of every domain.
+ *      int *order: The domains as returned by numa_policy_order().
+ *      int n: The number of allowed domains at the head of order, all of
+ *          them for an empty mask.
+ * Output: void
+ * Summary: Moves the fast tier domains ahead of the slow ones for a
+ *      NUMA_POLICY_TIERED policy, keeping the order within each tier, so a
+ *      page only comes from a slow allowed domain once every fast allowed
+ *      one is exhausted. The domains outside the mask stay last. The kernel
+ *      applies it both to new pages and to the domain the policy scanner
+ *      moves a page to.
+ */
+static __inline void
+numa_tier_order(const int8_t *tiers, int *order, int n)
+{
+	int d, i, j;
+
+	for (i = 1; i < n; i++) {
+		d = order[i];
+		for (j = i; j > 0 && tiers[order[j - 1]] > tiers[d]; j--)
+			order[j] = order[j - 1];
+		order[j] = d;
+	}
+}
+
+/* NUMA_BALANCE_MAXDOM: Domains tracked by the balancer statistics.
+ * Summary: The automatic balancer keeps per-domain fault counts for every
+ *      sampled page and every thread.
+ */
+#define NUMA_BALANCE_MAXDOM     16
+
+/* NUMA_BALANCE_WEIGHT: Score a single fault adds to the statistics.
+ * Summary: Scores are halved every period, so a fault counts fully in its
+ *      own period, half in the next and so on. A page sampled once per period
+ *      can take at most one fault per period and stays just under two.
+ */
+#define NUMA_BALANCE_WEIGHT     16
+
+/* nbt_min_faults: Decayed faults needed before a decision is made.
+ * nbt_ratio: Faults from the winning remote domain needed per 100 faults
+ *      from the home domain.
+ * nbt_hysteresis: Consecutive periods the same remote domain must win.
+ * Summary: Tunables of numa_balance_decide().
+ */
+struct numa_balance_tun {
+	u_int		nbt_min_faults;
+	u_int		nbt_ratio;
+	u_int		nbt_hysteresis;
+};
+
+/* nbs_faults: Decayed fault counts per domain.
+ * nbs_candidate: The remote domain currently winning, or -1.
+ * nbs_streak: Consecutive periods nbs_candidate has won.
+ * nbs_idle: Consecutive periods without a fault, up to the last decision.
+ * nbs_busy: Consecutive periods with a fault, up to the last decision.
+ * nbs_fresh: A fault was recorded since the last decision.
+ * Summary: Balancer statistics of a sampled page (faults counted by the
+ *      domain of the faulting CPU) or of a thread (faults counted by the
+ *      domain of the faulted page).
+ */
+struct numa_balance_stat {
+	uint16_t	nbs_faults[NUMA_BALANCE_MAXDOM];
+	int8_t		nbs_candidate;
+	uint8_t		nbs_streak;
+	uint8_t		nbs_idle;
+	uint8_t		nbs_busy;
+	uint8_t		nbs_fresh;
+};
+
+/* Function: numa_balance_record()
+ * Input:
+ *      struct numa_balance_stat *st: The statistics of a page or thread.
+ *      int domain: The domain to credit with a fault.
+ * Output: void
+ */
+static __inline void
+numa_balance_record(struct numa_balance_stat *st, int domain)
+{
+
+	if (domain < 0 || domain >= NUMA_BALANCE_MAXDOM)
+		return;
+	st->nbs_fresh = 1;
+	if (st->nbs_faults[domain] <= 0xffff - NUMA_BALANCE_WEIGHT)
+		st->nbs_faults[domain] += NUMA_BALANCE_WEIGHT;
+	else
+		st->nbs_faults[domain] = 0xffff;
+}
+
+/* Function: numa_balance_decide()
+ * Input:
+ *      struct numa_balance_stat *st: The statistics of a page or thread.
+ *      int ndomains: The number of NUMA domains.
+ *      int home: The domain of the page, or the domain a thread runs on.
+ *      const struct numa_balance_tun *tun: The decision tunables.
+ * Output: Returns the domain a page should move to (or a thread should run
+ *      on), or -1 to leave it alone.
+ * Summary: Called once per sampling period. A remote domain must dominate
+ *      the faults for nbt_hysteresis periods in a row before a move is
+ *      suggested, so pages shared by several domains do not bounce. The
+ *      counts are halved afterwards so old periods fade out.
+ */
+static __inline int
+numa_balance_decide(struct numa_balance_stat *st, int ndomains, int home,
+    const struct numa_balance_tun *tun)
+{
+	u_int best, d, total;
+	int decision;
+
+	if (ndomains > NUMA_BALANCE_MAXDOM)
+		ndomains = NUMA_BALANCE_MAXDOM;
+	if (home < 0 || home >= ndomains)
+		return (-1);
+	best = home;
+	total = 0;
+	for (d = 0; d < (u_int)ndomains; d++) {
+		total += st->nbs_faults[d];
+		if (st->nbs_faults[d] > st->nbs_faults[best])
+			best = d;
+	}
+	decision = -1;
+	if (total >= tun->nbt_min_faults * NUMA_BALANCE_WEIGHT &&
+	    best != (u_int)home &&
+	    st->nbs_faults[best] * 100 >=
+	    (u_int)st->nbs_faults[home] * tun->nbt_ratio) {
+		if (st->nbs_candidate == (int)best)
+			st->nbs_streak++;
+		else {
+			st->nbs_candidate = best;
+			st->nbs_streak = 1;
+		}
+		if (st->nbs_streak >= tun->nbt_hysteresis) {
+			decision = best;
+			st->nbs_candidate = -1;
+			st->nbs_streak = 0;
+		}
+	} else {
+		st->nbs_candidate = -1;
+		st->nbs_streak = 0;
+	}
+	for (d = 0; d < (u_int)ndomains; d++)
+		st->nbs_faults[d] /= 2;
+	if (st->nbs_fresh) {
+		st->nbs_idle = 0;
+		if (st->nbs_busy < 0xff)
+			st->nbs_busy++;
+	} else {
+		st->nbs_busy = 0;
+		if (st->nbs_idle < 0xff)
+			st->nbs_idle++;
+	}
+	st->nbs_fresh = 0;
+	return (decision);
+}
+
+/* ntt_hot: Periods in a row with a fault before a slow tier page is
+ *      promoted.
+ * ntt_cold: Periods without a fault before a fast tier page may be demoted.
+ * ntt_pressure: Pressure level of its domain at which fast tier pages are
+ *      demoted.
+ * Summary: Tunables of numa_tier_decide().
+ */
+struct numa_tier_tun {
+	u_int		ntt_hot;
+	u_int		ntt_cold;
+	int		ntt_pressure;
+};
+
+/* Function: numa_tier_decide()
+ * Input:
+ *      const struct numa_balance_stat *st: The statistics of a page, before
+ *          numa_balance_decide() is run on them for the period.
+ *      int ndomains: The number of NUMA domains.
+ *      const int8_t *tiers: The NUMA_TIER of every domain.
+ *      const short *weights: The ndomains x ndomains distance matrix.
+ *      const int *pressure: The NUMA_PRESSURE level of every domain.
+ *      int home: The domain of the page.
+ *      const struct numa_tier_tun *tun: The decision tunables.
+ * Output: Returns the domain the page should move to, or -1 to leave it.
+ * Summary: Called once per sampling period. A slow tier page that took a
+ *      fault in each of the last ntt_hot periods is promoted to the fast
+ *      domain faulting on it most, unless that domain is at
+ *      NUMA_PRESSURE_HIGH. A fast tier page
+ *      that took no fault for ntt_cold periods is demoted to the nearest
+ *      slow domain not at NUMA_PRESSURE_HIGH, once its own domain reaches
+ *      ntt_pressure.
+ */
+static __inline int
+numa_tier_decide(const struct numa_balance_stat *st, int ndomains,
+    const int8_t *tiers, const short *weights, const int *pressure, int home,
+    const struct numa_tier_tun *tun)
+{
+	const short *row;
+	u_int busy, idle;
+	int best, d;
+
+	if (ndomains > NUMA_BALANCE_MAXDOM)
+		ndomains = NUMA_BALANCE_MAXDOM;
+	if (home < 0 || home >= ndomains)
+		return (-1);
+	best = -1;
+	if (tiers[home] != NUMA_TIER_FAST) {
+		busy = st->nbs_fresh ? st->nbs_busy + 1 : 0;
+		if (busy < tun->ntt_hot)
+			return (-1);
+		for (d = 0; d < ndomains; d++)
+			if (tiers[d] == NUMA_TIER_FAST &&
+			    pressure[d] < NUMA_PRESSURE_HIGH && (best < 0 ||
+			    st->nbs_faults[d] > st->nbs_faults[best]))
+				best = d;
+		if (best >= 0 && st->nbs_faults[best] == 0)
+			return (-1);
+		return (best);
+	}
+	idle = st->nbs_fresh ? 0 : st->nbs_idle + 1;
+	if (idle < tun->ntt_cold || pressure[home] < tun->ntt_pressure)
+		return (-1);
+	row = &weights[home * ndomains];
+	for (d = 0; d < ndomains; d++)
+		if (tiers[d] != NUMA_TIER_FAST &&
+		    pressure[d] < NUMA_PRESSURE_HIGH &&
+		    (best < 0 || row[d] < row[best]))
+			best = d;
+	return (best);
+}
+
+/* nst_imbalance: Load difference between two CPUs needed before a thread
+ *      runs, or is stolen to run, outside its home domain.
+ * nst_home_ratio: Resident pages on another domain needed per 100 pages on
+ *      the home domain before the home follows them.
+ * Summary: Tunables of the scheduling hints.
+ */
+struct numa_sched_tun {
+	u_int		nst_imbalance;
+	u_int		nst_home_ratio;
+};
+
+/* Function: numa_sched_away()
+ * Input:
+ *      u_int home_load: The load of the least loaded CPU of the home domain.
+ *      u_int load: The load of the least loaded CPU of any domain.
+ *      const struct numa_sched_tun *tun: The tunables.
+ * Output: Returns 1 if a thread should be placed outside its home domain,
+ *      0 to keep it home.
+ */
+static __inline int
+numa_sched_away(u_int home_load, u_int load, const struct numa_sched_tun *tun)
+{
+
+	return (home_load > load && home_load - load >= tun->nst_imbalance);
+}
+
+/* Function: numa_sched_may_steal()
+ * Input:
+ *      int home: The home domain of the thread, or -1 if it has none.
+ *      int src: The domain of the CPU the thread is queued on.
+ *      int dst: The domain of the idle CPU that would steal it.
+ *      u_int src_load: The load of the source CPU.
+ *      u_int dst_load: The load of the stealing CPU.
+ *      const struct numa_sched_tun *tun: The tunables.
+ * Output: Returns 1 if the thread may be stolen, 0 otherwise.
+ * Summary: Steals within a domain, and steals that bring a thread home, are
+ *      left to the scheduler. Any other steal across domains needs a load
+ *      difference of nst_imbalance.
+ */
+static __inline int
+numa_sched_may_steal(int home, int src, int dst, u_int src_load,
+    u_int dst_load, const struct numa_sched_tun *tun)
+{
+
+	if (home < 0 || src == dst || dst == home)
+		return (1);
+	return (src_load > dst_load &&
+	    src_load - dst_load >= tun->nst_imbalance);
+}
+
+/* Function: numa_sched_rehome()
+ * Input:
+ *      const u_long *pages: The resident pages of a process per domain.
+ *      int ndomains: The number of NUMA domains.
+ *      int home: The current home domain, or -1 if there is none yet.
+ *      const struct numa_sched_tun *tun: The tunables.
+ * Output: Returns the new home domain, or -1 if there are no pages.
+ * Summary: The home goes to the domain holding the most pages, but only
+ *      once it holds nst_home_ratio pages per 100 on the current home, so
+ *      a process spread evenly does not flip between domains.
+ */
+static __inline int
+numa_sched_rehome(const u_long *pages, int ndomains, int home,
+    const struct numa_sched_tun *tun)
+{
+	int best, d;
+
+	best = -1;
+	for (d = 0; d < ndomains; d++)
+		if (pages[d] > 0 && (best < 0 || pages[d] > pages[best]))
+			best = d;
+	if (best < 0 || home < 0 || home >= ndomains || best == home)
+		return (best);
+	if (pages[best] * 100 >= pages[home] * tun->nst_home_ratio)
+		return (best);
+	return (home);
+}
+
 
 /* ------- SYSCALL INTERFACE ------ */
 
@@ -111,6 +686,17 @@ int cpuset_get_memory_affinity(cpulevel_t level,
  * Output: Returns 0 for success. Returns -1 for failure.
  * Summary: Sets the memory affinity and allocation policy of the object
  *      specified by level,which and id to the value stored in mask and policy.
+ *      A thread without a policy of its own uses the policy of its process,
+ *      then the one of its cpuset. New threads inherit the policy of the
+ *      thread creating them, and a forked process inherits the effective
+ *      policy of the forking thread. The page allocator takes new pages
+ *      from the domains the policy allows, and from the others only once
+ *      those are exhausted. Private pages that sit outside the policy of a
+ *      process or cpuset are moved by the kernel, at most
+ *      kern.numa.sched.scan_pages pages per kern.numa.sched.interval
+ *      milliseconds. NUMA_POLICY_BALANCE in policy switches
+ *      automatic balancing on for the process (thread or process target) or
+ *      off (process target without the flag); it is not inherited by fork.
  */
 int cpuset_set_memory_affinity(cpulevel_t level,
                                cpuwhich_t which,
@@ -119,6 +705,25 @@ int cpuset_set_memory_affinity(cpulevel_t level,
                                const cpuset_t *mask,
                                int policy);
 
+/* Function: cpuset_memory_affinity_vec()
+ * Input:
+ *      int op: NUMA_AFFINITY_GET or NUMA_AFFINITY_SET.
+ *      struct numa_affinity_req *reqs: The objects and, for
+ *          NUMA_AFFINITY_SET, their new masks and policies.
+ *      u_int count: The number of entries of reqs.
+ * Output: Returns 0 for success. Returns -1 for failure.
+ * Summary: Performs cpuset_get_memory_affinity() or
+ *      cpuset_set_memory_affinity() on every entry in one call. The outcome
+ *      of each entry is stored in its nar_error and does not stop the others;
+ *      the call itself only fails for a bad op or an unreadable array.
+ *      Consecutive thread entries (CPU_LEVEL_WHICH, CPU_WHICH_TID) of the
+ *      same process are applied under one acquisition of the process lock,
+ *      so they should be grouped by process.
+ */
+int cpuset_memory_affinity_vec(int op,
+                               struct numa_affinity_req *reqs,
+                               u_int count);
+
 /* Function: move_pages()
  * Input:
  *      int pid: Specifies the process ID of the pages to be moved. 0 refers to
@@ -133,6 +738,13 @@ int cpuset_set_memory_affinity(cpulevel_t level,
  *          other processes is also to be moved (NUMA_MOVE or NUMA_MOVE_ALL).
  * Output: Returns 0 for success.  Returns -1 for failure.
  * Summary: Used to move specific pages on specified nodes to new NUMA nodes.
+ *      After the call status[i] holds the node page i is on, or a negative
+ *      errno: -ENOENT (not resident), -EFAULT (not mapped), -EACCES (shared
+ *      and NUMA_MOVE given), -EBUSY (busy or wired) or -ENOMEM (target node
+ *      full). Passing a null node only fills status with the current
+ *      placement of every page. Pages are processed in batches, each batch
+ *      locking every VM object once and flushing the TLB once per run of
+ *      consecutive pages.
  */
 int move_pages(int pid,
                unsigned long count,
@@ -150,22 +762,43 @@ int move_pages(int pid,
  *      const unsigned long *new_nodes: The bitmask representing the new nodes.
  * Output: Returns 0 for success.  Returns -1 for failure.
  * Summary: Attempts to move all pages of a process in specified nodes to
- *      specified new NUMA nodes.
+ *      specified new NUMA nodes. The n-th node of old_nodes maps to the n-th
+ *      node of new_nodes, wrapping around new_nodes. The call only queues
+ *      the work: a kernel thread migrates the pages in chunks of
+ *      kern.numa.migrate_chunk pages at no more than kern.numa.migrate_bw
+ *      MB/s, leaving pages that are being written for later passes. Progress
+ *      is reported by migrate_pages_status(). A new request for the same
+ *      process waits for a running one to finish.
  */
 int migrate_pages(int pid,
                   unsigned long maxnode,
                   const unsigned long *old_nodes,
                   const unsigned long *new_nodes);
 
+/* Function: migrate_pages_status()
+ * Input:
+ *      int pid: The process ID given to migrate_pages(). 0 refers to the
+ *          calling process.
+ *      struct numa_migrate_status *status: Filled with the progress of the
+ *          last migration of pid.
+ * Output: Returns 0 for success.  Returns -1 for failure.
+ * Summary: Reports the progress of the asynchronous migration started by
+ *      migrate_pages(). Fails with ESRCH if none was requested for pid.
+ */
+int migrate_pages_status(int pid,
+                         struct numa_migrate_status *status);
+
 /* Function: get_numa_cpus()
  * Input:
  *      cpuset_t *buff: An array to be filled with cpusets.
  *      size_t length: The length of the array in bytes.
  * Output: Returns the count of NUMA nodes and fills buff with an array of
  *      cpusets. Passing a null buff and length of 0 will simply return the
- *      count of NUMA nodes.
+ *      count of NUMA nodes. Returns -1 with errno set to EINVAL if length is
+ *      too small for every node.
  * Summary: Allows processes to know what cpus belong to each NUMA node. This is
- *      useful in assigning memory affinity and policies. 
+ *      useful in assigning memory affinity and policies. A memory-only node
+ *      gets an empty set; get_numa_meminfo() reports it as NUMA_TIER_SLOW.
  */
 int get_numa_cpus(cpuset_t *buff,
                      size_t length);
@@ -176,14 +809,217 @@ int get_numa_cpus(cpuset_t *buff,
  *          the indexes are relative IDs.
  *      size_t length: The length of the array in bytes.
  * Output: Returns the count of NUMA nodes and fills buff with a 2 dimensional
- *      array of weights between NUMA nodes. Passing a null buff and length of 0
- *      will simply return the count of NUMA nodes.
+ *      array of weights between NUMA nodes. Passing a null buff will simply
+ *      return the count of NUMA nodes, so a caller can size buff as count *
+ *      count shorts in one round trip. Returns -1 with errno set to EINVAL if
+ *      length is too small for the whole matrix.
  * Summary: Allows processes to know about relative latency between NUMA nodes. 
  *      Weight between two NUMA nodes can be found by accessing the value at
- *      buff[a][b] where a and b are memory node IDs.
+ *      buff[a * count + b] where a and b are memory node IDs. The weights are
+ *      the firmware locality distances: NUMA_LOCAL_DISTANCE for a node to
+ *      itself and larger values for more distant nodes.
  */
 int get_numa_weights(short *buff,
                         size_t length);
 
+/* Function: get_numa_meminfo()
+ * Input:
+ *      struct numa_meminfo *buff: An array to be filled with one entry per
+ *          NUMA node.
+ *      size_t length: The length of the array in bytes.
+ * Output: Returns the count of NUMA nodes and fills buff with the page counts
+ *      and pressure of every node. Passing a null buff will simply return the
+ *      count of NUMA nodes. Returns -1 with errno set to EINVAL if length is
+ *      too small for every node.
+ * Summary: Lets processes see how full every NUMA node is, so they can steer
+ *      allocations away from a node before NUMA_POLICY_NEAREST falls back.
+ */
+int get_numa_meminfo(struct numa_meminfo *buff,
+                     size_t length);
+
+/* Function: mbind()
+ * Input:
+ *      void *addr: The start of the range, rounded down to a page.
+ *      size_t len: The length of the range in bytes.
+ *      int policy: NUMA_POLICY_NEAREST or NUMA_POLICY_INTERLEAVE, or 0 to
+ *          remove the range policy.
+ *      size_t setsize: The size of the set.
+ *      const cpuset_t *mask: The domains pages of the range should come
+ *          from.
+ *      int flags: 0 to leave resident pages to the background scanner,
+ *          NUMA_MOVE or NUMA_MOVE_ALL to move them now, as for move_pages().
+ * Output: Returns 0 for success. Returns -1 for failure.
+ * Summary: Attaches a memory policy to the VM objects mapped at the range
+ *      instead of to the calling thread. The pages of the range then end up
+ *      alike for every process mapping the same shared memory segment or
+ *      file, whichever process touched them first; interleaved pages are
+ *      dealt out by their offset in the object. The page allocator places
+ *      new pages of the range as the policy asks; pages placed elsewhere,
+ *      before the policy was set or once its domains ran out of memory, are
+ *      moved by the numa_sched thread every kern.numa.sched.interval
+ *      milliseconds, through the mappings of the calling process; shared
+ *      pages only where it may write them. A range policy takes precedence
+ *      over thread, process and cpuset policies and lasts as long as the
+ *      object.
+ *      Fails with EFAULT if part of the range is not mapped and with EINVAL
+ *      if part of it has no backing object yet. Private copies made on
+ *      write follow the policy of the process.
+ */
+int mbind(void *addr,
+          size_t len,
+          int policy,
+          size_t setsize,
+          const cpuset_t *mask,
+          int flags);
+
+/* Function: mbind_info()
+ * Input:
+ *      void *addr: The start of the range, rounded down to a page.
+ *      size_t len: The length of the range in bytes.
+ *      struct numa_range_info *info: Filled with the policy and the
+ *          placement of the range.
+ * Output: Returns 0 for success. Returns -1 for failure.
+ * Summary: Reports the range policy at addr and how many resident pages of
+ *      the range sit on every domain. Fails with EFAULT if addr is not
+ *      mapped.
+ */
+int mbind_info(void *addr,
+               size_t len,
+               struct numa_range_info *info);
+
+
+#ifdef _KERNEL
+
+/* ------- KERNEL INTERFACE ------- */
+
+struct thread;
+
+/* Function: numa_shared_update()
+ * Input: void
+ * Output: void
+ * Summary: Rewrites the topology page from the current CPU and domain
+ *      layout and moves its generation on. To be called after CPUs or
+ *      domains are added or removed.
+ */
+void numa_shared_update(void);
+
+struct thread;
+struct vm_object;
+
+/* Function: numa_page_domains()
+ * Input:
+ *      struct thread *td: The thread allocating the page.
+ *      struct vm_object *obj: The locked object the page is allocated for.
+ *      vm_pindex_t pindex: The index of the page in obj.
+ *      int *order: An array of MAXMEMDOM entries filled with the domains to
+ *          try, in order.
+ * Output: Returns the number of domains stored in order, 0 if no policy
+ *      applies.
+ * Summary: The allocator hook called by vm_page_alloc(). Resolves the range
+ *      policy covering the page, else the policy of td, and orders the
+ *      domains as numa_policy_order() does, an interleaved page starting at
+ *      the domain its index deals it to. Does not sleep.
+ */
+int numa_page_domains(struct thread *td, struct vm_object *obj,
+                      vm_pindex_t pindex, int *order);
+
+/* Function: numa_page_alloc_stat()
+ * Input:
+ *      struct thread *td: The thread the page was allocated by.
+ *      const int *order: The domains numa_page_domains() returned.
+ *      int n: The number of entries of order, 0 if no policy applied.
+ *      struct vm_page *m: The page allocated, inserted in its object.
+ * Output: void
+ * Summary: Called by vm_page_alloc() after allocating a page for an
+ *      object. Counts the page in the statistics of its domain and of the
+ *      process of td.
+ */
+struct vm_page;
+void numa_page_alloc_stat(struct thread *td,
+                          const int *order,
+                          int n,
+                          struct vm_page *m);
+
+/* Function: numa_object_terminate()
+ * Input:
+ *      struct vm_object *obj: An object about to be freed.
+ * Output: void
+ * Summary: Called by vm_object_destroy(), for an object terminated or
+ *      collapsed into its shadow. Drops the range policies of obj.
+ */
+void numa_object_terminate(struct vm_object *obj);
+
+/* Function: numa_balance_fault()
+ * Input:
+ *      struct thread *td: The faulting thread.
+ *      struct vm_page *m: The resident page the fault was resolved with.
+ * Output: void
+ * Summary: Called by vm_fault() for every fault it resolves. Records the
+ *      access if m is one of the pages the balancer unmapped for sampling.
+ */
+void numa_balance_fault(struct thread *td,
+                        struct vm_page *m);
+
+/* Function: numa_sched_home()
+ * Input:
+ *      struct thread *td: A thread being placed.
+ *      cpuset_t *mask: If not NULL, filled with the CPUs of the home domain.
+ * Output: Returns the home domain of td, or -1 if it has none.
+ * Summary: Lock free, for sched_pickcpu() and runq_steal() in ULE. Only
+ *      threads of processes that set a memory policy have a home.
+ */
+int numa_sched_home(struct thread *td,
+                    cpuset_t *mask);
+
+/* Function: numa_sched_pickcpu()
+ * Input:
+ *      struct thread *td: A thread being placed.
+ *      int home_cpu: The least loaded CPU of the home domain, or -1.
+ *      u_int home_load: The load of home_cpu.
+ *      int cpu: The least loaded CPU of any domain.
+ *      u_int load: The load of cpu.
+ * Output: Returns home_cpu, or cpu if the load difference exceeds
+ *      kern.numa.sched.imbalance.
+ * Summary: Called by sched_pickcpu() after it ran sched_lowest() over the
+ *      mask from numa_sched_home() and over all CPUs.
+ */
+int numa_sched_pickcpu(struct thread *td,
+                       int home_cpu,
+                       u_int home_load,
+                       int cpu,
+                       u_int load);
+
+/* Function: numa_sched_steal()
+ * Input:
+ *      struct thread *td: The thread an idle CPU is about to steal.
+ *      int src: The CPU td is queued on.
+ *      u_int src_load: The load of src.
+ *      int dst: The idle CPU.
+ *      u_int dst_load: The load of dst.
+ * Output: Returns 1 if td may be stolen, 0 otherwise.
+ * Summary: Called by runq_steal() and runq_steal_from() in ULE when
+ *      tdq_idled() or sched_balance() look for a thread to move, see
+ *      numa_sched_may_steal().
+ */
+int numa_sched_steal(struct thread *td,
+                     int src,
+                     u_int src_load,
+                     int dst,
+                     u_int dst_load);
+
+/* Function: numa_sched_migrated()
+ * Input:
+ *      struct thread *td: A thread that is about to run.
+ *      int from: The CPU td last ran on, or NOCPU.
+ *      int to: The CPU td runs on now.
+ * Output: void
+ * Summary: Called by sched_switch() when td changes CPU. Counts the
+ *      migration under kern.numa.sched.
+ */
+void numa_sched_migrated(struct thread *td,
+                         int from,
+                         int to);
+
+#endif /* _KERNEL */
 
 #endif /* __FREEBSDNUMA_H__ */
@@ -0,0 +1,200 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor affinity: cost of re-pinning the memory policy of every thread of
+ * a process.  The threads are parked, then moved round-robin over the
+ * domains once with one cpuset_set_memory_affinity() call per thread and
+ * once with a single cpuset_memory_affinity_vec() call, and the result is
+ * read back with the vectored get.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <pthread_np.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+static pthread_mutex_t bench_affinity_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_affinity_cv = PTHREAD_COND_INITIALIZER;
+static int bench_affinity_started;
+static int bench_affinity_done;
+
+
+/* ---------- BENCHMARK ----------- */
+
+static void
+bench_affinity_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor affinity [-t threads] [-r rounds]\n");
+	exit(1);
+}
+
+static void *
+bench_affinity_park(void *arg)
+{
+
+	pthread_mutex_lock(&bench_affinity_lock);
+	*(int *)arg = pthread_getthreadid_np();
+	bench_affinity_started++;
+	pthread_cond_broadcast(&bench_affinity_cv);
+	while (!bench_affinity_done)
+		pthread_cond_wait(&bench_affinity_cv, &bench_affinity_lock);
+	pthread_mutex_unlock(&bench_affinity_lock);
+	return (NULL);
+}
+
+static double
+bench_affinity_elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start->tv_sec) * 1e9 +
+	    (end.tv_nsec - start->tv_nsec));
+}
+
+int
+bench_affinity(int argc, char **argv)
+{
+	struct numa_affinity_req *reqs;
+	struct timespec start;
+	pthread_t *threads;
+	cpuset_t *masks;
+	double single, vec;
+	int *tids, ch, i, nd, nthreads, r, rounds, failed;
+
+	nthreads = 64;
+	rounds = 16;
+	while ((ch = getopt(argc, argv, "r:t:")) != -1) {
+		switch (ch) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			bench_affinity_usage();
+		}
+	}
+	if (nthreads < 1 || rounds < 1)
+		bench_affinity_usage();
+	if ((nd = is_numa_available()) == 0 || numa_simulated)
+		errx(1, "needs the NUMA syscalls");
+
+	threads = calloc(nthreads, sizeof(*threads));
+	tids = calloc(nthreads, sizeof(*tids));
+	masks = calloc(nd, sizeof(*masks));
+	reqs = calloc(nthreads, sizeof(*reqs));
+	if (threads == NULL || tids == NULL || masks == NULL || reqs == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nd; i++)
+		CPU_SET(i, &masks[i]);
+	for (i = 0; i < nthreads; i++)
+		if ((errno = pthread_create(&threads[i], NULL,
+		    bench_affinity_park, &tids[i])) != 0)
+			err(1, "pthread_create");
+	pthread_mutex_lock(&bench_affinity_lock);
+	while (bench_affinity_started < nthreads)
+		pthread_cond_wait(&bench_affinity_cv, &bench_affinity_lock);
+	pthread_mutex_unlock(&bench_affinity_lock);
+
+	single = vec = 0;
+	failed = 0;
+	for (r = 0; r < rounds; r++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < nthreads; i++)
+			if (cpuset_set_memory_affinity(CPU_LEVEL_WHICH,
+			    CPU_WHICH_TID, tids[i], sizeof(cpuset_t),
+			    &masks[(i + r) % nd], NUMA_POLICY_NEAREST) != 0)
+				err(1, "cpuset_set_memory_affinity");
+		single += bench_affinity_elapsed(&start);
+
+		for (i = 0; i < nthreads; i++) {
+			reqs[i].nar_level = CPU_LEVEL_WHICH;
+			reqs[i].nar_which = CPU_WHICH_TID;
+			reqs[i].nar_id = tids[i];
+			reqs[i].nar_policy = NUMA_POLICY_NEAREST;
+			reqs[i].nar_mask = masks[(i + r + 1) % nd];
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (cpuset_memory_affinity_vec(NUMA_AFFINITY_SET, reqs,
+		    nthreads) != 0)
+			err(1, "cpuset_memory_affinity_vec");
+		vec += bench_affinity_elapsed(&start);
+
+		/* Every entry must have taken its own mask. */
+		if (cpuset_memory_affinity_vec(NUMA_AFFINITY_GET, reqs,
+		    nthreads) != 0)
+			err(1, "cpuset_memory_affinity_vec");
+		for (i = 0; i < nthreads; i++)
+			if (reqs[i].nar_error != 0 ||
+			    CPU_CMP(&reqs[i].nar_mask,
+			    &masks[(i + r + 1) % nd]) != 0)
+				failed++;
+	}
+
+	pthread_mutex_lock(&bench_affinity_lock);
+	bench_affinity_done = 1;
+	pthread_cond_broadcast(&bench_affinity_cv);
+	pthread_mutex_unlock(&bench_affinity_lock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	single /= (double)rounds * nthreads;
+	vec /= (double)rounds * nthreads;
+	printf("%d threads, %d domains, %d rounds\n", nthreads, nd, rounds);
+	printf("single   %8.0f ns/thread\n", single);
+	printf("vectored %8.0f ns/thread (%.1fx)\n", vec,
+	    vec > 0 ? single / vec : 0);
+	printf("%d entries read back wrong\n", failed);
+	free(reqs);
+	free(masks);
+	free(tids);
+	free(threads);
+	return (failed != 0);
+}
@@ -0,0 +1,256 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor cache: producer/consumer throughput of fixed size objects.  Every
+ * pair has a producer on one domain that allocates objects and passes them
+ * through a ring to a consumer on the next domain, which frees them there.
+ * Every free is thus a remote one.  The run is repeated with a numa_cache,
+ * with numa_malloc() and with the libc allocator.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_CACHE_RING        1024
+#define BENCH_CACHE_CACHE       0
+#define BENCH_CACHE_MALLOC      1
+#define BENCH_CACHE_LIBC        2
+
+struct bench_cache_pair {
+	pthread_t	producer;
+	pthread_t	consumer;
+	pthread_barrier_t *barrier;
+	int		mode;
+	struct numa_cache *cache;
+	int		pdomain;	/* domain of the producer */
+	int		cdomain;	/* domain of the consumer */
+	size_t		size;
+	long		ops;
+	_Atomic(unsigned long) head __aligned(NUMA_CACHELINE);
+	_Atomic(unsigned long) tail __aligned(NUMA_CACHELINE);
+	void		*ring[BENCH_CACHE_RING] __aligned(NUMA_CACHELINE);
+};
+
+static const char *bench_cache_names[] = {
+	"cache", "numa", "libc"
+};
+
+
+/* ---------- BENCHMARK ----------- */
+
+static void
+bench_cache_ctor(void *obj, void *arg)
+{
+
+	memset(obj, 0, *(size_t *)arg);
+}
+
+static void *
+bench_cache_producer(void *arg)
+{
+	struct bench_cache_pair *a;
+	unsigned long head;
+	void *obj;
+	long n;
+
+	a = arg;
+	(void)set_thread_on_domain(0, a->pdomain);
+	pthread_barrier_wait(a->barrier);
+	head = 0;
+	for (n = 0; n < a->ops; n++) {
+		if (a->mode == BENCH_CACHE_CACHE)
+			obj = numa_cache_alloc(a->cache);
+		else if (a->mode == BENCH_CACHE_MALLOC)
+			obj = numa_malloc(a->size);
+		else
+			obj = malloc(a->size);
+		if (obj == NULL)
+			err(1, "alloc");
+		*(long *)obj = n;
+		while (head - atomic_load_explicit(&a->tail,
+		    memory_order_acquire) == BENCH_CACHE_RING)
+			sched_yield();
+		a->ring[head % BENCH_CACHE_RING] = obj;
+		atomic_store_explicit(&a->head, ++head, memory_order_release);
+	}
+	return (NULL);
+}
+
+static void *
+bench_cache_consumer(void *arg)
+{
+	struct bench_cache_pair *a;
+	unsigned long tail;
+	void *obj;
+	long n;
+
+	a = arg;
+	(void)set_thread_on_domain(0, a->cdomain);
+	pthread_barrier_wait(a->barrier);
+	tail = 0;
+	for (n = 0; n < a->ops; n++) {
+		while (atomic_load_explicit(&a->head, memory_order_acquire) ==
+		    tail)
+			sched_yield();
+		obj = a->ring[tail % BENCH_CACHE_RING];
+		atomic_store_explicit(&a->tail, ++tail, memory_order_release);
+		if (*(long *)obj != n)
+			errx(1, "object %ld out of order", n);
+		if (a->mode == BENCH_CACHE_CACHE)
+			numa_cache_free(a->cache, obj);
+		else if (a->mode == BENCH_CACHE_MALLOC)
+			numa_free(obj);
+		else
+			free(obj);
+	}
+	return (NULL);
+}
+
+static void
+bench_cache_run(int mode, int npairs, int ndomains, size_t size, long ops)
+{
+	struct bench_cache_pair *pairs;
+	struct numa_cache_stats st;
+	struct numa_cache *cache;
+	struct timespec start, end;
+	pthread_barrier_t barrier;
+	double secs;
+	int i;
+
+	cache = NULL;
+	if (mode == BENCH_CACHE_CACHE &&
+	    (cache = numa_cache_create(size, bench_cache_ctor, &size)) == NULL)
+		err(1, "numa_cache_create");
+	if (posix_memalign((void **)&pairs, NUMA_CACHELINE,
+	    npairs * sizeof(*pairs)) != 0)
+		errx(1, "posix_memalign");
+	memset(pairs, 0, npairs * sizeof(*pairs));
+	pthread_barrier_init(&barrier, NULL, 2 * npairs + 1);
+	for (i = 0; i < npairs; i++) {
+		pairs[i].barrier = &barrier;
+		pairs[i].mode = mode;
+		pairs[i].cache = cache;
+		pairs[i].pdomain = i % ndomains;
+		pairs[i].cdomain = (i + 1) % ndomains;
+		pairs[i].size = size;
+		pairs[i].ops = ops;
+		if (pthread_create(&pairs[i].producer, NULL,
+		    bench_cache_producer, &pairs[i]) != 0 ||
+		    pthread_create(&pairs[i].consumer, NULL,
+		    bench_cache_consumer, &pairs[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < npairs; i++) {
+		pthread_join(pairs[i].producer, NULL);
+		pthread_join(pairs[i].consumer, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&barrier);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-6s pairs %3d size %6zu ops %10ld time %8.3fs %8.2f Mops/s",
+	    bench_cache_names[mode], npairs, size, ops * npairs, secs,
+	    ops * npairs / secs / 1e6);
+	if (cache != NULL) {
+		numa_cache_stats(cache, &st);
+		printf(" remote %ju in %ju magazines, %ju exchanges, %ju slabs",
+		    (uintmax_t)st.ncs_remote_frees,
+		    (uintmax_t)st.ncs_remote_mags,
+		    (uintmax_t)st.ncs_exchanges, (uintmax_t)st.ncs_slabs);
+		numa_cache_destroy(cache);
+	}
+	printf("\n");
+	free(pairs);
+}
+
+int
+bench_cache(int argc, char **argv)
+{
+	size_t size;
+	long ops;
+	int ch, mode, npairs, ndomains;
+
+	size = 128;
+	ops = 1000000;
+	npairs = 0;
+	while ((ch = getopt(argc, argv, "S:b:n:p:")) != -1) {
+		switch (ch) {
+		case 'S':
+			if (numa_simulate(atoi(optarg), 1) == 0)
+				errx(1, "invalid domain count %s", optarg);
+			break;
+		case 'b':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			ops = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			npairs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: numanor cache [-S domains] "
+			    "[-b size] [-n ops] [-p pairs]\n");
+			return (1);
+		}
+	}
+	ndomains = MAX(is_numa_available(), 1);
+	if (npairs <= 0)
+		npairs = ndomains;
+	size = MAX(size, sizeof(long));
+	ops = MAX(ops, 1);
+
+	for (mode = BENCH_CACHE_CACHE; mode <= BENCH_CACHE_LIBC; mode++)
+		bench_cache_run(mode, npairs, ndomains, size, ops);
+	return (0);
+}
@@ -0,0 +1,182 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor init: first-touch initialization of a buffer by a single thread on
+ * domain 0 against numa_first_touch() with each partitioning.  The time and
+ * the placement check of numa_verify_placement() are printed for each, with
+ * the mean distance, from the topology weights, seen by one worker per domain
+ * walking one contiguous block of the buffer each.  Only the block layout
+ * keeps that walk local.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_INIT_SERIAL       (-1)
+
+static const char *bench_init_names[] = {
+	"block", "cyclic", "page"
+};
+
+
+/* ---------- BENCHMARK ----------- */
+
+/*
+ * Initialize a fresh mapping of size bytes with part, or from one thread on
+ * domain 0 for BENCH_INIT_SERIAL, and print the result row.
+ */
+static void
+bench_init_run(const struct numa_topology *t, int part, size_t size,
+    size_t unit)
+{
+	struct numa_place_report r;
+	struct timespec t0, t1;
+	double dist, secs;
+	size_t off, pagesize;
+	void *buf;
+	int d, home;
+
+	pagesize = getpagesize();
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+	    -1, 0);
+	if (buf == MAP_FAILED)
+		err(1, "mmap");
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (part == BENCH_INIT_SERIAL) {
+		if (!set_thread_on_domain(0, 0))
+			errx(1, "cannot pin to domain 0");
+		memset(buf, 0, size);
+	} else if (!numa_first_touch(buf, size, part, unit, NULL, NULL))
+		warn("numa_first_touch");
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	dist = 0;
+	for (off = 0; off < size; off += pagesize) {
+		d = numa_part_domain(size, NUMA_PART_BLOCK, 0, off);
+		home = part == BENCH_INIT_SERIAL ? 0 :
+		    numa_part_domain(size, part, unit, off);
+		dist += t->nt_weights[d * t->nt_ndomains + home];
+	}
+	dist /= howmany(size, pagesize);
+
+	printf("%-8s %9.2f ms %8.2f GB/s %7.1f",
+	    part == BENCH_INIT_SERIAL ? "serial" : bench_init_names[part],
+	    secs * 1e3, size / secs / 1e9, dist);
+	if (part == BENCH_INIT_SERIAL)
+		part = NUMA_PART_BLOCK;
+	if (!numa_verify_placement(buf, size, part, unit, &r))
+		printf("  placement: %s\n", strerror(errno));
+	else if (r.npr_unknown > 0)
+		printf("  %ld resident, domain unknown\n", r.npr_unknown);
+	else
+		printf("  %ld placed, %ld misplaced, %ld absent\n",
+		    r.npr_placed, r.npr_misplaced, r.npr_absent);
+	(void)munmap(buf, size);
+}
+
+static void
+bench_init_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor init [-S domains] [-m megabytes] "
+	    "[-p block|cyclic|page] [-u unit]\n");
+	exit(1);
+}
+
+int
+bench_init(int argc, char **argv)
+{
+	const struct numa_topology *t;
+	size_t size, unit;
+	int ch, p, part;
+
+	size = 256;
+	unit = 64 * 1024;
+	part = -1;
+	while ((ch = getopt(argc, argv, "S:m:p:u:")) != -1) {
+		switch (ch) {
+		case 'S':
+			if (numa_simulate(atoi(optarg), 1) == 0)
+				errx(1, "invalid domain count %s", optarg);
+			break;
+		case 'm':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			for (part = nitems(bench_init_names) - 1; part >= 0;
+			    part--)
+				if (strcmp(optarg, bench_init_names[part]) == 0)
+					break;
+			if (part < 0)
+				bench_init_usage();
+			break;
+		case 'u':
+			unit = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			bench_init_usage();
+		}
+	}
+	if ((t = numa_topology()) == NULL)
+		errx(1, "NUMA not available, use -S");
+	if (size == 0 || unit == 0)
+		bench_init_usage();
+	size <<= 20;
+
+	printf("%d domains%s, %zu MB, cyclic unit %zu bytes\n",
+	    t->nt_ndomains, numa_simulated ? " (simulated)" : "", size >> 20,
+	    unit);
+	printf("%-8s %12s %13s %7s\n", "init", "time", "rate", "dist");
+	bench_init_run(t, BENCH_INIT_SERIAL, size, unit);
+	for (p = NUMA_PART_BLOCK; p <= NUMA_PART_PAGE; p++)
+		if (part < 0 || part == p)
+			bench_init_run(t, p, size, unit);
+	return (0);
+}
@@ -0,0 +1,385 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor io: I/O buffer pool benchmark.  Threads placed on the domains
+ * round-robin each write requests of iovcnt buffers with writev() and read
+ * them back with readv(), over a loopback socket pair of their own or, with
+ * -f, through a region of their own in a file.  The data read is summed so
+ * every buffer is touched.  The buffers come once from a numa_bufpool and
+ * once from a single pool shared by all threads, a mutex protected free list
+ * of buffers faulted in on domain 0, as a per-process pool would be.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_IO_MAXIOV         64
+
+struct bench_io_shared {
+	pthread_mutex_t	lock;
+	void		**free;
+	int		nfree;
+	void		*base;
+	size_t		maplen;
+};
+
+struct bench_io_arg {
+	pthread_t	thread;
+	pthread_barrier_t *barrier;
+	struct numa_bufpool *bp;	/* NULL for the shared pool */
+	struct bench_io_shared *shared;
+	const char	*path;
+	int		index;
+	int		domain;
+	int		iovcnt;
+	size_t		size;
+	long		requests;
+	long		bufs;
+	long		remote;		/* buffers of another domain */
+	uint64_t	sum;
+};
+
+
+/* ---------- BENCHMARK ----------- */
+
+static int
+bench_io_get(struct bench_io_arg *a, struct iovec *iov, int n)
+{
+	struct bench_io_shared *sp;
+	int i;
+
+	if (a->bp != NULL)
+		return (numa_buf_iov(a->bp, iov, n));
+	sp = a->shared;
+	pthread_mutex_lock(&sp->lock);
+	for (i = 0; i < n && sp->nfree > 0; i++) {
+		iov[i].iov_base = sp->free[--sp->nfree];
+		iov[i].iov_len = a->size;
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return (i);
+}
+
+static void
+bench_io_put(struct bench_io_arg *a, struct iovec *iov, int n)
+{
+	struct bench_io_shared *sp;
+	int i;
+
+	if (a->bp != NULL) {
+		numa_buf_iov_put(a->bp, iov, n);
+		return;
+	}
+	sp = a->shared;
+	pthread_mutex_lock(&sp->lock);
+	for (i = 0; i < n; i++)
+		sp->free[sp->nfree++] = (char *)sp->base +
+		    rounddown((char *)iov[i].iov_base - (char *)sp->base,
+		    a->size);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/*
+ * Send one request of a->iovcnt buffers to fd.
+ */
+static void
+bench_io_send(struct bench_io_arg *a, int fd, long r)
+{
+	struct iovec iov[BENCH_IO_MAXIOV];
+	ssize_t n;
+	int i;
+
+	if (bench_io_get(a, iov, a->iovcnt) != a->iovcnt)
+		errx(1, "buffer pool exhausted");
+	for (i = 0; i < a->iovcnt; i++) {
+		memset(iov[i].iov_base, (int)(r + i), a->size);
+		if (a->bp != NULL ?
+		    numa_buf_domain(a->bp, iov[i].iov_base) != a->domain :
+		    a->domain != 0)
+			a->remote++;
+	}
+	a->bufs += a->iovcnt;
+	if (a->bp != NULL)
+		n = numa_buf_writev(a->bp, fd, iov, a->iovcnt);
+	else {
+		n = writev(fd, iov, a->iovcnt);
+		bench_io_put(a, iov, a->iovcnt);
+	}
+	if (n != (ssize_t)(a->iovcnt * a->size))
+		err(1, "writev");
+}
+
+/*
+ * Read one request back from fd and sum it.
+ */
+static void
+bench_io_receive(struct bench_io_arg *a, int fd)
+{
+	struct iovec iov[BENCH_IO_MAXIOV];
+	size_t got, off, want;
+	ssize_t n;
+	int cnt, i;
+
+	want = a->iovcnt * a->size;
+	for (got = 0; got < want; got += n) {
+		cnt = a->iovcnt;
+		if (a->bp != NULL)
+			n = numa_buf_readv(a->bp, fd, iov, &cnt);
+		else {
+			if ((cnt = bench_io_get(a, iov, cnt)) != a->iovcnt)
+				errx(1, "buffer pool exhausted");
+			n = readv(fd, iov, cnt);
+		}
+		if (n <= 0)
+			err(1, "readv");
+		for (off = 0, i = 0; off < (size_t)n; i++, off += a->size) {
+			iov[i].iov_len = MIN(a->size, n - off);
+			a->sum += *(volatile uint64_t *)iov[i].iov_base;
+			a->sum += ((volatile char *)iov[i].iov_base)
+			    [iov[i].iov_len - 1];
+		}
+		bench_io_put(a, iov, cnt);
+	}
+}
+
+static void *
+bench_io_thread(void *arg)
+{
+	struct bench_io_arg *a;
+	off_t off;
+	long r;
+	int bufsize, fds[2];
+
+	a = arg;
+	(void)set_thread_on_domain(0, a->domain);
+	off = (off_t)a->index * a->iovcnt * a->size;
+	if (a->path == NULL) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+			err(1, "socketpair");
+		/* A whole request must fit, the thread reads it back itself. */
+		bufsize = 2 * a->iovcnt * a->size;
+		if (setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufsize,
+		    sizeof(bufsize)) != 0 ||
+		    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &bufsize,
+		    sizeof(bufsize)) != 0)
+			err(1, "setsockopt");
+	} else {
+		if ((fds[0] = open(a->path, O_RDWR | O_CREAT, 0600)) == -1)
+			err(1, "%s", a->path);
+		fds[1] = fds[0];
+	}
+	pthread_barrier_wait(a->barrier);
+	for (r = 0; r < a->requests; r++) {
+		if (a->path != NULL && lseek(fds[0], off, SEEK_SET) == -1)
+			err(1, "lseek");
+		bench_io_send(a, fds[0], r);
+		if (a->path != NULL && lseek(fds[1], off, SEEK_SET) == -1)
+			err(1, "lseek");
+		bench_io_receive(a, fds[1]);
+	}
+	if (a->bp != NULL)
+		numa_buf_flush();
+	close(fds[0]);
+	if (fds[1] != fds[0])
+		close(fds[1]);
+	return (NULL);
+}
+
+static void
+bench_io_run(int use_numa, int nthreads, int ndomains, int iovcnt,
+    size_t size, long requests, const char *path)
+{
+	struct numa_bufpool_stats st;
+	struct bench_io_shared shared;
+	struct bench_io_arg *args;
+	struct timespec start, end;
+	pthread_barrier_t barrier;
+	double secs;
+	long bufs, remote;
+	int i, nbufs;
+
+	/* Every thread holds at most two requests worth at a time. */
+	nbufs = 2 * iovcnt * nthreads;
+	memset(&shared, 0, sizeof(shared));
+	size = roundup2(size, getpagesize());
+	if (!use_numa) {
+		shared.maplen = (size_t)nbufs * size;
+		shared.base = mmap(NULL, shared.maplen, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (shared.base == MAP_FAILED)
+			err(1, "mmap");
+		if ((shared.free = calloc(nbufs, sizeof(*shared.free))) == NULL)
+			err(1, "calloc");
+		(void)set_thread_on_domain(0, 0);
+		memset(shared.base, 0, shared.maplen);
+		for (i = 0; i < nbufs; i++)
+			shared.free[shared.nfree++] = (char *)shared.base +
+			    (size_t)i * size;
+		pthread_mutex_init(&shared.lock, NULL);
+	}
+
+	args = calloc(nthreads, sizeof(*args));
+	if (args == NULL)
+		err(1, "calloc");
+	if (use_numa &&
+	    (args[0].bp = numa_bufpool_create(size, nbufs)) == NULL)
+		err(1, "numa_bufpool_create");
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		args[i].barrier = &barrier;
+		args[i].bp = args[0].bp;
+		args[i].shared = &shared;
+		args[i].path = path;
+		args[i].index = i;
+		args[i].domain = i % ndomains;
+		args[i].iovcnt = iovcnt;
+		args[i].size = size;
+		args[i].requests = requests;
+		if (pthread_create(&args[i].thread, NULL, bench_io_thread,
+		    &args[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bufs = remote = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(args[i].thread, NULL);
+		bufs += args[i].bufs;
+		remote += args[i].remote;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&barrier);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-6s threads %3d requests %9ld time %8.3fs %9.0f req/s "
+	    "%8.1f MB/s remote %5.1f%%\n", use_numa ? "numa" : "shared",
+	    nthreads, requests * nthreads, secs, requests * nthreads / secs,
+	    2.0 * bufs * size / secs / 1e6,
+	    bufs > 0 ? 100.0 * remote / bufs : 0.0);
+	if (use_numa) {
+		numa_bufpool_stats(args[0].bp, &st);
+		printf("%-6s buffers %ju returned %ju in %ju batches, "
+		    "foreign %ju exhausted %ju\n", "", (uintmax_t)st.nbs_buffers,
+		    (uintmax_t)st.nbs_returned, (uintmax_t)st.nbs_batches,
+		    (uintmax_t)st.nbs_foreign, (uintmax_t)st.nbs_exhausted);
+		numa_bufpool_destroy(args[0].bp);
+	} else {
+		pthread_mutex_destroy(&shared.lock);
+		free(shared.free);
+		(void)munmap(shared.base, shared.maplen);
+	}
+	free(args);
+}
+
+static void
+bench_io_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor io [-S domains] [-b size] [-f file] "
+	    "[-i iovcnt] [-n requests] [-t threads]\n");
+	exit(1);
+}
+
+int
+bench_io(int argc, char **argv)
+{
+	const char *path;
+	size_t size;
+	long requests;
+	int ch, iovcnt, nthreads, ndomains;
+
+	size = 4096;
+	iovcnt = 8;
+	requests = 20000;
+	nthreads = 0;
+	path = NULL;
+	while ((ch = getopt(argc, argv, "S:b:f:i:n:t:")) != -1) {
+		switch (ch) {
+		case 'S':
+			if (numa_simulate(atoi(optarg), 1) == 0)
+				errx(1, "invalid domain count %s", optarg);
+			break;
+		case 'b':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'i':
+			iovcnt = atoi(optarg);
+			break;
+		case 'n':
+			requests = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			bench_io_usage();
+		}
+	}
+	ndomains = MAX(is_numa_available(), 1);
+	if (nthreads <= 0)
+		nthreads = ndomains;
+	if (size == 0 || iovcnt <= 0 || iovcnt > BENCH_IO_MAXIOV ||
+	    requests <= 0)
+		bench_io_usage();
+
+	printf("%s, %d x %zu byte buffers per request\n",
+	    path == NULL ? "loopback sockets" : path, iovcnt, size);
+	bench_io_run(0, nthreads, ndomains, iovcnt, size, requests, path);
+	bench_io_run(1, nthreads, ndomains, iovcnt, size, requests, path);
+	if (path != NULL)
+		(void)unlink(path);
+	return (0);
+}
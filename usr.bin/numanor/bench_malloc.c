@@ -0,0 +1,190 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor malloc: multithreaded allocation throughput benchmark.  Every
+ * thread is placed on a domain round-robin and repeatedly allocates a window
+ * of blocks and frees it again, once with numa_malloc()/numa_free() and once
+ * with the libc allocator for comparison.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_MALLOC_WINDOW     256
+
+struct bench_malloc_arg {
+	pthread_t	thread;
+	pthread_barrier_t *barrier;
+	int		domain;
+	int		use_numa;
+	size_t		size;
+	long		ops;
+	long		local;		/* blocks placed on the thread's domain */
+};
+
+
+/* ---------- BENCHMARK ----------- */
+
+static void *
+bench_malloc_thread(void *arg)
+{
+	struct bench_malloc_arg *a;
+	void *slot[BENCH_MALLOC_WINDOW];
+	long n;
+	int i;
+
+	a = arg;
+	(void)set_thread_on_domain(0, a->domain);
+	pthread_barrier_wait(a->barrier);
+	for (n = 0; n < a->ops; n += BENCH_MALLOC_WINDOW) {
+		for (i = 0; i < BENCH_MALLOC_WINDOW; i++) {
+			slot[i] = a->use_numa ? numa_malloc(a->size) :
+			    malloc(a->size);
+			if (slot[i] == NULL)
+				err(1, "malloc");
+			*(volatile char *)slot[i] = 0;
+		}
+		if (n == 0 && a->use_numa)
+			for (i = 0; i < BENCH_MALLOC_WINDOW; i++)
+				if (numa_ptr_domain(slot[i]) == a->domain)
+					a->local++;
+		for (i = BENCH_MALLOC_WINDOW - 1; i >= 0; i--) {
+			if (a->use_numa)
+				numa_free(slot[i]);
+			else
+				free(slot[i]);
+		}
+	}
+	return (NULL);
+}
+
+static void
+bench_malloc_run(int use_numa, int nthreads, long ops, size_t size,
+    int ndomains)
+{
+	struct bench_malloc_arg *args;
+	struct timespec start, end;
+	pthread_barrier_t barrier;
+	double secs;
+	long local;
+	int i;
+
+	args = calloc(nthreads, sizeof(*args));
+	if (args == NULL)
+		err(1, "calloc");
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		args[i].barrier = &barrier;
+		args[i].domain = i % ndomains;
+		args[i].use_numa = use_numa;
+		args[i].size = size;
+		args[i].ops = ops;
+		if (pthread_create(&args[i].thread, NULL, bench_malloc_thread,
+		    &args[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	local = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(args[i].thread, NULL);
+		local += args[i].local;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&barrier);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-6s threads %3d size %6zu ops %10ld time %8.3fs "
+	    "%8.2f Mops/s", use_numa ? "numa" : "libc", nthreads, size,
+	    ops * nthreads, secs, ops * nthreads / secs / 1e6);
+	if (use_numa)
+		printf(" local %5.1f%%", 100.0 * local /
+		    (nthreads * BENCH_MALLOC_WINDOW));
+	printf("\n");
+	free(args);
+}
+
+int
+bench_malloc(int argc, char **argv)
+{
+	size_t size;
+	long ops;
+	int ch, nthreads, ndomains;
+
+	size = 64;
+	ops = 1000000;
+	nthreads = 0;
+	while ((ch = getopt(argc, argv, "S:b:n:t:")) != -1) {
+		switch (ch) {
+		case 'S':
+			if (numa_simulate(atoi(optarg), 1) == 0)
+				errx(1, "invalid domain count %s", optarg);
+			break;
+		case 'b':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			ops = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: numanor malloc [-S domains] "
+			    "[-b size] [-n ops] [-t threads]\n");
+			return (1);
+		}
+	}
+	ndomains = MAX(is_numa_available(), 1);
+	if (nthreads <= 0)
+		nthreads = ndomains;
+	ops = roundup(MAX(ops, 1), BENCH_MALLOC_WINDOW);
+
+	bench_malloc_run(0, nthreads, ops, size, ndomains);
+	bench_malloc_run(1, nthreads, ops, size, ndomains);
+	return (0);
+}
@@ -0,0 +1,315 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor mask: the numa_mask functions against the CPU_ISSET() loops they
+ * replace.  A table of random CPU sets, each CPU of the topology present
+ * with the given density, is run through every operation both ways.  The
+ * results must agree; the time per operation and the speedup are printed.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/cpuset.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * BENCH_MASK_SETS: Random sets cycled through, a power of two.
+ */
+#define BENCH_MASK_SETS         256
+
+/*
+ * One operation on set a, with set b and domain d where it takes them.
+ * Returns a value folding in the whole result for the comparison.
+ */
+typedef int bench_mask_fn(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d);
+
+struct bench_mask_op {
+	const char	*bmo_name;
+	bench_mask_fn	*bmo_naive;
+	bench_mask_fn	*bmo_fast;
+};
+
+
+/* ---------- OPERATIONS ---------- */
+
+static int
+bench_mask_count_naive(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d)
+{
+	int c, n;
+
+	for (c = n = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, a))
+			n++;
+	return (n);
+}
+
+static int
+bench_mask_count_fast(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d)
+{
+
+	return (numa_mask_count(a));
+}
+
+static int
+bench_mask_walk_naive(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d)
+{
+	int c, n;
+
+	for (c = n = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, a))
+			n = n * 31 + c;
+	return (n);
+}
+
+static int
+bench_mask_walk_fast(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d)
+{
+	int c, n;
+
+	n = 0;
+	NUMA_MASK_FOREACH(c, a)
+		n = n * 31 + c;
+	return (n);
+}
+
+static int
+bench_mask_and_naive(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d)
+{
+	cpuset_t r;
+	int c, n;
+
+	CPU_ZERO(&r);
+	for (c = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, a) && CPU_ISSET(c, b))
+			CPU_SET(c, &r);
+	for (c = n = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, &r))
+			n = n * 31 + c;
+	return (n);
+}
+
+static int
+bench_mask_and_fast(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d)
+{
+	cpuset_t r;
+	int c, n;
+
+	n = 0;
+	if (numa_mask_and(&r, a, b))
+		NUMA_MASK_FOREACH(c, &r)
+			n = n * 31 + c;
+	return (n);
+}
+
+static int
+bench_mask_first_naive(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d)
+{
+	int c;
+
+	for (c = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, a) && t->nt_cpu_domain[c] == d)
+			return (c);
+	return (-1);
+}
+
+static int
+bench_mask_first_fast(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d)
+{
+
+	return (numa_mask_first_in_domain(a, d));
+}
+
+static int
+bench_mask_domains_naive(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d)
+{
+	cpuset_t r;
+	int c, n;
+
+	CPU_ZERO(&r);
+	for (c = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, a) && t->nt_cpu_domain[c] >= 0)
+			CPU_SET(t->nt_cpu_domain[c], &r);
+	for (d = n = 0; d < t->nt_ndomains; d++)
+		if (CPU_ISSET(d, &r))
+			n = n * 31 + d;
+	return (n);
+}
+
+static int
+bench_mask_domains_fast(const struct numa_topology *t, const cpuset_t *a,
+    const cpuset_t *b, int d)
+{
+	cpuset_t r;
+	int n;
+
+	n = 0;
+	if (numa_mask_domains(a, &r) > 0)
+		NUMA_MASK_FOREACH(d, &r)
+			n = n * 31 + d;
+	return (n);
+}
+
+static const struct bench_mask_op bench_mask_ops[] = {
+	{ "count", bench_mask_count_naive, bench_mask_count_fast },
+	{ "walk", bench_mask_walk_naive, bench_mask_walk_fast },
+	{ "and", bench_mask_and_naive, bench_mask_and_fast },
+	{ "first", bench_mask_first_naive, bench_mask_first_fast },
+	{ "domains", bench_mask_domains_naive, bench_mask_domains_fast },
+};
+
+
+/* ---------- BENCHMARK ----------- */
+
+/*
+ * Run fn over the sets iterations times.  Returns the seconds taken, the
+ * folded results go to *sum.
+ */
+static double
+bench_mask_time(const struct numa_topology *t, const cpuset_t *sets,
+    bench_mask_fn *fn, long iterations, int *sum)
+{
+	struct timespec start, end;
+	long i;
+	int s;
+
+	s = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++)
+		s += fn(t, &sets[i & (BENCH_MASK_SETS - 1)],
+		    &sets[(i + 1) & (BENCH_MASK_SETS - 1)],
+		    i % t->nt_ndomains);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*sum = s;
+	return ((end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+static void
+bench_mask_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor mask [-S domains [-c cpus]] "
+	    "[-d density] [-n iterations]\n");
+	exit(1);
+}
+
+int
+bench_mask(int argc, char **argv)
+{
+	const struct numa_topology *t;
+	const struct bench_mask_op *op;
+	cpuset_t *sets;
+	double naive, fast;
+	long iterations;
+	int c, ch, cpus, density, domains, i, nsum, fsum;
+
+	domains = 0;
+	cpus = 4;
+	density = 25;
+	iterations = 1000000;
+	while ((ch = getopt(argc, argv, "S:c:d:n:")) != -1) {
+		switch (ch) {
+		case 'S':
+			domains = atoi(optarg);
+			break;
+		case 'c':
+			cpus = atoi(optarg);
+			break;
+		case 'd':
+			density = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtol(optarg, NULL, 0);
+			break;
+		default:
+			bench_mask_usage();
+		}
+	}
+	if (density < 0 || density > 100 || iterations <= 0)
+		bench_mask_usage();
+	if (domains > 0 && numa_simulate(domains, cpus) == 0)
+		errx(1, "cannot simulate %d domains of %d cpus", domains,
+		    cpus);
+	if ((t = numa_topology()) == NULL)
+		errx(1, "NUMA not available, use -S");
+
+	if ((sets = calloc(BENCH_MASK_SETS, sizeof(*sets))) == NULL)
+		err(1, "calloc");
+	srandom(1);
+	for (i = 0; i < BENCH_MASK_SETS; i++)
+		for (c = 0; c < t->nt_ncpus; c++)
+			if (random() % 100 < density)
+				CPU_SET(c, &sets[i]);
+
+	printf("%d domains%s, %d cpus, density %d%%, %ld iterations\n",
+	    t->nt_ndomains, numa_simulated ? " (simulated)" : "",
+	    t->nt_ncpus, density, iterations);
+	printf("%-8s %12s %12s %8s\n", "op", "naive ns", "mask ns",
+	    "speedup");
+	for (op = bench_mask_ops; op < &bench_mask_ops[nitems(bench_mask_ops)];
+	    op++) {
+		naive = bench_mask_time(t, sets, op->bmo_naive, iterations,
+		    &nsum);
+		fast = bench_mask_time(t, sets, op->bmo_fast, iterations,
+		    &fsum);
+		if (nsum != fsum)
+			errx(1, "%s: results differ", op->bmo_name);
+		printf("%-8s %12.1f %12.1f %7.1fx\n", op->bmo_name,
+		    naive * 1e9 / iterations, fast * 1e9 / iterations,
+		    fast > 0 ? naive / fast : 0);
+	}
+	free(sets);
+	return (0);
+}
@@ -0,0 +1,420 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor matrix: measures load latency (pointer chasing) and read
+ * bandwidth (streaming sum) for every pair of a domain with CPUs and a
+ * memory domain, and prints the measured distances next to the weights
+ * reported by get_numa_weights().  The measured distance of a pair is its
+ * latency relative to the local latency of the CPU domain, scaled so local
+ * is 10 like the ACPI SLIT.
+ *
+ * Pairs run in nd rounds: round s measures CPU domain c against memory
+ * domain (c + s) % nd for all c at once, so no two threads of a round share
+ * either a CPU domain or a memory controller.  -s runs one pair at a time.
+ * Output is text, JSON (-o json) or CSV (-o csv).
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_MATRIX_TEXT       0
+#define BENCH_MATRIX_JSON       1
+#define BENCH_MATRIX_CSV        2
+
+struct bench_matrix_arg {
+	pthread_t	thread;
+	int		cpu;		/* domain the thread runs on */
+	const uint64_t	*region;	/* placed on the memory domain */
+	size_t		size;
+	int		passes;
+	long		hops;
+	double		lat_ns;
+	double		bw_gbs;
+	uint64_t	sink;
+};
+
+struct bench_matrix {
+	int		nd;
+	size_t		size;
+	double		*lat;		/* nd x nd, row = CPU domain */
+	double		*bw;
+	int		*valid;		/* row has CPUs */
+};
+
+
+/* ---------- BENCHMARK ----------- */
+
+static double
+bench_matrix_elapsed(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9);
+}
+
+static void *
+bench_matrix_thread(void *arg)
+{
+	struct bench_matrix_arg *a;
+	struct timespec t0;
+	uint64_t next, s;
+	size_t i, words;
+	long h;
+	int p;
+
+	a = arg;
+	if (!set_thread_on_domain(0, a->cpu))
+		errx(1, "cannot pin to domain %d", a->cpu);
+	words = a->size / sizeof(uint64_t);
+
+	/* Walk the chain once so the TLB and caches start the same way. */
+	next = 0;
+	for (i = 0; i < a->size / NUMA_CACHELINE; i++)
+		next = a->region[next * (NUMA_CACHELINE / sizeof(uint64_t))];
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (h = 0; h < a->hops; h++)
+		next = a->region[next * (NUMA_CACHELINE / sizeof(uint64_t))];
+	a->lat_ns = bench_matrix_elapsed(&t0) / a->hops * 1e9;
+
+	s = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (p = 0; p < a->passes; p++)
+		for (i = 0; i < words; i++)
+			s += a->region[i];
+	a->bw_gbs = (double)a->passes * a->size / bench_matrix_elapsed(&t0) /
+	    1e9;
+	a->sink = s + next;
+	return (NULL);
+}
+
+/*
+ * Run the pairs of args[0..n) concurrently and store their results.
+ */
+static void
+bench_matrix_round(struct bench_matrix *bm, struct bench_matrix_arg *args,
+    const int *mem, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (pthread_create(&args[i].thread, NULL, bench_matrix_thread,
+		    &args[i]) != 0)
+			errx(1, "pthread_create");
+	for (i = 0; i < n; i++) {
+		pthread_join(args[i].thread, NULL);
+		bm->lat[args[i].cpu * bm->nd + mem[i]] = args[i].lat_ns;
+		bm->bw[args[i].cpu * bm->nd + mem[i]] = args[i].bw_gbs;
+	}
+}
+
+static void
+bench_matrix_measure(struct bench_matrix *bm, uint64_t **regions,
+    int serial, int passes, long hops)
+{
+	struct bench_matrix_arg args[NUMA_MAXDOMAINS];
+	int mem[NUMA_MAXDOMAINS];
+	int c, n, s;
+
+	for (s = 0; s < bm->nd; s++) {
+		n = 0;
+		for (c = 0; c < bm->nd; c++) {
+			if (!bm->valid[c])
+				continue;
+			memset(&args[n], 0, sizeof(args[n]));
+			args[n].cpu = c;
+			mem[n] = (c + s) % bm->nd;
+			args[n].region = regions[mem[n]];
+			args[n].size = bm->size;
+			args[n].passes = passes;
+			args[n].hops = hops;
+			if (serial)
+				bench_matrix_round(bm, &args[n], &mem[n], 1);
+			else
+				n++;
+		}
+		bench_matrix_round(bm, args, mem, n);
+	}
+}
+
+/*
+ * Measured distance of a pair, local latency of the row scaled to 10.
+ */
+static double
+bench_matrix_distance(const struct bench_matrix *bm, int c, int m)
+{
+
+	return (10.0 * bm->lat[c * bm->nd + m] / bm->lat[c * bm->nd + c]);
+}
+
+static void
+bench_matrix_text(const struct bench_matrix *bm,
+    const struct numa_topology *t)
+{
+	int c, m;
+
+	printf("latency (ns)\n%8s", "");
+	for (m = 0; m < bm->nd; m++)
+		printf("    mem %2d", m);
+	for (c = 0; c < bm->nd; c++) {
+		if (!bm->valid[c])
+			continue;
+		printf("\ncpu %-4d", c);
+		for (m = 0; m < bm->nd; m++)
+			printf("%10.1f", bm->lat[c * bm->nd + m]);
+	}
+	printf("\n\nbandwidth (GB/s)\n%8s", "");
+	for (m = 0; m < bm->nd; m++)
+		printf("    mem %2d", m);
+	for (c = 0; c < bm->nd; c++) {
+		if (!bm->valid[c])
+			continue;
+		printf("\ncpu %-4d", c);
+		for (m = 0; m < bm->nd; m++)
+			printf("%10.2f", bm->bw[c * bm->nd + m]);
+	}
+	printf("\n\ndistance measured/reported\n%8s", "");
+	for (m = 0; m < bm->nd; m++)
+		printf("    mem %2d", m);
+	for (c = 0; c < bm->nd; c++) {
+		if (!bm->valid[c])
+			continue;
+		printf("\ncpu %-4d", c);
+		for (m = 0; m < bm->nd; m++)
+			printf("%6.0f/%-3u", bench_matrix_distance(bm, c, m),
+			    t->nt_weights[c * bm->nd + m]);
+	}
+	printf("\n");
+}
+
+/*
+ * One JSON array per row, null for domains without CPUs.
+ */
+static void
+bench_matrix_json_rows(const struct bench_matrix *bm,
+    const struct numa_topology *t, const char *name, int what)
+{
+	int c, m;
+
+	printf("  \"%s\": [", name);
+	for (c = 0; c < bm->nd; c++) {
+		printf("%s\n    ", c > 0 ? "," : "");
+		if (what != 3 && !bm->valid[c]) {
+			printf("null");
+			continue;
+		}
+		printf("[");
+		for (m = 0; m < bm->nd; m++) {
+			printf("%s", m > 0 ? ", " : "");
+			switch (what) {
+			case 0:
+				printf("%.1f", bm->lat[c * bm->nd + m]);
+				break;
+			case 1:
+				printf("%.3f", bm->bw[c * bm->nd + m]);
+				break;
+			case 2:
+				printf("%.1f", bench_matrix_distance(bm, c, m));
+				break;
+			case 3:
+				printf("%u", t->nt_weights[c * bm->nd + m]);
+				break;
+			}
+		}
+		printf("]");
+	}
+	printf("\n  ]");
+}
+
+static void
+bench_matrix_json(const struct bench_matrix *bm,
+    const struct numa_topology *t, const struct utsname *u, int passes,
+    long hops)
+{
+
+	printf("{\n  \"kernel\": \"%s %s\",\n  \"simulated\": %s,\n"
+	    "  \"domains\": %d,\n  \"size\": %zu,\n  \"passes\": %d,\n"
+	    "  \"hops\": %ld,\n", u->sysname, u->release,
+	    numa_simulated ? "true" : "false", bm->nd, bm->size, passes, hops);
+	bench_matrix_json_rows(bm, t, "latency_ns", 0);
+	printf(",\n");
+	bench_matrix_json_rows(bm, t, "bandwidth_gbs", 1);
+	printf(",\n");
+	bench_matrix_json_rows(bm, t, "distance", 2);
+	printf(",\n");
+	bench_matrix_json_rows(bm, t, "weights", 3);
+	printf("\n}\n");
+}
+
+static void
+bench_matrix_csv(const struct bench_matrix *bm,
+    const struct numa_topology *t)
+{
+	int c, m;
+
+	printf("cpu,mem,latency_ns,bandwidth_gbs,distance,weight\n");
+	for (c = 0; c < bm->nd; c++)
+		for (m = 0; bm->valid[c] && m < bm->nd; m++)
+			printf("%d,%d,%.1f,%.3f,%.1f,%u\n", c, m,
+			    bm->lat[c * bm->nd + m], bm->bw[c * bm->nd + m],
+			    bench_matrix_distance(bm, c, m),
+			    t->nt_weights[c * bm->nd + m]);
+}
+
+static void
+bench_matrix_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor matrix [-S domains | -f file] "
+	    "[-m megabytes] [-n hops] [-p passes] [-s] [-o text | json | csv]"
+	    "\n");
+	exit(1);
+}
+
+int
+bench_matrix(int argc, char **argv)
+{
+	const struct numa_topology *t;
+	struct bench_matrix bm;
+	struct utsname u;
+	uint64_t *regions[NUMA_MAXDOMAINS];
+	size_t size;
+	long hops;
+	int ch, d, format, passes, serial;
+
+	size = 64;
+	hops = 2000000;
+	passes = 4;
+	serial = 0;
+	format = BENCH_MATRIX_TEXT;
+	while ((ch = getopt(argc, argv, "S:f:m:n:o:p:s")) != -1) {
+		switch (ch) {
+		case 'S':
+			if (numa_simulate(atoi(optarg), 1) == 0)
+				errx(1, "invalid domain count %s", optarg);
+			break;
+		case 'f':
+			if (numa_topology_load(NUMA_TOPO_FILE, optarg) == 0)
+				errx(1, "cannot load topology from %s", optarg);
+			break;
+		case 'm':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			hops = strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			if (strcmp(optarg, "text") == 0)
+				format = BENCH_MATRIX_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				format = BENCH_MATRIX_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				format = BENCH_MATRIX_CSV;
+			else
+				bench_matrix_usage();
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 's':
+			serial = 1;
+			break;
+		default:
+			bench_matrix_usage();
+		}
+	}
+	if ((t = numa_topology()) == NULL)
+		errx(1, "NUMA not available, use -S or -f");
+	if (size == 0 || hops <= 0 || passes <= 0)
+		bench_matrix_usage();
+
+	memset(&bm, 0, sizeof(bm));
+	bm.nd = t->nt_ndomains;
+	bm.size = size * 1024 * 1024;
+	bm.lat = calloc(bm.nd * bm.nd, sizeof(*bm.lat));
+	bm.bw = calloc(bm.nd * bm.nd, sizeof(*bm.bw));
+	bm.valid = calloc(bm.nd, sizeof(*bm.valid));
+	if (bm.lat == NULL || bm.bw == NULL || bm.valid == NULL)
+		err(1, "calloc");
+	for (d = 0; d < bm.nd; d++) {
+		bm.valid[d] = CPU_COUNT(&t->nt_cpus[d]) > 0;
+		regions[d] = mmap(NULL, bm.size, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (regions[d] == MAP_FAILED)
+			err(1, "mmap");
+		if (!numa_bind_range(regions[d], bm.size, d))
+			errx(1, "cannot place memory on domain %d", d);
+		bench_chain_fill(regions[d], bm.size);
+	}
+
+	bench_matrix_measure(&bm, regions, serial, passes, hops);
+	if (uname(&u) != 0)
+		err(1, "uname");
+	switch (format) {
+	case BENCH_MATRIX_TEXT:
+		printf("%s %s, %d domains, %zu MB per domain\n\n", u.sysname,
+		    u.release, bm.nd, size);
+		bench_matrix_text(&bm, t);
+		break;
+	case BENCH_MATRIX_JSON:
+		bench_matrix_json(&bm, t, &u, passes, hops);
+		break;
+	case BENCH_MATRIX_CSV:
+		bench_matrix_csv(&bm, t);
+		break;
+	}
+
+	for (d = 0; d < bm.nd; d++)
+		(void)munmap(regions[d], bm.size);
+	free(bm.lat);
+	free(bm.bw);
+	free(bm.valid);
+	return (0);
+}
@@ -0,0 +1,155 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor move: move_pages() throughput benchmark.  A buffer is faulted in
+ * and then bounced between two domains with move_pages(), issuing the page
+ * list in batches of each requested size, and the migration rate is
+ * reported in GB/s per batch size.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- BENCHMARK ----------- */
+
+static const long bench_move_default[] = { 1, 16, 64, 256, 1024, 4096 };
+
+static void
+bench_move_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor move [-m megabytes] [-b batch] "
+	    "[-f from] [-t to]\n");
+	exit(1);
+}
+
+int
+bench_move(int argc, char **argv)
+{
+	struct timespec start, end;
+	const long *batches;
+	void **pages;
+	char *buf;
+	double secs;
+	long batch, npages, i, off;
+	int *node, *status, ch, from, to, nbatches, b, failed, round;
+	size_t len, pagesize;
+
+	len = 256 << 20;
+	from = 0;
+	to = 1;
+	batches = bench_move_default;
+	nbatches = nitems(bench_move_default);
+	while ((ch = getopt(argc, argv, "b:f:m:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			batch = strtol(optarg, NULL, 0);
+			if (batch <= 0)
+				bench_move_usage();
+			batches = &batch;
+			nbatches = 1;
+			break;
+		case 'f':
+			from = atoi(optarg);
+			break;
+		case 'm':
+			len = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 't':
+			to = atoi(optarg);
+			break;
+		default:
+			bench_move_usage();
+		}
+	}
+	if (is_numa_available() < 2 || from == to ||
+	    from < 0 || from >= is_numa_available() ||
+	    to < 0 || to >= is_numa_available())
+		errx(1, "need two distinct NUMA domains");
+
+	pagesize = getpagesize();
+	npages = len / pagesize;
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+	    -1, 0);
+	pages = calloc(npages, sizeof(*pages));
+	node = calloc(npages, sizeof(*node));
+	status = calloc(npages, sizeof(*status));
+	if (buf == MAP_FAILED || pages == NULL || node == NULL ||
+	    status == NULL)
+		err(1, "allocating %zu bytes", len);
+	if (!numa_bind_range(buf, len, from))
+		warnx("cannot bind buffer to domain %d", from);
+	for (i = 0; i < npages; i++)
+		pages[i] = buf + i * pagesize;
+
+	for (round = 0, b = 0; b < nbatches; b++, round++) {
+		/* Alternate the direction so every round really moves. */
+		for (i = 0; i < npages; i++)
+			node[i] = (round % 2) == 0 ? to : from;
+		failed = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (off = 0; off < npages; off += batches[b]) {
+			if (move_pages(0, MIN(batches[b], npages - off),
+			    pages + off, node + off, status + off,
+			    NUMA_MOVE) != 0)
+				err(1, "move_pages");
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		for (i = 0; i < npages; i++)
+			if (status[i] != node[i])
+				failed++;
+		secs = (end.tv_sec - start.tv_sec) +
+		    (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("batch %5ld pages %8ld -> domain %d time %8.3fs "
+		    "%7.2f GB/s failed %d\n", batches[b], npages, node[0],
+		    secs, (double)(npages - failed) * pagesize / secs / 1e9,
+		    failed);
+	}
+	free(status);
+	free(node);
+	free(pages);
+	munmap(buf, len);
+	return (0);
+}
@@ -0,0 +1,284 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor place: read bandwidth and load latency of one region under three
+ * placements.  "first-touch" puts the whole region on domain 0, as when one
+ * thread initializes it, "interleave" uses numa_alloc_interleaved() over all
+ * domains and "replicate" gives every domain its own numa_alloc_replicated()
+ * copy.  The threads, pinned round-robin to the domains, first sum the
+ * region and then chase a random cyclic pointer chain through its cache
+ * lines.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_PLACE_FIRST       0
+#define BENCH_PLACE_INTERLEAVE  1
+#define BENCH_PLACE_REPLICATE   2
+
+struct bench_place_arg {
+	pthread_t	thread;
+	pthread_barrier_t *barrier;
+	int		domain;
+	const void	*region;
+	struct numa_replica *replica;
+	size_t		size;
+	int		passes;
+	long		hops;
+	double		bw_secs;	/* time for passes sums */
+	double		chase_secs;	/* time for hops loads */
+	uint64_t	sink;
+};
+
+static const char *bench_place_names[] = {
+	"first-touch", "interleave", "replicate"
+};
+
+
+/* ---------- BENCHMARK ----------- */
+
+static double
+bench_place_elapsed(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9);
+}
+
+void
+bench_chain_fill(void *buf, size_t size)
+{
+	uint64_t *w, t;
+	size_t i, j, n, step;
+
+	w = buf;
+	step = NUMA_CACHELINE / sizeof(uint64_t);
+	n = size / NUMA_CACHELINE;
+	for (i = 0; i < size / sizeof(uint64_t); i++)
+		w[i] = i;
+	for (i = 0; i < n; i++)
+		w[i * step] = i;
+	srandom(1);
+	for (i = n - 1; i > 0; i--) {
+		j = random() % i;
+		t = w[i * step];
+		w[i * step] = w[j * step];
+		w[j * step] = t;
+	}
+}
+
+static void *
+bench_place_thread(void *arg)
+{
+	struct bench_place_arg *a;
+	struct timespec t0;
+	const uint64_t *w;
+	uint64_t s, next;
+	size_t i, words;
+	long h;
+	int p;
+
+	a = arg;
+	(void)set_thread_on_domain(0, a->domain);
+	pthread_barrier_wait(a->barrier);
+	w = a->replica != NULL ? numa_replica_local(a->replica) : a->region;
+	words = a->size / sizeof(uint64_t);
+
+	s = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (p = 0; p < a->passes; p++)
+		for (i = 0; i < words; i++)
+			s += w[i];
+	a->bw_secs = bench_place_elapsed(&t0);
+
+	next = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (h = 0; h < a->hops; h++)
+		next = w[next * (NUMA_CACHELINE / sizeof(uint64_t))];
+	a->chase_secs = bench_place_elapsed(&t0);
+	a->sink = s + next;
+	return (NULL);
+}
+
+static void
+bench_place_run(int placement, int nthreads, int ndomains, size_t size,
+    size_t stripe, int passes, long hops)
+{
+	struct bench_place_arg *args;
+	struct numa_replica *replica;
+	pthread_barrier_t barrier;
+	double bw, lat;
+	void *region;
+	int i;
+
+	region = NULL;
+	replica = NULL;
+	switch (placement) {
+	case BENCH_PLACE_FIRST:
+		region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (region == MAP_FAILED)
+			err(1, "mmap");
+		if (!numa_bind_range(region, size, 0))
+			errx(1, "cannot place region on domain 0");
+		bench_chain_fill(region, size);
+		break;
+	case BENCH_PLACE_INTERLEAVE:
+		if ((region = numa_alloc_interleaved(size, NULL, stripe)) ==
+		    NULL)
+			err(1, "numa_alloc_interleaved");
+		bench_chain_fill(region, size);
+		break;
+	case BENCH_PLACE_REPLICATE:
+		if ((replica = numa_alloc_replicated(size, NULL)) == NULL)
+			err(1, "numa_alloc_replicated");
+		bench_chain_fill(numa_replica_master(replica), size);
+		numa_replica_publish(replica);
+		break;
+	}
+
+	if ((args = calloc(nthreads, sizeof(*args))) == NULL)
+		err(1, "calloc");
+	pthread_barrier_init(&barrier, NULL, nthreads);
+	for (i = 0; i < nthreads; i++) {
+		args[i].barrier = &barrier;
+		args[i].domain = i % ndomains;
+		args[i].region = region;
+		args[i].replica = replica;
+		args[i].size = size;
+		args[i].passes = passes;
+		args[i].hops = hops;
+		if (pthread_create(&args[i].thread, NULL, bench_place_thread,
+		    &args[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	bw = lat = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(args[i].thread, NULL);
+		bw += (double)passes * size / args[i].bw_secs;
+		lat += args[i].chase_secs / hops;
+	}
+	pthread_barrier_destroy(&barrier);
+	printf("%-12s %9.2f GB/s %9.1f ns/load\n", bench_place_names[placement],
+	    bw / 1e9, lat / nthreads * 1e9);
+	free(args);
+
+	if (placement == BENCH_PLACE_FIRST)
+		(void)munmap(region, size);
+	else if (placement == BENCH_PLACE_INTERLEAVE)
+		numa_free_interleaved(region, size);
+	else
+		numa_free_replicated(replica);
+}
+
+static void
+bench_place_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor place [-S domains] [-m megabytes] "
+	    "[-s stripe_kb] [-p passes] [-n hops] [-t threads]\n");
+	exit(1);
+}
+
+int
+bench_place(int argc, char **argv)
+{
+	size_t size, stripe;
+	long hops;
+	int ch, nd, nthreads, passes, placement;
+
+	size = 64;
+	stripe = 4;
+	passes = 4;
+	hops = 4000000;
+	nthreads = 0;
+	while ((ch = getopt(argc, argv, "S:m:n:p:s:t:")) != -1) {
+		switch (ch) {
+		case 'S':
+			if (numa_simulate(atoi(optarg), 1) == 0)
+				errx(1, "invalid domain count %s", optarg);
+			break;
+		case 'm':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			hops = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 's':
+			stripe = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			bench_place_usage();
+		}
+	}
+	if ((nd = is_numa_available()) == 0)
+		errx(1, "NUMA not available, use -S");
+	if (size == 0 || passes <= 0 || hops <= 0 || nthreads < 0)
+		bench_place_usage();
+	if (nthreads == 0)
+		nthreads = nd;
+	size *= 1024 * 1024;
+	stripe *= 1024;
+
+	printf("%d domains, %d threads, %zu MB region, %zu KB stripes\n", nd,
+	    nthreads, size >> 20, stripe >> 10);
+	for (placement = BENCH_PLACE_FIRST; placement <= BENCH_PLACE_REPLICATE;
+	    placement++)
+		bench_place_run(placement, nthreads, nd, size, stripe, passes,
+		    hops);
+	return (0);
+}
@@ -0,0 +1,220 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor pool: domain-aware pool against a flat pool.  Data blocks are
+ * spread over the domains with numa_malloc_onnode(), every round submits one
+ * task per block with numa_pool_submit_data() and every task sums its block
+ * and spawns a few small child tasks to exercise stealing.  The same
+ * workload runs on a NUMA_POOL_FLAT pool with the same pinned workers.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_POOL_CHILDREN     4
+
+struct bench_pool_block {
+	struct numa_pool *pool;
+	uint64_t	*data;
+	size_t		words;
+	_Atomic(uint64_t) *sum;
+};
+
+
+/* ---------- BENCHMARK ----------- */
+
+static void
+bench_pool_child(void *arg)
+{
+	struct bench_pool_block *b;
+	uint64_t s;
+	size_t i;
+
+	b = arg;
+	s = 0;
+	for (i = 0; i < b->words; i += 64)
+		s += b->data[i];
+	atomic_fetch_add_explicit(b->sum, s, memory_order_relaxed);
+}
+
+static void
+bench_pool_task(void *arg)
+{
+	struct bench_pool_block *b;
+	uint64_t s;
+	size_t i;
+	int c;
+
+	b = arg;
+	s = 0;
+	for (i = 0; i < b->words; i++)
+		s += b->data[i];
+	atomic_fetch_add_explicit(b->sum, s, memory_order_relaxed);
+	for (c = 0; c < BENCH_POOL_CHILDREN; c++)
+		numa_pool_submit(b->pool, bench_pool_child, b);
+}
+
+static double
+bench_pool_run(int flags, int workers, struct bench_pool_block *blocks,
+    long nblocks, int rounds, struct numa_pool_stats *st)
+{
+	struct numa_pool *pool;
+	struct timespec t0, t1;
+	long i;
+	int r;
+
+	if ((pool = numa_pool_create(workers, flags)) == NULL)
+		err(1, "numa_pool_create");
+	for (i = 0; i < nblocks; i++)
+		blocks[i].pool = pool;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < nblocks; i++)
+			if (!numa_pool_submit_data(pool, blocks[i].data,
+			    bench_pool_task, &blocks[i]))
+				errx(1, "numa_pool_submit_data failed");
+		numa_pool_wait(pool);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	numa_pool_stats(pool, st);
+	numa_pool_destroy(pool);
+	return ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
+
+static void
+bench_pool_print(const char *name, double secs, int rounds, long nblocks,
+    size_t size, const struct numa_pool_stats *st)
+{
+
+	printf("%-5s %8.3f s %8.2f Mtasks/s %8.2f GB/s  local %5.1f%%  "
+	    "steals %ju local %ju remote\n", name, secs,
+	    st->nps_executed / secs / 1e6,
+	    (double)rounds * nblocks * size / secs / 1e9,
+	    st->nps_affine > 0 ? 100.0 * st->nps_local / st->nps_affine : 0.0,
+	    (uintmax_t)st->nps_stolen_local, (uintmax_t)st->nps_stolen_remote);
+}
+
+static void
+bench_pool_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor pool [-S domains] [-b blocksize] "
+	    "[-n blocks] [-r rounds] [-w workers]\n");
+	exit(1);
+}
+
+int
+bench_pool(int argc, char **argv)
+{
+	struct bench_pool_block *blocks;
+	struct numa_pool_stats st;
+	_Atomic(uint64_t) sum;
+	double secs;
+	size_t i, size;
+	long b, nblocks;
+	int ch, nd, rounds, sim, workers;
+
+	sim = 0;
+	size = 256 * 1024;
+	nblocks = 256;
+	rounds = 20;
+	workers = 0;
+	while ((ch = getopt(argc, argv, "S:b:n:r:w:")) != -1) {
+		switch (ch) {
+		case 'S':
+			sim = atoi(optarg);
+			break;
+		case 'b':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nblocks = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		default:
+			bench_pool_usage();
+		}
+	}
+	if (sim > 0 && numa_simulate(sim, MAX(1,
+	    (int)sysconf(_SC_NPROCESSORS_ONLN) / sim)) == 0)
+		errx(1, "invalid domain count %d", sim);
+	if ((nd = is_numa_available()) == 0)
+		errx(1, "NUMA not available, use -S");
+	if (size < sizeof(uint64_t) || nblocks <= 0 || rounds <= 0)
+		bench_pool_usage();
+
+	atomic_init(&sum, 0);
+	if ((blocks = calloc(nblocks, sizeof(*blocks))) == NULL)
+		err(1, "calloc");
+	for (b = 0; b < nblocks; b++) {
+		blocks[b].words = size / sizeof(uint64_t);
+		blocks[b].data = numa_malloc_onnode(size, b % nd);
+		if (blocks[b].data == NULL)
+			err(1, "numa_malloc_onnode");
+		for (i = 0; i < blocks[b].words; i++)
+			blocks[b].data[i] = i;
+		blocks[b].sum = &sum;
+	}
+
+	printf("%d domains, %ld blocks of %zu bytes, %d rounds\n", nd,
+	    nblocks, size, rounds);
+	secs = bench_pool_run(0, workers, blocks, nblocks, rounds, &st);
+	bench_pool_print("numa", secs, rounds, nblocks, size, &st);
+	secs = bench_pool_run(NUMA_POOL_FLAT, workers, blocks, nblocks, rounds,
+	    &st);
+	bench_pool_print("flat", secs, rounds, nblocks, size, &st);
+
+	for (b = 0; b < nblocks; b++)
+		numa_free(blocks[b].data);
+	free(blocks);
+	return (0);
+}
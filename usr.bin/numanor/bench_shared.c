@@ -0,0 +1,207 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor shared: a cache shared by several processes through a MAP_SHARED
+ * mapping, as a forked server would set one up.  A loader on domain 0 fills
+ * it, then one process per domain chases a random pointer chain through it.
+ * "first-touch" leaves placement to the loader, "mbind" interleaves the
+ * mapping with numa_set_range_policy() before loading, leaving the pages to
+ * the kernel's scanner, and "rebind" does so after loading, moving the pages
+ * at once.  The placement reported by
+ * numa_get_range_info() is printed with the load latency seen from every
+ * domain.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_SHARED_FIRST      0
+#define BENCH_SHARED_MBIND      1
+#define BENCH_SHARED_REBIND     2
+
+static const char *bench_shared_names[] = {
+	"first-touch", "mbind", "rebind"
+};
+
+
+/* ---------- BENCHMARK ----------- */
+
+/*
+ * Chase hops links of the chain in region from a process on domain and
+ * return the time per load in ns.
+ */
+static double
+bench_shared_chase(const uint64_t *w, int domain, long hops)
+{
+	struct timespec t0, t1;
+	uint64_t next;
+	long h;
+
+	(void)set_thread_on_domain(0, domain);
+	next = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (h = 0; h < hops; h++)
+		next = w[next * (NUMA_CACHELINE / sizeof(uint64_t))];
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (next == UINT64_MAX)
+		abort();
+	return (((t1.tv_sec - t0.tv_sec) * 1e9 +
+	    (t1.tv_nsec - t0.tv_nsec)) / hops);
+}
+
+static void
+bench_shared_run(int placement, int nprocs, int ndomains, size_t size,
+    long hops)
+{
+	struct numa_range_info info;
+	double *lat, lo, hi, sum;
+	pid_t *pids;
+	void *region;
+	int d, i, status;
+
+	region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+	    -1, 0);
+	lat = mmap(NULL, nprocs * sizeof(*lat), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (region == MAP_FAILED || lat == MAP_FAILED)
+		err(1, "mmap");
+	if (placement == BENCH_SHARED_MBIND &&
+	    !numa_set_range_policy(region, size, NULL, NUMA_POLICY_INTERLEAVE,
+	    0))
+		err(1, "numa_set_range_policy");
+	if (!set_thread_on_domain(0, 0))
+		errx(1, "cannot pin to domain 0");
+	bench_chain_fill(region, size);
+	if (placement == BENCH_SHARED_REBIND &&
+	    !numa_set_range_policy(region, size, NULL, NUMA_POLICY_INTERLEAVE,
+	    NUMA_MOVE_ALL))
+		err(1, "numa_set_range_policy");
+	if (!numa_get_range_info(region, size, &info))
+		err(1, "numa_get_range_info");
+
+	if ((pids = calloc(nprocs, sizeof(*pids))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nprocs; i++) {
+		if ((pids[i] = fork()) == -1)
+			err(1, "fork");
+		if (pids[i] == 0) {
+			lat[i] = bench_shared_chase(region, i % ndomains, hops);
+			_exit(0);
+		}
+	}
+	for (i = 0; i < nprocs; i++)
+		if (waitpid(pids[i], &status, 0) == -1 || status != 0)
+			errx(1, "reader %d failed", i);
+
+	printf("%-12s pages:", bench_shared_names[placement]);
+	for (d = 0; d < ndomains && d < NUMA_STAT_MAXDOM; d++)
+		printf(" %ju", (uintmax_t)info.nri_pages[d]);
+	printf("\n");
+	lo = hi = lat[0];
+	sum = 0;
+	for (i = 0; i < nprocs; i++) {
+		lo = MIN(lo, lat[i]);
+		hi = MAX(hi, lat[i]);
+		sum += lat[i];
+	}
+	printf("%-12s %9.1f ns/load, %.1f to %.1f across readers\n", "",
+	    sum / nprocs, lo, hi);
+	free(pids);
+	(void)munmap(lat, nprocs * sizeof(*lat));
+	(void)munmap(region, size);
+}
+
+static void
+bench_shared_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor shared [-m megabytes] [-n hops] "
+	    "[-p procs]\n");
+	exit(1);
+}
+
+int
+bench_shared(int argc, char **argv)
+{
+	size_t size;
+	long hops;
+	int ch, nd, nprocs, placement;
+
+	size = 64;
+	hops = 4000000;
+	nprocs = 0;
+	while ((ch = getopt(argc, argv, "m:n:p:")) != -1) {
+		switch (ch) {
+		case 'm':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			hops = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			nprocs = atoi(optarg);
+			break;
+		default:
+			bench_shared_usage();
+		}
+	}
+	if ((nd = is_numa_available()) == 0 || numa_simulated)
+		errx(1, "range policies need the kernel's NUMA support");
+	if (nprocs <= 0)
+		nprocs = nd;
+	if (size == 0 || hops <= 0)
+		bench_shared_usage();
+	size <<= 20;
+
+	printf("%d readers over %zu MB, %ld hops each\n", nprocs, size >> 20,
+	    hops);
+	for (placement = BENCH_SHARED_FIRST; placement <= BENCH_SHARED_REBIND;
+	    placement++)
+		bench_shared_run(placement, nprocs, nd, size, hops);
+	return (0);
+}
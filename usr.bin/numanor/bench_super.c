@@ -0,0 +1,195 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor super: random access over numa_malloc_onnode() blocks on small
+ * and on large pages.  The first set of blocks comes from ordinary 1 MB
+ * arena chunks, which the kernel cannot promote.  Then a superpage
+ * reservation is made on the domain and a second set comes from it.  Each
+ * set is linked into one random cycle of page sized blocks, so every hop
+ * lands on another page, and chased from a thread on the domain.  The
+ * number of translations the set spans is what the TLB has to cover.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_SUPER_BLOCK       4096
+
+
+/* ---------- BENCHMARK ----------- */
+
+static void
+bench_super_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor super [-S domains] [-d domain] "
+	    "[-m megabytes] [-n hops]\n");
+	exit(1);
+}
+
+/*
+ * Allocate n blocks on domain and link them into one random cycle
+ * (Sattolo's shuffle).  Returns the blocks.
+ */
+static void **
+bench_super_chain(int domain, long n)
+{
+	void **blocks, *tmp;
+	long i, j;
+
+	if ((blocks = calloc(n, sizeof(*blocks))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < n; i++)
+		if ((blocks[i] = numa_malloc_onnode(BENCH_SUPER_BLOCK,
+		    domain)) == NULL)
+			err(1, "numa_malloc_onnode");
+	srandom(1);
+	for (i = n - 1; i > 0; i--) {
+		j = random() % i;
+		tmp = blocks[i];
+		blocks[i] = blocks[j];
+		blocks[j] = tmp;
+	}
+	for (i = 0; i < n; i++)
+		*(void **)blocks[i] = blocks[(i + 1) % n];
+	return (blocks);
+}
+
+static double
+bench_super_chase(void *start, long hops)
+{
+	struct timespec t0, t1;
+	void *p;
+	long i;
+
+	/* One lap to warm the caches that can hold the set. */
+	p = start;
+	for (i = 0; i < hops / 8; i++)
+		p = *(void **)p;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < hops; i++)
+		p = *(void **)p;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (p == NULL)
+		abort();
+	return (((t1.tv_sec - t0.tv_sec) * 1e9 +
+	    (t1.tv_nsec - t0.tv_nsec)) / hops);
+}
+
+int
+bench_super(int argc, char **argv)
+{
+	struct numa_super_stats st;
+	void **small, **large;
+	double ns_small, ns_large;
+	size_t mb, pagesize, spans;
+	long hops, i, n;
+	int ch, domain;
+
+	domain = 0;
+	mb = 256;
+	hops = 1 << 22;
+	while ((ch = getopt(argc, argv, "S:d:m:n:")) != -1) {
+		switch (ch) {
+		case 'S':
+			if (numa_simulate(atoi(optarg), 1) == 0)
+				errx(1, "invalid domain count %s", optarg);
+			break;
+		case 'd':
+			domain = atoi(optarg);
+			break;
+		case 'm':
+			mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			hops = strtol(optarg, NULL, 0);
+			break;
+		default:
+			bench_super_usage();
+		}
+	}
+	if (is_numa_available() == 0)
+		errx(1, "NUMA not available, use -S");
+	if (domain < 0 || domain >= is_numa_available() || mb == 0 ||
+	    hops <= 0)
+		bench_super_usage();
+	if (!set_thread_on_domain(0, domain))
+		errx(1, "cannot pin to domain %d", domain);
+	pagesize = getpagesize();
+	n = mb * 1024 * 1024 / BENCH_SUPER_BLOCK;
+
+	small = bench_super_chain(domain, n);
+	ns_small = bench_super_chase(small[0], hops);
+
+	/* Room for the blocks and their chunk headers. */
+	if (!numa_reserve_superpages(domain, mb * 1024 * 1024 * 17 / 16 +
+	    NUMA_SUPERPAGE_SIZE, NUMA_SUPER_2M))
+		err(1, "numa_reserve_superpages");
+	large = bench_super_chain(domain, n);
+	ns_large = bench_super_chase(large[0], hops);
+	if (!numa_superpage_stats(domain, &st))
+		errx(1, "numa_superpage_stats failed");
+
+	printf("domain %d, %zu MB in %ld blocks of %d bytes, %ld hops\n",
+	    domain, mb, n, BENCH_SUPER_BLOCK, hops);
+	printf("reserved %zu MB: %zu MB on 2 MB pages, %zu MB on small pages\n",
+	    st.nss_reserved >> 20, st.nss_super >> 20,
+	    (st.nss_reserved - st.nss_super) >> 20);
+	spans = st.nss_super / NUMA_SUPERPAGE_SIZE +
+	    (st.nss_reserved - st.nss_super) / pagesize;
+	printf("small pages: %8.1f ns/hop over %ld translations\n", ns_small,
+	    (long)(n * BENCH_SUPER_BLOCK / pagesize));
+	printf("reservation: %8.1f ns/hop over %zu translations (%.2fx)\n",
+	    ns_large, spans, ns_large > 0 ? ns_small / ns_large : 0);
+
+	for (i = 0; i < n; i++) {
+		numa_free(small[i]);
+		numa_free(large[i]);
+	}
+	free(small);
+	free(large);
+	return (0);
+}
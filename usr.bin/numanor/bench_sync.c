@@ -0,0 +1,340 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor sync: numa_barrier, numa_barrier_reduce() and numa_rwlock against
+ * pthread_barrier, a mutex protected sum behind a pthread_barrier, and
+ * pthread_rwlock.  The same threads, placed on the domains round-robin, run
+ * the same rounds with both.  The reductions are checked, and so is that no
+ * reader sees a writer's update half done.  -S takes a list,
+ * "numanor sync -S 2,4,8" runs everything at 2, 4 and 8 simulated domains.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_SYNC_BARRIER      0
+#define BENCH_SYNC_REDUCE       1
+#define BENCH_SYNC_RWLOCK       2
+
+#define BENCH_SYNC_NUMA         0
+#define BENCH_SYNC_PTHREAD      1
+
+/*
+ * BENCH_SYNC_DATA: Words read by rwlock readers and written by writers.
+ */
+#define BENCH_SYNC_DATA         8
+
+/*
+ * State shared by the threads of one run.  The pthread reduction adds into
+ * psum[r % 3] in round r; the serial thread of round r clears the sum of
+ * round r + 2, which no thread reads or writes any more or yet.
+ */
+struct bench_sync {
+	pthread_barrier_t start;
+	int		test;
+	int		impl;
+	int		nthreads;
+	long		rounds;
+	int		wpct;
+	struct numa_barrier *nb;
+	struct numa_rwlock *nrw;
+	pthread_barrier_t pb;
+	pthread_mutex_t	pmtx;
+	pthread_rwlock_t prw;
+	double		psum[3];
+	long		data[BENCH_SYNC_DATA] __aligned(NUMA_CACHELINE);
+};
+
+struct bench_sync_thread {
+	pthread_t	thread;
+	struct bench_sync *bs;
+	int		id;
+	int		domain;
+	long		bad;		/* wrong sums, torn reads */
+	long		sum;		/* of the data read */
+};
+
+static const char *bench_sync_names[] = {
+	"barrier", "reduce", "rwlock"
+};
+
+
+/* ---------- BENCHMARK ----------- */
+
+static void
+bench_sync_add(void *acc, const void *val)
+{
+
+	*(double *)acc += *(const double *)val;
+}
+
+static double
+bench_sync_reduce(struct bench_sync *bs, double v, long r)
+{
+
+	if (bs->impl == BENCH_SYNC_NUMA) {
+		(void)numa_barrier_reduce(bs->nb, &v, sizeof(v),
+		    bench_sync_add);
+		return (v);
+	}
+	pthread_mutex_lock(&bs->pmtx);
+	bs->psum[r % 3] += v;
+	pthread_mutex_unlock(&bs->pmtx);
+	if (pthread_barrier_wait(&bs->pb) == PTHREAD_BARRIER_SERIAL_THREAD)
+		bs->psum[(r + 2) % 3] = 0;
+	return (bs->psum[r % 3]);
+}
+
+static void
+bench_sync_rw(struct bench_sync *bs, struct bench_sync_thread *a, int write)
+{
+	struct numa_rwlock_tracker tr;
+	int i;
+
+	if (write) {
+		if (bs->impl == BENCH_SYNC_NUMA)
+			numa_rwlock_wrlock(bs->nrw);
+		else
+			pthread_rwlock_wrlock(&bs->prw);
+		for (i = 0; i < BENCH_SYNC_DATA; i++)
+			bs->data[i]++;
+		if (bs->impl == BENCH_SYNC_NUMA)
+			numa_rwlock_wrunlock(bs->nrw);
+		else
+			pthread_rwlock_unlock(&bs->prw);
+		return;
+	}
+	if (bs->impl == BENCH_SYNC_NUMA)
+		numa_rwlock_rdlock(bs->nrw, &tr);
+	else
+		pthread_rwlock_rdlock(&bs->prw);
+	for (i = 0; i < BENCH_SYNC_DATA; i++) {
+		if (bs->data[i] != bs->data[0])
+			a->bad++;
+		a->sum += bs->data[i];
+	}
+	if (bs->impl == BENCH_SYNC_NUMA)
+		numa_rwlock_rdunlock(bs->nrw, &tr);
+	else
+		pthread_rwlock_unlock(&bs->prw);
+}
+
+static void *
+bench_sync_thread(void *arg)
+{
+	struct bench_sync_thread *a;
+	struct bench_sync *bs;
+	double n, v;
+	long r;
+
+	a = arg;
+	bs = a->bs;
+	(void)set_thread_on_domain(0, a->domain);
+	pthread_barrier_wait(&bs->start);
+	n = bs->nthreads;
+	for (r = 0; r < bs->rounds; r++) {
+		switch (bs->test) {
+		case BENCH_SYNC_BARRIER:
+			if (bs->impl == BENCH_SYNC_NUMA)
+				(void)numa_barrier_wait(bs->nb);
+			else
+				(void)pthread_barrier_wait(&bs->pb);
+			break;
+		case BENCH_SYNC_REDUCE:
+			/* The ids add up to n * (n - 1) / 2. */
+			v = bench_sync_reduce(bs, a->id + r, r);
+			if (v != n * r + n * (n - 1) / 2)
+				a->bad++;
+			break;
+		case BENCH_SYNC_RWLOCK:
+			bench_sync_rw(bs, a, (r * 7 + a->id) % 100 < bs->wpct);
+			break;
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Run test with impl and return the nanoseconds per round.
+ */
+static double
+bench_sync_run(int test, int impl, int ndomains, int threads, long rounds,
+    int wpct)
+{
+	struct bench_sync_thread *args;
+	struct bench_sync *bs;
+	struct timespec start, end;
+	int count[NUMA_MAXDOMAINS];
+	long bad;
+	int d, i, n;
+
+	n = ndomains * threads;
+	if (posix_memalign((void **)&bs, NUMA_CACHELINE, sizeof(*bs)) != 0)
+		errx(1, "posix_memalign");
+	memset(bs, 0, sizeof(*bs));
+	bs->test = test;
+	bs->impl = impl;
+	bs->nthreads = n;
+	bs->rounds = rounds;
+	bs->wpct = wpct;
+	for (d = 0; d < ndomains; d++)
+		count[d] = threads;
+	if (impl == BENCH_SYNC_NUMA && test != BENCH_SYNC_RWLOCK &&
+	    (bs->nb = numa_barrier_create(count)) == NULL)
+		err(1, "numa_barrier_create");
+	if (impl == BENCH_SYNC_NUMA && test == BENCH_SYNC_RWLOCK &&
+	    (bs->nrw = numa_rwlock_create()) == NULL)
+		err(1, "numa_rwlock_create");
+	pthread_barrier_init(&bs->pb, NULL, n);
+	pthread_mutex_init(&bs->pmtx, NULL);
+	pthread_rwlock_init(&bs->prw, NULL);
+	pthread_barrier_init(&bs->start, NULL, n + 1);
+	if ((args = calloc(n, sizeof(*args))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < n; i++) {
+		args[i].bs = bs;
+		args[i].id = i;
+		args[i].domain = i % ndomains;
+		if (pthread_create(&args[i].thread, NULL, bench_sync_thread,
+		    &args[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	pthread_barrier_wait(&bs->start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++)
+		pthread_join(args[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = bad = 0; i < n; i++)
+		bad += args[i].bad;
+	if (bad != 0)
+		errx(1, "%s: %ld wrong results", bench_sync_names[test], bad);
+	free(args);
+	pthread_barrier_destroy(&bs->start);
+	pthread_rwlock_destroy(&bs->prw);
+	pthread_mutex_destroy(&bs->pmtx);
+	pthread_barrier_destroy(&bs->pb);
+	numa_rwlock_destroy(bs->nrw);
+	numa_barrier_destroy(bs->nb);
+	free(bs);
+	return (((end.tv_sec - start.tv_sec) * 1e9 +
+	    (end.tv_nsec - start.tv_nsec)) / rounds);
+}
+
+static void
+bench_sync_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor sync [-S domains[,domains ...]] "
+	    "[-c cpus] [-n rounds] [-t threads] [-w write_pct]\n");
+	exit(1);
+}
+
+int
+bench_sync(int argc, char **argv)
+{
+	const struct numa_topology *t;
+	char *sim, *s;
+	double numa, pthr;
+	long rounds;
+	int ch, cpus, nd, test, threads, wpct;
+
+	sim = NULL;
+	cpus = 1;
+	rounds = 10000;
+	threads = 2;
+	wpct = 10;
+	while ((ch = getopt(argc, argv, "S:c:n:t:w:")) != -1) {
+		switch (ch) {
+		case 'S':
+			sim = optarg;
+			break;
+		case 'c':
+			cpus = atoi(optarg);
+			break;
+		case 'n':
+			rounds = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'w':
+			wpct = atoi(optarg);
+			break;
+		default:
+			bench_sync_usage();
+		}
+	}
+	if (rounds <= 0 || threads <= 0 || wpct < 0 || wpct > 100)
+		bench_sync_usage();
+
+	do {
+		if (sim != NULL) {
+			s = strsep(&sim, ",");
+			if (numa_simulate(atoi(s), cpus) == 0)
+				errx(1, "invalid domain count %s", s);
+		}
+		if ((t = numa_topology()) == NULL)
+			errx(1, "NUMA not available, use -S");
+		nd = t->nt_ndomains;
+		printf("%d domains%s, %d threads per domain, %ld rounds, "
+		    "%d%% writes\n", nd, numa_simulated ? " (simulated)" : "",
+		    threads, rounds, wpct);
+		printf("%-8s %12s %12s %8s\n", "test", "numa ns", "pthread ns",
+		    "speedup");
+		for (test = BENCH_SYNC_BARRIER; test <= BENCH_SYNC_RWLOCK;
+		    test++) {
+			numa = bench_sync_run(test, BENCH_SYNC_NUMA, nd,
+			    threads, rounds, wpct);
+			pthr = bench_sync_run(test, BENCH_SYNC_PTHREAD, nd,
+			    threads, rounds, wpct);
+			printf("%-8s %12.1f %12.1f %7.2fx\n",
+			    bench_sync_names[test], numa, pthr, pthr / numa);
+		}
+	} while (sim != NULL);
+	return (0);
+}
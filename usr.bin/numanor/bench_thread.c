@@ -0,0 +1,161 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor thread: moves the calling thread around the domains with
+ * numa_move_thread(MEM_MIGRATE).  Before every move the thread dirties a
+ * stack frame of the requested size and cycles blocks through its
+ * allocator cache; after it, the report is printed and the thread's domain
+ * and the placement of a fresh numa_malloc() block are checked against the
+ * target.  Works on a simulated topology.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define BENCH_THREAD_BLOCK      128
+
+
+/* ---------- BENCHMARK ----------- */
+
+static void
+bench_thread_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor thread [-S domains | -f file] "
+	    "[-s stack_kb] [-n blocks] [-r rounds]\n");
+	exit(1);
+}
+
+/*
+ * Dirty a stack frame of kb KB, churn n blocks through the allocator and
+ * move to domain from inside the frame, so the frame is part of the move.
+ */
+static int
+bench_thread_move(size_t kb, long n, int domain)
+{
+	struct numa_move_report r;
+	void **blocks, *p;
+	char frame[kb * 1024];
+	long i;
+	int ok;
+
+	memset(frame, 0xa5, sizeof(frame));
+	if ((blocks = calloc(n, sizeof(*blocks))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < n; i++)
+		blocks[i] = numa_malloc(BENCH_THREAD_BLOCK);
+	for (i = 0; i < n; i++)
+		numa_free(blocks[i]);
+	free(blocks);
+
+	if (!numa_move_thread(0, domain, MEM_MIGRATE, &r))
+		errx(1, "numa_move_thread to domain %d failed", domain);
+	printf("-> %d: %zu bytes moved (%ld resident, %ld failed) in "
+	    "%.1f us\n", domain, r.nmr_bytes, r.nmr_pages, r.nmr_failed,
+	    r.nmr_nsec / 1e3);
+
+	ok = 1;
+	if (numa_thread_domain() != domain) {
+		warnx("thread runs on domain %d, not %d",
+		    numa_thread_domain(), domain);
+		ok = 0;
+	}
+	if ((p = numa_malloc(BENCH_THREAD_BLOCK)) == NULL ||
+	    numa_ptr_domain(p) != domain) {
+		warnx("new block not placed on domain %d", domain);
+		ok = 0;
+	}
+	numa_free(p);
+	/* Keep the frame live across the move. */
+	return (ok && frame[sizeof(frame) - 1] == (char)0xa5);
+}
+
+int
+bench_thread(int argc, char **argv)
+{
+	size_t kb;
+	long blocks;
+	int ch, nd, r, rounds, failed;
+
+	kb = 64;
+	blocks = 1024;
+	rounds = 8;
+	while ((ch = getopt(argc, argv, "S:f:n:r:s:")) != -1) {
+		switch (ch) {
+		case 'S':
+			if (numa_simulate(atoi(optarg), 1) == 0)
+				errx(1, "invalid domain count %s", optarg);
+			break;
+		case 'f':
+			if (numa_topology_load(NUMA_TOPO_FILE, optarg) == 0)
+				errx(1, "cannot load topology from %s", optarg);
+			break;
+		case 'n':
+			blocks = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 's':
+			kb = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			bench_thread_usage();
+		}
+	}
+	if ((nd = is_numa_available()) < 2)
+		errx(1, "need at least two domains, use -S or -f");
+	if (kb == 0 || kb > 4096 || blocks < 0)
+		bench_thread_usage();
+	if (!set_thread_on_domain(0, 0))
+		errx(1, "cannot pin to domain 0");
+
+	failed = 0;
+	for (r = 0; r < rounds; r++)
+		if (!bench_thread_move(kb, blocks, (r + 1) % nd))
+			failed++;
+	printf("%d moves, %d failed checks\n", rounds, failed);
+	return (failed != 0);
+}
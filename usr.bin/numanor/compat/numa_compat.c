@@ -0,0 +1,204 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Linux build support: the FreeBSD system calls the library makes, none of
+ * which has a Linux counterpart it could forward to.  Each one fails as the
+ * FreeBSD call would on a kernel without NUMA support, so the library falls
+ * back to the topologies it reads from files or simulates.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <sys/sysctl.h>
+
+#include <errno.h>
+#include <pthread_np.h>
+#include <unistd.h>
+
+#include "numanor.h"
+
+
+/* ---------- FUNCTIONS ----------- */
+
+int
+issetugid(void)
+{
+
+	return (getuid() != geteuid() || getgid() != getegid());
+}
+
+int
+pthread_getthreadid_np(void)
+{
+
+	return ((int)syscall(SYS_gettid));
+}
+
+int
+sysctl(const int *name, u_int namelen, void *oldp, size_t *oldlenp,
+    const void *newp, size_t newlen)
+{
+
+	errno = ENOENT;
+	return (-1);
+}
+
+int
+sysctlbyname(const char *name, void *oldp, size_t *oldlenp,
+    const void *newp, size_t newlen)
+{
+
+	errno = ENOENT;
+	return (-1);
+}
+
+int
+sysctlnametomib(const char *name, int *mibp, size_t *sizep)
+{
+
+	errno = ENOENT;
+	return (-1);
+}
+
+int
+cpuset_getaffinity(cpulevel_t level, cpuwhich_t which, id_t id,
+    size_t setsize, cpuset_t *mask)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+cpuset_setaffinity(cpulevel_t level, cpuwhich_t which, id_t id,
+    size_t setsize, const cpuset_t *mask)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+cpuset_get_memory_affinity(cpulevel_t level, cpuwhich_t which, id_t id,
+    size_t setsize, cpuset_t *mask, int *policy)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+cpuset_set_memory_affinity(cpulevel_t level, cpuwhich_t which, id_t id,
+    size_t setsize, const cpuset_t *mask, int policy)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+cpuset_memory_affinity_vec(int op, struct numa_affinity_req *reqs,
+    u_int count)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+move_pages(int pid, unsigned long count, void **pages, const int *nodes,
+    int *status, int flags)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+migrate_pages(int pid, unsigned long maxnode, const unsigned long *old_nodes,
+    const unsigned long *new_nodes)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+migrate_pages_status(int pid, struct numa_migrate_status *status)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+get_numa_cpus(cpuset_t *buff, size_t len)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+get_numa_weights(short *buff, size_t len)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+get_numa_meminfo(struct numa_meminfo *buff, size_t len)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+mbind(void *addr, size_t len, int policy, size_t setsize,
+    const cpuset_t *mask, int flags)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+mbind_info(void *addr, size_t len, struct numa_range_info *info)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
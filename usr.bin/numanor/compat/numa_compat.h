@@ -0,0 +1,99 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Linux build support.  numa_compat.h is included ahead of every source by
+ * GNUmakefile and supplies the cdefs.h and param.h macros glibc lacks; the
+ * headers under compat/ stand in for the FreeBSD ones of the same name.  The
+ * file and sysfs topology backends and the simulators run unchanged.  There
+ * is no FreeBSD kernel underneath, so the NUMA syscalls and cpuset(2) fail
+ * with ENOSYS and sysctl(3) with ENOENT, see numa_compat.c, and the library
+ * never finds a topology of its own.
+ */
+
+#ifndef __NUMA_COMPAT_H__
+#define __NUMA_COMPAT_H__
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <stdint.h>
+
+
+/* ---------- DEFINITIONS --------- */
+
+#ifndef __dead2
+#define __dead2                 __attribute__((__noreturn__))
+#endif
+#ifndef __unused
+#define __unused                __attribute__((__unused__))
+#endif
+#ifndef __aligned
+#define __aligned(x)            __attribute__((__aligned__(x)))
+#endif
+#ifndef __predict_true
+#define __predict_true(exp)     __builtin_expect((exp), 1)
+#define __predict_false(exp)    __builtin_expect((exp), 0)
+#endif
+
+#ifndef roundup2
+#define roundup2(x, y)          (((x) + ((y) - 1)) & (~((y) - 1)))
+#endif
+#ifndef rounddown
+#define rounddown(x, y)         (((x) / (y)) * (y))
+#endif
+#ifndef rounddown2
+#define rounddown2(x, y)        ((x) & (~((y) - 1)))
+#endif
+#ifndef nitems
+#define nitems(x)               (sizeof((x)) / sizeof((x)[0]))
+#endif
+
+/*
+ * mincore(2) only reports residency on Linux, in the low bit FreeBSD calls
+ * MINCORE_INCORE.  MINCORE_SUPER keeps its FreeBSD value and is never set.
+ */
+#ifndef MINCORE_INCORE
+#define MINCORE_INCORE          0x1
+#endif
+#ifndef MINCORE_SUPER
+#define MINCORE_SUPER           0x20
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX                 1024
+#endif
+
+int issetugid(void);
+
+#endif /* __NUMA_COMPAT_H__ */
@@ -0,0 +1,130 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Linux stand-in for <sys/cpuset.h>: cpuset_t laid out as FreeBSD lays it
+ * out, the CPU_*() operations the library uses, and the cpuset(2) calls,
+ * which fail with ENOSYS.
+ */
+
+#ifndef __NUMA_COMPAT_SYS_CPUSET_H__
+#define __NUMA_COMPAT_SYS_CPUSET_H__
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <string.h>
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define CPU_MAXSIZE             256
+#define CPU_SETSIZE             CPU_MAXSIZE
+#define _NCPUBITS               (sizeof(long) * NBBY)
+#define _NCPUWORDS              ((CPU_SETSIZE + _NCPUBITS - 1) / _NCPUBITS)
+
+typedef struct _cpuset {
+	long __bits[_NCPUWORDS];
+} cpuset_t;
+
+typedef int cpulevel_t;
+typedef int cpuwhich_t;
+typedef int cpusetid_t;
+
+#define CPU_LEVEL_ROOT          1
+#define CPU_LEVEL_CPUSET        2
+#define CPU_LEVEL_WHICH         3
+
+#define CPU_WHICH_TID           1
+#define CPU_WHICH_PID           2
+#define CPU_WHICH_CPUSET        3
+#define CPU_WHICH_IRQ           4
+#define CPU_WHICH_JAIL          5
+
+#define __cpuset_mask(n)        (1UL << ((n) % _NCPUBITS))
+#define __cpuset_word(n)        ((n) / _NCPUBITS)
+
+#define CPU_ZERO(p)             memset((p), 0, sizeof(cpuset_t))
+#define CPU_FILL(p)             memset((p), 0xff, sizeof(cpuset_t))
+#define CPU_SET(n, p)                                                   \
+        ((p)->__bits[__cpuset_word(n)] |= __cpuset_mask(n))
+#define CPU_CLR(n, p)                                                   \
+        ((p)->__bits[__cpuset_word(n)] &= ~__cpuset_mask(n))
+#define CPU_ISSET(n, p)                                                 \
+        (((p)->__bits[__cpuset_word(n)] & __cpuset_mask(n)) != 0)
+#define CPU_CMP(p, c)           (memcmp((p), (c), sizeof(cpuset_t)) != 0)
+#define CPU_COPY(f, t)          (*(t) = *(f))
+#define CPU_EMPTY(p)            __cpuset_empty(p)
+#define CPU_COUNT(p)            __cpuset_count(p)
+#define CPU_FFS(p)              __cpuset_ffs(p)
+
+
+/* ---------- FUNCTIONS ----------- */
+
+static __inline int
+__cpuset_empty(const cpuset_t *p)
+{
+	size_t i;
+
+	for (i = 0; i < _NCPUWORDS; i++)
+		if (p->__bits[i] != 0)
+			return (0);
+	return (1);
+}
+
+static __inline int
+__cpuset_count(const cpuset_t *p)
+{
+	size_t i;
+	int n;
+
+	for (i = 0, n = 0; i < _NCPUWORDS; i++)
+		n += __builtin_popcountl(p->__bits[i]);
+	return (n);
+}
+
+static __inline int
+__cpuset_ffs(const cpuset_t *p)
+{
+	size_t i;
+
+	for (i = 0; i < _NCPUWORDS; i++)
+		if (p->__bits[i] != 0)
+			return (i * _NCPUBITS + __builtin_ffsl(p->__bits[i]));
+	return (0);
+}
+
+int cpuset_getaffinity(cpulevel_t, cpuwhich_t, id_t, size_t, cpuset_t *);
+int cpuset_setaffinity(cpulevel_t, cpuwhich_t, id_t, size_t,
+    const cpuset_t *);
+
+#endif /* __NUMA_COMPAT_SYS_CPUSET_H__ */
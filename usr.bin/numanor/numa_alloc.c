@@ -0,0 +1,271 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Large mmap-backed regions with an explicit placement.  An interleaved
+ * region deals its stripes round-robin over a set of domains, so streaming
+ * over it uses the bandwidth of all of them.  A replicated region keeps one
+ * copy per domain: the writer fills a private master copy and publishes it,
+ * readers get the copy of their own domain through numa_replica_local().
+ *
+ * Every replica has two slots.  A publish copies the master into the slots
+ * readers are not using and then flips nr_gen, so readers never see a half
+ * written copy and never take a lock.  A pointer handed out by
+ * numa_replica_local() stays valid until the second publish after it.
+ *
+ * Regions are placed with numa_bind_range() and numa_bind_stripes(), which
+ * attach the policy to the memory with mbind() or move the pages with
+ * move_pages(), never through the caller's own policy.  Memory shared
+ * between processes gets its policy with mbind() as well, so it does not
+ * matter which process touches a page first.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * nr_size: Bytes per copy, rounded up to the page size.
+ * nr_ncopies: Number of replicas, one per domain of the mask.
+ * nr_copy: The two slots of every replica.
+ * nr_local: Replica serving each domain, the nearest one for domains
+ *      outside the mask.
+ * nr_master: Copy the writer fills before publishing.
+ * nr_gen: Publish count, its low bit selects the live slot.
+ * nr_lock: Serializes publishers.
+ */
+struct numa_replica {
+	size_t		nr_size;
+	int		nr_ncopies;
+	void		*nr_copy[NUMA_MAXDOMAINS][2];
+	int		nr_local[NUMA_MAXDOMAINS];
+	void		*nr_master;
+	_Atomic(u_int)	nr_gen;
+	pthread_mutex_t	nr_lock;
+};
+
+
+/* ---------- ALLOCATION ---------- */
+
+/*
+ * Collect the domains of mask, all of them for NULL.  Returns the count.
+ */
+static int
+numa_alloc_domains(const cpuset_t *mask, int *domains)
+{
+	int d, n, nd;
+
+	nd = is_numa_available();
+	for (d = n = 0; d < nd && d < NUMA_MAXDOMAINS; d++)
+		if (mask == NULL || CPU_ISSET(d, mask))
+			domains[n++] = d;
+	return (n);
+}
+
+static void *
+numa_region_map(size_t size)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+	    -1, 0);
+	return (p == MAP_FAILED ? NULL : p);
+}
+
+void *
+numa_alloc_interleaved(size_t size, const cpuset_t *mask, size_t stripe)
+{
+	int domains[NUMA_MAXDOMAINS], n;
+	size_t pagesize;
+	void *p;
+
+	pagesize = getpagesize();
+	if (size == 0 || (n = numa_alloc_domains(mask, domains)) == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	size = roundup2(size, pagesize);
+	stripe = roundup2(MAX(stripe, pagesize), pagesize);
+	if ((p = numa_region_map(size)) == NULL)
+		return (NULL);
+	if (!numa_bind_stripes(p, size, stripe, domains, n)) {
+		(void)munmap(p, size);
+		errno = EPERM;
+		return (NULL);
+	}
+	return (p);
+}
+
+void
+numa_free_interleaved(void *ptr, size_t size)
+{
+
+	if (ptr != NULL)
+		(void)munmap(ptr, roundup2(size, getpagesize()));
+}
+
+struct numa_replica *
+numa_alloc_replicated(size_t size, const cpuset_t *mask)
+{
+	struct numa_replica *r;
+	int domains[NUMA_MAXDOMAINS], c, d, k, nd;
+
+	if (size == 0 || (nd = numa_alloc_domains(mask, domains)) == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		return (NULL);
+	r->nr_size = roundup2(size, getpagesize());
+	pthread_mutex_init(&r->nr_lock, NULL);
+	atomic_init(&r->nr_gen, 0);
+	if ((r->nr_master = numa_region_map(r->nr_size)) == NULL)
+		goto fail;
+	for (c = 0; c < nd; c++) {
+		for (k = 0; k < 2; k++) {
+			r->nr_copy[c][k] = numa_region_map(r->nr_size);
+			if (r->nr_copy[c][k] == NULL ||
+			    !numa_bind_range(r->nr_copy[c][k], r->nr_size,
+			    domains[c]))
+				goto fail;
+		}
+		r->nr_ncopies++;
+	}
+
+	/* Domains without a replica read the nearest one. */
+	nd = is_numa_available();
+	for (d = 0; d < nd; d++) {
+		r->nr_local[d] = 0;
+		for (k = 0; k < nd; k++) {
+			for (c = 0; c < r->nr_ncopies; c++)
+				if (domains[c] == numa_nearest_domain(d, k))
+					break;
+			if (c < r->nr_ncopies) {
+				r->nr_local[d] = c;
+				break;
+			}
+		}
+	}
+	return (r);
+
+fail:
+	numa_free_replicated(r);
+	errno = ENOMEM;
+	return (NULL);
+}
+
+void *
+numa_replica_master(struct numa_replica *r)
+{
+
+	return (r->nr_master);
+}
+
+void
+numa_replica_publish(struct numa_replica *r)
+{
+	u_int gen;
+	int c;
+
+	pthread_mutex_lock(&r->nr_lock);
+	gen = atomic_load_explicit(&r->nr_gen, memory_order_relaxed) + 1;
+	for (c = 0; c < r->nr_ncopies; c++)
+		memcpy(r->nr_copy[c][gen & 1], r->nr_master, r->nr_size);
+	atomic_store_explicit(&r->nr_gen, gen, memory_order_release);
+	pthread_mutex_unlock(&r->nr_lock);
+}
+
+const void *
+numa_replica_local(struct numa_replica *r)
+{
+	u_int gen;
+
+	gen = atomic_load_explicit(&r->nr_gen, memory_order_acquire);
+	return (r->nr_copy[r->nr_local[numa_thread_domain()]][gen & 1]);
+}
+
+void
+numa_free_replicated(struct numa_replica *r)
+{
+	int c, k;
+
+	if (r == NULL)
+		return;
+	for (c = 0; c < NUMA_MAXDOMAINS; c++)
+		for (k = 0; k < 2; k++)
+			if (r->nr_copy[c][k] != NULL)
+				(void)munmap(r->nr_copy[c][k], r->nr_size);
+	if (r->nr_master != NULL)
+		(void)munmap(r->nr_master, r->nr_size);
+	pthread_mutex_destroy(&r->nr_lock);
+	free(r);
+}
+
+int
+numa_set_range_policy(void *addr, size_t len, const cpuset_t *mask,
+    int policy, int flags)
+{
+	cpuset_t all;
+	int d, nd;
+
+	if ((nd = is_numa_available()) == 0 || numa_simulated)
+		return (0);
+	if (mask == NULL) {
+		CPU_ZERO(&all);
+		for (d = 0; d < nd; d++)
+			CPU_SET(d, &all);
+		mask = &all;
+	}
+	return (mbind(addr, len, policy, sizeof(*mask), mask, flags) == 0);
+}
+
+int
+numa_get_range_info(void *addr, size_t len, struct numa_range_info *info)
+{
+
+	if (is_numa_available() == 0 || numa_simulated)
+		return (0);
+	return (mbind_info(addr, len, info) == 0);
+}
@@ -0,0 +1,548 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * I/O buffer pools.  Every domain owns one mapping of page aligned buffers,
+ * bound to the domain and faulted in when the pool is created, and a
+ * bounded lock-free ring (Vyukov's MPMC queue) of its free buffers.  Threads
+ * take buffers from the ring of their domain and put local buffers back
+ * there, so neither path takes a lock or touches memory of another domain.
+ *
+ * A buffer put back on another domain is collected in a per-thread batch
+ * and pushed onto its owner's return list, a chain linked through the first
+ * word of the buffers, with one compare-and-swap per NUMA_BUF_BATCH
+ * buffers.  The owner's threads take the whole chain with one exchange
+ * when their ring runs dry.  Buffers of other domains, nearest first, are
+ * only handed out when the local domain has none left; that path drains
+ * their return lists too, so the buffers of a domain without CPUs or idle
+ * threads are not stranded there.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * NUMA_BUF_BATCH: Buffers of another domain collected before they are
+ *      returned to it.
+ */
+#define NUMA_BUF_BATCH          32
+
+struct numa_buf_cell {
+	atomic_size_t	nbc_seq;
+	void		*nbc_buf;
+};
+
+/*
+ * nbd_head, nbd_tail: Enqueue and dequeue positions of the ring.
+ * nbd_remote: Buffers returned from other domains, linked through their
+ *      first word.
+ * nbd_base: The mapping holding the buffers of the domain.
+ */
+struct numa_buf_domain {
+	atomic_size_t	nbd_head __aligned(NUMA_CACHELINE);
+	atomic_size_t	nbd_tail __aligned(NUMA_CACHELINE);
+	_Atomic(void *)	nbd_remote __aligned(NUMA_CACHELINE);
+	atomic_uint_fast64_t nbd_returned;
+	atomic_uint_fast64_t nbd_batches;
+	atomic_uint_fast64_t nbd_refills;
+	atomic_uint_fast64_t nbd_foreign;
+	atomic_uint_fast64_t nbd_exhausted;
+	struct numa_buf_cell *nbd_cells __aligned(NUMA_CACHELINE);
+	size_t		nbd_mask;
+	char		*nbd_base;
+};
+
+struct numa_bufpool {
+	size_t		nbp_size;
+	int		nbp_nbufs;	/* per domain */
+	int		nbp_ndomains;
+	size_t		nbp_maplen;	/* per domain */
+	struct numa_buf_domain *nbp_domains;
+};
+
+/*
+ * Buffers of another domain put back by this thread, all owned by
+ * bs_domain of bs_pool.
+ */
+struct numa_buf_stash {
+	struct numa_bufpool *bs_pool;
+	int		bs_domain;
+	int		bs_count;
+	void		*bs_bufs[NUMA_BUF_BATCH];
+};
+
+static __thread struct numa_buf_stash numa_buf_stash;
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+static int
+numa_buf_push(struct numa_buf_domain *nbd, void *buf)
+{
+	struct numa_buf_cell *c;
+	size_t pos, seq;
+
+	pos = atomic_load_explicit(&nbd->nbd_head, memory_order_relaxed);
+	for (;;) {
+		c = &nbd->nbd_cells[pos & nbd->nbd_mask];
+		seq = atomic_load_explicit(&c->nbc_seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(
+			    &nbd->nbd_head, &pos, pos + 1,
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if ((intptr_t)(seq - pos) < 0) {
+			/* Full, or a pop has not released the cell yet. */
+			if (atomic_load_explicit(&nbd->nbd_tail,
+			    memory_order_relaxed) + nbd->nbd_mask + 1 == pos)
+				return (0);
+			sched_yield();
+			pos = atomic_load_explicit(&nbd->nbd_head,
+			    memory_order_relaxed);
+		} else
+			pos = atomic_load_explicit(&nbd->nbd_head,
+			    memory_order_relaxed);
+	}
+	c->nbc_buf = buf;
+	atomic_store_explicit(&c->nbc_seq, pos + 1, memory_order_release);
+	return (1);
+}
+
+static void *
+numa_buf_pop(struct numa_buf_domain *nbd)
+{
+	struct numa_buf_cell *c;
+	size_t pos, seq;
+	void *buf;
+
+	pos = atomic_load_explicit(&nbd->nbd_tail, memory_order_relaxed);
+	for (;;) {
+		c = &nbd->nbd_cells[pos & nbd->nbd_mask];
+		seq = atomic_load_explicit(&c->nbc_seq, memory_order_acquire);
+		if (seq == pos + 1) {
+			if (atomic_compare_exchange_weak_explicit(
+			    &nbd->nbd_tail, &pos, pos + 1,
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if ((intptr_t)(seq - (pos + 1)) < 0) {
+			/*
+			 * Empty, unless a push has claimed the cell and not
+			 * filled it yet: wait for that one rather than fail.
+			 */
+			if (atomic_load_explicit(&nbd->nbd_head,
+			    memory_order_relaxed) == pos)
+				return (NULL);
+			sched_yield();
+			pos = atomic_load_explicit(&nbd->nbd_tail,
+			    memory_order_relaxed);
+		} else
+			pos = atomic_load_explicit(&nbd->nbd_tail,
+			    memory_order_relaxed);
+	}
+	buf = c->nbc_buf;
+	atomic_store_explicit(&c->nbc_seq, pos + nbd->nbd_mask + 1,
+	    memory_order_release);
+	return (buf);
+}
+
+/*
+ * Take the return list of nbd, keep its first buffer and queue the rest.
+ */
+static void *
+numa_buf_refill(struct numa_buf_domain *nbd)
+{
+	void *buf, *link, *next;
+
+	if (atomic_load_explicit(&nbd->nbd_remote, memory_order_relaxed) ==
+	    NULL)
+		return (NULL);
+	buf = atomic_exchange_explicit(&nbd->nbd_remote, NULL,
+	    memory_order_acquire);
+	if (buf == NULL)
+		return (NULL);
+	atomic_fetch_add_explicit(&nbd->nbd_refills, 1, memory_order_relaxed);
+	/* Read each link first: once queued, a buffer may be reused. */
+	for (next = *(void **)buf; next != NULL; next = link) {
+		link = *(void **)next;
+		/* The ring has room for every buffer of the domain. */
+		(void)numa_buf_push(nbd, next);
+	}
+	return (buf);
+}
+
+/*
+ * The domain owning buf, with buf rounded down to the start of its buffer.
+ */
+static int
+numa_buf_owner(const struct numa_bufpool *bp, void **buf)
+{
+	const struct numa_buf_domain *nbd;
+	size_t off;
+	int d;
+
+	for (d = 0; d < bp->nbp_ndomains; d++) {
+		nbd = &bp->nbp_domains[d];
+		if ((char *)*buf < nbd->nbd_base ||
+		    (char *)*buf >= nbd->nbd_base +
+		    (size_t)bp->nbp_nbufs * bp->nbp_size)
+			continue;
+		off = (char *)*buf - nbd->nbd_base;
+		*buf = nbd->nbd_base + off - off % bp->nbp_size;
+		return (d);
+	}
+	return (-1);
+}
+
+/*
+ * The domain whose ring the calling thread uses.
+ */
+static int
+numa_buf_local(const struct numa_bufpool *bp)
+{
+	int d;
+
+	d = numa_thread_domain();
+	return (d >= 0 && d < bp->nbp_ndomains ? d : 0);
+}
+
+
+/* ---------- NUMA BUFFER POOLS --- */
+
+struct numa_bufpool *
+numa_bufpool_create(size_t size, int nbufs)
+{
+	struct numa_buf_domain *nbd;
+	struct numa_bufpool *bp;
+	size_t i, ncells;
+	int d;
+
+	if (size == 0 || nbufs <= 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((bp = calloc(1, sizeof(*bp))) == NULL)
+		return (NULL);
+	bp->nbp_size = roundup2(size, getpagesize());
+	bp->nbp_nbufs = nbufs;
+	bp->nbp_ndomains = MAX(is_numa_available(), 1);
+	bp->nbp_maplen = (size_t)nbufs * bp->nbp_size;
+	if (posix_memalign((void **)&bp->nbp_domains, NUMA_CACHELINE,
+	    bp->nbp_ndomains * sizeof(*bp->nbp_domains)) != 0) {
+		free(bp);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	memset(bp->nbp_domains, 0, bp->nbp_ndomains *
+	    sizeof(*bp->nbp_domains));
+	for (ncells = 1; ncells < (size_t)nbufs; ncells <<= 1)
+		;
+	for (d = 0; d < bp->nbp_ndomains; d++) {
+		nbd = &bp->nbp_domains[d];
+		nbd->nbd_mask = ncells - 1;
+		nbd->nbd_base = mmap(NULL, bp->nbp_maplen,
+		    PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (nbd->nbd_base == MAP_FAILED) {
+			nbd->nbd_base = NULL;
+			goto fail;
+		}
+		if ((nbd->nbd_cells = calloc(ncells,
+		    sizeof(*nbd->nbd_cells))) == NULL)
+			goto fail;
+		/* Fault the buffers in now, on their domain. */
+		if (!numa_bind_range(nbd->nbd_base, bp->nbp_maplen, d) ||
+		    numa_simulated)
+			memset(nbd->nbd_base, 0, bp->nbp_maplen);
+		for (i = 0; i < ncells; i++)
+			atomic_init(&nbd->nbd_cells[i].nbc_seq, i);
+		for (i = 0; i < (size_t)nbufs; i++)
+			(void)numa_buf_push(nbd, nbd->nbd_base +
+			    i * bp->nbp_size);
+	}
+	return (bp);
+fail:
+	numa_bufpool_destroy(bp);
+	errno = ENOMEM;
+	return (NULL);
+}
+
+void *
+numa_buf_get(struct numa_bufpool *bp)
+{
+	struct numa_buf_domain *nbd;
+	void *buf;
+	int d, local, r;
+
+	local = numa_buf_local(bp);
+	nbd = &bp->nbp_domains[local];
+	if ((buf = numa_buf_pop(nbd)) != NULL ||
+	    (buf = numa_buf_refill(nbd)) != NULL)
+		return (buf);
+	/* Buffers this thread holds back must be reachable below. */
+	if (numa_buf_stash.bs_count > 0 && numa_buf_stash.bs_pool == bp)
+		numa_buf_flush();
+	for (r = 1; r < bp->nbp_ndomains; r++) {
+		if ((d = numa_nearest_domain(local, r)) < 0 ||
+		    d >= bp->nbp_ndomains)
+			continue;
+		/*
+		 * Only threads of the owner refill from its return list, and
+		 * a domain without CPUs has none.
+		 */
+		if ((buf = numa_buf_pop(&bp->nbp_domains[d])) != NULL ||
+		    (buf = numa_buf_refill(&bp->nbp_domains[d])) != NULL) {
+			atomic_fetch_add_explicit(&nbd->nbd_foreign, 1,
+			    memory_order_relaxed);
+			return (buf);
+		}
+	}
+	atomic_fetch_add_explicit(&nbd->nbd_exhausted, 1, memory_order_relaxed);
+	errno = ENOBUFS;
+	return (NULL);
+}
+
+void
+numa_buf_flush(void)
+{
+	struct numa_buf_stash *bs;
+	struct numa_buf_domain *nbd;
+	void *head;
+	int i;
+
+	bs = &numa_buf_stash;
+	if (bs->bs_count == 0)
+		return;
+	for (i = 0; i < bs->bs_count - 1; i++)
+		*(void **)bs->bs_bufs[i] = bs->bs_bufs[i + 1];
+	nbd = &bs->bs_pool->nbp_domains[bs->bs_domain];
+	head = atomic_load_explicit(&nbd->nbd_remote, memory_order_relaxed);
+	do {
+		*(void **)bs->bs_bufs[bs->bs_count - 1] = head;
+	} while (!atomic_compare_exchange_weak_explicit(&nbd->nbd_remote,
+	    &head, bs->bs_bufs[0], memory_order_release,
+	    memory_order_relaxed));
+	atomic_fetch_add_explicit(&nbd->nbd_returned, bs->bs_count,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&nbd->nbd_batches, 1, memory_order_relaxed);
+	bs->bs_count = 0;
+}
+
+void
+numa_buf_put(struct numa_bufpool *bp, void *buf)
+{
+	struct numa_buf_stash *bs;
+	int owner;
+
+	if (buf == NULL || (owner = numa_buf_owner(bp, &buf)) < 0)
+		return;
+	if (owner == numa_buf_local(bp)) {
+		(void)numa_buf_push(&bp->nbp_domains[owner], buf);
+		return;
+	}
+	bs = &numa_buf_stash;
+	if (bs->bs_count > 0 &&
+	    (bs->bs_pool != bp || bs->bs_domain != owner))
+		numa_buf_flush();
+	bs->bs_pool = bp;
+	bs->bs_domain = owner;
+	bs->bs_bufs[bs->bs_count++] = buf;
+	if (bs->bs_count == NUMA_BUF_BATCH)
+		numa_buf_flush();
+}
+
+int
+numa_buf_domain(struct numa_bufpool *bp, const void *buf)
+{
+	void *p;
+
+	p = (void *)(uintptr_t)buf;
+	return (numa_buf_owner(bp, &p));
+}
+
+size_t
+numa_buf_size(struct numa_bufpool *bp)
+{
+
+	return (bp->nbp_size);
+}
+
+int
+numa_buf_iov(struct numa_bufpool *bp, struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if ((iov[i].iov_base = numa_buf_get(bp)) == NULL)
+			break;
+		iov[i].iov_len = bp->nbp_size;
+	}
+	return (i);
+}
+
+void
+numa_buf_iov_put(struct numa_bufpool *bp, const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		numa_buf_put(bp, iov[i].iov_base);
+}
+
+ssize_t
+numa_buf_readv(struct numa_bufpool *bp, int fd, struct iovec *iov,
+    int *iovcnt)
+{
+	ssize_t n, left;
+	int i, got;
+
+	if ((got = numa_buf_iov(bp, iov, *iovcnt)) == 0) {
+		*iovcnt = 0;
+		return (-1);
+	}
+	if ((n = readv(fd, iov, got)) < 0) {
+		numa_buf_iov_put(bp, iov, got);
+		*iovcnt = 0;
+		return (-1);
+	}
+	/* Trim the vector to the data, give back the buffers left empty. */
+	left = n;
+	for (i = 0; i < got && left > 0; i++) {
+		iov[i].iov_len = MIN((size_t)left, iov[i].iov_len);
+		left -= iov[i].iov_len;
+	}
+	numa_buf_iov_put(bp, iov + i, got - i);
+	*iovcnt = i;
+	return (n);
+}
+
+ssize_t
+numa_buf_writev(struct numa_bufpool *bp, int fd, struct iovec *iov,
+    int iovcnt)
+{
+	ssize_t n, total;
+	void *base;
+	int i;
+
+	total = 0;
+	i = 0;
+	while (i < iovcnt) {
+		if ((n = writev(fd, iov + i, MIN(iovcnt - i, IOV_MAX))) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		total += n;
+		/* Step over what went out; buffers go back once written. */
+		for (; i < iovcnt && (size_t)n >= iov[i].iov_len; i++) {
+			n -= iov[i].iov_len;
+			numa_buf_put(bp, iov[i].iov_base);
+		}
+		if (i < iovcnt) {
+			base = (char *)iov[i].iov_base + n;
+			iov[i].iov_base = base;
+			iov[i].iov_len -= n;
+		}
+	}
+	numa_buf_iov_put(bp, iov + i, iovcnt - i);
+	return (i == iovcnt ? total : -1);
+}
+
+ssize_t
+numa_buf_sendmsg(struct numa_bufpool *bp, int s, const struct msghdr *msg,
+    int flags)
+{
+	ssize_t n;
+
+	n = sendmsg(s, msg, flags);
+	numa_buf_iov_put(bp, msg->msg_iov, msg->msg_iovlen);
+	return (n);
+}
+
+void
+numa_bufpool_stats(struct numa_bufpool *bp, struct numa_bufpool_stats *st)
+{
+	struct numa_buf_domain *nbd;
+	int d;
+
+	memset(st, 0, sizeof(*st));
+	st->nbs_buffers = (uint64_t)bp->nbp_nbufs * bp->nbp_ndomains;
+	for (d = 0; d < bp->nbp_ndomains; d++) {
+		nbd = &bp->nbp_domains[d];
+		st->nbs_returned += atomic_load_explicit(&nbd->nbd_returned,
+		    memory_order_relaxed);
+		st->nbs_batches += atomic_load_explicit(&nbd->nbd_batches,
+		    memory_order_relaxed);
+		st->nbs_refills += atomic_load_explicit(&nbd->nbd_refills,
+		    memory_order_relaxed);
+		st->nbs_foreign += atomic_load_explicit(&nbd->nbd_foreign,
+		    memory_order_relaxed);
+		st->nbs_exhausted += atomic_load_explicit(&nbd->nbd_exhausted,
+		    memory_order_relaxed);
+	}
+}
+
+void
+numa_bufpool_destroy(struct numa_bufpool *bp)
+{
+	struct numa_buf_domain *nbd;
+	int d;
+
+	if (bp == NULL)
+		return;
+	if (numa_buf_stash.bs_pool == bp)
+		numa_buf_stash.bs_count = 0;
+	for (d = 0; d < bp->nbp_ndomains; d++) {
+		nbd = &bp->nbp_domains[d];
+		if (nbd->nbd_base != NULL)
+			(void)munmap(nbd->nbd_base, bp->nbp_maplen);
+		free(nbd->nbd_cells);
+	}
+	free(bp->nbp_domains);
+	free(bp);
+}
@@ -0,0 +1,575 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Object caches for fixed size objects, after Bonwick's magazine design.
+ * Objects are carved from NUMA_SLAB_SIZE aligned slabs bound to one domain;
+ * the slab header names the domain, so the owner of an object is found by
+ * masking its address.  Every domain has a depot holding full and empty
+ * magazines of its objects.  Every CPU has a slot with a loaded and a
+ * previous magazine of its domain's objects, so alloc and free usually only
+ * touch the slot, and a magazine exchange with the depot takes one lock
+ * round trip per NUMA_MAG_SIZE objects.
+ *
+ * An object freed on another domain goes to a per-slot magazine for its
+ * owner.  Once that holds NUMA_MAG_SIZE objects it is handed to the owner's
+ * depot as a whole, so remote frees cost one depot lock per magazine and
+ * never migrate objects to the freeing domain.
+ *
+ * The slot of a thread is its CPU when numa_current_cpu() can tell it
+ * without a syscall.  Otherwise it is one of NUMA_CACHE_TSLOTS slots of the
+ * thread's domain, picked by thread id.  Either way a slot only ever holds
+ * objects of one domain.  Objects keep their constructed state while
+ * cached; the constructor runs once per object.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <pthread_np.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * NUMA_SLAB_SIZE: Size and alignment of a slab.
+ * NUMA_SLAB_MAGIC: Stored in every slab header, with the cache the slab
+ *      belongs to, to catch objects freed to the wrong cache.
+ * NUMA_CACHE_MAXSIZE: Largest object a cache takes, so a slab holds at
+ *      least 16 of them.
+ * NUMA_MAG_SIZE: Objects per magazine.
+ * NUMA_CACHE_TSLOTS: Slots per domain for threads whose CPU is unknown.
+ */
+#define NUMA_SLAB_SIZE          ((size_t)256 << 10)
+#define NUMA_SLAB_MAGIC         0x534c4142
+#define NUMA_CACHE_MAXSIZE      (NUMA_SLAB_SIZE / 16)
+#define NUMA_MAG_SIZE           32
+#define NUMA_CACHE_TSLOTS       8
+
+struct numa_slab {
+	uint32_t	ns_magic;
+	int		ns_domain;
+	struct numa_cache *ns_cache;
+	struct numa_slab *ns_next;
+} __aligned(NUMA_CACHELINE);
+
+struct numa_mag {
+	struct numa_mag	*nm_next;
+	int		nm_count;
+	void		*nm_objs[NUMA_MAG_SIZE];
+};
+
+/*
+ * nd_full, nd_empty: Magazines of the domain's objects.
+ * nd_loose: Objects freed while no magazine could be allocated, linked
+ *      through their first word and constructed again when reused.
+ * nd_bump, nd_end: Uncarved part of the current slab.
+ */
+struct numa_depot {
+	pthread_mutex_t	nd_lock;
+	struct numa_mag	*nd_full;
+	struct numa_mag	*nd_empty;
+	void		*nd_loose;
+	struct numa_slab *nd_slabs;
+	char		*nd_bump;
+	char		*nd_end;
+	uint64_t	nd_nslabs;
+	uint64_t	nd_exchanges;
+	uint64_t	nd_remote_mags;
+} __aligned(NUMA_CACHELINE);
+
+/*
+ * cs_domain: The domain whose objects cs_loaded and cs_prev hold.
+ * cs_remote: Objects freed here for every other domain.
+ */
+struct numa_cache_slot {
+	pthread_mutex_t	cs_lock;
+	int		cs_domain;
+	struct numa_mag	*cs_loaded;
+	struct numa_mag	*cs_prev;
+	struct numa_mag	**cs_remote;
+	uint64_t	cs_allocs;
+	uint64_t	cs_frees;
+	uint64_t	cs_remote_frees;
+} __aligned(NUMA_CACHELINE);
+
+struct numa_cache {
+	size_t		ncc_size;
+	numa_cache_ctor *ncc_ctor;
+	void		*ncc_arg;
+	const struct numa_topology *ncc_topo;
+	int		ncc_ndomains;
+	int		ncc_ncpus;	/* slots indexed by CPU */
+	int		ncc_nslots;
+	struct numa_depot *ncc_depots;
+	struct numa_cache_slot *ncc_slots;
+};
+
+/* Thread id of the calling thread plus one, 0 until first looked up. */
+static __thread u_int numa_cache_tid;
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+/*
+ * The slab holding obj, or NULL if obj does not point past the header of a
+ * slab of nc.
+ */
+static struct numa_slab *
+numa_obj_slab(struct numa_cache *nc, const void *obj)
+{
+	struct numa_slab *slab;
+
+	slab = (struct numa_slab *)((uintptr_t)obj & ~(NUMA_SLAB_SIZE - 1));
+	if ((const char *)obj < (const char *)(slab + 1) ||
+	    slab->ns_magic != NUMA_SLAB_MAGIC || slab->ns_cache != nc)
+		return (NULL);
+	return (slab);
+}
+
+static struct numa_mag *
+numa_mag_alloc(int domain)
+{
+	struct numa_mag *m;
+
+	if ((m = numa_malloc_onnode(sizeof(*m), domain)) != NULL)
+		m->nm_count = 0;
+	return (m);
+}
+
+/*
+ * Map a new slab of nc for the depot of domain.  The depot lock is held.
+ */
+static int
+numa_depot_grow(struct numa_cache *nc, struct numa_depot *nd, int domain)
+{
+	struct numa_slab *slab;
+	char *p, *aligned;
+	size_t lead;
+
+	p = mmap(NULL, 2 * NUMA_SLAB_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED)
+		return (0);
+	aligned = (char *)roundup2((uintptr_t)p, NUMA_SLAB_SIZE);
+	lead = aligned - p;
+	if (lead > 0)
+		munmap(p, lead);
+	munmap(aligned + NUMA_SLAB_SIZE, NUMA_SLAB_SIZE - lead);
+	(void)numa_bind_range(aligned, NUMA_SLAB_SIZE, domain);
+
+	slab = (struct numa_slab *)aligned;
+	slab->ns_magic = NUMA_SLAB_MAGIC;
+	slab->ns_domain = domain;
+	slab->ns_cache = nc;
+	slab->ns_next = nd->nd_slabs;
+	nd->nd_slabs = slab;
+	nd->nd_nslabs++;
+	nd->nd_bump = (char *)(slab + 1);
+	nd->nd_end = aligned + NUMA_SLAB_SIZE;
+	return (1);
+}
+
+/*
+ * Hand a partly filled magazine back to the depot of domain, or free it if
+ * it is empty.
+ */
+static void
+numa_depot_put(struct numa_cache *nc, int domain, struct numa_mag *m)
+{
+	struct numa_depot *nd;
+
+	if (m == NULL)
+		return;
+	nd = &nc->ncc_depots[domain];
+	pthread_mutex_lock(&nd->nd_lock);
+	if (m->nm_count > 0) {
+		m->nm_next = nd->nd_full;
+		nd->nd_full = m;
+	} else {
+		m->nm_next = nd->nd_empty;
+		nd->nd_empty = m;
+	}
+	pthread_mutex_unlock(&nd->nd_lock);
+}
+
+/*
+ * Function: numa_depot_full()
+ * Input:
+ *     struct numa_cache *nc: The cache.
+ *     int domain: The depot to take from.
+ *     struct numa_mag *empty: An empty magazine to leave in the depot, may
+ *          be NULL.
+ * Output: Returns a magazine holding at least one object, or NULL if out of
+ *      memory.  empty stays with the caller then.
+ * Summary: Takes a full magazine from the depot, or fills empty with loose
+ *      objects and new ones carved from the depot's slabs.  These are
+ *      constructed after the lock is dropped.
+ */
+static struct numa_mag *
+numa_depot_full(struct numa_cache *nc, int domain, struct numa_mag *empty)
+{
+	struct numa_depot *nd;
+	struct numa_mag *m;
+	int first, i;
+
+	nd = &nc->ncc_depots[domain];
+	pthread_mutex_lock(&nd->nd_lock);
+	nd->nd_exchanges++;
+	if ((m = nd->nd_full) != NULL) {
+		nd->nd_full = m->nm_next;
+		if (empty != NULL) {
+			empty->nm_next = nd->nd_empty;
+			nd->nd_empty = empty;
+		}
+		pthread_mutex_unlock(&nd->nd_lock);
+		return (m);
+	}
+	if ((m = empty) == NULL && (m = nd->nd_empty) != NULL)
+		nd->nd_empty = m->nm_next;
+	pthread_mutex_unlock(&nd->nd_lock);
+	if (m == NULL && (m = numa_mag_alloc(domain)) == NULL)
+		return (NULL);
+
+	first = m->nm_count;
+	pthread_mutex_lock(&nd->nd_lock);
+	while (m->nm_count < NUMA_MAG_SIZE && nd->nd_loose != NULL) {
+		m->nm_objs[m->nm_count++] = nd->nd_loose;
+		nd->nd_loose = *(void **)nd->nd_loose;
+	}
+	while (m->nm_count < NUMA_MAG_SIZE) {
+		if ((size_t)(nd->nd_end - nd->nd_bump) < nc->ncc_size &&
+		    !numa_depot_grow(nc, nd, domain))
+			break;
+		m->nm_objs[m->nm_count++] = nd->nd_bump;
+		nd->nd_bump += nc->ncc_size;
+	}
+	pthread_mutex_unlock(&nd->nd_lock);
+	if (nc->ncc_ctor != NULL)
+		for (i = first; i < m->nm_count; i++)
+			nc->ncc_ctor(m->nm_objs[i], nc->ncc_arg);
+	if (m->nm_count == 0) {
+		if (m != empty)
+			numa_depot_put(nc, domain, m);
+		return (NULL);
+	}
+	return (m);
+}
+
+/*
+ * Function: numa_depot_empty()
+ * Input:
+ *     struct numa_cache *nc: The cache.
+ *     int domain: The depot owning the objects of full.
+ *     struct numa_mag *full: A full magazine to hand over.
+ *     int remote: Non-zero if full was filled on another domain.
+ * Output: Returns an empty magazine, or NULL if out of memory.
+ * Summary: Gives full to the depot and takes an empty magazine in the same
+ *      lock round trip.
+ */
+static struct numa_mag *
+numa_depot_empty(struct numa_cache *nc, int domain, struct numa_mag *full,
+    int remote)
+{
+	struct numa_depot *nd;
+	struct numa_mag *m;
+
+	nd = &nc->ncc_depots[domain];
+	pthread_mutex_lock(&nd->nd_lock);
+	nd->nd_exchanges++;
+	if (remote)
+		nd->nd_remote_mags++;
+	full->nm_next = nd->nd_full;
+	nd->nd_full = full;
+	if ((m = nd->nd_empty) != NULL)
+		nd->nd_empty = m->nm_next;
+	pthread_mutex_unlock(&nd->nd_lock);
+	if (m == NULL)
+		m = numa_mag_alloc(domain);
+	return (m);
+}
+
+/*
+ * Return the locked slot of the calling thread and set *domain to its
+ * domain.
+ */
+static struct numa_cache_slot *
+numa_cache_slot(struct numa_cache *nc, int *domain)
+{
+	struct numa_cache_slot *cs;
+	int cpu, d;
+
+	cpu = numa_simulated ? -1 : numa_current_cpu();
+	if (cpu >= 0 && cpu < nc->ncc_ncpus &&
+	    nc->ncc_topo->nt_cpu_domain[cpu] >= 0)
+		cs = &nc->ncc_slots[cpu];
+	else {
+		if (numa_cache_tid == 0)
+			numa_cache_tid = (u_int)pthread_getthreadid_np() + 1;
+		d = numa_thread_domain() % nc->ncc_ndomains;
+		cs = &nc->ncc_slots[nc->ncc_ncpus + d * NUMA_CACHE_TSLOTS +
+		    numa_cache_tid % NUMA_CACHE_TSLOTS];
+	}
+	pthread_mutex_lock(&cs->cs_lock);
+	*domain = cs->cs_domain;
+	return (cs);
+}
+
+
+/* ---------- OBJECT CACHES ------- */
+
+struct numa_cache *
+numa_cache_create(size_t size, numa_cache_ctor *ctor, void *arg)
+{
+	struct numa_cache *nc;
+	int d, s;
+
+	if (size == 0 || size > NUMA_CACHE_MAXSIZE) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((nc = calloc(1, sizeof(*nc))) == NULL)
+		return (NULL);
+	nc->ncc_size = roundup2(size, sizeof(void *));
+	nc->ncc_ctor = ctor;
+	nc->ncc_arg = arg;
+	nc->ncc_ndomains = MAX(is_numa_available(), 1);
+	if ((nc->ncc_topo = numa_topology()) == NULL) {
+		free(nc);
+		errno = ENXIO;
+		return (NULL);
+	}
+	nc->ncc_ncpus = nc->ncc_topo->nt_ncpus;
+	nc->ncc_nslots = nc->ncc_ncpus +
+	    nc->ncc_ndomains * NUMA_CACHE_TSLOTS;
+	if (posix_memalign((void **)&nc->ncc_depots, NUMA_CACHELINE,
+	    nc->ncc_ndomains * sizeof(*nc->ncc_depots)) != 0 ||
+	    posix_memalign((void **)&nc->ncc_slots, NUMA_CACHELINE,
+	    nc->ncc_nslots * sizeof(*nc->ncc_slots)) != 0) {
+		free(nc->ncc_depots);
+		free(nc);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	memset(nc->ncc_depots, 0, nc->ncc_ndomains * sizeof(*nc->ncc_depots));
+	memset(nc->ncc_slots, 0, nc->ncc_nslots * sizeof(*nc->ncc_slots));
+	for (d = 0; d < nc->ncc_ndomains; d++)
+		pthread_mutex_init(&nc->ncc_depots[d].nd_lock, NULL);
+	for (s = 0; s < nc->ncc_nslots; s++) {
+		pthread_mutex_init(&nc->ncc_slots[s].cs_lock, NULL);
+		if (s < nc->ncc_ncpus)
+			d = MAX(nc->ncc_topo->nt_cpu_domain[s], 0);
+		else
+			d = (s - nc->ncc_ncpus) / NUMA_CACHE_TSLOTS;
+		nc->ncc_slots[s].cs_domain = d % nc->ncc_ndomains;
+	}
+	return (nc);
+}
+
+void *
+numa_cache_alloc(struct numa_cache *nc)
+{
+	struct numa_cache_slot *cs;
+	struct numa_mag *m;
+	void *obj;
+	int domain;
+
+	cs = numa_cache_slot(nc, &domain);
+	if ((m = cs->cs_loaded) == NULL || m->nm_count == 0) {
+		if (cs->cs_prev != NULL && cs->cs_prev->nm_count > 0) {
+			cs->cs_loaded = cs->cs_prev;
+			cs->cs_prev = m;
+		} else if ((m = numa_depot_full(nc, domain,
+		    cs->cs_prev)) != NULL) {
+			cs->cs_prev = cs->cs_loaded;
+			cs->cs_loaded = m;
+		} else {
+			pthread_mutex_unlock(&cs->cs_lock);
+			errno = ENOMEM;
+			return (NULL);
+		}
+		m = cs->cs_loaded;
+	}
+	obj = m->nm_objs[--m->nm_count];
+	cs->cs_allocs++;
+	pthread_mutex_unlock(&cs->cs_lock);
+	return (obj);
+}
+
+void
+numa_cache_free(struct numa_cache *nc, void *obj)
+{
+	struct numa_cache_slot *cs;
+	struct numa_depot *nd;
+	struct numa_slab *slab;
+	struct numa_mag **mp, *m;
+	int domain, owner;
+
+	if (obj == NULL)
+		return;
+	if ((slab = numa_obj_slab(nc, obj)) == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	owner = slab->ns_domain;
+	cs = numa_cache_slot(nc, &domain);
+	cs->cs_frees++;
+	if (owner != domain) {
+		/* Collect a magazine for the owner, hand it over when full. */
+		cs->cs_remote_frees++;
+		if (cs->cs_remote == NULL && (cs->cs_remote = calloc(
+		    nc->ncc_ndomains, sizeof(*cs->cs_remote))) == NULL)
+			goto direct;
+		mp = &cs->cs_remote[owner];
+		if (*mp == NULL && (*mp = numa_mag_alloc(owner)) == NULL)
+			goto direct;
+		m = *mp;
+		m->nm_objs[m->nm_count++] = obj;
+		if (m->nm_count == NUMA_MAG_SIZE)
+			*mp = numa_depot_empty(nc, owner, m, 1);
+		pthread_mutex_unlock(&cs->cs_lock);
+		return;
+	}
+
+	if ((m = cs->cs_loaded) == NULL || m->nm_count == NUMA_MAG_SIZE) {
+		if (cs->cs_prev != NULL && cs->cs_prev->nm_count == 0) {
+			cs->cs_loaded = cs->cs_prev;
+			cs->cs_prev = m;
+		} else {
+			if (cs->cs_prev != NULL &&
+			    (m = numa_depot_empty(nc, domain,
+			    cs->cs_prev, 0)) == NULL) {
+				cs->cs_prev = NULL;
+				goto direct;
+			}
+			if (cs->cs_prev == NULL &&
+			    (m = numa_mag_alloc(domain)) == NULL)
+				goto direct;
+			cs->cs_prev = cs->cs_loaded;
+			cs->cs_loaded = m;
+		}
+		m = cs->cs_loaded;
+	}
+	m->nm_objs[m->nm_count++] = obj;
+	pthread_mutex_unlock(&cs->cs_lock);
+	return;
+
+direct:
+	/* No magazine to put it in: give the object back on its own. */
+	nd = &nc->ncc_depots[owner];
+	pthread_mutex_lock(&nd->nd_lock);
+	*(void **)obj = nd->nd_loose;
+	nd->nd_loose = obj;
+	pthread_mutex_unlock(&nd->nd_lock);
+	pthread_mutex_unlock(&cs->cs_lock);
+}
+
+void
+numa_cache_stats(struct numa_cache *nc, struct numa_cache_stats *st)
+{
+	struct numa_cache_slot *cs;
+	struct numa_depot *nd;
+	int d, s;
+
+	memset(st, 0, sizeof(*st));
+	for (s = 0; s < nc->ncc_nslots; s++) {
+		cs = &nc->ncc_slots[s];
+		pthread_mutex_lock(&cs->cs_lock);
+		st->ncs_allocs += cs->cs_allocs;
+		st->ncs_frees += cs->cs_frees;
+		st->ncs_remote_frees += cs->cs_remote_frees;
+		pthread_mutex_unlock(&cs->cs_lock);
+	}
+	for (d = 0; d < nc->ncc_ndomains; d++) {
+		nd = &nc->ncc_depots[d];
+		pthread_mutex_lock(&nd->nd_lock);
+		st->ncs_exchanges += nd->nd_exchanges;
+		st->ncs_remote_mags += nd->nd_remote_mags;
+		st->ncs_slabs += nd->nd_nslabs;
+		pthread_mutex_unlock(&nd->nd_lock);
+	}
+}
+
+static void
+numa_mag_free_list(struct numa_mag *m)
+{
+	struct numa_mag *next;
+
+	for (; m != NULL; m = next) {
+		next = m->nm_next;
+		numa_free(m);
+	}
+}
+
+void
+numa_cache_destroy(struct numa_cache *nc)
+{
+	struct numa_cache_slot *cs;
+	struct numa_depot *nd;
+	struct numa_slab *slab, *next;
+	int d, s;
+
+	if (nc == NULL)
+		return;
+	for (s = 0; s < nc->ncc_nslots; s++) {
+		cs = &nc->ncc_slots[s];
+		numa_free(cs->cs_loaded);
+		numa_free(cs->cs_prev);
+		if (cs->cs_remote != NULL)
+			for (d = 0; d < nc->ncc_ndomains; d++)
+				numa_free(cs->cs_remote[d]);
+		free(cs->cs_remote);
+		pthread_mutex_destroy(&cs->cs_lock);
+	}
+	for (d = 0; d < nc->ncc_ndomains; d++) {
+		nd = &nc->ncc_depots[d];
+		numa_mag_free_list(nd->nd_full);
+		numa_mag_free_list(nd->nd_empty);
+		for (slab = nd->nd_slabs; slab != NULL; slab = next) {
+			next = slab->ns_next;
+			munmap(slab, NUMA_SLAB_SIZE);
+		}
+		pthread_mutex_destroy(&nd->nd_lock);
+	}
+	free(nc->ncc_slots);
+	free(nc->ncc_depots);
+	free(nc);
+}
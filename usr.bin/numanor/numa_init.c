@@ -0,0 +1,299 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Parallel first-touch initialization.  A buffer is cut into partitions
+ * (one block per domain, fixed size units dealt round-robin, or single
+ * pages dealt round-robin) and one worker per domain initializes the
+ * partitions of its domain.  The worker runs on its domain's CPUs, where it
+ * has any, faults the pages of its partitions in and moves them to the
+ * domain with move_pages() before initializing them, so the placement does
+ * not depend on the memory policy of the worker.  A domain without CPUs
+ * gets its pages the same way from a worker running elsewhere.
+ * numa_verify_placement() checks the result with the query mode of
+ * move_pages().
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * NUMA_INIT_BATCH: Pages moved or queried per move_pages() call.
+ */
+#define NUMA_INIT_BATCH         512
+
+/*
+ * ni_domain: The domain of the worker.
+ * ni_unit: Length of a partition, as set up by numa_part_unit().
+ * ni_ok: Cleared if the worker could not move its pages to ni_domain.
+ * ni_started: Set if ni_thread was created.
+ */
+struct numa_init_arg {
+	pthread_t	ni_thread;
+	char		*ni_buf;
+	size_t		ni_len;
+	int		ni_part;
+	size_t		ni_unit;
+	int		ni_ndomains;
+	int		ni_domain;
+	numa_init_fn	*ni_fn;
+	void		*ni_arg;
+	int		ni_ok;
+	int		ni_started;
+};
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+/*
+ * The length of one partition, a multiple of the page size.
+ */
+static size_t
+numa_part_unit(size_t len, int part, size_t unit, int ndomains)
+{
+	size_t pagesize;
+
+	pagesize = getpagesize();
+	switch (part) {
+	case NUMA_PART_BLOCK:
+		return (roundup2(howmany(len, ndomains), pagesize));
+	case NUMA_PART_CYCLIC:
+		return (roundup2(MAX(unit, pagesize), pagesize));
+	default:
+		return (pagesize);
+	}
+}
+
+/*
+ * Move the n pages of pages to domain.  Returns 0 if move_pages() failed.
+ */
+static int
+numa_init_move(void **pages, long n, int domain)
+{
+	int node[NUMA_INIT_BATCH], status[NUMA_INIT_BATCH];
+	long i;
+
+	if (numa_simulated || n == 0)
+		return (1);
+	for (i = 0; i < n; i++)
+		node[i] = domain;
+	return (move_pages(0, n, pages, node, status, NUMA_MOVE) == 0);
+}
+
+/*
+ * Fault in the partitions of a->ni_domain, keeping what they hold, and move
+ * their pages to the domain, NUMA_INIT_BATCH pages per move_pages() call
+ * however small the partitions are.  Clears ni_ok if a move failed.
+ */
+static void
+numa_init_place(struct numa_init_arg *a, size_t stride)
+{
+	void *pages[NUMA_INIT_BATCH];
+	size_t end, off, pagesize;
+	volatile char *p;
+	long n;
+
+	pagesize = getpagesize();
+	n = 0;
+	for (off = a->ni_domain * a->ni_unit; off < a->ni_len; off += stride) {
+		end = MIN(off + a->ni_unit, a->ni_len);
+		for (p = a->ni_buf + off; p < a->ni_buf + end; p += pagesize) {
+			*p = *p;
+			pages[n++] = (void *)p;
+			if (n < NUMA_INIT_BATCH)
+				continue;
+			if (!numa_init_move(pages, n, a->ni_domain))
+				a->ni_ok = 0;
+			n = 0;
+		}
+	}
+	if (!numa_init_move(pages, n, a->ni_domain))
+		a->ni_ok = 0;
+}
+
+/*
+ * Place and initialize the partitions of a->ni_domain from the calling
+ * thread.
+ */
+static void
+numa_init_share(struct numa_init_arg *a)
+{
+	size_t end, off, stride;
+
+	stride = a->ni_part == NUMA_PART_BLOCK ? a->ni_len :
+	    a->ni_unit * a->ni_ndomains;
+	numa_init_place(a, stride);
+	for (off = a->ni_domain * a->ni_unit; off < a->ni_len; off += stride) {
+		end = MIN(off + a->ni_unit, a->ni_len);
+		if (a->ni_fn == NULL)
+			memset(a->ni_buf + off, 0, end - off);
+		else
+			a->ni_fn(a->ni_buf + off, off, end - off, a->ni_arg);
+	}
+}
+
+static void *
+numa_init_worker(void *arg)
+{
+	struct numa_init_arg *a;
+
+	a = arg;
+	/* Fails for a domain without CPUs, whose pages are moved all the same. */
+	(void)set_thread_on_domain(0, a->ni_domain);
+	numa_init_share(a);
+	return (NULL);
+}
+
+/* ---------- NUMA REGIONS -------- */
+
+int
+numa_part_domain(size_t len, int part, size_t unit, size_t off)
+{
+	int nd;
+
+	nd = MAX(is_numa_available(), 1);
+	if (off >= len)
+		return (-1);
+	return ((off / numa_part_unit(len, part, unit, nd)) % nd);
+}
+
+int
+numa_first_touch(void *buf, size_t len, int part, size_t unit,
+    numa_init_fn *fn, void *arg)
+{
+	struct numa_init_arg *args;
+	int d, nd, ok;
+
+	if (part != NUMA_PART_BLOCK && part != NUMA_PART_CYCLIC &&
+	    part != NUMA_PART_PAGE) {
+		errno = EINVAL;
+		return (0);
+	}
+	if ((uintptr_t)buf % getpagesize() != 0 || len == 0) {
+		errno = EINVAL;
+		return (0);
+	}
+	nd = MAX(is_numa_available(), 1);
+	if ((args = calloc(nd, sizeof(*args))) == NULL)
+		return (0);
+	ok = 1;
+	for (d = 0; d < nd; d++) {
+		args[d].ni_buf = buf;
+		args[d].ni_len = len;
+		args[d].ni_part = part;
+		args[d].ni_unit = numa_part_unit(len, part, unit, nd);
+		args[d].ni_ndomains = nd;
+		args[d].ni_domain = d;
+		args[d].ni_fn = fn;
+		args[d].ni_arg = arg;
+		args[d].ni_ok = 1;
+		if (pthread_create(&args[d].ni_thread, NULL, numa_init_worker,
+		    &args[d]) == 0) {
+			args[d].ni_started = 1;
+			continue;
+		}
+		/* Do that share from here, without moving the caller. */
+		numa_init_share(&args[d]);
+	}
+	for (d = 0; d < nd; d++) {
+		if (args[d].ni_started)
+			pthread_join(args[d].ni_thread, NULL);
+		ok &= args[d].ni_ok;
+	}
+	free(args);
+	if (!ok)
+		errno = EPERM;
+	return (ok);
+}
+
+int
+numa_verify_placement(void *buf, size_t len, int part, size_t unit,
+    struct numa_place_report *r)
+{
+	void *pages[NUMA_INIT_BATCH];
+	int status[NUMA_INIT_BATCH];
+	size_t off, pagesize;
+	long i, n;
+	char vec;
+
+	memset(r, 0, sizeof(*r));
+	pagesize = getpagesize();
+	if ((uintptr_t)buf % pagesize != 0 || len == 0) {
+		errno = EINVAL;
+		return (0);
+	}
+	for (off = 0; off < len; off += n * pagesize) {
+		n = MIN(NUMA_INIT_BATCH, howmany(len - off, pagesize));
+		for (i = 0; i < n; i++)
+			pages[i] = (char *)buf + off + i * pagesize;
+		if (numa_simulated) {
+			/* No placement to query: only residency is known. */
+			for (i = 0; i < n; i++) {
+				if (mincore(pages[i], pagesize,
+				    (void *)&vec) == 0 &&
+				    (vec & MINCORE_INCORE) != 0)
+					r->npr_unknown++;
+				else
+					r->npr_absent++;
+			}
+			r->npr_pages += n;
+			continue;
+		}
+		if (move_pages(0, n, pages, NULL, status, NUMA_MOVE) != 0)
+			return (0);
+		for (i = 0; i < n; i++) {
+			if (status[i] < 0)
+				r->npr_absent++;
+			else if (status[i] == numa_part_domain(len, part, unit,
+			    off + i * pagesize))
+				r->npr_placed++;
+			else
+				r->npr_misplaced++;
+		}
+		r->npr_pages += n;
+	}
+	return (1);
+}
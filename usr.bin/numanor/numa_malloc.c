@@ -0,0 +1,520 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * NUMA-partitioned memory allocator.  Every domain owns an arena built from
+ * NUMA_CHUNK_SIZE aligned chunks whose pages are backed by that domain.  A
+ * chunk serves a single size class and records its domain in its header, so
+ * the owner of any block is found by masking the block address.  Threads keep
+ * per-domain caches of free blocks which are refilled from, and flushed back
+ * to, the owning arena NUMA_TCACHE_BATCH blocks at a time.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * NUMA_CHUNK_SIZE: Size and alignment of the chunks making up an arena.
+ * NUMA_CHUNK_MAGIC: Stored in every chunk header to catch foreign pointers.
+ * NUMA_LARGE: Size class of chunks holding a single large block.
+ * NUMA_TCACHE_MAX: Blocks of one class a thread caches for its own domain.
+ * NUMA_TCACHE_BATCH: Blocks moved between a thread cache and an arena per
+ *      lock round trip.  Blocks of other domains are cached up to this count
+ *      only, then handed back to their owner together.
+ */
+#define NUMA_CHUNK_SHIFT        20
+#define NUMA_CHUNK_SIZE         ((size_t)1 << NUMA_CHUNK_SHIFT)
+#define NUMA_CHUNK_MASK         (NUMA_CHUNK_SIZE - 1)
+#define NUMA_CHUNK_MAGIC        0x4e554d41
+#define NUMA_NCLASSES           20
+#define NUMA_MAX_SMALL          32768
+#define NUMA_LARGE              (-1)
+#define NUMA_TCACHE_MAX         64
+#define NUMA_TCACHE_BATCH       32
+
+static const uint32_t numa_class_size[NUMA_NCLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512,
+	768, 1024, 1536, 2048, 3072, 4096, 6144, 8192, 16384, 32768
+};
+
+/* Size class of every 16 byte step up to 1024 bytes. */
+static uint8_t numa_class_lookup[1024 / 16 + 1];
+
+struct numa_block {
+	struct numa_block	*nb_next;
+};
+
+struct numa_chunk {
+	uint32_t	nc_magic;
+	int		nc_domain;
+	int		nc_class;
+	size_t		nc_mapsize;
+} __aligned(NUMA_CACHELINE);
+
+struct numa_bin {
+	pthread_mutex_t	nb_lock;
+	struct numa_block *nb_free;
+	char		*nb_bump;	/* uncarved part of the current chunk */
+	char		*nb_end;
+} __aligned(NUMA_CACHELINE);
+
+struct numa_arena {
+	struct numa_bin	na_bins[NUMA_NCLASSES];
+};
+
+struct numa_tbin {
+	struct numa_block *tb_head;
+	unsigned	tb_count;
+};
+
+struct numa_tcache {
+	unsigned	tc_interleave;	/* next domain for interleaving */
+	struct numa_tbin tc_bins[];	/* numa_narenas * NUMA_NCLASSES */
+};
+
+static struct numa_arena *numa_arenas;
+static int numa_narenas;
+static pthread_once_t numa_malloc_once = PTHREAD_ONCE_INIT;
+static pthread_key_t numa_tcache_key;
+static __thread struct numa_tcache *numa_tcache;
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+static void numa_tcache_destroy(void *arg);
+
+static void
+numa_malloc_init(void)
+{
+	const char *path;
+	int c, i, d;
+
+	c = 0;
+	for (i = 0; i <= 1024 / 16; i++) {
+		while (numa_class_size[c] < (uint32_t)i * 16)
+			c++;
+		numa_class_lookup[i] = c;
+	}
+	numa_narenas = MAX(is_numa_available(), 1);
+	if (posix_memalign((void **)&numa_arenas, NUMA_CACHELINE,
+	    numa_narenas * sizeof(*numa_arenas)) != 0) {
+		numa_narenas = 0;
+		return;
+	}
+	for (d = 0; d < numa_narenas; d++) {
+		for (c = 0; c < NUMA_NCLASSES; c++) {
+			pthread_mutex_init(&numa_arenas[d].na_bins[c].nb_lock,
+			    NULL);
+			numa_arenas[d].na_bins[c].nb_free = NULL;
+			numa_arenas[d].na_bins[c].nb_bump = NULL;
+			numa_arenas[d].na_bins[c].nb_end = NULL;
+		}
+	}
+	pthread_key_create(&numa_tcache_key, numa_tcache_destroy);
+	if (!issetugid() && (path = getenv("NUMANOR_TRACE")) != NULL &&
+	    !numa_trace_file(path))
+		warn("cannot trace to %s", path);
+}
+
+static int
+numa_size_class(size_t size)
+{
+	int c;
+
+	if (size <= 1024)
+		return (numa_class_lookup[(size + 15) / 16]);
+	for (c = numa_class_lookup[1024 / 16]; numa_class_size[c] < size; c++)
+		;
+	return (c);
+}
+
+/*
+ * The chunk holding ptr, or NULL with errno set to EINVAL if ptr does not
+ * point past the header of one of ours.
+ */
+static struct numa_chunk *
+numa_ptr_chunk(const void *ptr)
+{
+	struct numa_chunk *chunk;
+
+	chunk = (struct numa_chunk *)((uintptr_t)ptr & ~NUMA_CHUNK_MASK);
+	if ((const char *)ptr < (const char *)(chunk + 1) ||
+	    chunk->nc_magic != NUMA_CHUNK_MAGIC ||
+	    chunk->nc_domain < 0 || chunk->nc_domain >= numa_narenas) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	return (chunk);
+}
+
+/*
+ * Function: numa_chunk_map()
+ * Input:
+ *     int domain: The domain the chunk belongs to.
+ *     size_t mapsize: Length of the chunk, a multiple of the page size.
+ * Output: Returns the new chunk, or NULL if out of memory.
+ * Summary: Maps a NUMA_CHUNK_SIZE aligned region and binds it to domain.
+ *      Binding is best effort: if the kernel refuses, the chunk is still
+ *      usable and placed by first touch.
+ */
+static struct numa_chunk *
+numa_chunk_map(int domain, size_t mapsize)
+{
+	struct numa_chunk *chunk;
+	char *p, *aligned;
+	size_t align, lead;
+
+	/* Large blocks get the alignment that lets them use superpages. */
+	align = mapsize >= NUMA_SUPERPAGE_SIZE ? NUMA_SUPERPAGE_SIZE :
+	    NUMA_CHUNK_SIZE;
+	p = mmap(NULL, mapsize + align, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED)
+		return (NULL);
+	aligned = (char *)roundup2((uintptr_t)p, align);
+	lead = aligned - p;
+	if (lead > 0)
+		munmap(p, lead);
+	munmap(aligned + mapsize, align - lead);
+	(void)numa_bind_range(aligned, mapsize, domain);
+	numa_pressure_refresh();
+
+	chunk = (struct numa_chunk *)aligned;
+	chunk->nc_magic = NUMA_CHUNK_MAGIC;
+	chunk->nc_domain = domain;
+	chunk->nc_class = NUMA_LARGE;
+	chunk->nc_mapsize = mapsize;
+	return (chunk);
+}
+
+/*
+ * Function: numa_arena_take()
+ * Input:
+ *     int domain, int cls: The arena and size class to take blocks from.
+ *     struct numa_tbin *tb: The thread cache bin to fill.
+ *     unsigned want: The number of blocks wanted.
+ * Output: Returns the number of blocks added to tb.
+ * Summary: Moves free blocks from the arena to tb under a single lock, and
+ *      carves new blocks from the arena's current chunk when it runs out.
+ */
+static unsigned
+numa_arena_take(int domain, int cls, struct numa_tbin *tb, unsigned want)
+{
+	struct numa_bin *bin;
+	struct numa_block *b;
+	struct numa_chunk *chunk;
+	size_t size;
+	unsigned n;
+
+	bin = &numa_arenas[domain].na_bins[cls];
+	size = numa_class_size[cls];
+	n = 0;
+	pthread_mutex_lock(&bin->nb_lock);
+	while (n < want && (b = bin->nb_free) != NULL) {
+		bin->nb_free = b->nb_next;
+		b->nb_next = tb->tb_head;
+		tb->tb_head = b;
+		n++;
+	}
+	while (n < want) {
+		if ((size_t)(bin->nb_end - bin->nb_bump) < size) {
+			/* The domain's superpage reservation goes first. */
+			if ((chunk = numa_super_take(domain,
+			    NUMA_CHUNK_SIZE)) != NULL) {
+				chunk->nc_magic = NUMA_CHUNK_MAGIC;
+				chunk->nc_domain = domain;
+				chunk->nc_mapsize = NUMA_CHUNK_SIZE;
+			} else if ((chunk = numa_chunk_map(domain,
+			    NUMA_CHUNK_SIZE)) == NULL)
+				break;
+			chunk->nc_class = cls;
+			bin->nb_bump = (char *)(chunk + 1);
+			bin->nb_end = (char *)chunk + NUMA_CHUNK_SIZE;
+		}
+		b = (struct numa_block *)bin->nb_bump;
+		bin->nb_bump += size;
+		b->nb_next = tb->tb_head;
+		tb->tb_head = b;
+		n++;
+	}
+	pthread_mutex_unlock(&bin->nb_lock);
+	tb->tb_count += n;
+	return (n);
+}
+
+/*
+ * Function: numa_arena_put()
+ * Input:
+ *     int domain, int cls: The arena and size class owning the blocks.
+ *     struct numa_tbin *tb: The thread cache bin to drain.
+ *     unsigned n: The number of blocks to return, at most tb->tb_count.
+ * Output: void
+ * Summary: Hands the first n blocks of tb back to their arena under a single
+ *      lock.
+ */
+static void
+numa_arena_put(int domain, int cls, struct numa_tbin *tb, unsigned n)
+{
+	struct numa_bin *bin;
+	struct numa_block *first, *last;
+	unsigned i;
+
+	if (n == 0)
+		return;
+	first = last = tb->tb_head;
+	for (i = 1; i < n; i++)
+		last = last->nb_next;
+	tb->tb_head = last->nb_next;
+	tb->tb_count -= n;
+
+	bin = &numa_arenas[domain].na_bins[cls];
+	pthread_mutex_lock(&bin->nb_lock);
+	last->nb_next = bin->nb_free;
+	bin->nb_free = first;
+	pthread_mutex_unlock(&bin->nb_lock);
+}
+
+static struct numa_tcache *
+numa_tcache_get(void)
+{
+	struct numa_tcache *tc;
+
+	if ((tc = numa_tcache) != NULL)
+		return (tc);
+	tc = calloc(1, sizeof(*tc) +
+	    numa_narenas * NUMA_NCLASSES * sizeof(struct numa_tbin));
+	if (tc == NULL)
+		return (NULL);
+	tc->tc_interleave = numa_thread_domain();
+	pthread_setspecific(numa_tcache_key, tc);
+	numa_tcache = tc;
+	return (tc);
+}
+
+static void
+numa_tcache_destroy(void *arg)
+{
+	struct numa_tcache *tc;
+	struct numa_tbin *tb;
+	int d, c;
+
+	tc = arg;
+	for (d = 0; d < numa_narenas; d++) {
+		for (c = 0; c < NUMA_NCLASSES; c++) {
+			tb = &tc->tc_bins[d * NUMA_NCLASSES + c];
+			numa_arena_put(d, c, tb, tb->tb_count);
+		}
+	}
+	numa_tcache = NULL;
+	free(tc);
+}
+
+void *
+numa_tcache_move(int from, size_t *len)
+{
+	struct numa_tcache *tc;
+	struct numa_tbin *tb;
+	int c;
+
+	if ((tc = numa_tcache) == NULL)
+		return (NULL);
+	if (from >= 0 && from < numa_narenas) {
+		for (c = 0; c < NUMA_NCLASSES; c++) {
+			tb = &tc->tc_bins[from * NUMA_NCLASSES + c];
+			numa_arena_put(from, c, tb, tb->tb_count);
+		}
+	}
+	tc->tc_interleave = numa_thread_domain();
+	*len = sizeof(*tc) +
+	    numa_narenas * NUMA_NCLASSES * sizeof(struct numa_tbin);
+	return (tc);
+}
+
+static void *
+numa_alloc_large(size_t size, int domain)
+{
+	struct numa_chunk *chunk;
+	size_t mapsize;
+
+	if (size > SIZE_MAX / 2) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	mapsize = roundup2(size + sizeof(*chunk), getpagesize());
+	if ((chunk = numa_chunk_map(domain, mapsize)) == NULL) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	return (chunk + 1);
+}
+
+static void *
+numa_alloc(size_t size, int domain, struct numa_tcache *tc)
+{
+	struct numa_tbin local, *tb;
+	struct numa_block *b;
+	int cls;
+
+	if (size > NUMA_MAX_SMALL)
+		return (numa_alloc_large(size, domain));
+	cls = numa_size_class(size);
+	if (tc != NULL)
+		tb = &tc->tc_bins[domain * NUMA_NCLASSES + cls];
+	else {
+		local.tb_head = NULL;
+		local.tb_count = 0;
+		tb = &local;
+	}
+	if (tb->tb_head == NULL &&
+	    numa_arena_take(domain, cls, tb, tc != NULL ?
+	    NUMA_TCACHE_BATCH : 1) == 0) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	b = tb->tb_head;
+	tb->tb_head = b->nb_next;
+	tb->tb_count--;
+	return (b);
+}
+
+
+/* ---------- NUMA ALLOCATOR ------ */
+
+void *
+numa_malloc(size_t size)
+{
+	struct numa_tcache *tc;
+	void *p;
+	int domain;
+
+	pthread_once(&numa_malloc_once, numa_malloc_init);
+	if (numa_narenas == 0) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	tc = numa_tcache_get();
+	if (numa_thread_policy() == NUMA_POLICY_INTERLEAVE && tc != NULL)
+		domain = tc->tc_interleave++ % numa_narenas;
+	else
+		domain = numa_thread_domain() % numa_narenas;
+	domain = numa_pressure_avoid(domain);
+	p = numa_alloc(size, domain, tc);
+	if (NUMA_TRACING() && p != NULL)
+		numa_trace(NUMA_TRACE_ALLOC, numa_thread_domain(),
+		    numa_thread_policy() == NUMA_POLICY_INTERLEAVE ? -1 :
+		    numa_thread_domain(), domain, size);
+	return (p);
+}
+
+void *
+numa_malloc_onnode(size_t size, int domain)
+{
+	void *p;
+
+	pthread_once(&numa_malloc_once, numa_malloc_init);
+	if (numa_narenas == 0) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	if (domain < 0 || domain >= numa_narenas) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	p = numa_alloc(size, domain, numa_tcache_get());
+	if (NUMA_TRACING() && p != NULL)
+		numa_trace(NUMA_TRACE_ALLOC, numa_thread_domain(), domain,
+		    domain, size);
+	return (p);
+}
+
+void
+numa_free(void *ptr)
+{
+	struct numa_chunk *chunk;
+	struct numa_tcache *tc;
+	struct numa_tbin local, *tb;
+	int domain, cls;
+
+	if (ptr == NULL || (chunk = numa_ptr_chunk(ptr)) == NULL)
+		return;
+	if (NUMA_TRACING())
+		numa_trace(NUMA_TRACE_FREE, numa_thread_domain(), -1,
+		    chunk->nc_domain, chunk->nc_class == NUMA_LARGE ?
+		    chunk->nc_mapsize : numa_class_size[chunk->nc_class]);
+	if (chunk->nc_class == NUMA_LARGE) {
+		munmap(chunk, chunk->nc_mapsize);
+		return;
+	}
+	domain = chunk->nc_domain;
+	cls = chunk->nc_class;
+	if ((tc = numa_tcache_get()) == NULL) {
+		local.tb_head = NULL;
+		local.tb_count = 0;
+		tb = &local;
+	} else
+		tb = &tc->tc_bins[domain * NUMA_NCLASSES + cls];
+	((struct numa_block *)ptr)->nb_next = tb->tb_head;
+	tb->tb_head = ptr;
+	tb->tb_count++;
+
+	if (tc == NULL)
+		numa_arena_put(domain, cls, tb, 1);
+	else if (domain != numa_thread_domain() % numa_narenas) {
+		if (tb->tb_count >= NUMA_TCACHE_BATCH)
+			numa_arena_put(domain, cls, tb, tb->tb_count);
+	} else if (tb->tb_count > NUMA_TCACHE_MAX)
+		numa_arena_put(domain, cls, tb, NUMA_TCACHE_BATCH);
+}
+
+int
+numa_ptr_domain(const void *ptr)
+{
+	struct numa_chunk *chunk;
+
+	if ((chunk = numa_ptr_chunk(ptr)) == NULL)
+		return (-1);
+	return (chunk->nc_domain);
+}
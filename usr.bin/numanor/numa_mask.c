@@ -0,0 +1,297 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * CPU and domain masks.  Policy code asks the same few questions of a
+ * cpuset_t over and over: how many CPUs, which ones, do two sets meet, which
+ * CPU of a domain is allowed, which domains does a set reach.  CPU_ISSET()
+ * answers them one bit at a time, CPU_SETSIZE tests per question whatever
+ * the set holds.  The functions here work a long at a time instead:
+ * popcount for counting, count-trailing-zeros to jump from one set bit to
+ * the next, and vector AND/OR/ANDN for combining sets, so a walk costs one
+ * step per word plus one per CPU found.
+ *
+ * The per-domain sets come precomputed from the topology snapshot
+ * (nt_cpus) and the CPU to domain table (nt_cpu_domain), so nothing here
+ * allocates or takes a lock.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/cpuset.h>
+
+#include <stddef.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * NUMA_MASK_BITS: Bits in one word of a cpuset_t.
+ * NUMA_MASK_WORDS: Words in a cpuset_t.
+ * NUMA_MASK_VEC: Bytes handled per vector operation, 0 without vectors.
+ *      The vector paths are only taken when a cpuset_t is a whole number of
+ *      vectors, which the compiler decides.
+ */
+#define NUMA_MASK_BITS          (NBBY * sizeof(long))
+#define NUMA_MASK_WORDS         _NCPUWORDS
+
+#if defined(__AVX2__)
+#define NUMA_MASK_VEC           32
+#elif defined(__SSE2__)
+#define NUMA_MASK_VEC           16
+#else
+#define NUMA_MASK_VEC           0
+#endif
+
+#define NUMA_MASK_VECTORS                                               \
+	(NUMA_MASK_VEC != 0 && sizeof(cpuset_t) % NUMA_MASK_VEC == 0)
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+/*
+ * Clear the CPUs of b from dst.
+ */
+static void
+numa_mask_clear(cpuset_t *dst, const cpuset_t *b)
+{
+	size_t i;
+
+#if defined(__AVX2__)
+	if (NUMA_MASK_VECTORS) {
+		for (i = 0; i < sizeof(cpuset_t); i += NUMA_MASK_VEC)
+			_mm256_storeu_si256((__m256i *)((char *)dst + i),
+			    _mm256_andnot_si256(
+			    _mm256_loadu_si256((const __m256i *)
+			    ((const char *)b + i)),
+			    _mm256_loadu_si256((const __m256i *)
+			    ((char *)dst + i))));
+		return;
+	}
+#elif defined(__SSE2__)
+	if (NUMA_MASK_VECTORS) {
+		for (i = 0; i < sizeof(cpuset_t); i += NUMA_MASK_VEC)
+			_mm_storeu_si128((__m128i *)((char *)dst + i),
+			    _mm_andnot_si128(
+			    _mm_loadu_si128((const __m128i *)
+			    ((const char *)b + i)),
+			    _mm_loadu_si128((const __m128i *)
+			    ((char *)dst + i))));
+		return;
+	}
+#endif
+	for (i = 0; i < NUMA_MASK_WORDS; i++)
+		dst->__bits[i] &= ~b->__bits[i];
+}
+
+/*
+ * Add the CPUs of b to dst.
+ */
+static void
+numa_mask_or(cpuset_t *dst, const cpuset_t *b)
+{
+	size_t i;
+
+	/* Simple enough for the compiler to vectorize on its own. */
+	for (i = 0; i < NUMA_MASK_WORDS; i++)
+		dst->__bits[i] |= b->__bits[i];
+}
+
+
+/* ---------- NUMA CPU MASKS ------ */
+
+int
+numa_mask_count(const cpuset_t *mask)
+{
+	size_t i;
+	int n;
+
+	for (i = n = 0; i < NUMA_MASK_WORDS; i++)
+		n += __builtin_popcountl((u_long)mask->__bits[i]);
+	return (n);
+}
+
+int
+numa_mask_first(const cpuset_t *mask)
+{
+
+	return (numa_mask_next(mask, -1));
+}
+
+int
+numa_mask_next(const cpuset_t *mask, int cpu)
+{
+	u_long w;
+	size_t i;
+
+	if (++cpu < 0)
+		cpu = 0;
+	if (cpu >= CPU_SETSIZE)
+		return (-1);
+	i = cpu / NUMA_MASK_BITS;
+	w = (u_long)mask->__bits[i] & (~0UL << (cpu % NUMA_MASK_BITS));
+	while (w == 0) {
+		if (++i >= NUMA_MASK_WORDS)
+			return (-1);
+		w = mask->__bits[i];
+	}
+	return (i * NUMA_MASK_BITS + __builtin_ctzl(w));
+}
+
+int
+numa_mask_and(cpuset_t *dst, const cpuset_t *a, const cpuset_t *b)
+{
+	size_t i;
+	u_long any;
+
+#if defined(__AVX2__)
+	if (NUMA_MASK_VECTORS) {
+		__m256i acc, v;
+
+		acc = _mm256_setzero_si256();
+		for (i = 0; i < sizeof(cpuset_t); i += NUMA_MASK_VEC) {
+			v = _mm256_and_si256(
+			    _mm256_loadu_si256((const __m256i *)
+			    ((const char *)a + i)),
+			    _mm256_loadu_si256((const __m256i *)
+			    ((const char *)b + i)));
+			if (dst != NULL)
+				_mm256_storeu_si256((__m256i *)
+				    ((char *)dst + i), v);
+			acc = _mm256_or_si256(acc, v);
+		}
+		return (!_mm256_testz_si256(acc, acc));
+	}
+#elif defined(__SSE2__)
+	if (NUMA_MASK_VECTORS) {
+		__m128i acc, v;
+
+		acc = _mm_setzero_si128();
+		for (i = 0; i < sizeof(cpuset_t); i += NUMA_MASK_VEC) {
+			v = _mm_and_si128(
+			    _mm_loadu_si128((const __m128i *)
+			    ((const char *)a + i)),
+			    _mm_loadu_si128((const __m128i *)
+			    ((const char *)b + i)));
+			if (dst != NULL)
+				_mm_storeu_si128((__m128i *)
+				    ((char *)dst + i), v);
+			acc = _mm_or_si128(acc, v);
+		}
+		return (_mm_movemask_epi8(_mm_cmpeq_epi8(acc,
+		    _mm_setzero_si128())) != 0xffff);
+	}
+#endif
+	any = 0;
+	for (i = 0; i < NUMA_MASK_WORDS; i++) {
+		if (dst != NULL) {
+			dst->__bits[i] = a->__bits[i] & b->__bits[i];
+			any |= dst->__bits[i];
+		} else
+			any |= a->__bits[i] & b->__bits[i];
+	}
+	return (any != 0);
+}
+
+int
+numa_mask_first_in_domain(const cpuset_t *mask, int domain)
+{
+	const struct numa_topology *t;
+	const cpuset_t *cpus;
+	u_long w;
+	size_t i;
+
+	if ((t = numa_topology()) == NULL || domain < 0 ||
+	    domain >= t->nt_ndomains)
+		return (-1);
+	cpus = &t->nt_cpus[domain];
+	for (i = 0; i < NUMA_MASK_WORDS; i++)
+		if ((w = (u_long)(mask->__bits[i] & cpus->__bits[i])) != 0)
+			return (i * NUMA_MASK_BITS + __builtin_ctzl(w));
+	return (-1);
+}
+
+int
+numa_mask_domains(const cpuset_t *mask, cpuset_t *domains)
+{
+	const struct numa_topology *t;
+	cpuset_t left;
+	int c, d, n;
+
+	if (domains != NULL)
+		CPU_ZERO(domains);
+	if ((t = numa_topology()) == NULL)
+		return (0);
+	left = *mask;
+	n = 0;
+	NUMA_MASK_FOREACH(c, &left) {
+		if ((d = t->nt_cpu_domain[c]) < 0)
+			continue;
+		if (domains != NULL)
+			CPU_SET(d, domains);
+		n++;
+		/* The rest of d is known, skip over it. */
+		numa_mask_clear(&left, &t->nt_cpus[d]);
+	}
+	return (n);
+}
+
+int
+numa_mask_cpus(const cpuset_t *domains, cpuset_t *cpus)
+{
+	const struct numa_topology *t;
+	int d;
+
+	CPU_ZERO(cpus);
+	if ((t = numa_topology()) == NULL)
+		return (0);
+	if (domains == NULL) {
+		for (d = 0; d < t->nt_ndomains; d++)
+			numa_mask_or(cpus, &t->nt_cpus[d]);
+	} else {
+		NUMA_MASK_FOREACH(d, domains) {
+			if (d >= t->nt_ndomains)
+				break;
+			numa_mask_or(cpus, &t->nt_cpus[d]);
+		}
+	}
+	return (numa_mask_count(cpus));
+}
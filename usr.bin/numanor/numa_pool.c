@@ -0,0 +1,640 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Domain-aware work-stealing thread pool.  The workers of a domain form a
+ * group and are pinned to the domain's CPUs.  Every worker owns a Chase-Lev
+ * deque it pushes to and pops from at the bottom, other workers steal from
+ * the top.  Tasks submitted from outside a group go through the group's
+ * bounded MPMC inject ring.  An idle worker looks at its own deque, then at
+ * its group's ring and the other deques of its group and, once its own
+ * domain stayed dry for NUMA_POOL_REMOTE_SPIN rounds, at the groups of the
+ * other domains by increasing distance.  Workers that find nothing for
+ * NUMA_POOL_SPIN rounds sleep until a task is queued.
+ *
+ * Domains without CPUs have no workers, tasks meant for them go to the
+ * nearest domain that has some.  A NUMA_POOL_FLAT pool pins its workers the
+ * same way but puts them all in one group, which makes it an ordinary
+ * work-stealing pool to compare against.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * NUMA_DEQUE_SIZE: Tasks a worker deque holds, a power of 2.
+ * NUMA_INJECT_SIZE: Tasks a group inject ring holds, a power of 2.
+ * NUMA_POOL_REMOTE_SPIN: Empty search rounds of its own domain before a
+ *      worker looks at other domains, so a busy domain's own workers get the
+ *      first chance at its tasks.
+ * NUMA_POOL_SPIN: Empty search rounds before an idle worker sleeps.
+ */
+#define NUMA_DEQUE_SIZE         1024
+#define NUMA_INJECT_SIZE        4096
+#define NUMA_POOL_REMOTE_SPIN   16
+#define NUMA_POOL_SPIN          64
+
+struct numa_task {
+	numa_task_t	*nt_fn;
+	void		*nt_arg;
+	int		nt_domain;	/* domain asked for, or -1 */
+	int		nt_from;	/* domain of the submitter, if tracing */
+};
+
+struct numa_deque {
+	_Atomic(long)	nd_top __aligned(NUMA_CACHELINE);
+	_Atomic(long)	nd_bottom __aligned(NUMA_CACHELINE);
+	_Atomic(struct numa_task *) nd_buf[NUMA_DEQUE_SIZE];
+};
+
+struct numa_ring_cell {
+	_Atomic(size_t)	nrc_seq;
+	struct numa_task *nrc_task;
+};
+
+struct numa_ring {
+	_Atomic(size_t)	nr_enq __aligned(NUMA_CACHELINE);
+	_Atomic(size_t)	nr_deq __aligned(NUMA_CACHELINE);
+	struct numa_ring_cell nr_cells[NUMA_INJECT_SIZE];
+};
+
+struct numa_worker {
+	struct numa_deque nw_deque;
+	struct numa_pool *nw_pool;
+	pthread_t	nw_thread;
+	int		nw_domain;	/* domain the worker is pinned to */
+	int		nw_group;
+	unsigned	nw_victim;	/* next deque to steal from */
+	uint64_t	nw_executed;
+	uint64_t	nw_stolen_local;
+	uint64_t	nw_stolen_remote;
+	uint64_t	nw_affine;
+	uint64_t	nw_local;
+} __aligned(NUMA_CACHELINE);
+
+struct numa_group {
+	struct numa_ring ng_inject;
+	struct numa_worker *ng_workers;
+	int		ng_nworkers;
+	int		ng_norder;
+	int		ng_order[NUMA_MAXDOMAINS];	/* groups by distance */
+} __aligned(NUMA_CACHELINE);
+
+struct numa_pool {
+	struct numa_group *np_groups;
+	int		np_ngroups;
+	struct numa_worker *np_workers;
+	int		np_nworkers;
+	int		np_route[NUMA_MAXDOMAINS];	/* group serving a domain */
+	int		np_nspread;
+	int		np_spread[NUMA_MAXDOMAINS];	/* groups with workers */
+	_Atomic(unsigned) np_next;	/* round-robin group for plain submits */
+	_Atomic(long)	np_queued;	/* tasks waiting in deques and rings */
+	_Atomic(long)	np_pending;	/* tasks submitted and not finished */
+	_Atomic(int)	np_idle;
+	_Atomic(int)	np_stop;
+	pthread_mutex_t	np_lock;
+	pthread_cond_t	np_work;
+	pthread_cond_t	np_done;
+};
+
+static __thread struct numa_worker *numa_pool_self;
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+static int
+numa_deque_push(struct numa_deque *dq, struct numa_task *t)
+{
+	long b, top;
+
+	b = atomic_load_explicit(&dq->nd_bottom, memory_order_relaxed);
+	top = atomic_load_explicit(&dq->nd_top, memory_order_acquire);
+	if (b - top >= NUMA_DEQUE_SIZE)
+		return (0);
+	atomic_store_explicit(&dq->nd_buf[b & (NUMA_DEQUE_SIZE - 1)], t,
+	    memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&dq->nd_bottom, b + 1, memory_order_relaxed);
+	return (1);
+}
+
+static struct numa_task *
+numa_deque_pop(struct numa_deque *dq)
+{
+	struct numa_task *t;
+	long b, top;
+
+	b = atomic_load_explicit(&dq->nd_bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&dq->nd_bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	top = atomic_load_explicit(&dq->nd_top, memory_order_relaxed);
+	if (top > b) {
+		atomic_store_explicit(&dq->nd_bottom, b + 1,
+		    memory_order_relaxed);
+		return (NULL);
+	}
+	t = atomic_load_explicit(&dq->nd_buf[b & (NUMA_DEQUE_SIZE - 1)],
+	    memory_order_relaxed);
+	if (top == b) {
+		/* Last task: race the thieves for it. */
+		if (!atomic_compare_exchange_strong_explicit(&dq->nd_top, &top,
+		    top + 1, memory_order_seq_cst, memory_order_relaxed))
+			t = NULL;
+		atomic_store_explicit(&dq->nd_bottom, b + 1,
+		    memory_order_relaxed);
+	}
+	return (t);
+}
+
+static struct numa_task *
+numa_deque_steal(struct numa_deque *dq)
+{
+	struct numa_task *t;
+	long b, top;
+
+	top = atomic_load_explicit(&dq->nd_top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&dq->nd_bottom, memory_order_acquire);
+	if (top >= b)
+		return (NULL);
+	t = atomic_load_explicit(&dq->nd_buf[top & (NUMA_DEQUE_SIZE - 1)],
+	    memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&dq->nd_top, &top,
+	    top + 1, memory_order_seq_cst, memory_order_relaxed))
+		return (NULL);
+	return (t);
+}
+
+static void
+numa_ring_init(struct numa_ring *r)
+{
+	size_t i;
+
+	for (i = 0; i < NUMA_INJECT_SIZE; i++)
+		atomic_init(&r->nr_cells[i].nrc_seq, i);
+	atomic_init(&r->nr_enq, 0);
+	atomic_init(&r->nr_deq, 0);
+}
+
+static int
+numa_ring_push(struct numa_ring *r, struct numa_task *t)
+{
+	struct numa_ring_cell *c;
+	size_t pos, seq;
+
+	pos = atomic_load_explicit(&r->nr_enq, memory_order_relaxed);
+	for (;;) {
+		c = &r->nr_cells[pos & (NUMA_INJECT_SIZE - 1)];
+		seq = atomic_load_explicit(&c->nrc_seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&r->nr_enq,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				break;
+		} else if ((intptr_t)(seq - pos) < 0)
+			return (0);		/* full */
+		else
+			pos = atomic_load_explicit(&r->nr_enq,
+			    memory_order_relaxed);
+	}
+	c->nrc_task = t;
+	atomic_store_explicit(&c->nrc_seq, pos + 1, memory_order_release);
+	return (1);
+}
+
+static struct numa_task *
+numa_ring_pop(struct numa_ring *r)
+{
+	struct numa_ring_cell *c;
+	struct numa_task *t;
+	size_t pos, seq;
+
+	pos = atomic_load_explicit(&r->nr_deq, memory_order_relaxed);
+	for (;;) {
+		c = &r->nr_cells[pos & (NUMA_INJECT_SIZE - 1)];
+		seq = atomic_load_explicit(&c->nrc_seq, memory_order_acquire);
+		if (seq == pos + 1) {
+			if (atomic_compare_exchange_weak_explicit(&r->nr_deq,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				break;
+		} else if ((intptr_t)(seq - (pos + 1)) < 0)
+			return (NULL);		/* empty */
+		else
+			pos = atomic_load_explicit(&r->nr_deq,
+			    memory_order_relaxed);
+	}
+	t = c->nrc_task;
+	atomic_store_explicit(&c->nrc_seq, pos + NUMA_INJECT_SIZE,
+	    memory_order_release);
+	return (t);
+}
+
+/*
+ * Take a task from group g for worker w: from the inject ring, then from the
+ * deques of the group's workers starting at w's next victim.
+ */
+static struct numa_task *
+numa_pool_take(struct numa_worker *w, struct numa_group *g)
+{
+	struct numa_task *t;
+	int i, v;
+
+	if ((t = numa_ring_pop(&g->ng_inject)) != NULL)
+		return (t);
+	for (i = 0; i < g->ng_nworkers; i++) {
+		v = (w->nw_victim + i) % g->ng_nworkers;
+		if (&g->ng_workers[v] == w)
+			continue;
+		if ((t = numa_deque_steal(&g->ng_workers[v].nw_deque)) !=
+		    NULL) {
+			w->nw_victim = v;
+			if (g->ng_workers[v].nw_domain == w->nw_domain)
+				w->nw_stolen_local++;
+			else
+				w->nw_stolen_remote++;
+			return (t);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Find work for w: its own deque, its own group, and with remote set the
+ * other groups by distance.
+ */
+static struct numa_task *
+numa_pool_find(struct numa_worker *w, int remote)
+{
+	struct numa_pool *pool;
+	struct numa_group *g;
+	struct numa_task *t;
+	int r;
+
+	pool = w->nw_pool;
+	if ((t = numa_deque_pop(&w->nw_deque)) != NULL)
+		return (t);
+	g = &pool->np_groups[w->nw_group];
+	for (r = 0; r < (remote ? g->ng_norder : 1); r++)
+		if ((t = numa_pool_take(w,
+		    &pool->np_groups[g->ng_order[r]])) != NULL)
+			return (t);
+	return (NULL);
+}
+
+static void
+numa_pool_run(struct numa_worker *w, struct numa_task *t)
+{
+	struct numa_pool *pool;
+
+	pool = w->nw_pool;
+	atomic_fetch_sub(&pool->np_queued, 1);
+	w->nw_executed++;
+	if (t->nt_domain >= 0) {
+		w->nw_affine++;
+		if (t->nt_domain == w->nw_domain)
+			w->nw_local++;
+	}
+	if (NUMA_TRACING())
+		numa_trace(NUMA_TRACE_TASK, t->nt_from, t->nt_domain,
+		    w->nw_domain, 0);
+	t->nt_fn(t->nt_arg);
+	numa_free(t);
+	if (atomic_fetch_sub(&pool->np_pending, 1) == 1) {
+		pthread_mutex_lock(&pool->np_lock);
+		pthread_cond_broadcast(&pool->np_done);
+		pthread_mutex_unlock(&pool->np_lock);
+	}
+}
+
+static void *
+numa_pool_worker(void *arg)
+{
+	struct numa_worker *w;
+	struct numa_pool *pool;
+	struct numa_task *t;
+	int spins;
+
+	w = arg;
+	pool = w->nw_pool;
+	numa_pool_self = w;
+	(void)set_thread_on_domain(0, w->nw_domain);
+	spins = 0;
+	for (;;) {
+		if ((t = numa_pool_find(w,
+		    spins >= NUMA_POOL_REMOTE_SPIN)) != NULL) {
+			numa_pool_run(w, t);
+			spins = 0;
+			continue;
+		}
+		if (++spins < NUMA_POOL_SPIN) {
+			sched_yield();
+			continue;
+		}
+		spins = 0;
+		/*
+		 * np_idle is raised before np_queued is checked, a submitter
+		 * raises np_queued before checking np_idle: one of the two
+		 * always sees the other.
+		 */
+		pthread_mutex_lock(&pool->np_lock);
+		atomic_fetch_add(&pool->np_idle, 1);
+		while (atomic_load(&pool->np_queued) == 0 &&
+		    !atomic_load(&pool->np_stop))
+			pthread_cond_wait(&pool->np_work, &pool->np_lock);
+		atomic_fetch_sub(&pool->np_idle, 1);
+		pthread_mutex_unlock(&pool->np_lock);
+		if (atomic_load(&pool->np_stop) &&
+		    atomic_load(&pool->np_queued) == 0)
+			break;
+	}
+	numa_pool_self = NULL;
+	return (NULL);
+}
+
+/*
+ * Round-robin group for a plain submit from outside the pool.  Group g
+ * serves domain g; only the groups with workers take turns, a domain
+ * without CPUs has nobody to run its tasks.  Groups of domains under high
+ * memory pressure are passed over, as their workers would allocate there.
+ */
+static int
+numa_pool_spread(struct numa_pool *pool)
+{
+	int group, i, k;
+
+	k = atomic_fetch_add(&pool->np_next, 1) % pool->np_nspread;
+	if (pool->np_nspread == 1)
+		return (pool->np_spread[k]);
+	for (i = 0; i < pool->np_nspread; i++) {
+		group = pool->np_spread[(k + i) % pool->np_nspread];
+		if (numa_pressure_avoid(group) == group)
+			return (group);
+	}
+	return (pool->np_spread[k]);
+}
+
+static int
+numa_pool_enqueue(struct numa_pool *pool, int domain, numa_task_t *fn,
+    void *arg)
+{
+	struct numa_worker *self;
+	struct numa_group *g;
+	struct numa_task *t;
+	int group;
+
+	if ((t = numa_malloc(sizeof(*t))) == NULL)
+		return (0);
+	t->nt_fn = fn;
+	t->nt_arg = arg;
+	t->nt_domain = domain;
+	t->nt_from = NUMA_TRACING() ? numa_thread_domain() : -1;
+	if (domain >= 0)
+		group = pool->np_route[domain];
+	else if ((self = numa_pool_self) != NULL && self->nw_pool == pool)
+		group = self->nw_group;
+	else
+		group = numa_pool_spread(pool);
+	g = &pool->np_groups[group];
+
+	atomic_fetch_add(&pool->np_pending, 1);
+	self = numa_pool_self;
+	if (self == NULL || self->nw_pool != pool || self->nw_group != group ||
+	    !numa_deque_push(&self->nw_deque, t)) {
+		while (!numa_ring_push(&g->ng_inject, t)) {
+			/* A worker may run it rather than wait on itself. */
+			if (self != NULL && self->nw_pool == pool &&
+			    numa_deque_push(&self->nw_deque, t))
+				break;
+			sched_yield();
+		}
+	}
+	atomic_fetch_add(&pool->np_queued, 1);
+	if (atomic_load(&pool->np_idle) > 0) {
+		pthread_mutex_lock(&pool->np_lock);
+		pthread_cond_signal(&pool->np_work);
+		pthread_mutex_unlock(&pool->np_lock);
+	}
+	return (1);
+}
+
+
+/* ---------- LIBRARY API --------- */
+
+struct numa_pool *
+numa_pool_create(int workers, int flags)
+{
+	const struct numa_topology *topo;
+	struct numa_pool *pool;
+	struct numa_group *g;
+	struct numa_worker *w;
+	int d, g0, i, n, r, nd, ngroups;
+	int count[NUMA_MAXDOMAINS];
+
+	if ((topo = numa_topology()) == NULL || workers < 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	nd = topo->nt_ndomains;
+	n = 0;
+	for (d = 0; d < nd; d++) {
+		count[d] = workers > 0 ? (CPU_EMPTY(&topo->nt_cpus[d]) ? 0 :
+		    workers) : CPU_COUNT(&topo->nt_cpus[d]);
+		n += count[d];
+	}
+	if (n == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	ngroups = (flags & NUMA_POOL_FLAT) != 0 ? 1 : nd;
+
+	if ((pool = calloc(1, sizeof(*pool))) == NULL)
+		return (NULL);
+	if (posix_memalign((void **)&pool->np_groups, NUMA_CACHELINE,
+	    ngroups * sizeof(*pool->np_groups)) != 0 ||
+	    posix_memalign((void **)&pool->np_workers, NUMA_CACHELINE,
+	    n * sizeof(*pool->np_workers)) != 0) {
+		free(pool->np_groups);
+		free(pool);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	pool->np_ngroups = ngroups;
+	pool->np_nworkers = n;
+	pthread_mutex_init(&pool->np_lock, NULL);
+	pthread_cond_init(&pool->np_work, NULL);
+	pthread_cond_init(&pool->np_done, NULL);
+
+	/* Lay the workers out by domain, a group takes a domain's run. */
+	i = 0;
+	for (d = 0; d < nd; d++) {
+		for (r = 0; r < count[d]; r++, i++) {
+			w = &pool->np_workers[i];
+			memset(w, 0, sizeof(*w));
+			w->nw_pool = pool;
+			w->nw_domain = d;
+			w->nw_group = ngroups == 1 ? 0 : d;
+			w->nw_victim = r + 1;
+		}
+	}
+	for (g0 = 0, i = 0; g0 < ngroups; g0++) {
+		g = &pool->np_groups[g0];
+		numa_ring_init(&g->ng_inject);
+		g->ng_workers = &pool->np_workers[i];
+		g->ng_nworkers = ngroups == 1 ? n : count[g0];
+		i += g->ng_nworkers;
+		g->ng_norder = 0;
+		if (ngroups == 1) {
+			g->ng_order[g->ng_norder++] = 0;
+			continue;
+		}
+		for (r = 0; r < nd; r++) {
+			d = numa_nearest_domain(g0, r);
+			if (d >= 0 && count[d] > 0)
+				g->ng_order[g->ng_norder++] = d;
+		}
+	}
+	pool->np_nspread = 0;
+	for (g0 = 0; g0 < ngroups; g0++)
+		if (pool->np_groups[g0].ng_nworkers > 0)
+			pool->np_spread[pool->np_nspread++] = g0;
+	for (d = 0; d < nd; d++) {
+		pool->np_route[d] = 0;
+		if (ngroups == 1)
+			continue;
+		for (r = 0; r < nd; r++)
+			if (count[numa_nearest_domain(d, r)] > 0) {
+				pool->np_route[d] = numa_nearest_domain(d, r);
+				break;
+			}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&pool->np_workers[i].nw_thread, NULL,
+		    numa_pool_worker, &pool->np_workers[i]) != 0) {
+			pool->np_nworkers = i;
+			numa_pool_destroy(pool);
+			errno = EAGAIN;
+			return (NULL);
+		}
+	}
+	return (pool);
+}
+
+int
+numa_pool_submit(struct numa_pool *pool, numa_task_t *fn, void *arg)
+{
+
+	return (numa_pool_enqueue(pool, -1, fn, arg));
+}
+
+int
+numa_pool_submit_domain(struct numa_pool *pool, int domain, numa_task_t *fn,
+    void *arg)
+{
+
+	if (domain < 0 || domain >= numa_topology()->nt_ndomains)
+		return (0);
+	return (numa_pool_enqueue(pool, domain, fn, arg));
+}
+
+int
+numa_pool_submit_data(struct numa_pool *pool, const void *data,
+    numa_task_t *fn, void *arg)
+{
+
+	return (numa_pool_enqueue(pool, numa_ptr_domain(data), fn, arg));
+}
+
+void
+numa_pool_wait(struct numa_pool *pool)
+{
+
+	pthread_mutex_lock(&pool->np_lock);
+	while (atomic_load(&pool->np_pending) > 0)
+		pthread_cond_wait(&pool->np_done, &pool->np_lock);
+	pthread_mutex_unlock(&pool->np_lock);
+}
+
+void
+numa_pool_stats(struct numa_pool *pool, struct numa_pool_stats *st)
+{
+	struct numa_worker *w;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < pool->np_nworkers; i++) {
+		w = &pool->np_workers[i];
+		st->nps_executed += w->nw_executed;
+		st->nps_stolen_local += w->nw_stolen_local;
+		st->nps_stolen_remote += w->nw_stolen_remote;
+		st->nps_affine += w->nw_affine;
+		st->nps_local += w->nw_local;
+	}
+}
+
+void
+numa_pool_destroy(struct numa_pool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+	numa_pool_wait(pool);
+	pthread_mutex_lock(&pool->np_lock);
+	atomic_store(&pool->np_stop, 1);
+	pthread_cond_broadcast(&pool->np_work);
+	pthread_mutex_unlock(&pool->np_lock);
+	for (i = 0; i < pool->np_nworkers; i++)
+		pthread_join(pool->np_workers[i].nw_thread, NULL);
+	pthread_cond_destroy(&pool->np_done);
+	pthread_cond_destroy(&pool->np_work);
+	pthread_mutex_destroy(&pool->np_lock);
+	free(pool->np_workers);
+	free(pool->np_groups);
+	free(pool);
+}
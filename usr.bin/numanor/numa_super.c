@@ -0,0 +1,196 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Superpage reservations.  numa_reserve_superpages() maps a region of a
+ * domain backed by 2 MB superpages, and the arena allocator carves the
+ * domain's chunks from it before it maps new memory.  The region is mapped
+ * superpage aligned, bound to the domain with mbind() and faulted in, so
+ * every reservation the kernel starts is on the domain, fills up and gets
+ * promoted.  Whatever the kernel could not back with superpages stays
+ * usable as small pages; mincore() tells how much was.  FreeBSD 10 promotes
+ * anonymous memory to 2 MB superpages only, so NUMA_SUPER_1G is refused.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+struct numa_super {
+	char		*ns_base;
+	size_t		ns_len;
+	size_t		ns_used;
+};
+
+static pthread_mutex_t numa_super_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct numa_super numa_supers[NUMA_MAXDOMAINS];
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+/*
+ * Map len bytes on domain, superpage aligned, and fault them in.
+ */
+static void *
+numa_super_map(int domain, size_t len)
+{
+	char *p, *aligned;
+	size_t lead;
+
+#ifdef MAP_ALIGNED_SUPER
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE | MAP_ALIGNED_SUPER, -1, 0);
+	if (p != MAP_FAILED)
+		aligned = p;
+	else
+#endif
+	{
+		p = mmap(NULL, len + NUMA_SUPERPAGE_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (p == MAP_FAILED)
+			return (NULL);
+		aligned = (char *)roundup2((uintptr_t)p, NUMA_SUPERPAGE_SIZE);
+		lead = aligned - p;
+		if (lead > 0)
+			munmap(p, lead);
+		munmap(aligned + len, NUMA_SUPERPAGE_SIZE - lead);
+	}
+	if (!numa_bind_range(aligned, len, domain)) {
+		munmap(aligned, len);
+		return (NULL);
+	}
+	return (aligned);
+}
+
+void *
+numa_super_take(int domain, size_t len)
+{
+	struct numa_super *ns;
+	void *p;
+
+	ns = &numa_supers[domain];
+	p = NULL;
+	pthread_mutex_lock(&numa_super_lock);
+	if (ns->ns_base != NULL && ns->ns_len - ns->ns_used >= len) {
+		p = ns->ns_base + ns->ns_used;
+		ns->ns_used += len;
+	}
+	pthread_mutex_unlock(&numa_super_lock);
+	return (p);
+}
+
+
+/* ---------- LIBRARY API --------- */
+
+int
+numa_reserve_superpages(int domain, size_t size, int flags)
+{
+	struct numa_super *ns;
+	size_t len;
+	void *p;
+
+	if (domain < 0 || domain >= is_numa_available() || size == 0 ||
+	    size > SIZE_MAX - NUMA_SUPERPAGE_SIZE ||
+	    (flags & ~(NUMA_SUPER_2M | NUMA_SUPER_1G)) != 0) {
+		errno = EINVAL;
+		return (0);
+	}
+	if ((flags & NUMA_SUPER_1G) != 0) {
+		errno = EOPNOTSUPP;
+		return (0);
+	}
+	ns = &numa_supers[domain];
+	pthread_mutex_lock(&numa_super_lock);
+	if (ns->ns_base != NULL) {
+		pthread_mutex_unlock(&numa_super_lock);
+		errno = EBUSY;
+		return (0);
+	}
+	len = roundup2(size, NUMA_SUPERPAGE_SIZE);
+	if ((p = numa_super_map(domain, len)) != NULL) {
+		ns->ns_base = p;
+		ns->ns_len = len;
+		ns->ns_used = 0;
+	}
+	pthread_mutex_unlock(&numa_super_lock);
+	if (p == NULL) {
+		errno = ENOMEM;
+		return (0);
+	}
+	return (1);
+}
+
+int
+numa_superpage_stats(int domain, struct numa_super_stats *st)
+{
+	struct numa_super ns;
+	size_t off, pagesize;
+	char *vec;
+
+	memset(st, 0, sizeof(*st));
+	if (domain < 0 || domain >= is_numa_available())
+		return (0);
+	pthread_mutex_lock(&numa_super_lock);
+	ns = numa_supers[domain];
+	pthread_mutex_unlock(&numa_super_lock);
+	if (ns.ns_base == NULL)
+		return (0);
+	st->nss_reserved = ns.ns_len;
+	st->nss_used = ns.ns_used;
+
+	/* Pages may have been demoted since, so look again. */
+	pagesize = getpagesize();
+	if ((vec = malloc(ns.ns_len / pagesize)) == NULL)
+		return (0);
+	if (mincore(ns.ns_base, ns.ns_len, (void *)vec) != 0) {
+		free(vec);
+		return (0);
+	}
+	for (off = 0; off < ns.ns_len; off += pagesize)
+		if ((vec[off / pagesize] & MINCORE_SUPER) != 0)
+			st->nss_super += pagesize;
+	free(vec);
+	return (1);
+}
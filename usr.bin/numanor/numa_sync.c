@@ -0,0 +1,414 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Synchronization laid out along the domains.  A flat barrier or rwlock has
+ * every thread write one counter, so the line holding it travels between
+ * sockets on every arrival.  Here each domain has its own counters, on a
+ * page bound to the domain, and only one thread per domain reaches the
+ * global state.
+ *
+ * The barrier is a two level sense-reversing barrier.  The last thread to
+ * arrive on a domain carries the domain up, the last domain releases the
+ * others, and each domain's last thread releases its own threads, which
+ * spin on their domain's line.  A reduction rides on the same episode:
+ * every thread leaves its value in a slot line of its domain, the domain's
+ * last thread folds them into a per-domain partial and the last domain
+ * folds the partials.
+ *
+ * The rwlock keeps one reader count per domain next to a writer flag
+ * shared by all.  A reader announces itself on its domain's count, then
+ * checks the flag (the two are ordered, as are the writer's store of the
+ * flag and its reads of the counts), so a reader and a writer cannot both
+ * miss each other.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * NUMA_SYNC_SPINS: Polls of a flag before a waiter starts yielding the CPU
+ *      between polls.
+ */
+#define NUMA_SYNC_SPINS         1000
+
+/*
+ * nsd_arrived: Threads of the domain that arrived in this episode.
+ * nsd_ticket: Slots handed out in this episode of a reduction.
+ * nsd_count: Threads of the domain taking part.
+ * nsd_sense: Bumped by the domain's last thread to release the others.
+ * nsd_result: The result of a reduction, copied here for the domain.
+ * nsd_slots: One line per thread for the values of a reduction.
+ * Summary: Per-domain barrier state, on a page of the domain.
+ */
+struct numa_sync_domain {
+	atomic_uint	nsd_arrived;
+	atomic_uint	nsd_ticket;
+	u_int		nsd_count;
+	atomic_uint	nsd_sense __aligned(NUMA_CACHELINE);
+	char		nsd_result[NUMA_REDUCE_MAX] __aligned(NUMA_CACHELINE);
+	char		nsd_slots[][NUMA_REDUCE_MAX];
+};
+
+struct numa_barrier {
+	atomic_uint	nb_arrived;
+	u_int		nb_nactive;
+	atomic_uint	nb_sense __aligned(NUMA_CACHELINE);
+	char		nb_result[NUMA_REDUCE_MAX] __aligned(NUMA_CACHELINE);
+	char		(*nb_partial)[NUMA_REDUCE_MAX];
+	struct numa_sync_domain *nb_domains[NUMA_MAXDOMAINS];
+	int		nb_active[NUMA_MAXDOMAINS];
+	int		nb_ndomains;
+	void		*nb_map;
+	size_t		nb_maplen;
+};
+
+struct numa_rw_domain {
+	atomic_long	nrd_readers;
+};
+
+struct numa_rwlock {
+	atomic_int	nrw_writer;
+	int		nrw_ndomains;
+	struct numa_rw_domain *nrw_domains[NUMA_MAXDOMAINS];
+	pthread_mutex_t	nrw_wlock __aligned(NUMA_CACHELINE);
+	void		*nrw_map;
+	size_t		nrw_maplen;
+};
+
+/* Checks and RMW operations are sequentially consistent unless marked. */
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+/*
+ * Map ndomains strides of stride bytes, rounded up to pages, each bound to
+ * its domain.  The length mapped goes to *len.
+ */
+static char *
+numa_sync_map(int ndomains, size_t *stride, size_t *len)
+{
+	char *p;
+	int d;
+
+	*stride = roundup2(*stride, getpagesize());
+	*len = *stride * ndomains;
+	p = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+	    -1, 0);
+	if (p == MAP_FAILED)
+		return (NULL);
+	for (d = 0; d < ndomains; d++)
+		if (!numa_bind_range(p + d * *stride, *stride, d) ||
+		    numa_simulated)
+			memset(p + d * *stride, 0, *stride);
+	return (p);
+}
+
+/*
+ * One poll of a waiter, *spins counting them.
+ */
+static void
+numa_sync_pause(u_int *spins)
+{
+
+	if (++*spins > NUMA_SYNC_SPINS)
+		sched_yield();
+}
+
+static int
+numa_sync_domain(int ndomains)
+{
+	int d;
+
+	d = numa_thread_domain();
+	return (d >= 0 && d < ndomains ? d : 0);
+}
+
+/*
+ * One barrier episode, a reduction of val when fn is not NULL.
+ */
+static int
+numa_barrier_enter(struct numa_barrier *b, void *val, size_t size,
+    numa_reduce_fn *fn)
+{
+	struct numa_sync_domain *nsd;
+	u_int i, sense, gsense, spins;
+	int d, serial;
+
+	d = numa_sync_domain(b->nb_ndomains);
+	nsd = b->nb_domains[d];
+	sense = atomic_load_explicit(&nsd->nsd_sense, memory_order_relaxed);
+	if (fn != NULL) {
+		i = atomic_fetch_add_explicit(&nsd->nsd_ticket, 1,
+		    memory_order_relaxed);
+		memcpy(nsd->nsd_slots[i], val, size);
+	}
+	if (atomic_fetch_add_explicit(&nsd->nsd_arrived, 1,
+	    memory_order_acq_rel) + 1 != nsd->nsd_count) {
+		/* Not the last here, wait for the domain's last. */
+		spins = 0;
+		while (atomic_load_explicit(&nsd->nsd_sense,
+		    memory_order_acquire) == sense)
+			numa_sync_pause(&spins);
+		if (fn != NULL)
+			memcpy(val, nsd->nsd_result, size);
+		return (0);
+	}
+
+	/* Last of the domain: fold its values and go up a level. */
+	atomic_store_explicit(&nsd->nsd_arrived, 0, memory_order_relaxed);
+	if (fn != NULL) {
+		atomic_store_explicit(&nsd->nsd_ticket, 0,
+		    memory_order_relaxed);
+		memcpy(b->nb_partial[d], nsd->nsd_slots[0], size);
+		for (i = 1; i < nsd->nsd_count; i++)
+			fn(b->nb_partial[d], nsd->nsd_slots[i]);
+	}
+	gsense = atomic_load_explicit(&b->nb_sense, memory_order_relaxed);
+	serial = atomic_fetch_add_explicit(&b->nb_arrived, 1,
+	    memory_order_acq_rel) + 1 == b->nb_nactive;
+	if (serial) {
+		atomic_store_explicit(&b->nb_arrived, 0, memory_order_relaxed);
+		if (fn != NULL) {
+			memcpy(b->nb_result, b->nb_partial[b->nb_active[0]],
+			    size);
+			for (i = 1; i < b->nb_nactive; i++)
+				fn(b->nb_result,
+				    b->nb_partial[b->nb_active[i]]);
+		}
+		atomic_store_explicit(&b->nb_sense, gsense + 1,
+		    memory_order_release);
+	} else {
+		spins = 0;
+		while (atomic_load_explicit(&b->nb_sense,
+		    memory_order_acquire) == gsense)
+			numa_sync_pause(&spins);
+	}
+	if (fn != NULL) {
+		memcpy(nsd->nsd_result, b->nb_result, size);
+		memcpy(val, b->nb_result, size);
+	}
+	atomic_store_explicit(&nsd->nsd_sense, sense + 1,
+	    memory_order_release);
+	return (serial);
+}
+
+
+/* ---------- NUMA SYNC ----------- */
+
+struct numa_barrier *
+numa_barrier_create(const int *count)
+{
+	const struct numa_topology *t;
+	struct numa_barrier *b;
+	size_t stride;
+	int d, n, nd;
+
+	if ((t = numa_topology()) == NULL) {
+		errno = ENXIO;
+		return (NULL);
+	}
+	nd = MIN(t->nt_ndomains, NUMA_MAXDOMAINS);
+	for (d = n = 0; d < nd; d++) {
+		if (count != NULL && count[d] < 0) {
+			errno = EINVAL;
+			return (NULL);
+		}
+		n = MAX(n, count != NULL ? count[d] :
+		    numa_mask_count(&t->nt_cpus[d]));
+	}
+	if (n == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if (posix_memalign((void **)&b, NUMA_CACHELINE, sizeof(*b)) != 0) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	memset(b, 0, sizeof(*b));
+	b->nb_ndomains = nd;
+	if (posix_memalign((void **)&b->nb_partial, NUMA_CACHELINE,
+	    nd * sizeof(*b->nb_partial)) != 0)
+		goto fail;
+	stride = sizeof(struct numa_sync_domain) + n * NUMA_REDUCE_MAX;
+	if ((b->nb_map = numa_sync_map(nd, &stride, &b->nb_maplen)) == NULL)
+		goto fail;
+	for (d = 0; d < nd; d++) {
+		b->nb_domains[d] = (struct numa_sync_domain *)
+		    ((char *)b->nb_map + d * stride);
+		b->nb_domains[d]->nsd_count = count != NULL ? count[d] :
+		    numa_mask_count(&t->nt_cpus[d]);
+		if (b->nb_domains[d]->nsd_count > 0)
+			b->nb_active[b->nb_nactive++] = d;
+	}
+	return (b);
+fail:
+	numa_barrier_destroy(b);
+	errno = ENOMEM;
+	return (NULL);
+}
+
+int
+numa_barrier_wait(struct numa_barrier *b)
+{
+
+	return (numa_barrier_enter(b, NULL, 0, NULL));
+}
+
+int
+numa_barrier_reduce(struct numa_barrier *b, void *val, size_t size,
+    numa_reduce_fn *fn)
+{
+
+	if (size > NUMA_REDUCE_MAX) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (numa_barrier_enter(b, val, size, fn));
+}
+
+void
+numa_barrier_destroy(struct numa_barrier *b)
+{
+
+	if (b == NULL)
+		return;
+	if (b->nb_map != NULL)
+		(void)munmap(b->nb_map, b->nb_maplen);
+	free(b->nb_partial);
+	free(b);
+}
+
+struct numa_rwlock *
+numa_rwlock_create(void)
+{
+	struct numa_rwlock *l;
+	size_t stride;
+	int d;
+
+	if (posix_memalign((void **)&l, NUMA_CACHELINE, sizeof(*l)) != 0) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	memset(l, 0, sizeof(*l));
+	l->nrw_ndomains = MIN(MAX(is_numa_available(), 1), NUMA_MAXDOMAINS);
+	stride = sizeof(struct numa_rw_domain);
+	if ((l->nrw_map = numa_sync_map(l->nrw_ndomains, &stride,
+	    &l->nrw_maplen)) == NULL) {
+		free(l);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	for (d = 0; d < l->nrw_ndomains; d++)
+		l->nrw_domains[d] = (struct numa_rw_domain *)
+		    ((char *)l->nrw_map + d * stride);
+	pthread_mutex_init(&l->nrw_wlock, NULL);
+	return (l);
+}
+
+void
+numa_rwlock_rdlock(struct numa_rwlock *l, struct numa_rwlock_tracker *tr)
+{
+	atomic_long *readers;
+	u_int spins;
+	int d;
+
+	d = numa_sync_domain(l->nrw_ndomains);
+	readers = &l->nrw_domains[d]->nrd_readers;
+	for (spins = 0;;) {
+		atomic_fetch_add(readers, 1);
+		if (atomic_load(&l->nrw_writer) == 0)
+			break;
+		/* A writer is in or on its way, step back until it is done. */
+		atomic_fetch_sub_explicit(readers, 1, memory_order_release);
+		while (atomic_load_explicit(&l->nrw_writer,
+		    memory_order_relaxed) != 0)
+			numa_sync_pause(&spins);
+	}
+	tr->nrt_domain = d;
+}
+
+void
+numa_rwlock_rdunlock(struct numa_rwlock *l, struct numa_rwlock_tracker *tr)
+{
+
+	atomic_fetch_sub_explicit(&l->nrw_domains[tr->nrt_domain]->nrd_readers,
+	    1, memory_order_release);
+}
+
+void
+numa_rwlock_wrlock(struct numa_rwlock *l)
+{
+	u_int spins;
+	int d;
+
+	pthread_mutex_lock(&l->nrw_wlock);
+	atomic_store(&l->nrw_writer, 1);
+	spins = 0;
+	for (d = 0; d < l->nrw_ndomains; d++)
+		while (atomic_load(&l->nrw_domains[d]->nrd_readers) != 0)
+			numa_sync_pause(&spins);
+}
+
+void
+numa_rwlock_wrunlock(struct numa_rwlock *l)
+{
+
+	atomic_store_explicit(&l->nrw_writer, 0, memory_order_release);
+	pthread_mutex_unlock(&l->nrw_wlock);
+}
+
+void
+numa_rwlock_destroy(struct numa_rwlock *l)
+{
+
+	if (l == NULL)
+		return;
+	pthread_mutex_destroy(&l->nrw_wlock);
+	(void)munmap(l->nrw_map, l->nrw_maplen);
+	free(l);
+}
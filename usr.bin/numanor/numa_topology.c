@@ -0,0 +1,617 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Topology snapshot.  The domain layout is read once, from the topology page
+ * the kernel maps into every process, from the NUMA syscalls, from a Linux
+ * style sysfs node directory or from a topology description file, and
+ * published as an immutable struct numa_topology.  Readers only
+ * perform an acquire load of the snapshot pointer, so the lookups below are
+ * safe on the allocator hot path.  A snapshot is never freed once published:
+ * replacing it with numa_simulate() or numa_topology_load() leaves earlier
+ * readers with a consistent, if stale, view.  A snapshot taken from the
+ * topology page remembers the page's generation and is rebuilt by the first
+ * numa_topology() call that sees a newer one.
+ *
+ * The sysfs backend reads the Linux node directory layout, either from a
+ * Linux machine, where the library builds with the stand-ins under compat/,
+ * or from a copy taken on one.  Neither is the system the placement syscalls
+ * act on, so its topology is installed as simulated.
+ *
+ * A description file holds one directive per line, '#' starts a comment:
+ *
+ *      domain 0 cpus 0-3,8
+ *      domain 1 cpus 4-7
+ *      distance 0 10 21
+ *      distance 1 21 10
+ *
+ * Domains must be numbered from 0 without gaps.  Missing distance rows
+ * default to 10 on the diagonal and 20 elsewhere.  A domain with an empty
+ * cpu list ("domain 2 cpus") is memory-only and makes up the slow tier.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+#include <sys/sysctl.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define NUMA_SYSFS_NODE         "/sys/devices/system/node"
+
+static _Atomic(struct numa_topology *) numa_topo;
+static pthread_mutex_t numa_topo_lock = PTHREAD_MUTEX_INITIALIZER;
+static int numa_topo_tried;
+
+/*
+ * numa_shpage: The kernel's topology page, NULL if it has none.  Located
+ *      with one sysctl the first time a topology is built.
+ * numa_rdtscp: Non-zero if the kernel keeps the CPU id in TSC_AUX.
+ */
+static const struct numa_shared *numa_shpage;
+static int numa_shpage_tried;
+static atomic_int numa_rdtscp;
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+static struct numa_topology *
+numa_topology_alloc(int ndomains)
+{
+	struct numa_topology *t;
+
+	if (ndomains <= 0 || ndomains > NUMA_MAXDOMAINS)
+		return (NULL);
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return (NULL);
+	t->nt_ndomains = ndomains;
+	t->nt_cpus = calloc(ndomains, sizeof(*t->nt_cpus));
+	t->nt_weights = calloc(ndomains * ndomains, sizeof(*t->nt_weights));
+	t->nt_nearest = calloc(ndomains * ndomains, sizeof(*t->nt_nearest));
+	if (t->nt_cpus == NULL || t->nt_weights == NULL ||
+	    t->nt_nearest == NULL) {
+		free(t->nt_cpus);
+		free(t->nt_weights);
+		free(t->nt_nearest);
+		free(t);
+		return (NULL);
+	}
+	return (t);
+}
+
+static void
+numa_topology_free(struct numa_topology *t)
+{
+
+	if (t == NULL)
+		return;
+	free(t->nt_cpus);
+	free(t->nt_weights);
+	free(t->nt_nearest);
+	free(t);
+}
+
+static void
+numa_topology_default_weights(struct numa_topology *t)
+{
+	int d, e, n;
+
+	n = t->nt_ndomains;
+	for (d = 0; d < n; d++)
+		for (e = 0; e < n; e++)
+			t->nt_weights[d * n + e] = (d == e) ?
+			    NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+}
+
+/*
+ * Function: numa_topology_finish()
+ * Input:
+ *     struct numa_topology *t: A topology with cpus and weights filled in.
+ * Output: void
+ * Summary: Derives the CPU to domain table, the memory tiers and the ranked
+ *      nearest domain lists.  Every domain ranks itself first, the others
+ *      follow by increasing weight, ties broken by domain index.
+ */
+static void
+numa_topology_finish(struct numa_topology *t)
+{
+	int *rank;
+	int c, d, i, j, n, tmp;
+
+	n = t->nt_ndomains;
+	t->nt_ncpus = 0;
+	for (c = 0; c < CPU_SETSIZE; c++)
+		t->nt_cpu_domain[c] = -1;
+	for (d = 0; d < n; d++) {
+		NUMA_MASK_FOREACH(c, &t->nt_cpus[d]) {
+			if (t->nt_cpu_domain[c] != -1)
+				continue;
+			t->nt_cpu_domain[c] = d;
+			t->nt_ncpus = MAX(t->nt_ncpus, c + 1);
+		}
+		t->nt_tier[d] = CPU_EMPTY(&t->nt_cpus[d]) ? NUMA_TIER_SLOW :
+		    NUMA_TIER_FAST;
+	}
+
+	for (d = 0; d < n; d++) {
+		rank = &t->nt_nearest[d * n];
+		rank[0] = d;
+		for (i = 1, j = 0; j < n; j++)
+			if (j != d)
+				rank[i++] = j;
+		/* Insertion sort, n is small. */
+		for (i = 2; i < n; i++) {
+			for (j = i; j > 1 && t->nt_weights[d * n + rank[j]] <
+			    t->nt_weights[d * n + rank[j - 1]]; j--) {
+				tmp = rank[j];
+				rank[j] = rank[j - 1];
+				rank[j - 1] = tmp;
+			}
+		}
+	}
+}
+
+int
+numa_parse_cpulist(const char *s, cpuset_t *set)
+{
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (isspace((unsigned char)*s))
+		s++;
+	while (*s != '\0' && *s != '\n' && *s != '#') {
+		lo = strtol(s, &end, 10);
+		if (end == s)
+			return (0);
+		hi = lo;
+		if (*end == '-') {
+			s = end + 1;
+			hi = strtol(s, &end, 10);
+			if (end == s)
+				return (0);
+		}
+		if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+			return (0);
+		for (; lo <= hi; lo++)
+			CPU_SET(lo, set);
+		s = end;
+		if (*s == ',')
+			s++;
+		while (isspace((unsigned char)*s))
+			s++;
+	}
+	return (1);
+}
+
+static struct numa_topology *
+numa_topo_syscall(void)
+{
+	struct numa_topology *t;
+	int n;
+
+	n = get_numa_cpus(NULL, 0);
+	if ((t = numa_topology_alloc(n)) == NULL)
+		return (NULL);
+	if (get_numa_cpus(t->nt_cpus, n * sizeof(*t->nt_cpus)) != n ||
+	    get_numa_weights((short *)t->nt_weights,
+	    n * n * sizeof(*t->nt_weights)) != n) {
+		numa_topology_free(t);
+		return (NULL);
+	}
+	return (t);
+}
+
+/*
+ * Function: numa_topo_shared()
+ * Input: void
+ * Output: Returns a topology read from the topology page, or NULL.
+ * Summary: Copies the page until the copy was taken under one even
+ *      generation, i.e. while the kernel was not rewriting it.  Called with
+ *      numa_topo_lock held.
+ */
+static struct numa_topology *
+numa_topo_shared(void)
+{
+	struct numa_shared copy;
+	struct numa_topology *t;
+	u_long addr;
+	size_t len;
+	uint32_t gen;
+	int c, d, n;
+
+	if (!numa_shpage_tried) {
+		numa_shpage_tried = 1;
+		len = sizeof(addr);
+		if (sysctlbyname("kern.numa.shared", &addr, &len, NULL, 0) == 0 &&
+		    len == sizeof(addr))
+			numa_shpage = (const struct numa_shared *)addr;
+	}
+	if (numa_shpage == NULL)
+		return (NULL);
+	do {
+		if ((gen = numa_shpage->nsh_gen) == 0)
+			return (NULL);
+		atomic_thread_fence(memory_order_acquire);
+		memcpy(&copy, (const void *)numa_shpage, sizeof(copy));
+		atomic_thread_fence(memory_order_acquire);
+	} while ((gen & 1) != 0 || numa_shpage->nsh_gen != gen);
+
+	n = copy.nsh_ndomains;
+	if (n > NUMA_SHARED_MAXDOM || (t = numa_topology_alloc(n)) == NULL)
+		return (NULL);
+	for (c = 0; c < MIN(copy.nsh_ncpus, NUMA_SHARED_MAXCPU); c++)
+		if ((d = copy.nsh_cpu_domain[c]) >= 0 && d < n &&
+		    c < CPU_SETSIZE)
+			CPU_SET(c, &t->nt_cpus[d]);
+	for (d = 0; d < n * n; d++)
+		t->nt_weights[d] = copy.nsh_weights[d];
+	t->nt_gen = gen;
+	atomic_store_explicit(&numa_rdtscp,
+	    (copy.nsh_flags & NUMA_SHARED_RDTSCP) != 0, memory_order_relaxed);
+	return (t);
+}
+
+static char *
+numa_read_line(const char *path, char *buf, size_t len)
+{
+	FILE *fp;
+	char *ret;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (NULL);
+	ret = fgets(buf, len, fp);
+	fclose(fp);
+	return (ret);
+}
+
+static struct numa_topology *
+numa_topo_sysfs(const char *root)
+{
+	struct numa_topology *t;
+	cpuset_t online;
+	char path[PATH_MAX], buf[4096], *p, *end;
+	int node[NUMA_MAXDOMAINS];
+	int c, d, e, n;
+
+	if (root == NULL)
+		root = NUMA_SYSFS_NODE;
+	snprintf(path, sizeof(path), "%s/online", root);
+	if (numa_read_line(path, buf, sizeof(buf)) == NULL ||
+	    !numa_parse_cpulist(buf, &online))
+		return (NULL);
+	n = 0;
+	for (c = 0; c < CPU_SETSIZE && n < NUMA_MAXDOMAINS; c++)
+		if (CPU_ISSET(c, &online))
+			node[n++] = c;
+	if ((t = numa_topology_alloc(n)) == NULL)
+		return (NULL);
+	numa_topology_default_weights(t);
+
+	for (d = 0; d < n; d++) {
+		snprintf(path, sizeof(path), "%s/node%d/cpulist", root,
+		    node[d]);
+		if (numa_read_line(path, buf, sizeof(buf)) == NULL ||
+		    !numa_parse_cpulist(buf, &t->nt_cpus[d]))
+			goto fail;
+		/* The distance row covers the online nodes in order. */
+		snprintf(path, sizeof(path), "%s/node%d/distance", root,
+		    node[d]);
+		if (numa_read_line(path, buf, sizeof(buf)) == NULL)
+			continue;
+		for (p = buf, e = 0; e < n; e++, p = end) {
+			t->nt_weights[d * n + e] = strtol(p, &end, 10);
+			if (end == p)
+				goto fail;
+		}
+	}
+	return (t);
+fail:
+	numa_topology_free(t);
+	return (NULL);
+}
+
+static struct numa_topology *
+numa_topo_file(const char *path)
+{
+	struct numa_topology *t;
+	FILE *fp;
+	cpuset_t cpus[NUMA_MAXDOMAINS];
+	uint16_t *weights;
+	char buf[4096], *p, *end;
+	long w;
+	int d, e, n, lineno, seen[NUMA_MAXDOMAINS];
+
+	if (path == NULL || (fp = fopen(path, "r")) == NULL)
+		return (NULL);
+	t = NULL;
+	weights = calloc(NUMA_MAXDOMAINS * NUMA_MAXDOMAINS,
+	    sizeof(*weights));
+	if (weights == NULL)
+		goto out;
+	memset(seen, 0, sizeof(seen));
+	n = 0;
+	lineno = 0;
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		lineno++;
+		p = buf + strspn(buf, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+		if (strncmp(p, "domain", 6) == 0 && isspace((unsigned char)p[6])) {
+			d = strtol(p + 6, &end, 10);
+			if (end == p + 6 || d < 0 || d >= NUMA_MAXDOMAINS)
+				goto bad;
+			p = end + strspn(end, " \t");
+			if (strncmp(p, "cpus", 4) != 0 ||
+			    !numa_parse_cpulist(p + 4, &cpus[d]))
+				goto bad;
+			seen[d] |= 1;
+			n = MAX(n, d + 1);
+		} else if (strncmp(p, "distance", 8) == 0 &&
+		    isspace((unsigned char)p[8])) {
+			d = strtol(p + 8, &end, 10);
+			if (end == p + 8 || d < 0 || d >= NUMA_MAXDOMAINS)
+				goto bad;
+			for (p = end, e = 0; ; e++, p = end) {
+				w = strtol(p, &end, 10);
+				if (end == p)
+					break;
+				if (e >= NUMA_MAXDOMAINS || w <= 0 ||
+				    w > UINT16_MAX)
+					goto bad;
+				weights[d * NUMA_MAXDOMAINS + e] = w;
+			}
+			seen[d] |= 2;
+		} else
+			goto bad;
+	}
+	for (d = 0; d < n; d++)
+		if ((seen[d] & 1) == 0)
+			goto bad;
+	if ((t = numa_topology_alloc(n)) == NULL)
+		goto out;
+	numa_topology_default_weights(t);
+	for (d = 0; d < n; d++) {
+		t->nt_cpus[d] = cpus[d];
+		if ((seen[d] & 2) == 0)
+			continue;
+		for (e = 0; e < n; e++)
+			if (weights[d * NUMA_MAXDOMAINS + e] != 0)
+				t->nt_weights[d * n + e] =
+				    weights[d * NUMA_MAXDOMAINS + e];
+	}
+	goto out;
+bad:
+	fprintf(stderr, "%s:%d: invalid topology description\n", path,
+	    lineno);
+	errno = EINVAL;
+out:
+	free(weights);
+	fclose(fp);
+	return (t);
+}
+
+/*
+ * Function: numa_topology_build()
+ * Input:
+ *     int backend: One of the NUMA_TOPO backends.
+ *     const char *path: The directory or file to read, if the backend takes
+ *          one.
+ *     int *simulated: Set to non-zero if the topology does not describe the
+ *          running system.
+ * Output: Returns a new topology, or NULL if the backend has none.
+ * Summary: Only the topology page and the NUMA syscalls describe the machine
+ *      the placement syscalls act on.  A sysfs tree never does: on FreeBSD it
+ *      was copied from another machine, and under the Linux compat layer the
+ *      syscalls are stubs, so it is simulated like a description file.
+ */
+static struct numa_topology *
+numa_topology_build(int backend, const char *path, int *simulated)
+{
+	struct numa_topology *t;
+
+	*simulated = 0;
+	switch (backend) {
+	case NUMA_TOPO_AUTO:
+		if ((t = numa_topo_shared()) == NULL &&
+		    (t = numa_topo_syscall()) == NULL &&
+		    (t = numa_topo_sysfs(NULL)) != NULL)
+			*simulated = 1;
+		return (t);
+	case NUMA_TOPO_SHARED:
+		return (numa_topo_shared());
+	case NUMA_TOPO_SYSCALL:
+		return (numa_topo_syscall());
+	case NUMA_TOPO_SYSFS:
+		*simulated = 1;
+		return (numa_topo_sysfs(path));
+	case NUMA_TOPO_FILE:
+		*simulated = 1;
+		return (numa_topo_file(path));
+	}
+	errno = EINVAL;
+	return (NULL);
+}
+
+/*
+ * Function: numa_topology_install()
+ * Input:
+ *     struct numa_topology *t: A complete topology, owned by the library from
+ *          now on.
+ *     int simulated: Non-zero if placement syscalls must not be made.
+ * Output: Returns the number of domains of t.
+ * Summary: Publishes t as the current snapshot and points the numanor.h
+ *      globals at it.  Called with numa_topo_lock held.
+ */
+static int
+numa_topology_install(struct numa_topology *t, int simulated)
+{
+
+	numa_topology_finish(t);
+	numa_cpus = t->nt_cpus;
+	numa_weights = t->nt_weights;
+	numa_count = t->nt_ndomains;
+	numa_simulated = simulated;
+	numa_topo_tried = 1;
+	atomic_store_explicit(&numa_topo, t, memory_order_release);
+	return (t->nt_ndomains);
+}
+
+
+/* ---------- USERSPACE LIBRARY --- */
+
+const struct numa_topology *
+numa_topology(void)
+{
+	struct numa_topology *t;
+	int simulated;
+
+	t = atomic_load_explicit(&numa_topo, memory_order_acquire);
+	if (__predict_true(t != NULL) &&
+	    __predict_true(t->nt_gen == 0 || t->nt_gen == numa_shpage->nsh_gen))
+		return (t);
+
+	/*
+	 * Only the first caller probes the backends, and only the first
+	 * caller after a topology page update rebuilds the snapshot.
+	 */
+	pthread_mutex_lock(&numa_topo_lock);
+	if (!numa_topo_tried) {
+		numa_topo_tried = 1;
+		if ((t = numa_topology_build(NUMA_TOPO_AUTO, NULL,
+		    &simulated)) != NULL)
+			(void)numa_topology_install(t, simulated);
+	} else if (t != NULL &&
+	    t == atomic_load_explicit(&numa_topo, memory_order_relaxed) &&
+	    t->nt_gen != numa_shpage->nsh_gen) {
+		if ((t = numa_topology_build(NUMA_TOPO_AUTO, NULL,
+		    &simulated)) != NULL)
+			(void)numa_topology_install(t, simulated);
+	}
+	pthread_mutex_unlock(&numa_topo_lock);
+	return (atomic_load_explicit(&numa_topo, memory_order_acquire));
+}
+
+int
+numa_topology_load(int backend, const char *path)
+{
+	struct numa_topology *t;
+	int n, simulated;
+
+	if ((t = numa_topology_build(backend, path, &simulated)) == NULL)
+		return (0);
+	pthread_mutex_lock(&numa_topo_lock);
+	n = numa_topology_install(t, simulated);
+	pthread_mutex_unlock(&numa_topo_lock);
+	return (n);
+}
+
+int
+numa_simulate(int ndomains, int ncpus)
+{
+
+	return (numa_simulate_tiered(ndomains, ncpus, 0));
+}
+
+int
+numa_simulate_tiered(int ndomains, int ncpus, int nslow)
+{
+	struct numa_topology *t;
+	int c, d, e, n, nfast;
+
+	nfast = ndomains - nslow;
+	if (ncpus <= 0 || nslow < 0 || nfast <= 0 ||
+	    nfast * ncpus > CPU_SETSIZE)
+		return (0);
+	if ((t = numa_topology_alloc(ndomains)) == NULL)
+		return (0);
+	for (d = 0; d < nfast; d++)
+		for (c = 0; c < ncpus; c++)
+			CPU_SET(d * ncpus + c, &t->nt_cpus[d]);
+	numa_topology_default_weights(t);
+	for (d = 0; d < ndomains; d++)
+		for (e = nfast; e < ndomains; e++)
+			if (d != e)
+				t->nt_weights[d * ndomains + e] =
+				    t->nt_weights[e * ndomains + d] =
+				    NUMA_REMOTE_DISTANCE + NUMA_LOCAL_DISTANCE;
+	pthread_mutex_lock(&numa_topo_lock);
+	n = numa_topology_install(t, 1);
+	pthread_mutex_unlock(&numa_topo_lock);
+	return (n);
+}
+
+int
+numa_cpu_to_domain(int cpu)
+{
+	const struct numa_topology *t;
+
+	if ((t = numa_topology()) == NULL || cpu < 0 || cpu >= CPU_SETSIZE)
+		return (-1);
+	return (t->nt_cpu_domain[cpu]);
+}
+
+int
+numa_current_cpu(void)
+{
+#if defined(__amd64__) || defined(__i386__)
+	uint32_t aux, hi, lo;
+
+	if (atomic_load_explicit(&numa_rdtscp, memory_order_relaxed)) {
+		__asm __volatile("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+		return ((int)aux);
+	}
+#endif
+	return (-1);
+}
+
+int
+numa_nearest_domain(int domain, int rank)
+{
+	const struct numa_topology *t;
+
+	if ((t = numa_topology()) == NULL || domain < 0 ||
+	    domain >= t->nt_ndomains || rank < 0 || rank >= t->nt_ndomains)
+		return (-1);
+	return (t->nt_nearest[domain * t->nt_ndomains + rank]);
+}
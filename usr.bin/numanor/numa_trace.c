@@ -0,0 +1,301 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Placement tracing.  The allocator and the thread pool report every event
+ * to the hook installed with numa_trace_set(); numa_trace_file() installs a
+ * hook writing them as text lines "kind from want got bytes".  The
+ * numa_trace.d script prints the kernel's numa DTrace probes in the same
+ * format, and "numanor heatmap" turns any mix of such lines into one
+ * from-domain x served-domain matrix per event kind.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * numa_trace_busy: Number of threads inside numa_trace().  numa_trace_set()
+ *      waits for it to drop to zero after taking the old hook down, so the
+ *      old hook and its argument are no longer in use once it returns.
+ */
+numa_trace_fn *_Atomic numa_trace_hook;
+static void *_Atomic numa_trace_arg;
+static _Atomic int numa_trace_busy;
+static FILE *numa_trace_fp;
+
+static const char *numa_trace_kinds[] = {
+	"?", "alloc", "free", "task", "page", "migrate"
+};
+
+/*
+ * ht_count: Events per (from, got) pair, rows of NUMA_MAXDOMAINS.
+ * ht_bytes: Bytes per (from, got) pair.
+ * ht_missed: Events not served by the domain asked for.
+ * ht_unknown: Events without a from domain, left out of the matrix.
+ */
+struct numa_heat {
+	uint64_t	ht_count[NUMA_MAXDOMAINS * NUMA_MAXDOMAINS];
+	uint64_t	ht_bytes[NUMA_MAXDOMAINS * NUMA_MAXDOMAINS];
+	uint64_t	ht_events;
+	uint64_t	ht_missed;
+	uint64_t	ht_unknown;
+	uint64_t	ht_total_bytes;
+};
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+void
+numa_trace(int kind, int from, int want, int got, size_t bytes)
+{
+	struct numa_trace_event ev;
+	numa_trace_fn *fn;
+
+	atomic_fetch_add(&numa_trace_busy, 1);
+	fn = atomic_load(&numa_trace_hook);
+	if (fn != NULL) {
+		ev.nte_kind = kind;
+		ev.nte_from = from;
+		ev.nte_want = want;
+		ev.nte_got = got;
+		ev.nte_bytes = bytes;
+		fn(&ev, atomic_load_explicit(&numa_trace_arg,
+		    memory_order_relaxed));
+	}
+	atomic_fetch_sub_explicit(&numa_trace_busy, 1, memory_order_release);
+}
+
+static void
+numa_trace_write(const struct numa_trace_event *ev, void *arg)
+{
+
+	fprintf(arg, "%s %d %d %d %zu\n", numa_trace_kinds[ev->nte_kind],
+	    ev->nte_from, ev->nte_want, ev->nte_got, ev->nte_bytes);
+}
+
+
+/* ---------- LIBRARY API --------- */
+
+void
+numa_trace_set(numa_trace_fn *fn, void *arg)
+{
+
+	/*
+	 * Take the old hook down and wait for the threads still calling it
+	 * before publishing the new pair, so no call mixes the old hook with
+	 * the new argument and the caller may free the old argument.
+	 */
+	atomic_store(&numa_trace_hook, NULL);
+	while (atomic_load(&numa_trace_busy) != 0)
+		sched_yield();
+	atomic_store_explicit(&numa_trace_arg, arg, memory_order_relaxed);
+	atomic_store(&numa_trace_hook, fn);
+}
+
+int
+numa_trace_file(const char *path)
+{
+	FILE *fp;
+
+	if (path == NULL) {
+		numa_trace_set(NULL, NULL);
+		if (numa_trace_fp != NULL) {
+			fclose(numa_trace_fp);
+			numa_trace_fp = NULL;
+		}
+		return (1);
+	}
+	if ((fp = fopen(path, "w")) == NULL)
+		return (0);
+	/* numa_trace_set() waits until no event is written to the old file. */
+	numa_trace_set(numa_trace_write, fp);
+	if (numa_trace_fp != NULL)
+		fclose(numa_trace_fp);
+	numa_trace_fp = fp;
+	return (1);
+}
+
+
+/* ---------- HEATMAP ------------- */
+
+static void
+numa_heat_print(const char *kind, const struct numa_heat *h, int nd,
+    int bytes)
+{
+	static const char shade[] = " .:-=+*#%@";
+	const uint64_t *cell;
+	uint64_t max, v;
+	int f, g;
+
+	printf("%s: %ju events, %ju bytes, %.1f%% not on the domain asked "
+	    "for", kind, (uintmax_t)h->ht_events, (uintmax_t)h->ht_total_bytes,
+	    h->ht_events > 0 ? 100.0 * h->ht_missed / h->ht_events : 0.0);
+	if (h->ht_unknown > 0)
+		printf(", %ju from unknown domains", (uintmax_t)h->ht_unknown);
+	printf("\n%8s", "from\\got");
+	for (g = 0; g < nd; g++)
+		printf(" %10d", g);
+	printf("\n");
+
+	cell = bytes ? h->ht_bytes : h->ht_count;
+	max = 0;
+	for (f = 0; f < nd; f++)
+		for (g = 0; g < nd; g++)
+			max = MAX(max, cell[f * NUMA_MAXDOMAINS + g]);
+	for (f = 0; f < nd; f++) {
+		printf("%8d", f);
+		for (g = 0; g < nd; g++) {
+			v = cell[f * NUMA_MAXDOMAINS + g];
+			printf(" %c%9ju", shade[max == 0 ? 0 :
+			    (v * (sizeof(shade) - 2) + max - 1) / max],
+			    (uintmax_t)v);
+		}
+		printf("\n");
+	}
+	printf("\n");
+}
+
+static void
+numa_heatmap_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor heatmap [-b] [-k kind] [file ...]\n");
+	exit(1);
+}
+
+/*
+ * Read the trace lines of fp into heat, one struct per kind.  Returns the
+ * number of domains seen.
+ */
+static int
+numa_heatmap_read(FILE *fp, const char *name, struct numa_heat *heat, int nd)
+{
+	char line[256], kind[16];
+	struct numa_heat *h;
+	uintmax_t bytes;
+	int from, got, k, lineno, want;
+
+	lineno = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%15s %d %d %d %ju", kind, &from, &want, &got,
+		    &bytes) != 5) {
+			warnx("%s:%d: malformed line", name, lineno);
+			continue;
+		}
+		for (k = 1; k < (int)nitems(numa_trace_kinds); k++)
+			if (strcmp(kind, numa_trace_kinds[k]) == 0)
+				break;
+		if (k == (int)nitems(numa_trace_kinds) || got < 0 ||
+		    got >= NUMA_MAXDOMAINS || from >= NUMA_MAXDOMAINS) {
+			warnx("%s:%d: bad event", name, lineno);
+			continue;
+		}
+		h = &heat[k];
+		h->ht_events++;
+		h->ht_total_bytes += bytes;
+		if (want >= 0 && want != got)
+			h->ht_missed++;
+		if (from < 0) {
+			h->ht_unknown++;
+			continue;
+		}
+		h->ht_count[from * NUMA_MAXDOMAINS + got]++;
+		h->ht_bytes[from * NUMA_MAXDOMAINS + got] += bytes;
+		nd = MAX(nd, MAX(from, got) + 1);
+	}
+	return (nd);
+}
+
+int
+numa_trace_heatmap(int argc, char **argv)
+{
+	struct numa_heat *heat;
+	const char *only;
+	FILE *fp;
+	int bytes, ch, i, k, nd;
+
+	bytes = 0;
+	only = NULL;
+	while ((ch = getopt(argc, argv, "bk:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bytes = 1;
+			break;
+		case 'k':
+			only = optarg;
+			break;
+		default:
+			numa_heatmap_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if ((heat = calloc(nitems(numa_trace_kinds), sizeof(*heat))) == NULL)
+		err(1, "calloc");
+	nd = 0;
+	if (argc == 0)
+		nd = numa_heatmap_read(stdin, "stdin", heat, nd);
+	for (i = 0; i < argc; i++) {
+		if ((fp = fopen(argv[i], "r")) == NULL)
+			err(1, "%s", argv[i]);
+		nd = numa_heatmap_read(fp, argv[i], heat, nd);
+		fclose(fp);
+	}
+
+	for (k = 1; k < (int)nitems(numa_trace_kinds); k++) {
+		if (heat[k].ht_events == 0 ||
+		    (only != NULL && strcmp(only, numa_trace_kinds[k]) != 0))
+			continue;
+		numa_heat_print(numa_trace_kinds[k], &heat[k], nd, bytes);
+	}
+	free(heat);
+	return (0);
+}
@@ -42,11 +42,184 @@
 /* ----------- INCLUDES ----------- */
 
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
 #include <sys/freebsdnuma.h>        /* NUMA syscalls */
 
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <pthread_np.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
 
 /* ---------- DEFINITIONS --------- */
 
+size_t numa_count;
+cpuset_t *numa_cpus;
+uint16_t *numa_weights;
+
+int numa_simulated;
+
+/*
+ * numa_pressure: Pressure level of every domain, from get_numa_meminfo() or
+ *      numa_simulate_pressure().
+ * numa_pressure_next: CLOCK_MONOTONIC time in ms after which
+ *      numa_pressure_refresh() reads the levels again.
+ */
+#define NUMA_PRESSURE_INTERVAL  100
+
+static _Atomic(int) numa_pressure[NUMA_MAXDOMAINS];
+static _Atomic(int64_t) numa_pressure_next;
+
+/*
+ * NUMA_BIND_BATCH: Pages faulted in and moved per move_pages() call by
+ *      numa_bind_stripes().
+ */
+#define NUMA_BIND_BATCH         512
+
+/*
+ * numa_td_domain: Cached domain of the calling thread, -1 until looked up.
+ * numa_td_checks: Lookups left before numa_td_domain is refreshed.
+ * numa_td_policy: Allocation policy of the calling thread.
+ */
+static __thread int numa_td_domain = -1;
+static __thread int numa_td_checks;
+static __thread int numa_td_policy = NUMA_POLICY_NEAREST;
+
+static void usage(void) __dead2;
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+int
+numa_thread_domain(void)
+{
+	cpuset_t set;
+	int cpu, domain;
+
+	if (!numa_simulated && (cpu = numa_current_cpu()) >= 0 &&
+	    (domain = numa_cpu_to_domain(cpu)) >= 0)
+		return (domain);
+	if (numa_td_domain >= 0 && (numa_simulated || --numa_td_checks > 0))
+		return (numa_td_domain);
+	if (is_numa_available() == 0)
+		return (0);
+	numa_td_checks = NUMA_DOMAIN_RECHECK;
+	if (numa_simulated) {
+		numa_td_domain = 0;
+		return (0);
+	}
+	if (cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
+	    sizeof(set), &set) != 0 ||
+	    (domain = numa_cpu_to_domain(CPU_FFS(&set) - 1)) < 0)
+		domain = 0;
+	numa_td_domain = domain;
+	return (domain);
+}
+
+void
+numa_pressure_refresh(void)
+{
+	struct numa_meminfo mi[NUMA_MAXDOMAINS];
+	struct timespec ts;
+	int64_t next, now;
+
+	if (numa_simulated)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	next = atomic_load_explicit(&numa_pressure_next, memory_order_relaxed);
+	/* One thread refreshes, the others keep the previous levels. */
+	if (now < next || !atomic_compare_exchange_strong(&numa_pressure_next,
+	    &next, now + NUMA_PRESSURE_INTERVAL))
+		return;
+	(void)numa_get_meminfo(mi, NUMA_MAXDOMAINS);
+}
+
+int
+numa_pressure_avoid(int domain)
+{
+	int d, nd, r;
+
+	if (__predict_true(atomic_load_explicit(&numa_pressure[domain],
+	    memory_order_relaxed) < NUMA_PRESSURE_HIGH))
+		return (domain);
+	nd = is_numa_available();
+	for (r = 1; r < nd; r++) {
+		d = numa_nearest_domain(domain, r);
+		if (atomic_load_explicit(&numa_pressure[d],
+		    memory_order_relaxed) < NUMA_PRESSURE_HIGH)
+			return (d);
+	}
+	return (domain);
+}
+
+int
+numa_thread_policy(void)
+{
+
+	return (numa_td_policy);
+}
+
+int
+numa_bind_range(void *addr, size_t len, int domain)
+{
+	cpuset_t mask;
+	size_t off, pagesize;
+
+	if (numa_simulated)
+		return (1);
+	/*
+	 * mbind() needs the backing object the first fault creates.  The
+	 * pages faulted after it come from domain straight away.
+	 */
+	pagesize = getpagesize();
+	*(volatile char *)addr = 0;
+	CPU_ZERO(&mask);
+	CPU_SET(domain, &mask);
+	if (mbind(addr, len, NUMA_POLICY_NEAREST, sizeof(mask), &mask,
+	    NUMA_MOVE) != 0)
+		return (numa_bind_stripes(addr, len, len, &domain, 1));
+	for (off = pagesize; off < len; off += pagesize)
+		((volatile char *)addr)[off] = 0;
+	return (1);
+}
+
+int
+numa_bind_stripes(void *addr, size_t len, size_t stripe, const int *domains,
+    int ndomains)
+{
+	void *pages[NUMA_BIND_BATCH];
+	int node[NUMA_BIND_BATCH], status[NUMA_BIND_BATCH];
+	size_t off, pagesize;
+	long i, n;
+
+	if (numa_simulated)
+		return (1);
+	pagesize = getpagesize();
+	for (off = 0; off < len; off += n * pagesize) {
+		n = MIN(NUMA_BIND_BATCH, howmany(len - off, pagesize));
+		for (i = 0; i < n; i++) {
+			pages[i] = (char *)addr + off + i * pagesize;
+			*(volatile char *)pages[i] = 0;
+			node[i] = domains[(off + i * pagesize) / stripe %
+			    ndomains];
+		}
+		if (move_pages(0, n, pages, node, status, NUMA_MOVE) != 0)
+			return (0);
+	}
+	return (1);
+}
+
 
 /* ---------- USERSPACE LIBRARY --- */
 
@@ -65,8 +238,17 @@
 int
 is_numa_available(void)
 {
+	const struct numa_topology *t;
 
-	return (0);
+	t = numa_topology();
+	return (t == NULL ? 0 : t->nt_ndomains);
+}
+
+int
+numa_current_domain(void)
+{
+
+	return (numa_thread_domain());
 }
 
 /* 
@@ -82,7 +264,23 @@ int
 set_thread_on_domain(pid_t pid, int domain)
 {
 
-	return (0);
+	if (domain < 0 || domain >= is_numa_available() ||
+	    CPU_EMPTY(&numa_cpus[domain]))
+		return (0);
+	if (numa_simulated) {
+		if (pid != 0)
+			return (0);
+		numa_td_domain = domain;
+		return (1);
+	}
+	if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID,
+	    pid == 0 ? -1 : pid, sizeof(cpuset_t), &numa_cpus[domain]) != 0)
+		return (0);
+	if (pid == 0) {
+		numa_td_domain = domain;
+		numa_td_checks = NUMA_DOMAIN_RECHECK;
+	}
+	return (1);
 }
 
 /* 
@@ -97,8 +295,173 @@ set_thread_on_domain(pid_t pid, int domain)
  */
 int set_memory_policy(pid_t pid, int thread_policy)
 {
+	cpuset_t mask;
+	size_t d;
 
-	return (0);
+	if (thread_policy != NUMA_POLICY_NEAREST &&
+	    thread_policy != NUMA_POLICY_INTERLEAVE)
+		return (0);
+	if (is_numa_available() == 0)
+		return (0);
+	if (!numa_simulated) {
+		CPU_ZERO(&mask);
+		for (d = 0; d < numa_count; d++)
+			CPU_SET(d, &mask);
+		if (cpuset_set_memory_affinity(CPU_LEVEL_WHICH, CPU_WHICH_TID,
+		    pid == 0 ? -1 : pid, sizeof(mask), &mask,
+		    thread_policy) != 0)
+			return (0);
+	} else if (pid != 0)
+		return (0);
+	if (pid == 0)
+		numa_td_policy = thread_policy;
+	return (1);
+}
+
+int
+numa_set_balancing(int pid, int enable)
+{
+	cpuset_t mask;
+	int policy;
+
+	if (is_numa_available() == 0 || numa_simulated)
+		return (0);
+	if (cpuset_get_memory_affinity(CPU_LEVEL_WHICH, CPU_WHICH_PID,
+	    pid == 0 ? -1 : pid, sizeof(mask), &mask, &policy) != 0)
+		return (0);
+	policy &= NUMA_POLICY_MASK;
+	if (enable)
+		policy |= NUMA_POLICY_BALANCE;
+	if (cpuset_set_memory_affinity(CPU_LEVEL_WHICH, CPU_WHICH_PID,
+	    pid == 0 ? -1 : pid, sizeof(mask), &mask, policy) != 0)
+		return (0);
+	return (1);
+}
+
+int
+numa_set_threads_policy(const int *tids, int n, const cpuset_t *mask,
+    int policy, int *errors)
+{
+	struct numa_affinity_req *reqs;
+	int i, ok;
+
+	if (n <= 0 || is_numa_available() == 0)
+		return (0);
+	if ((policy & NUMA_POLICY_MASK) != NUMA_POLICY_NEAREST &&
+	    (policy & NUMA_POLICY_MASK) != NUMA_POLICY_INTERLEAVE)
+		return (0);
+	if (numa_simulated) {
+		/* Only the calling thread has a simulated policy. */
+		ok = 0;
+		for (i = 0; i < n; i++) {
+			if (tids[i] == 0) {
+				numa_td_policy = policy & NUMA_POLICY_MASK;
+				ok++;
+			}
+			if (errors != NULL)
+				errors[i] = tids[i] == 0 ? 0 : ESRCH;
+		}
+		return (ok);
+	}
+	if ((reqs = calloc(n, sizeof(*reqs))) == NULL)
+		return (0);
+	for (i = 0; i < n; i++) {
+		reqs[i].nar_level = CPU_LEVEL_WHICH;
+		reqs[i].nar_which = CPU_WHICH_TID;
+		reqs[i].nar_id = tids[i] == 0 ? -1 : tids[i];
+		reqs[i].nar_policy = policy;
+		if (mask != NULL)
+			reqs[i].nar_mask = *mask;
+		else
+			CPU_FILL(&reqs[i].nar_mask);
+	}
+	ok = 0;
+	if (cpuset_memory_affinity_vec(NUMA_AFFINITY_SET, reqs, n) == 0) {
+		for (i = 0; i < n; i++) {
+			if (errors != NULL)
+				errors[i] = reqs[i].nar_error;
+			if (reqs[i].nar_error != 0)
+				continue;
+			if (tids[i] == 0)
+				numa_td_policy = policy & NUMA_POLICY_MASK;
+			ok++;
+		}
+	} else if (errors != NULL)
+		for (i = 0; i < n; i++)
+			errors[i] = errno;
+	free(reqs);
+	return (ok);
+}
+
+int
+numa_get_meminfo(struct numa_meminfo *mi, int n)
+{
+	int d, nd;
+
+	if ((nd = is_numa_available()) == 0 || n < nd)
+		return (0);
+	if (numa_simulated) {
+		memset(mi, 0, nd * sizeof(*mi));
+		for (d = 0; d < nd; d++) {
+			mi[d].nmi_pressure = atomic_load_explicit(
+			    &numa_pressure[d], memory_order_relaxed);
+			mi[d].nmi_tier = numa_topology()->nt_tier[d];
+		}
+		return (nd);
+	}
+	if (get_numa_meminfo(mi, n * sizeof(*mi)) != nd)
+		return (0);
+	for (d = 0; d < nd; d++)
+		atomic_store_explicit(&numa_pressure[d], mi[d].nmi_pressure,
+		    memory_order_relaxed);
+	return (nd);
+}
+
+int
+numa_domain_pressure(int domain)
+{
+
+	if (domain < 0 || domain >= is_numa_available())
+		return (NUMA_PRESSURE_NONE);
+	numa_pressure_refresh();
+	return (atomic_load_explicit(&numa_pressure[domain],
+	    memory_order_relaxed));
+}
+
+int
+numa_simulate_pressure(int domain, int level)
+{
+
+	if (!numa_simulated || domain < 0 || domain >= is_numa_available() ||
+	    level < NUMA_PRESSURE_NONE || level > NUMA_PRESSURE_HIGH)
+		return (0);
+	atomic_store_explicit(&numa_pressure[domain], level,
+	    memory_order_relaxed);
+	return (1);
+}
+
+int
+numa_get_stats(int pid, struct numa_stats *st)
+{
+	int mib[CTL_MAXNAME];
+	size_t len, miblen;
+
+	memset(st, 0, sizeof(*st));
+	if (is_numa_available() == 0)
+		return (0);
+	if (numa_simulated) {
+		st->ns_ndomains = is_numa_available();
+		st->ns_pid = pid == 0 ? getpid() : pid;
+		return (1);
+	}
+	miblen = nitems(mib) - 1;
+	if (sysctlnametomib("kern.numa.stats.snapshot", mib, &miblen) != 0)
+		return (0);
+	mib[miblen++] = pid;
+	len = sizeof(*st);
+	if (sysctl(mib, miblen, st, &len, NULL, 0) != 0 || len != sizeof(*st))
+		return (0);
+	return (1);
 }
 
 /* 
@@ -117,12 +480,440 @@ int
 move_thread(pid_t pid, int domain, int mem_flag)
 {
 
-	return (0);
+	return (numa_move_thread(pid, domain, mem_flag, NULL));
+}
+
+static int
+numa_page_cmp(const void *a, const void *b)
+{
+	uintptr_t x, y;
+
+	x = (uintptr_t)*(void * const *)a;
+	y = (uintptr_t)*(void * const *)b;
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Append the pages of [addr, addr + len) to pages, which has room for max.
+ * Returns the new page count.
+ */
+static long
+numa_add_pages(void **pages, long n, long max, const void *addr, size_t len)
+{
+	uintptr_t a, end;
+	size_t pagesize;
+
+	pagesize = getpagesize();
+	a = rounddown2((uintptr_t)addr, pagesize);
+	end = roundup2((uintptr_t)addr + len, pagesize);
+	for (; a < end && n < max; a += pagesize)
+		pages[n++] = (void *)a;
+	return (n);
+}
+
+/*
+ * Move the n distinct pages of pages to domain and account for them in r.
+ * Pages already on domain or not resident are left alone.
+ */
+static int
+numa_move_own_pages(void **pages, long n, int domain,
+    struct numa_move_report *r)
+{
+	size_t pagesize;
+	long i, m;
+	int *node, *status, ok;
+	char vec;
+
+	pagesize = getpagesize();
+	if (numa_simulated) {
+		for (i = 0; i < n; i++) {
+			if (mincore(pages[i], pagesize, (void *)&vec) == 0 &&
+			    (vec & MINCORE_INCORE) != 0) {
+				r->nmr_pages++;
+				r->nmr_bytes += pagesize;
+			}
+		}
+		return (1);
+	}
+
+	node = malloc(n * sizeof(*node));
+	status = malloc(n * sizeof(*status));
+	ok = 0;
+	if (node == NULL || status == NULL)
+		goto out;
+	if (move_pages(0, n, pages, NULL, status, NUMA_MOVE) != 0)
+		goto out;
+	for (i = m = 0; i < n; i++) {
+		if (status[i] < 0)
+			continue;
+		r->nmr_pages++;
+		if (status[i] != domain)
+			pages[m++] = pages[i];
+	}
+	for (i = 0; i < m; i++)
+		node[i] = domain;
+	if (m > 0 && move_pages(0, m, pages, node, status, NUMA_MOVE) != 0)
+		goto out;
+	for (i = 0; i < m; i++) {
+		if (status[i] == domain)
+			r->nmr_bytes += pagesize;
+		else
+			r->nmr_failed++;
+	}
+	ok = 1;
+out:
+	free(status);
+	free(node);
+	return (ok);
 }
 
 int
-main(void)
+numa_move_thread(pid_t pid, int domain, int mem_flag,
+    struct numa_move_report *report)
 {
+	struct numa_move_report r;
+	struct timespec t0, t1;
+	pthread_attr_t attr;
+	void **pages, *stack, *tc;
+	size_t stacksize, tclen, pagesize;
+	uintptr_t sp;
+	long max, n, i, j;
+	int from, ok;
+
+	memset(&r, 0, sizeof(r));
+	if (mem_flag != MEM_LEAVE && mem_flag != MEM_MIGRATE)
+		return (0);
+	/* Only the calling thread's stack and thread cache are known. */
+	if (mem_flag == MEM_MIGRATE && pid != 0)
+		return (0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	from = pid == 0 ? numa_thread_domain() : -1;
+	if (!set_thread_on_domain(pid, domain))
+		return (0);
+
+	ok = 1;
+	if (mem_flag == MEM_MIGRATE && from != domain) {
+		pagesize = getpagesize();
+		stack = NULL;
+		stacksize = 0;
+		pthread_attr_init(&attr);
+		if (pthread_attr_get_np(pthread_self(), &attr) == 0)
+			(void)pthread_attr_getstack(&attr, &stack, &stacksize);
+		pthread_attr_destroy(&attr);
+		tc = numa_tcache_move(from, &tclen);
+
+		max = stacksize / pagesize + 2 +
+		    (tc != NULL ? tclen / pagesize + 2 : 0) + 1;
+		if ((pages = malloc(max * sizeof(*pages))) == NULL)
+			return (0);
+		n = 0;
+		/* The stack grows down: only the part above sp is in use. */
+		sp = (uintptr_t)&r;
+		if (stack != NULL && sp >= (uintptr_t)stack &&
+		    sp < (uintptr_t)stack + stacksize)
+			n = numa_add_pages(pages, n, max, (void *)sp,
+			    (uintptr_t)stack + stacksize - sp);
+		if (tc != NULL)
+			n = numa_add_pages(pages, n, max, tc, tclen);
+		n = numa_add_pages(pages, n, max, &numa_td_domain,
+		    sizeof(numa_td_domain));
+		qsort(pages, n, sizeof(*pages), numa_page_cmp);
+		for (i = j = 0; i < n; i++)
+			if (j == 0 || pages[i] != pages[j - 1])
+				pages[j++] = pages[i];
+		ok = numa_move_own_pages(pages, j, domain, &r);
+		free(pages);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	r.nmr_nsec = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 +
+	    t1.tv_nsec - t0.tv_nsec;
+	if (report != NULL)
+		*report = r;
+	return (ok);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: numanor [info [-f file | -s nodedir]]\n"
+	    "       numanor malloc [-S domains] [-b size] [-n ops] "
+	    "[-t threads]\n"
+	    "       numanor policy [-S domains [-s slow] | -f file] "
+	    "[-p nearest | interleave | tiered] ...\n"
+	    "       numanor balance [-S domains | -f file] [-g periods] "
+	    "[trace] ...\n"
+	    "       numanor sched [-S domains [-c cpus] | -f file] [-g ticks] "
+	    "[trace]\n"
+	    "       numanor tier [-S domains [-s slow] | -f file] [-F fast_pages] "
+	    "[-l fast_ns,slow_ns] ...\n"
+	    "       numanor pool [-S domains] [-b blocksize] [-n blocks] "
+	    "[-r rounds] [-w workers]\n"
+	    "       numanor thread [-S domains | -f file] [-s stack_kb] "
+	    "[-n blocks] [-r rounds]\n"
+	    "       numanor matrix [-S domains | -f file] [-m megabytes] "
+	    "[-s] [-o text | json | csv]\n"
+	    "       numanor place [-S domains] [-m megabytes] [-s stripe_kb] "
+	    "[-t threads]\n"
+	    "       numanor move [-m megabytes] [-b batch] [-f from] "
+	    "[-t to]\n"
+	    "       numanor affinity [-t threads] [-r rounds]\n"
+	    "       numanor super [-S domains] [-d domain] [-m megabytes] "
+	    "[-n hops] [-g]\n"
+	    "       numanor shared [-m megabytes] [-n hops] [-p procs]\n"
+	    "       numanor cache [-S domains] [-b size] [-n ops] [-p pairs]\n"
+	    "       numanor init [-S domains] [-m megabytes] "
+	    "[-p block|cyclic|page] [-u unit]\n"
+	    "       numanor io [-S domains] [-b size] [-f file] [-i iovcnt] "
+	    "[-n requests] [-t threads]\n"
+	    "       numanor mask [-S domains [-c cpus]] [-d density] "
+	    "[-n iterations]\n"
+	    "       numanor sync [-S domains[,domains ...]] [-c cpus] "
+	    "[-n rounds] [-t threads] [-w write_pct]\n"
+	    "       numanor stats [-p pid]\n"
+	    "       numanor heatmap [-b] [-k kind] [file ...]\n"
+	    "       numanor migrate [-p pid] [-f domainlist -t domainlist] "
+	    "[-w]\n");
+	exit(1);
+}
 
+static int
+numa_info(int argc, char **argv)
+{
+	static const char *numa_pressure_names[] = { "none", "low", "high" };
+	struct numa_meminfo mi[NUMA_MAXDOMAINS];
+	const struct numa_topology *t;
+	double mb;
+	int c, ch, d, e;
+
+	while ((ch = getopt(argc, argv, "f:s:")) != -1) {
+		switch (ch) {
+		case 'f':
+			if (numa_topology_load(NUMA_TOPO_FILE, optarg) == 0)
+				errx(1, "cannot load topology from %s", optarg);
+			break;
+		case 's':
+			if (numa_topology_load(NUMA_TOPO_SYSFS, optarg) == 0)
+				errx(1, "cannot load topology from %s", optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((t = numa_topology()) == NULL) {
+		printf("NUMA not available\n");
+		return (1);
+	}
+	for (d = 0; d < t->nt_ndomains; d++) {
+		printf("domain %d: cpus", d);
+		NUMA_MASK_FOREACH(c, &t->nt_cpus[d])
+			printf(" %d", c);
+		printf("; tier %s; nearest", t->nt_tier[d] == NUMA_TIER_FAST ?
+		    "fast" : "slow");
+		for (e = 0; e < t->nt_ndomains; e++)
+			printf(" %d", numa_nearest_domain(d, e));
+		printf("\n");
+	}
+	for (d = 0; d < t->nt_ndomains; d++) {
+		for (e = 0; e < t->nt_ndomains; e++)
+			printf("%4u", t->nt_weights[d * t->nt_ndomains + e]);
+		printf("\n");
+	}
+	if (!numa_simulated &&
+	    numa_get_meminfo(mi, NUMA_MAXDOMAINS) == t->nt_ndomains) {
+		mb = getpagesize() / 1024.0 / 1024.0;
+		for (d = 0; d < t->nt_ndomains; d++)
+			printf("domain %d: %.0f MB total, %.0f free, %.0f active, "
+			    "%.0f inactive, pressure %s\n", d,
+			    mi[d].nmi_total * mb, mi[d].nmi_free * mb,
+			    mi[d].nmi_active * mb, mi[d].nmi_inactive * mb,
+			    numa_pressure_names[mi[d].nmi_pressure]);
+	}
 	return (0);
 }
+
+static void
+numa_stats_row(const uint64_t *row)
+{
+	uint64_t allocs;
+	int i;
+
+	for (i = 0; i < NUMA_STAT_COUNT; i++)
+		printf(" %12ju", (uintmax_t)row[i]);
+	allocs = row[NUMA_STAT_LOCAL] + row[NUMA_STAT_REMOTE];
+	printf(" %7.1f%%\n", allocs == 0 ? 0.0 :
+	    100.0 * row[NUMA_STAT_REMOTE] / allocs);
+}
+
+static int
+numa_stats_show(int argc, char **argv)
+{
+	static const char *names[NUMA_STAT_COUNT] = {
+		"local", "remote", "interleave", "fallback", "migrated",
+		"failed"
+	};
+	struct numa_stats st;
+	uint64_t *row, total[NUMA_STAT_COUNT];
+	int ch, d, i, pid;
+
+	pid = -1;
+	while ((ch = getopt(argc, argv, "p:")) != -1) {
+		switch (ch) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!numa_get_stats(pid, &st))
+		err(1, "numa_get_stats");
+
+	printf("%-8s", "domain");
+	for (i = 0; i < NUMA_STAT_COUNT; i++)
+		printf(" %12s", names[i]);
+	printf(" %8s\n", "remote%");
+	memset(total, 0, sizeof(total));
+	for (d = 0; d <= st.ns_ndomains; d++) {
+		if (d < st.ns_ndomains) {
+			row = st.ns_domain[d];
+			printf("%-8d", d);
+			for (i = 0; i < NUMA_STAT_COUNT; i++)
+				total[i] += row[i];
+		} else {
+			row = total;
+			printf("%-8s", "total");
+		}
+		numa_stats_row(row);
+	}
+	if (st.ns_pid > 0) {
+		printf("pid %-4d", st.ns_pid);
+		numa_stats_row(st.ns_proc);
+	}
+	return (0);
+}
+
+static int
+numa_migrate(int argc, char **argv)
+{
+	static const char *states[] = {
+		"?", "queued", "running", "done", "failed"
+	};
+	struct numa_migrate_status st;
+	cpuset_t from, to;
+	u_long oldmask[howmany(NUMA_MAXDOMAINS, NBBY * sizeof(u_long))];
+	u_long newmask[howmany(NUMA_MAXDOMAINS, NBBY * sizeof(u_long))];
+	int ch, d, pid, wait;
+
+	pid = 0;
+	wait = 0;
+	CPU_ZERO(&from);
+	CPU_ZERO(&to);
+	while ((ch = getopt(argc, argv, "f:p:t:w")) != -1) {
+		switch (ch) {
+		case 'f':
+			if (!numa_parse_cpulist(optarg, &from))
+				errx(1, "invalid domain list %s", optarg);
+			break;
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 't':
+			if (!numa_parse_cpulist(optarg, &to))
+				errx(1, "invalid domain list %s", optarg);
+			break;
+		case 'w':
+			wait = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (CPU_EMPTY(&from) != CPU_EMPTY(&to))
+		usage();
+	if (!CPU_EMPTY(&from)) {
+		memset(oldmask, 0, sizeof(oldmask));
+		memset(newmask, 0, sizeof(newmask));
+		for (d = 0; d < NUMA_MAXDOMAINS; d++) {
+			if (CPU_ISSET(d, &from))
+				oldmask[d / (NBBY * sizeof(u_long))] |=
+				    1UL << (d % (NBBY * sizeof(u_long)));
+			if (CPU_ISSET(d, &to))
+				newmask[d / (NBBY * sizeof(u_long))] |=
+				    1UL << (d % (NBBY * sizeof(u_long)));
+		}
+		if (migrate_pages(pid, NUMA_MAXDOMAINS, oldmask, newmask) != 0)
+			err(1, "migrate_pages");
+	}
+
+	/* Report progress, once or until the migration ends. */
+	for (;;) {
+		if (migrate_pages_status(pid, &st) != 0)
+			err(1, "migrate_pages_status");
+		printf("pid %d %s queued %ju moved %ju failed %ju "
+		    "skipped %ju %.1f MB/s\n", st.nms_pid,
+		    states[st.nms_state < (int)nitems(states) ?
+		    st.nms_state : 0], (uintmax_t)st.nms_queued,
+		    (uintmax_t)st.nms_moved, (uintmax_t)st.nms_failed,
+		    (uintmax_t)st.nms_skipped, st.nms_bytes_per_sec / 1e6);
+		if (!wait || st.nms_state == NUMA_MIGRATE_DONE ||
+		    st.nms_state == NUMA_MIGRATE_FAILED)
+			break;
+		sleep(1);
+	}
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+
+	if (argc < 2)
+		return (numa_info(argc, argv));
+	if (strcmp(argv[1], "info") == 0)
+		return (numa_info(argc - 1, argv + 1));
+	if (strcmp(argv[1], "malloc") == 0)
+		return (bench_malloc(argc - 1, argv + 1));
+	if (strcmp(argv[1], "policy") == 0)
+		return (sim_policy(argc - 1, argv + 1));
+	if (strcmp(argv[1], "balance") == 0)
+		return (sim_balance(argc - 1, argv + 1));
+	if (strcmp(argv[1], "sched") == 0)
+		return (sim_sched(argc - 1, argv + 1));
+	if (strcmp(argv[1], "tier") == 0)
+		return (sim_tier(argc - 1, argv + 1));
+	if (strcmp(argv[1], "pool") == 0)
+		return (bench_pool(argc - 1, argv + 1));
+	if (strcmp(argv[1], "thread") == 0)
+		return (bench_thread(argc - 1, argv + 1));
+	if (strcmp(argv[1], "matrix") == 0)
+		return (bench_matrix(argc - 1, argv + 1));
+	if (strcmp(argv[1], "place") == 0)
+		return (bench_place(argc - 1, argv + 1));
+	if (strcmp(argv[1], "move") == 0)
+		return (bench_move(argc - 1, argv + 1));
+	if (strcmp(argv[1], "affinity") == 0)
+		return (bench_affinity(argc - 1, argv + 1));
+	if (strcmp(argv[1], "cache") == 0)
+		return (bench_cache(argc - 1, argv + 1));
+	if (strcmp(argv[1], "io") == 0)
+		return (bench_io(argc - 1, argv + 1));
+	if (strcmp(argv[1], "mask") == 0)
+		return (bench_mask(argc - 1, argv + 1));
+	if (strcmp(argv[1], "sync") == 0)
+		return (bench_sync(argc - 1, argv + 1));
+	if (strcmp(argv[1], "init") == 0)
+		return (bench_init(argc - 1, argv + 1));
+	if (strcmp(argv[1], "shared") == 0)
+		return (bench_shared(argc - 1, argv + 1));
+	if (strcmp(argv[1], "super") == 0)
+		return (bench_super(argc - 1, argv + 1));
+	if (strcmp(argv[1], "heatmap") == 0)
+		return (numa_trace_heatmap(argc - 1, argv + 1));
+	if (strcmp(argv[1], "stats") == 0)
+		return (numa_stats_show(argc - 1, argv + 1));
+	if (strcmp(argv[1], "migrate") == 0)
+		return (numa_migrate(argc - 1, argv + 1));
+	usage();
+}
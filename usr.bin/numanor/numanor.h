@@ -34,6 +34,10 @@
  * included in freebsdnuma.h and makes them more user friendly.  Users should be
  * able to make their application NUMA-aware by using these functions.  Also
  * included are basic functions to test NUMA.
+ *
+ * The library targets FreeBSD.  On Linux it builds with GNUmakefile and the
+ * stand-ins under compat/, which fail every FreeBSD syscall, so only the
+ * file and sysfs topologies and the simulators are useful there.
  * 
  * Last Edited: December 08, 2013
  */
@@ -65,12 +69,60 @@ extern uint16_t *numa_weights;
 /*
  * MEM_LEAVE: When moving a thread, leaves all associated memory pages estranged
  * MEM_MIGRATE: When moving a thread, migrates all associated memory pages to
- *      the specified NUMA domain.
+ *      the specified NUMA domain.  Only the calling thread can be moved this
+ *      way: its stack, its libnumanor thread cache and its TLS page move.
  * Summary: The MEM flags specify the behaviour of move_thread()
  */
 #define MEM_LEAVE       1
 #define MEM_MIGRATE     2
 
+/*
+ * NUMA_MAXDOMAINS: The largest number of domains the library handles.
+ * NUMA_TOPO_AUTO: Use the kernel's topology page, then the NUMA syscalls,
+ *      falling back to Linux sysfs, which is treated as simulated.
+ * NUMA_TOPO_SYSCALL: Read the topology with get_numa_cpus() and
+ *      get_numa_weights().
+ * NUMA_TOPO_SYSFS: Read the topology from a Linux style node directory
+ *      (/sys/devices/system/node by default), such as one copied from a
+ *      Linux machine.  The machine described is treated as simulated.
+ * NUMA_TOPO_FILE: Read the topology from a description file.  The machine
+ *      described is treated as simulated, see numa_simulate().
+ * NUMA_TOPO_SHARED: Read the topology from the page the kernel maps into
+ *      every process, see struct numa_shared in freebsdnuma.h.
+ * Summary: The NUMA_TOPO backends are passed to numa_topology_load().
+ */
+#define NUMA_MAXDOMAINS         64
+#define NUMA_TOPO_AUTO          0
+#define NUMA_TOPO_SYSCALL       1
+#define NUMA_TOPO_SYSFS         2
+#define NUMA_TOPO_FILE          3
+#define NUMA_TOPO_SHARED        4
+
+/*
+ * nt_ndomains: The number of domains.
+ * nt_ncpus: One more than the highest CPU belonging to a domain.
+ * nt_cpus: The CPUs of every domain, nt_ndomains entries.
+ * nt_weights: The nt_ndomains x nt_ndomains distance matrix, row major.
+ * nt_nearest: For every domain a row of nt_ndomains domains ranked by
+ *      distance, starting with the domain itself.
+ * nt_cpu_domain: The domain of every CPU, -1 for CPUs outside any domain.
+ * nt_tier: The NUMA_TIER of every domain, NUMA_TIER_SLOW for the domains
+ *      without CPUs.
+ * nt_gen: The generation of the topology page the snapshot was read from,
+ *      0 for the other backends.
+ * Summary: Immutable topology snapshot returned by numa_topology().
+ */
+struct numa_topology {
+	int		nt_ndomains;
+	int		nt_ncpus;
+	cpuset_t	*nt_cpus;
+	uint16_t	*nt_weights;
+	int		*nt_nearest;
+	int16_t		nt_cpu_domain[CPU_SETSIZE];
+	int8_t		nt_tier[NUMA_MAXDOMAINS];
+	uint32_t	nt_gen;
+};
+
 
 /* ---------- USERSPACE LIBRARY --- */
 
@@ -95,7 +147,8 @@ int is_numa_available(void);
  *     int domain: The index of the target NUMA domain.
  * Output: Returns 1 on success. Returns 0 on failure.
  * Summary: Sets the domain of the designated thread specified by PID to the
- *      specified NUMA domain.
+ *      specified NUMA domain.  Fails for a memory-only domain, it has no CPUs
+ *      to run on.
  */
 int set_thread_on_domain(int pid,
                          int domain);
@@ -113,6 +166,93 @@ int set_thread_on_domain(int pid,
 int set_memory_policy(int pid,
                       int thread_policy);
 
+/*
+ * Function: numa_set_balancing()
+ * Input:
+ *     int pid: The ID of the process, 0 for the calling process.
+ *     int enable: Non-zero to switch automatic balancing on, zero for off.
+ * Output: Returns 1 on success. Returns 0 on failure.
+ * Summary: Toggles NUMA_POLICY_BALANCE in the process's memory policy, keeping
+ *      its allocation policy and domain mask. The kernel then moves pages the
+ *      process keeps accessing from a remote domain, tuned through the
+ *      kern.numa.balance sysctls.
+ */
+int numa_set_balancing(int pid,
+                       int enable);
+
+/*
+ * Function: numa_set_threads_policy()
+ * Input:
+ *     const int *tids: The threads to change, 0 for the calling thread.
+ *          Threads of the same process should be adjacent.
+ *     int n: The number of entries of tids.
+ *     const cpuset_t *mask: The allowed domains, NULL for all of them.
+ *     int policy: NUMA_POLICY_NEAREST or NUMA_POLICY_INTERLEAVE, optionally
+ *          with NUMA_POLICY_BALANCE.
+ *     int *errors: If not NULL, set to 0 or the errno of every thread.
+ * Output: Returns the number of threads whose policy was set.
+ * Summary: set_memory_policy() for many threads with a single
+ *      cpuset_memory_affinity_vec() call, which takes the process lock once
+ *      per run of threads of the same process.
+ */
+int numa_set_threads_policy(const int *tids,
+                            int n,
+                            const cpuset_t *mask,
+                            int policy,
+                            int *errors);
+
+/*
+ * Function: numa_get_meminfo()
+ * Input:
+ *     struct numa_meminfo *mi: An array to fill, one entry per domain.
+ *     int n: The number of entries of mi.
+ * Output: Returns the number of domains filled in. Returns 0 on failure.
+ * Summary: Free, active, inactive and total pages and the pressure level of
+ *      every domain with one get_numa_meminfo() call, see struct
+ *      numa_meminfo in freebsdnuma.h.  On a simulated topology the counts
+ *      are zero, the tiers are those of the topology and the levels are
+ *      those set by numa_simulate_pressure().
+ */
+int numa_get_meminfo(struct numa_meminfo *mi,
+                     int n);
+
+/*
+ * Function: numa_domain_pressure()
+ * Input:
+ *     int domain: The index of a NUMA domain.
+ * Output: Returns the NUMA_PRESSURE level of domain.
+ * Summary: Served from a cache refreshed at most every 100 ms.  numa_malloc()
+ *      and numa_pool_submit() steer away from domains at NUMA_PRESSURE_HIGH
+ *      to the nearest domain that is not, before the kernel's own fallback
+ *      has to.
+ */
+int numa_domain_pressure(int domain);
+
+/*
+ * Function: numa_simulate_pressure()
+ * Input:
+ *     int domain: The index of a simulated domain.
+ *     int level: The NUMA_PRESSURE level to report for it.
+ * Output: Returns 1 on success. Returns 0 on failure, or if no simulation is
+ *      active.
+ */
+int numa_simulate_pressure(int domain,
+                           int level);
+
+/*
+ * Function: numa_get_stats()
+ * Input:
+ *     int pid: The process to include, 0 for the calling process, -1 for
+ *          none.
+ *     struct numa_stats *st: Filled with the snapshot.
+ * Output: Returns 1 on success. Returns 0 on failure.
+ * Summary: Reads every per-domain placement counter and the counters of pid
+ *      with a single sysctl, see struct numa_stats in freebsdnuma.h.  On a
+ *      simulated topology all counters are zero.
+ */
+int numa_get_stats(int pid,
+                   struct numa_stats *st);
+
 /* 
  * Function: move_thread()
  * Input: 
@@ -129,5 +269,1136 @@ int move_thread(int pid,
                 int domain,
                 int mem_flag);
 
+/*
+ * nmr_bytes: Bytes moved to the target domain.
+ * nmr_pages: Resident pages found in the moved regions.
+ * nmr_failed: Resident pages that could not be moved.
+ * nmr_nsec: Time the whole move took, re-pinning included.
+ */
+struct numa_move_report {
+	size_t		nmr_bytes;
+	long		nmr_pages;
+	long		nmr_failed;
+	uint64_t	nmr_nsec;
+};
+
+/*
+ * Function: numa_move_thread()
+ * Input:
+ *     int pid: The ID of thread to move, 0 for the calling thread.
+ *     int domain: The ID of NUMA domain to move to.
+ *     int mem_flag: MEM_LEAVE or MEM_MIGRATE.
+ *     struct numa_move_report *report: Filled in if not NULL.
+ * Output: Returns 1 on success. Returns 0 on failure.
+ * Summary: move_thread() with a report.  With MEM_MIGRATE the calling thread
+ *      is pinned to the CPUs of domain, then the used part of its stack, its
+ *      allocator thread cache and its TLS page are moved with one
+ *      move_pages() call, and the blocks it had cached for its old domain
+ *      are handed back to that domain.  On a simulated topology no pages
+ *      are moved, every resident page counts as moved instead.
+ */
+int numa_move_thread(int pid,
+                     int domain,
+                     int mem_flag,
+                     struct numa_move_report *report);
+
+/* 
+ * Function: numa_simulate()
+ * Input:
+ *     int ndomains: The number of NUMA domains to simulate.
+ *     int ncpus: The number of CPUs in each simulated domain.
+ * Output: Returns the number of simulated domains. Returns 0 on failure.
+ * Summary: Installs a fake topology in place of the one reported by the
+ *      kernel so that the library can be exercised on non-NUMA machines.  CPUs
+ *      are numbered consecutively by domain and the weights are 10 on the
+ *      diagonal and 20 elsewhere.  set_thread_on_domain() with a pid of 0 only
+ *      records the domain of the calling thread while a simulation is active.
+ *      Must be called before any other function of the library.
+ */
+int numa_simulate(int ndomains,
+                  int ncpus);
+
+/*
+ * Function: numa_simulate_tiered()
+ * Input:
+ *     int ndomains: The number of NUMA domains to simulate.
+ *     int ncpus: The number of CPUs in each simulated domain with CPUs.
+ *     int nslow: The number of trailing domains without CPUs.
+ * Output: Returns the number of simulated domains. Returns 0 on failure.
+ * Summary: numa_simulate() with the last nslow domains memory-only, like CXL
+ *      memory expanders.  They are reported as NUMA_TIER_SLOW and are 30
+ *      away from every other domain.  At least one domain must have CPUs.
+ */
+int numa_simulate_tiered(int ndomains,
+                         int ncpus,
+                         int nslow);
+
+/* 
+ * Function: numa_topology()
+ * Input: void
+ * Output: Returns the topology snapshot, or NULL if NUMA is not available.
+ * Summary: The snapshot is built on first use with the NUMA_TOPO_AUTO backend
+ *      unless numa_topology_load() or numa_simulate() installed one before.
+ *      It is never modified or freed, and reading it takes no lock.  A
+ *      snapshot read from the topology page is replaced once the kernel moves
+ *      the page's generation on; checking for that is a memory load.
+ */
+const struct numa_topology *numa_topology(void);
+
+/* 
+ * Function: numa_topology_load()
+ * Input:
+ *     int backend: One of the NUMA_TOPO backends.
+ *     const char *path: The node directory for NUMA_TOPO_SYSFS (NULL for the
+ *          default) or the description file for NUMA_TOPO_FILE.
+ * Output: Returns the number of domains loaded. Returns 0 on failure.
+ * Summary: Replaces the topology snapshot with one read from backend.  Like
+ *      numa_simulate(), must be called before the rest of the library is used.
+ */
+int numa_topology_load(int backend,
+                       const char *path);
+
+/* 
+ * Function: numa_cpu_to_domain()
+ * Input:
+ *     int cpu: A CPU number.
+ * Output: Returns the domain of cpu, or -1 if it belongs to none.
+ * Summary: Constant time lookup in the topology snapshot.
+ */
+int numa_cpu_to_domain(int cpu);
+
+/*
+ * Function: numa_current_domain()
+ * Input: void
+ * Output: Returns the domain the calling thread runs on at the time of the
+ *      call.
+ * Summary: Reads the CPU with rdtscp where the topology page says the kernel
+ *      supports it, which takes no syscall.  Elsewhere the domain is derived
+ *      from the thread's CPU affinity and cached per thread, see
+ *      set_thread_on_domain().
+ */
+int numa_current_domain(void);
+
+/* 
+ * Function: numa_nearest_domain()
+ * Input:
+ *     int domain: The index of a NUMA domain.
+ *     int rank: 0 for domain itself, 1 for the closest other domain, ...
+ * Output: Returns the domain at position rank in the distance order of
+ *      domain, or -1 if either argument is out of range.
+ * Summary: Constant time lookup in the topology snapshot.
+ */
+int numa_nearest_domain(int domain,
+                        int rank);
+
+
+/* ---------- NUMA CPU MASKS ------ */
+
+/*
+ * NUMA_MASK_FOREACH: Runs the statement following it for every CPU in mask,
+ *      lowest first, with cpu set to the CPU.  Each step costs one ctz per
+ *      word of the set rather than one test per bit.  mask must not change
+ *      during the walk.
+ * Summary: The numa_mask functions work on whole words of a cpuset_t, using
+ *      popcount and count-trailing-zeros and, on amd64, SSE2 or AVX2 for the
+ *      operations combining two sets.  Those taking a domain read its CPUs
+ *      from nt_cpus of the topology snapshot, so a lookup costs no more than
+ *      a walk of two sets.  Domain sets use the bit of every domain, as in
+ *      set_memory_policy().
+ */
+#define NUMA_MASK_FOREACH(cpu, mask)                                    \
+	for ((cpu) = numa_mask_first(mask); (cpu) >= 0;                 \
+	    (cpu) = numa_mask_next((mask), (cpu)))
+
+/*
+ * Function: numa_mask_count()
+ * Input:
+ *     const cpuset_t *mask: The set to count.
+ * Output: Returns the number of CPUs in mask.
+ */
+int numa_mask_count(const cpuset_t *mask);
+
+/*
+ * Function: numa_mask_first()
+ * Input:
+ *     const cpuset_t *mask: The set to search.
+ * Output: Returns the lowest CPU in mask, or -1 if it is empty.
+ */
+int numa_mask_first(const cpuset_t *mask);
+
+/*
+ * Function: numa_mask_next()
+ * Input:
+ *     const cpuset_t *mask: The set to search.
+ *     int cpu: The CPU to search after, -1 to start at the beginning.
+ * Output: Returns the lowest CPU in mask above cpu, or -1 if there is none.
+ */
+int numa_mask_next(const cpuset_t *mask,
+                   int cpu);
+
+/*
+ * Function: numa_mask_and()
+ * Input:
+ *     cpuset_t *dst: Receives the intersection, may be a or b.  NULL only
+ *          tests whether the sets intersect.
+ *     const cpuset_t *a: The first set.
+ *     const cpuset_t *b: The second set.
+ * Output: Returns 1 if a and b intersect. Returns 0 otherwise.
+ */
+int numa_mask_and(cpuset_t *dst,
+                  const cpuset_t *a,
+                  const cpuset_t *b);
+
+/*
+ * Function: numa_mask_first_in_domain()
+ * Input:
+ *     const cpuset_t *mask: The set to search.
+ *     int domain: The index of a NUMA domain.
+ * Output: Returns the lowest CPU of domain in mask, or -1 if mask holds none
+ *      of its CPUs or domain is out of range.
+ */
+int numa_mask_first_in_domain(const cpuset_t *mask,
+                              int domain);
+
+/*
+ * Function: numa_mask_domains()
+ * Input:
+ *     const cpuset_t *mask: A set of CPUs.
+ *     cpuset_t *domains: Receives the domains with at least one CPU in mask,
+ *          may be NULL.
+ * Output: Returns the number of domains covered by mask.
+ * Summary: Looks up the domain of the lowest CPU left and then drops all
+ *      CPUs of that domain from the walk, so the cost grows with the domains
+ *      covered rather than with the CPUs in mask.  CPUs outside any domain
+ *      are ignored.
+ */
+int numa_mask_domains(const cpuset_t *mask,
+                      cpuset_t *domains);
+
+/*
+ * Function: numa_mask_cpus()
+ * Input:
+ *     const cpuset_t *domains: A set of domains, NULL for all of them.
+ *     cpuset_t *cpus: Receives the CPUs of those domains.
+ * Output: Returns the number of CPUs stored in cpus.
+ * Summary: The inverse of numa_mask_domains(), turning a memory policy's
+ *      domain set into the CPUs a thread following it should run on.
+ */
+int numa_mask_cpus(const cpuset_t *domains,
+                   cpuset_t *cpus);
+
+
+/* ---------- NUMA ALLOCATOR ------ */
+
+/* 
+ * Function: numa_malloc()
+ * Input:
+ *     size_t size: The number of bytes to allocate.
+ * Output: Returns a pointer to the allocated memory, or NULL with errno set.
+ * Summary: Allocates memory according to the memory policy of the calling
+ *      thread.  With NUMA_POLICY_NEAREST the block comes from the arena of the
+ *      domain the thread currently runs on, with NUMA_POLICY_INTERLEAVE
+ *      consecutive allocations rotate over all domains.  Small sizes are
+ *      served from a per-thread cache without taking any lock.
+ */
+void *numa_malloc(size_t size);
+
+/* 
+ * Function: numa_malloc_onnode()
+ * Input:
+ *     size_t size: The number of bytes to allocate.
+ *     int domain: The index of the NUMA domain to allocate from.
+ * Output: Returns a pointer to the allocated memory, or NULL with errno set.
+ * Summary: Allocates memory from the arena of the given domain regardless of
+ *      the memory policy of the calling thread.
+ */
+void *numa_malloc_onnode(size_t size,
+                         int domain);
+
+/* 
+ * Function: numa_free()
+ * Input:
+ *     void *ptr: A pointer returned by numa_malloc() or numa_malloc_onnode().
+ * Output: void
+ * Summary: Releases the memory at ptr.  The block is always returned to the
+ *      arena of the domain it was allocated from, never to the arena of the
+ *      freeing thread.  Passing NULL does nothing.  A pointer whose chunk
+ *      header does not carry the allocator's magic is ignored and errno set
+ *      to EINVAL; the chunk boundary below it must be mapped for that check.
+ */
+void numa_free(void *ptr);
+
+/*
+ * NUMA_SUPER_2M: Back a reservation with 2 MB superpages.
+ * NUMA_SUPER_1G: Back it with 1 GB pages.  FreeBSD 10 cannot back
+ *      anonymous memory with them, so numa_reserve_superpages() fails with
+ *      EOPNOTSUPP.
+ * Summary: Flags of numa_reserve_superpages().
+ */
+#define NUMA_SUPER_2M           0x1
+#define NUMA_SUPER_1G           0x2
+
+/*
+ * nss_reserved: Bytes reserved on the domain.
+ * nss_used: Bytes of the reservation handed to the arena.
+ * nss_super: Bytes of the reservation mapped by 2 MB superpages.
+ * Summary: Filled by numa_superpage_stats().  The rest of the reservation,
+ *      nss_reserved - nss_super, fell back to small pages.
+ */
+struct numa_super_stats {
+	size_t		nss_reserved;
+	size_t		nss_used;
+	size_t		nss_super;
+};
+
+/*
+ * Function: numa_reserve_superpages()
+ * Input:
+ *     int domain: The index of the NUMA domain to reserve memory on.
+ *     size_t size: The number of bytes, rounded up to the page size used.
+ *     int flags: NUMA_SUPER_2M.
+ * Output: Returns 1 on success. Returns 0 with errno set on failure, EBUSY if
+ *      the domain has a reservation already, EOPNOTSUPP for NUMA_SUPER_1G.
+ * Summary: Maps a region of domain, binds it there with mbind() and faults
+ *      it in, laid out so the kernel can back it with large pages.  The
+ *      arena of domain takes its chunks from the region until it is used up,
+ *      so numa_malloc() and numa_malloc_onnode() blocks of that domain land
+ *      on large pages.  Parts the kernel could not back with large pages are
+ *      kept as small pages, see numa_superpage_stats().  Meant to be called
+ *      at startup, before the domain's arena has grown.
+ */
+int numa_reserve_superpages(int domain,
+                            size_t size,
+                            int flags);
+
+/*
+ * Function: numa_superpage_stats()
+ * Input:
+ *     int domain: The index of a NUMA domain.
+ *     struct numa_super_stats *st: Filled with the state of the reservation.
+ * Output: Returns 1 on success. Returns 0 if domain has no reservation.
+ * Summary: The large page counts are read with mincore() at the time of the
+ *      call.
+ */
+int numa_superpage_stats(int domain,
+                         struct numa_super_stats *st);
+
+/* 
+ * Function: numa_ptr_domain()
+ * Input:
+ *     const void *ptr: A pointer returned by numa_malloc() or
+ *          numa_malloc_onnode().
+ * Output: Returns the index of the domain owning the block. Returns -1 and
+ *      sets errno to EINVAL if ptr is not from numa_malloc().
+ * Summary: Identifies the arena a block belongs to.
+ */
+int numa_ptr_domain(const void *ptr);
+
+
+/* ---------- NUMA OBJECT CACHES -- */
+
+typedef void numa_cache_ctor(void *obj, void *arg);
+
+struct numa_cache;
+
+/*
+ * ncs_allocs, ncs_frees: Objects allocated and freed.
+ * ncs_remote_frees: Objects freed on another domain than the one owning
+ *      them.
+ * ncs_remote_mags: Magazines of such objects handed to their owner.
+ * ncs_exchanges: Magazine exchanges with the per-domain depots.
+ * ncs_slabs: Slabs mapped, over all domains.
+ */
+struct numa_cache_stats {
+	uint64_t	ncs_allocs;
+	uint64_t	ncs_frees;
+	uint64_t	ncs_remote_frees;
+	uint64_t	ncs_remote_mags;
+	uint64_t	ncs_exchanges;
+	uint64_t	ncs_slabs;
+};
+
+/*
+ * Function: numa_cache_create()
+ * Input:
+ *     size_t size: The size of the objects, at most 16 KB.
+ *     numa_cache_ctor *ctor: Called with arg on every object before it is
+ *          first handed out, may be NULL.
+ *     void *arg: Passed to ctor.
+ * Output: Returns the new cache, or NULL with errno set.
+ * Summary: Creates a cache of fixed size objects with per-CPU magazines in
+ *      front of one depot per domain, whose slabs are backed by that
+ *      domain.  Objects should be freed in their constructed state; the
+ *      constructor only runs again for objects that had to be returned
+ *      without a magazine.
+ */
+struct numa_cache *numa_cache_create(size_t size,
+                                     numa_cache_ctor *ctor,
+                                     void *arg);
+
+/*
+ * Function: numa_cache_alloc()
+ * Input:
+ *     struct numa_cache *nc: The cache.
+ * Output: Returns an object of the calling thread's domain, or NULL with
+ *      errno set.
+ */
+void *numa_cache_alloc(struct numa_cache *nc);
+
+/*
+ * Function: numa_cache_free()
+ * Input:
+ *     struct numa_cache *nc: The cache the object came from.
+ *     void *obj: The object, may be NULL.
+ * Output: void
+ * Summary: An object of another domain is collected with others of that
+ *      domain and returned to its depot a magazine at a time.  An object
+ *      not allocated from nc is ignored and errno set to EINVAL.
+ */
+void numa_cache_free(struct numa_cache *nc,
+                     void *obj);
+
+/*
+ * Function: numa_cache_stats()
+ * Input:
+ *     struct numa_cache *nc: The cache.
+ *     struct numa_cache_stats *st: Filled with the counters of the cache.
+ * Output: void
+ */
+void numa_cache_stats(struct numa_cache *nc,
+                      struct numa_cache_stats *st);
+
+/*
+ * Function: numa_cache_destroy()
+ * Input:
+ *     struct numa_cache *nc: The cache, may be NULL.
+ * Output: void
+ * Summary: Unmaps all slabs.  No object of the cache may still be in use.
+ */
+void numa_cache_destroy(struct numa_cache *nc);
+
+
+/* ---------- NUMA BUFFER POOLS --- */
+
+struct numa_bufpool;
+struct iovec;
+struct msghdr;
+
+/*
+ * nbs_buffers: Buffers in the pool, over all domains.
+ * nbs_returned: Buffers put back on another domain than their own.
+ * nbs_batches: Batches those were returned to their domain in.
+ * nbs_refills: Return lists taken over by a domain whose ring ran dry.
+ * nbs_foreign: Buffers handed out from another domain for lack of local
+ *      ones.
+ * nbs_exhausted: Requests that found no buffer at all.
+ */
+struct numa_bufpool_stats {
+	uint64_t	nbs_buffers;
+	uint64_t	nbs_returned;
+	uint64_t	nbs_batches;
+	uint64_t	nbs_refills;
+	uint64_t	nbs_foreign;
+	uint64_t	nbs_exhausted;
+};
+
+/*
+ * Function: numa_bufpool_create()
+ * Input:
+ *     size_t size: The size of a buffer, rounded up to pages.
+ *     int nbufs: The number of buffers of every domain.
+ * Output: Returns the new pool, or NULL with errno set.
+ * Summary: Maps nbufs page aligned buffers per domain, placed on the domain
+ *      and faulted in before the call returns.  Every thread that puts back
+ *      buffers of other domains may hold up to 31 of them until its batch
+ *      is full; nbufs should leave room for that.
+ */
+struct numa_bufpool *numa_bufpool_create(size_t size,
+                                         int nbufs);
+
+/*
+ * Function: numa_buf_get()
+ * Input:
+ *     struct numa_bufpool *bp: The pool.
+ * Output: Returns a buffer, or NULL with errno set to ENOBUFS.
+ * Summary: Lock free.  The buffer is of the calling thread's domain unless
+ *      that domain has none left, then of the nearest domain that has one.
+ */
+void *numa_buf_get(struct numa_bufpool *bp);
+
+/*
+ * Function: numa_buf_put()
+ * Input:
+ *     struct numa_bufpool *bp: The pool the buffer came from.
+ *     void *buf: A buffer, or any address inside one.  NULL is ignored.
+ * Output: void
+ * Summary: Lock free.  A buffer of another domain is kept by the calling
+ *      thread until it has a batch for that domain, see numa_buf_flush().
+ */
+void numa_buf_put(struct numa_bufpool *bp,
+                  void *buf);
+
+/*
+ * Function: numa_buf_flush()
+ * Input: void
+ * Output: void
+ * Summary: Returns the buffers of other domains numa_buf_put() kept back on
+ *      the calling thread.  To be called before the thread exits, or goes
+ *      idle for long, and before its pool is destroyed.
+ */
+void numa_buf_flush(void);
+
+/*
+ * Function: numa_buf_domain()
+ * Input:
+ *     struct numa_bufpool *bp: The pool.
+ *     const void *buf: An address inside a buffer of the pool.
+ * Output: Returns the domain of the buffer, or -1 if buf is not in the pool.
+ */
+int numa_buf_domain(struct numa_bufpool *bp,
+                    const void *buf);
+
+/*
+ * Function: numa_buf_size()
+ * Input:
+ *     struct numa_bufpool *bp: The pool.
+ * Output: Returns the size of its buffers.
+ */
+size_t numa_buf_size(struct numa_bufpool *bp);
+
+/*
+ * Function: numa_buf_iov()
+ * Input:
+ *     struct numa_bufpool *bp: The pool.
+ *     struct iovec *iov: An array of iovcnt entries.
+ *     int iovcnt: The number of buffers wanted.
+ * Output: Returns the number of entries filled with a buffer each.
+ */
+int numa_buf_iov(struct numa_bufpool *bp,
+                 struct iovec *iov,
+                 int iovcnt);
+
+/*
+ * Function: numa_buf_iov_put()
+ * Input:
+ *     struct numa_bufpool *bp: The pool.
+ *     const struct iovec *iov: Entries pointing into buffers of the pool.
+ *     int iovcnt: The number of entries.
+ * Output: void
+ */
+void numa_buf_iov_put(struct numa_bufpool *bp,
+                      const struct iovec *iov,
+                      int iovcnt);
+
+/*
+ * Function: numa_buf_readv()
+ * Input:
+ *     struct numa_bufpool *bp: The pool.
+ *     int fd: The descriptor to read from.
+ *     struct iovec *iov: An array of *iovcnt entries.
+ *     int *iovcnt: The most buffers to read into.  Set to the number of
+ *          entries of iov holding data.
+ * Output: Returns what readv() returned.
+ * Summary: Reads into buffers of the calling thread's domain.  The entries
+ *      holding data belong to the caller, to be given back with
+ *      numa_buf_iov_put() or passed on to numa_buf_writev().
+ */
+ssize_t numa_buf_readv(struct numa_bufpool *bp,
+                       int fd,
+                       struct iovec *iov,
+                       int *iovcnt);
+
+/*
+ * Function: numa_buf_writev()
+ * Input:
+ *     struct numa_bufpool *bp: The pool.
+ *     int fd: The descriptor to write to.
+ *     struct iovec *iov: Entries pointing into buffers of the pool,
+ *          modified as the data goes out.
+ *     int iovcnt: The number of entries.
+ * Output: Returns the number of bytes written, or -1 with errno set if not
+ *      all of them could be.
+ * Summary: Writes the whole vector, retrying short writes, and gives every
+ *      buffer back to the pool, whether written or not.
+ */
+ssize_t numa_buf_writev(struct numa_bufpool *bp,
+                        int fd,
+                        struct iovec *iov,
+                        int iovcnt);
+
+/*
+ * Function: numa_buf_sendmsg()
+ * Input:
+ *     struct numa_bufpool *bp: The pool.
+ *     int s: The socket.
+ *     const struct msghdr *msg: A message whose msg_iov points into buffers
+ *          of the pool.
+ *     int flags: Passed to sendmsg().
+ * Output: Returns what sendmsg() returned.
+ * Summary: Sends the message and gives its buffers back to the pool.  The
+ *      buffers are whole pages, so a zero-copy socket can loan them.
+ */
+ssize_t numa_buf_sendmsg(struct numa_bufpool *bp,
+                         int s,
+                         const struct msghdr *msg,
+                         int flags);
+
+/*
+ * Function: numa_bufpool_stats()
+ * Input:
+ *     struct numa_bufpool *bp: The pool.
+ *     struct numa_bufpool_stats *st: Filled with the counters of the pool.
+ * Output: void
+ */
+void numa_bufpool_stats(struct numa_bufpool *bp,
+                        struct numa_bufpool_stats *st);
+
+/*
+ * Function: numa_bufpool_destroy()
+ * Input:
+ *     struct numa_bufpool *bp: The pool, may be NULL.
+ * Output: void
+ * Summary: Unmaps all buffers.  No buffer of the pool may still be in use
+ *      or kept back by a thread.
+ */
+void numa_bufpool_destroy(struct numa_bufpool *bp);
+
+
+/* ---------- NUMA REGIONS -------- */
+
+struct numa_replica;
+
+/*
+ * Function: numa_alloc_interleaved()
+ * Input:
+ *     size_t size: The number of bytes to map.
+ *     const cpuset_t *mask: The domains to spread over, NULL for all.
+ *     size_t stripe: Bytes placed on one domain before moving to the next,
+ *          rounded up to a multiple of the page size.
+ * Output: Returns the page aligned region, or NULL with errno set.
+ * Summary: Maps an anonymous region and backs it stripe by stripe on the
+ *      domains of mask in turn, so sequential access draws on the memory
+ *      bandwidth of all of them.
+ */
+void *numa_alloc_interleaved(size_t size,
+                             const cpuset_t *mask,
+                             size_t stripe);
+
+/*
+ * Function: numa_free_interleaved()
+ * Input:
+ *     void *ptr: A region returned by numa_alloc_interleaved(), may be NULL.
+ *     size_t size: The size it was allocated with.
+ * Output: void
+ * Summary: Unmaps the region.
+ */
+void numa_free_interleaved(void *ptr,
+                           size_t size);
+
+/*
+ * Function: numa_alloc_replicated()
+ * Input:
+ *     size_t size: The number of bytes of the region.
+ *     const cpuset_t *mask: The domains that get a replica, NULL for all.
+ * Output: Returns the replicated region, or NULL with errno set.
+ * Summary: Allocates one copy of a read-mostly region on every domain of
+ *      mask, plus a master copy for the writer.  All copies start zeroed.
+ */
+struct numa_replica *numa_alloc_replicated(size_t size,
+                                           const cpuset_t *mask);
+
+/*
+ * Function: numa_replica_master()
+ * Input:
+ *     struct numa_replica *r: The region.
+ * Output: Returns the writable master copy.
+ * Summary: Changes to the master reach readers only through
+ *      numa_replica_publish().
+ */
+void *numa_replica_master(struct numa_replica *r);
+
+/*
+ * Function: numa_replica_publish()
+ * Input:
+ *     struct numa_replica *r: The region.
+ * Output: void
+ * Summary: Copies the master to every replica and switches readers to the
+ *      new contents at once.  Readers are never blocked.
+ */
+void numa_replica_publish(struct numa_replica *r);
+
+/*
+ * Function: numa_replica_local()
+ * Input:
+ *     struct numa_replica *r: The region.
+ * Output: Returns the replica of the calling thread's domain, or of the
+ *      nearest domain that has one.
+ * Summary: Lock free and without syscalls.  The pointer stays valid until
+ *      the second numa_replica_publish() after the call; long readers should
+ *      call it again instead of caching it.
+ */
+const void *numa_replica_local(struct numa_replica *r);
+
+/*
+ * Function: numa_free_replicated()
+ * Input:
+ *     struct numa_replica *r: The region, may be NULL.
+ * Output: void
+ * Summary: Unmaps all copies.  No reader may still use the region.
+ */
+void numa_free_replicated(struct numa_replica *r);
+
+/*
+ * Function: numa_set_range_policy()
+ * Input:
+ *     void *addr: The start of a mapped range.
+ *     size_t len: The length of the range in bytes.
+ *     const cpuset_t *mask: The allowed domains, NULL for all of them.
+ *     int policy: NUMA_POLICY_NEAREST or NUMA_POLICY_INTERLEAVE, or 0 to
+ *          remove the range policy.
+ *     int flags: 0 to let the kernel's scanner move the pages already
+ *          resident over the next periods, NUMA_MOVE or NUMA_MOVE_ALL to
+ *          move them now.
+ * Output: Returns 1 on success. Returns 0 on failure, or on a simulated
+ *      topology.
+ * Summary: Attaches the policy to the memory behind the range with mbind(),
+ *      so the pages shared by every process (a MAP_SHARED mapping, a SysV
+ *      segment, a mapped file) end up alike.  The range must be backed
+ *      already: anonymous shared mappings and files are, private anonymous
+ *      memory only once touched.
+ */
+int numa_set_range_policy(void *addr,
+                          size_t len,
+                          const cpuset_t *mask,
+                          int policy,
+                          int flags);
+
+/*
+ * Function: numa_get_range_info()
+ * Input:
+ *     void *addr: The start of a mapped range.
+ *     size_t len: The length of the range in bytes.
+ *     struct numa_range_info *info: Filled with the range policy at addr and
+ *          the resident pages of the range per domain.
+ * Output: Returns 1 on success. Returns 0 on failure, or on a simulated
+ *      topology.
+ */
+int numa_get_range_info(void *addr,
+                        size_t len,
+                        struct numa_range_info *info);
+
+/*
+ * NUMA_PART_BLOCK: One contiguous block per domain, rounded to pages.
+ * NUMA_PART_CYCLIC: Units of the given size, rounded up to pages, dealt to
+ *      the domains round-robin.
+ * NUMA_PART_PAGE: Single pages dealt to the domains round-robin.
+ */
+#define NUMA_PART_BLOCK         0
+#define NUMA_PART_CYCLIC        1
+#define NUMA_PART_PAGE          2
+
+/*
+ * Called by numa_first_touch() for each partition, from a worker running on
+ * the partition's domain, or from the caller if the worker could not be
+ * started.  part is the partition, at offset off from the start of the buffer.
+ */
+typedef void numa_init_fn(void *part, size_t off, size_t len, void *arg);
+
+/*
+ * npr_pages: Pages checked.
+ * npr_placed: Resident pages on the domain their partition maps to.
+ * npr_misplaced: Resident pages on another domain.
+ * npr_absent: Pages not resident.
+ * npr_unknown: Resident pages whose domain could not be queried, which is
+ *      all of them on a simulated topology.
+ */
+struct numa_place_report {
+	long		npr_pages;
+	long		npr_placed;
+	long		npr_misplaced;
+	long		npr_absent;
+	long		npr_unknown;
+};
+
+/*
+ * Function: numa_part_domain()
+ * Input:
+ *     size_t len: The length of the buffer in bytes.
+ *     int part: One of NUMA_PART_BLOCK, NUMA_PART_CYCLIC or NUMA_PART_PAGE.
+ *     size_t unit: The unit for NUMA_PART_CYCLIC, ignored otherwise.
+ *     size_t off: An offset in the buffer.
+ * Output: Returns the domain the byte at off is initialized on, or -1 if off
+ *      is past the end of the buffer.
+ */
+int numa_part_domain(size_t len,
+                     int part,
+                     size_t unit,
+                     size_t off);
+
+/*
+ * Function: numa_first_touch()
+ * Input:
+ *     void *buf: A page aligned buffer, usually not faulted in yet.
+ *     size_t len: The length of the buffer in bytes.
+ *     int part: One of NUMA_PART_BLOCK, NUMA_PART_CYCLIC or NUMA_PART_PAGE.
+ *     size_t unit: The unit for NUMA_PART_CYCLIC, ignored otherwise.
+ *     numa_init_fn *fn: Initializes one partition, or NULL to zero it.
+ *     void *arg: Passed to fn.
+ * Output: Returns 1 on success. Returns 0 if the pages of a domain could
+ *      not be moved there; the buffer is initialized all the same.
+ * Summary: Starts one worker per domain, run on the CPUs of the domain with
+ *      set_thread_on_domain() where it has any, and has it fault in the
+ *      partitions of that domain, move them there with move_pages() and
+ *      initialize them.  If a worker cannot be started the caller does its
+ *      share.  No thread's memory policy or affinity is changed.  Returns
+ *      once the whole buffer is initialized.
+ */
+int numa_first_touch(void *buf,
+                     size_t len,
+                     int part,
+                     size_t unit,
+                     numa_init_fn *fn,
+                     void *arg);
+
+/*
+ * Function: numa_verify_placement()
+ * Input:
+ *     void *buf: A buffer set up by numa_first_touch().
+ *     size_t len: The length of the buffer in bytes.
+ *     int part: The partitioning given to numa_first_touch().
+ *     size_t unit: The unit given to numa_first_touch().
+ *     struct numa_place_report *r: Filled with the page counts.
+ * Output: Returns 1 on success, 0 on failure.
+ * Summary: Queries the domain of every page with move_pages() and compares
+ *      it with numa_part_domain().  On a simulated topology only residency
+ *      is checked.
+ */
+int numa_verify_placement(void *buf,
+                          size_t len,
+                          int part,
+                          size_t unit,
+                          struct numa_place_report *r);
+
+
+/* ---------- NUMA THREAD POOL ---- */
+
+/*
+ * NUMA_POOL_FLAT: Put all workers in one group, ignoring domains when
+ *      queueing and stealing.  Meant as a baseline for comparisons.
+ */
+#define NUMA_POOL_FLAT          0x1
+
+typedef void numa_task_t(void *arg);
+
+struct numa_pool;
+
+/*
+ * nps_executed: Tasks run.
+ * nps_stolen_local: Tasks taken from the deque of a worker of the same domain.
+ * nps_stolen_remote: Tasks taken from the deque of a worker of another domain.
+ * nps_affine: Tasks submitted for a domain.
+ * nps_local: Tasks submitted for a domain that ran on it.
+ */
+struct numa_pool_stats {
+	uint64_t	nps_executed;
+	uint64_t	nps_stolen_local;
+	uint64_t	nps_stolen_remote;
+	uint64_t	nps_affine;
+	uint64_t	nps_local;
+};
+
+/*
+ * Function: numa_pool_create()
+ * Input:
+ *     int workers: Workers per domain, 0 for one per CPU of the domain.
+ *     int flags: 0 or NUMA_POOL_FLAT.
+ * Output: Returns the new pool, or NULL with errno set.
+ * Summary: Starts one group of workers per domain with CPUs, each worker
+ *      pinned to its domain.  An idle worker takes work from its own domain
+ *      first, then from the other domains by increasing distance.
+ */
+struct numa_pool *numa_pool_create(int workers,
+                                   int flags);
+
+/*
+ * Function: numa_pool_submit()
+ * Input:
+ *     struct numa_pool *pool: The pool.
+ *     numa_task_t *fn: The function to run.
+ *     void *arg: The argument passed to fn.
+ * Output: Returns 1 on success. Returns 0 on failure.
+ * Summary: Queues fn on the calling worker's domain, or spreads tasks over the
+ *      domains round-robin when called from outside the pool, passing over
+ *      domains at NUMA_PRESSURE_HIGH.
+ */
+int numa_pool_submit(struct numa_pool *pool,
+                     numa_task_t *fn,
+                     void *arg);
+
+/*
+ * Function: numa_pool_submit_domain()
+ * Input:
+ *     struct numa_pool *pool: The pool.
+ *     int domain: The domain fn should run on.
+ *     numa_task_t *fn: The function to run.
+ *     void *arg: The argument passed to fn.
+ * Output: Returns 1 on success. Returns 0 on failure.
+ * Summary: Queues fn on the workers of domain, or of the nearest domain with
+ *      CPUs.  Other domains only get it by stealing when they run dry.
+ */
+int numa_pool_submit_domain(struct numa_pool *pool,
+                            int domain,
+                            numa_task_t *fn,
+                            void *arg);
+
+/*
+ * Function: numa_pool_submit_data()
+ * Input:
+ *     struct numa_pool *pool: The pool.
+ *     const void *data: Memory returned by numa_malloc() the task works on.
+ *     numa_task_t *fn: The function to run.
+ *     void *arg: The argument passed to fn.
+ * Output: Returns 1 on success. Returns 0 on failure.
+ * Summary: numa_pool_submit_domain() on the domain owning data, or
+ *      numa_pool_submit() if data is not from numa_malloc().
+ */
+int numa_pool_submit_data(struct numa_pool *pool,
+                          const void *data,
+                          numa_task_t *fn,
+                          void *arg);
+
+/*
+ * Function: numa_pool_wait()
+ * Input:
+ *     struct numa_pool *pool: The pool.
+ * Output: void
+ * Summary: Waits until every submitted task, including tasks submitted by
+ *      tasks, has finished.  Must not be called from a task.
+ */
+void numa_pool_wait(struct numa_pool *pool);
+
+/*
+ * Function: numa_pool_stats()
+ * Input:
+ *     struct numa_pool *pool: The pool.
+ *     struct numa_pool_stats *st: Filled with the pool's counters.
+ * Output: void
+ * Summary: The counters are exact once numa_pool_wait() has returned.
+ */
+void numa_pool_stats(struct numa_pool *pool,
+                     struct numa_pool_stats *st);
+
+/*
+ * Function: numa_pool_destroy()
+ * Input:
+ *     struct numa_pool *pool: The pool, may be NULL.
+ * Output: void
+ * Summary: Waits for the queued tasks, then stops and frees the workers.
+ */
+void numa_pool_destroy(struct numa_pool *pool);
+
+
+/* ---------- NUMA SYNC ----------- */
+
+/*
+ * NUMA_REDUCE_MAX: The largest value numa_barrier_reduce() combines.
+ */
+#define NUMA_REDUCE_MAX         64
+
+typedef void numa_reduce_fn(void *acc, const void *val);
+
+struct numa_barrier;
+struct numa_rwlock;
+
+/*
+ * nrt_domain: The domain whose reader count the read lock was taken on.
+ * Summary: Kept by a reader between numa_rwlock_rdlock() and
+ *      numa_rwlock_rdunlock(), usually on its stack, like an rmlock(9)
+ *      tracker.  The thread may change domains while it holds the lock.
+ */
+struct numa_rwlock_tracker {
+	int		nrt_domain;
+};
+
+/*
+ * Function: numa_barrier_create()
+ * Input:
+ *     const int *count: The number of threads of every domain taking part,
+ *          one entry per domain.  NULL for one thread per CPU of each domain.
+ * Output: Returns the new barrier, or NULL with errno set.
+ * Summary: Threads meet first on a counter of their own domain, placed on
+ *      that domain; the last of each domain then meets the other domains'
+ *      last on a global counter.  A thread waiting spins on a line of its
+ *      own domain only, so one episode moves a line between domains once
+ *      per domain rather than once per thread.  A thread's domain is the one
+ *      it runs on when it enters the barrier; threads must not be moved
+ *      across domains between episodes.
+ */
+struct numa_barrier *numa_barrier_create(const int *count);
+
+/*
+ * Function: numa_barrier_wait()
+ * Input:
+ *     struct numa_barrier *b: The barrier.
+ * Output: Returns 1 to one thread of the episode, 0 to the others.
+ * Summary: Blocks until all threads counted by numa_barrier_create() have
+ *      called it, spinning for a while and then yielding the CPU.
+ */
+int numa_barrier_wait(struct numa_barrier *b);
+
+/*
+ * Function: numa_barrier_reduce()
+ * Input:
+ *     struct numa_barrier *b: The barrier.
+ *     void *val: The calling thread's value, replaced by the result.
+ *     size_t size: The size of the value, at most NUMA_REDUCE_MAX bytes.
+ *     numa_reduce_fn *fn: Combines val into acc.  Must be associative and
+ *          commutative; the order values are combined in is not fixed.
+ * Output: Returns 1 to one thread of the episode, 0 to the others. Returns -1
+ *      with errno set to EINVAL if size is too large.
+ * Summary: A barrier episode that also combines the values of all threads.
+ *      The last thread of each domain combines the values of its domain, the
+ *      last domain the per-domain results, and every thread gets the result
+ *      back from a copy on its own domain.  All threads of an episode must
+ *      call it with the same size and fn.
+ */
+int numa_barrier_reduce(struct numa_barrier *b,
+                        void *val,
+                        size_t size,
+                        numa_reduce_fn *fn);
+
+/*
+ * Function: numa_barrier_destroy()
+ * Input:
+ *     struct numa_barrier *b: The barrier, may be NULL.
+ * Output: void
+ * Summary: No thread may be waiting on the barrier.
+ */
+void numa_barrier_destroy(struct numa_barrier *b);
+
+/*
+ * Function: numa_rwlock_create()
+ * Input: void
+ * Output: Returns the new lock, or NULL with errno set.
+ * Summary: A reader-writer lock with one reader count per domain, each on a
+ *      cache line of its domain.  Readers only write the count of their own
+ *      domain and read the writer flag, which stays shared in every cache as
+ *      long as no writer comes.  Writers set the flag and wait for every
+ *      domain's count to drain, so they pay for the split; waiting writers
+ *      hold off new readers.
+ */
+struct numa_rwlock *numa_rwlock_create(void);
+
+/*
+ * Function: numa_rwlock_rdlock()
+ * Input:
+ *     struct numa_rwlock *l: The lock.
+ *     struct numa_rwlock_tracker *tr: Filled for numa_rwlock_rdunlock().
+ * Output: void
+ * Summary: Takes the lock shared.  Not recursive against a writer waiting.
+ */
+void numa_rwlock_rdlock(struct numa_rwlock *l,
+                        struct numa_rwlock_tracker *tr);
+
+/*
+ * Function: numa_rwlock_rdunlock()
+ * Input:
+ *     struct numa_rwlock *l: The lock.
+ *     struct numa_rwlock_tracker *tr: As filled by numa_rwlock_rdlock().
+ * Output: void
+ */
+void numa_rwlock_rdunlock(struct numa_rwlock *l,
+                          struct numa_rwlock_tracker *tr);
+
+/*
+ * Function: numa_rwlock_wrlock()
+ * Input:
+ *     struct numa_rwlock *l: The lock.
+ * Output: void
+ * Summary: Takes the lock exclusive.  Writers queue on a mutex.
+ */
+void numa_rwlock_wrlock(struct numa_rwlock *l);
+
+/*
+ * Function: numa_rwlock_wrunlock()
+ * Input:
+ *     struct numa_rwlock *l: The lock.
+ * Output: void
+ */
+void numa_rwlock_wrunlock(struct numa_rwlock *l);
+
+/*
+ * Function: numa_rwlock_destroy()
+ * Input:
+ *     struct numa_rwlock *l: The lock, may be NULL.
+ * Output: void
+ * Summary: The lock must not be held.
+ */
+void numa_rwlock_destroy(struct numa_rwlock *l);
+
+
+/* ---------- NUMA TRACING -------- */
+
+/*
+ * NUMA_TRACE_ALLOC: numa_malloc() or numa_malloc_onnode() returned a block.
+ * NUMA_TRACE_FREE: numa_free() released a block.
+ * NUMA_TRACE_TASK: A pool task ran.
+ * NUMA_TRACE_PAGE: The kernel placed a page (numa::policy:place).
+ * NUMA_TRACE_MIGRATE: The kernel moved a page (numa::page:migrate).
+ * Summary: Event kinds.  The library emits the first three, the last two
+ *      come from the numa DTrace provider through numa_trace.d, so one
+ *      aggregator reads both.
+ */
+#define NUMA_TRACE_ALLOC        1
+#define NUMA_TRACE_FREE         2
+#define NUMA_TRACE_TASK         3
+#define NUMA_TRACE_PAGE         4
+#define NUMA_TRACE_MIGRATE      5
+
+/*
+ * nte_from: Domain of the CPU making the request, the task's submitter or
+ *      the source of a moved page.  -1 if unknown.
+ * nte_want: Domain asked for, -1 for any.
+ * nte_got: Domain that served the request.
+ * nte_bytes: Size of the block or page, 0 for tasks.
+ */
+struct numa_trace_event {
+	int		nte_kind;
+	int		nte_from;
+	int		nte_want;
+	int		nte_got;
+	size_t		nte_bytes;
+};
+
+typedef void numa_trace_fn(const struct numa_trace_event *ev, void *arg);
+
+/*
+ * Function: numa_trace_set()
+ * Input:
+ *     numa_trace_fn *fn: Called for every event, from the thread causing it.
+ *          NULL turns tracing off.
+ *     void *arg: Passed to fn.
+ * Output: void
+ * Summary: Installs the trace hook of the allocator and the thread pool.
+ *      While no hook is installed tracing costs a load and a branch per
+ *      call.  fn must not call numa_malloc(), numa_free() or
+ *      numa_trace_set().  Returns once no thread calls the previous hook any
+ *      more, so its argument may be released then.
+ */
+void numa_trace_set(numa_trace_fn *fn,
+                    void *arg);
+
+/*
+ * Function: numa_trace_file()
+ * Input:
+ *     const char *path: File to write the trace to, NULL to stop tracing and
+ *          close the file.
+ * Output: Returns 1 on success. Returns 0 on failure.
+ * Summary: Installs a hook writing one line per event, "kind from want got
+ *      bytes", the format read by "numanor heatmap".  Setting NUMANOR_TRACE
+ *      in the environment does the same when the allocator starts.
+ */
+int numa_trace_file(const char *path);
+
 
 #endif /* __NUMANOR_H__ */
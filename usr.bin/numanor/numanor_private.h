@@ -0,0 +1,420 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * Internal interfaces shared between the numanor library sources.  Nothing in
+ * here is part of the public numanor.h API.
+ */
+
+#ifndef __NUMANOR_PRIVATE_H__
+#define __NUMANOR_PRIVATE_H__
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/types.h>
+
+#include <stdatomic.h>
+
+#include "numanor.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+/*
+ * NUMA_CACHELINE: Alignment used to keep per-domain and per-thread state from
+ *      sharing cache lines.
+ * NUMA_DOMAIN_RECHECK: Number of lookups between two refreshes of the cached
+ *      domain of the calling thread.
+ * NUMA_SUPERPAGE_SIZE: Size and alignment of a superpage.
+ */
+#define NUMA_CACHELINE          64
+#define NUMA_DOMAIN_RECHECK     1024
+#define NUMA_SUPERPAGE_SIZE     ((size_t)2 << 20)
+
+/*
+ * numa_simulated: Non-zero when the topology was installed by numa_simulate()
+ *      rather than read from the kernel.  No syscalls are made for placement
+ *      while it is set.
+ */
+extern int numa_simulated;
+
+/*
+ * numa_trace_hook: The function installed by numa_trace_set(), or NULL.
+ * NUMA_TRACING(): True while a hook is installed.  Callers test it before
+ *      collecting the event so a disabled trace costs nothing else.
+ */
+extern numa_trace_fn *_Atomic numa_trace_hook;
+
+#define NUMA_TRACING()                                                  \
+        __predict_false(atomic_load_explicit(&numa_trace_hook,          \
+            memory_order_relaxed) != NULL)
+
+
+/* ---------- INTERNAL LIBRARY ---- */
+
+/*
+ * Function: numa_trace()
+ * Input: The fields of a struct numa_trace_event.
+ * Output: void
+ * Summary: Passes the event to the installed hook, if any.
+ */
+void numa_trace(int kind,
+                int from,
+                int want,
+                int got,
+                size_t bytes);
+
+/*
+ * Function: numa_thread_domain()
+ * Input: void
+ * Output: Returns the domain the calling thread currently runs on.
+ * Summary: Read with numa_current_cpu() where possible.  Otherwise looked up
+ *      from the thread's CPU affinity and cached per thread for
+ *      NUMA_DOMAIN_RECHECK calls.
+ */
+int numa_thread_domain(void);
+
+/*
+ * Function: numa_current_cpu()
+ * Input: void
+ * Output: Returns the CPU the calling thread runs on, or -1 if that cannot
+ *      be told without a syscall.
+ */
+int numa_current_cpu(void);
+
+/*
+ * Function: numa_pressure_refresh()
+ * Input: void
+ * Output: void
+ * Summary: Reads the pressure levels of all domains with get_numa_meminfo()
+ *      if the last read is older than NUMA_PRESSURE_INTERVAL ms.  Called on
+ *      the slow paths that take new memory from the kernel.
+ */
+void numa_pressure_refresh(void);
+
+/*
+ * Function: numa_pressure_avoid()
+ * Input:
+ *     int domain: The domain an allocation or task would go to.
+ * Output: Returns domain, or the nearest domain not at NUMA_PRESSURE_HIGH if
+ *      domain is.  Returns domain if every domain is.
+ * Summary: Uses the levels of the last numa_pressure_refresh(), so it costs a
+ *      load when domain is fine.
+ */
+int numa_pressure_avoid(int domain);
+
+/*
+ * Function: numa_thread_policy()
+ * Input: void
+ * Output: Returns the allocation policy of the calling thread.
+ * Summary: NUMA_POLICY_NEAREST unless changed by set_memory_policy().
+ */
+int numa_thread_policy(void);
+
+/*
+ * Function: numa_bind_range()
+ * Input:
+ *     void *addr: Page aligned start of a fresh anonymous mapping.
+ *     size_t len: Length of the mapping in bytes.
+ *     int domain: The domain the pages should be backed by.
+ * Output: Returns 1 on success. Returns 0 on failure.
+ * Summary: Faults in the first page, attaches a NUMA_POLICY_NEAREST range
+ *      policy for domain with mbind(NUMA_MOVE), which also moves that page,
+ *      and faults in the rest, so the kernel allocates it on domain. Falls
+ *      back to numa_bind_stripes() if mbind() fails. The thread's own memory
+ *      affinity is left alone.
+ */
+int numa_bind_range(void *addr,
+                    size_t len,
+                    int domain);
+
+/*
+ * Function: numa_bind_stripes()
+ * Input:
+ *     void *addr: Page aligned start of a fresh anonymous mapping.
+ *     size_t len: Length of the mapping in bytes.
+ *     size_t stripe: Bytes per stripe, a multiple of the page size.
+ *     const int *domains: The domains to deal the stripes to, in order.
+ *     int ndomains: The number of entries of domains.
+ * Output: Returns 1 on success. Returns 0 on failure.
+ * Summary: Backs stripe i of the range by domains[i % ndomains]: faults
+ *      the pages in NUMA_BIND_BATCH at a time and moves them with
+ *      move_pages(). A page the kernel could not move, because its target
+ *      domain is full, stays where it was faulted in. Fails only if
+ *      move_pages() does.
+ */
+int numa_bind_stripes(void *addr,
+                      size_t len,
+                      size_t stripe,
+                      const int *domains,
+                      int ndomains);
+
+/*
+ * Function: numa_tcache_move()
+ * Input:
+ *     int from: The domain the calling thread was moved away from.
+ *     size_t *len: Set to the size of the thread cache.
+ * Output: Returns the thread cache of the calling thread, or NULL if it has
+ *      none yet.
+ * Summary: Returns the blocks the thread cached for its own use on from to
+ *      that domain's arena, where the threads still running there can reuse
+ *      them.  The caller moves the pages of the returned cache itself.
+ */
+void *numa_tcache_move(int from,
+                       size_t *len);
+
+/*
+ * Function: numa_super_take()
+ * Input:
+ *     int domain: The domain whose reservation to take from.
+ *     size_t len: The number of bytes, a multiple of 1 MB.
+ * Output: Returns len bytes of the domain's superpage reservation, already
+ *      faulted in and aligned to len, or NULL if there is none or too little
+ *      left.
+ * Summary: Called by the arena allocator before it maps a new chunk.  The
+ *      memory is never given back.
+ */
+void *numa_super_take(int domain,
+                      size_t len);
+
+/*
+ * Function: numa_parse_cpulist()
+ * Input:
+ *     const char *s: A list of CPUs or domains such as "0-3,8".
+ *     cpuset_t *set: The set to fill.
+ * Output: Returns 1 on success. Returns 0 on a malformed list.
+ */
+int numa_parse_cpulist(const char *s,
+                       cpuset_t *set);
+
+/*
+ * Function: sim_policy()
+ * Input: argc and argv of the "policy" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Replays the kernel's numa_policy_order() decisions for a policy
+ *      on a simulated topology.
+ */
+int sim_policy(int argc,
+               char **argv);
+
+/*
+ * Function: sim_balance()
+ * Input: argc and argv of the "balance" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Replays an access trace through the kernel's automatic balancing
+ *      decisions.
+ */
+int sim_balance(int argc,
+                char **argv);
+
+/*
+ * Function: sim_sched()
+ * Input: argc and argv of the "sched" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Replays a load trace through a model of ULE with and without the
+ *      kernel's scheduling hints.
+ */
+int sim_sched(int argc,
+              char **argv);
+
+/*
+ * Function: sim_tier()
+ * Input: argc and argv of the "tier" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Replays a shifting hot set on a topology with memory-only
+ *      domains through the kernel's tier and balancing decisions, and
+ *      compares the mean access latency with flat placement.
+ */
+int sim_tier(int argc,
+             char **argv);
+
+/*
+ * Function: bench_malloc()
+ * Input: argc and argv of the "malloc" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Multithreaded numa_malloc()/numa_free() throughput benchmark.
+ */
+int bench_malloc(int argc,
+                 char **argv);
+
+/*
+ * Function: bench_pool()
+ * Input: argc and argv of the "pool" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Domain-aware thread pool against a flat pool on the same workers.
+ */
+int bench_pool(int argc,
+               char **argv);
+
+/*
+ * Function: bench_thread()
+ * Input: argc and argv of the "thread" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Moves the calling thread between domains with MEM_MIGRATE and
+ *      checks where it and its allocations end up.
+ */
+int bench_thread(int argc,
+                 char **argv);
+
+/*
+ * Function: bench_move()
+ * Input: argc and argv of the "move" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: move_pages() migration rate per batch size.
+ */
+int bench_move(int argc,
+               char **argv);
+
+/*
+ * Function: bench_affinity()
+ * Input: argc and argv of the "affinity" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Per-thread memory policy changes through single and vectored
+ *      calls.
+ */
+int bench_affinity(int argc,
+                   char **argv);
+
+/*
+ * Function: bench_super()
+ * Input: argc and argv of the "super" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Random access latency over arena blocks on small pages and on a
+ *      superpage reservation.
+ */
+int bench_super(int argc,
+                char **argv);
+
+/*
+ * Function: bench_shared()
+ * Input: argc and argv of the "shared" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Placement and latency of a cache shared between processes, with
+ *      and without a range policy.
+ */
+int bench_shared(int argc,
+                 char **argv);
+
+/*
+ * Function: bench_cache()
+ * Input: argc and argv of the "cache" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Producer/consumer throughput with frees on a remote domain, for
+ *      numa_cache, numa_malloc() and libc.
+ */
+int bench_cache(int argc,
+                char **argv);
+
+/*
+ * Function: bench_init()
+ * Input: argc and argv of the "init" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Time and placement of single threaded and per-domain first-touch
+ *      initialization.
+ */
+int bench_init(int argc,
+               char **argv);
+
+/*
+ * Function: bench_io()
+ * Input: argc and argv of the "io" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: readv()/writev() throughput of pinned threads with per-domain
+ *      buffer pools and with one shared pool.
+ */
+int bench_io(int argc,
+             char **argv);
+
+/*
+ * Function: bench_mask()
+ * Input: argc and argv of the "mask" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: The numa_mask functions against the CPU_ISSET() loops they
+ *      replace.
+ */
+int bench_mask(int argc,
+               char **argv);
+
+/*
+ * Function: bench_sync()
+ * Input: argc and argv of the "sync" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Domain-hierarchical barrier, reduction and rwlock against their
+ *      pthread counterparts.
+ */
+int bench_sync(int argc,
+               char **argv);
+
+/*
+ * Function: bench_chain_fill()
+ * Input:
+ *     void *buf: The buffer, a multiple of NUMA_CACHELINE bytes.
+ *     size_t size: Its length in bytes.
+ * Output: void
+ * Summary: Writes one random cycle through the cache lines of buf (Sattolo's
+ *      shuffle).  The first word of line i holds the index of the line after
+ *      it, the other words hold their own word index.  The order is the same
+ *      on every call.
+ */
+void bench_chain_fill(void *buf,
+                      size_t size);
+
+/*
+ * Function: bench_place()
+ * Input: argc and argv of the "place" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Bandwidth and latency of first-touch, interleaved and replicated
+ *      regions.
+ */
+int bench_place(int argc,
+                char **argv);
+
+/*
+ * Function: bench_matrix()
+ * Input: argc and argv of the "matrix" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Latency and bandwidth of every CPU domain, memory domain pair,
+ *      compared with the reported weights.
+ */
+int bench_matrix(int argc,
+                 char **argv);
+
+/*
+ * Function: numa_trace_heatmap()
+ * Input: argc and argv of the "heatmap" subcommand.
+ * Output: Returns the exit status of the subcommand.
+ * Summary: Aggregates trace files into per-domain heatmaps.
+ */
+int numa_trace_heatmap(int argc,
+                       char **argv);
+
+
+#endif /* __NUMANOR_PRIVATE_H__ */
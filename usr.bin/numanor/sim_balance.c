@@ -0,0 +1,375 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor balance: replay of the kernel's automatic balancing decisions.
+ * The harness runs numa_balance_decide() from freebsdnuma.h on an access
+ * trace the same way the numa_balance kernel thread does, as if every page
+ * were part of the sample: only the first access to a page within a period
+ * faults, and is credited to the page (by the thread's domain) and to the
+ * thread (by the page's domain).
+ *
+ * A trace is a list of lines:
+ *
+ *      page <page> <domain>    place a page
+ *      thread <thread> <domain> place a thread
+ *      access <thread> <page>  the thread touches the page
+ *      period                  end of a sampling period
+ *
+ * With -g the trace is generated instead: one thread per domain, every page
+ * first touched on domain 0 and owned by thread page % domains, one page in
+ * ten shared by all threads in random order, ownership rotating by one
+ * domain halfway through.  Pages moved back to the domain they left are
+ * counted as bounces; with the defaults only the ownership change should
+ * cause them.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define SIM_BALANCE_PAGES       1024    /* pages of a generated trace */
+
+struct sim_page {
+	int		sp_domain;	/* -1 if never placed */
+	int		sp_prev;	/* domain before the last move */
+	int		sp_faulted;	/* faulted in this period */
+	struct numa_balance_stat sp_stat;
+};
+
+struct sim_thread {
+	int		st_domain;	/* -1 if never placed */
+	struct numa_balance_stat st_stat;
+};
+
+struct sim_balance {
+	int		sb_ndomains;
+	int		sb_quiet;
+	int		sb_apply;	/* move threads to suggested domains */
+	struct numa_balance_tun sb_ptun;
+	struct numa_balance_tun sb_ttun;
+	struct sim_page	*sb_pages;
+	long		sb_npages;
+	struct sim_thread *sb_threads;
+	long		sb_nthreads;
+	long		sb_period;
+	long		sb_accesses;
+	long		sb_faults;
+	long		sb_local;
+	long		sb_moves;
+	long		sb_bounces;
+	long		sb_hints;
+};
+
+
+/* ---------- SIMULATION ---------- */
+
+static void
+sim_balance_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor balance [-S domains | -f file] "
+	    "[-g periods] [-aq]\n"
+	    "           [-m min_faults] [-r ratio] [-H hysteresis]\n"
+	    "           [-M thread_min_faults] [-R thread_ratio] "
+	    "[-T thread_hysteresis] [trace]\n");
+	exit(1);
+}
+
+static struct sim_page *
+sim_balance_page(struct sim_balance *sb, long id)
+{
+	long n;
+
+	if (id < 0)
+		return (NULL);
+	if (id >= sb->sb_npages) {
+		n = MAX(id + 1, sb->sb_npages * 2);
+		sb->sb_pages = realloc(sb->sb_pages, n * sizeof(*sb->sb_pages));
+		if (sb->sb_pages == NULL)
+			err(1, "realloc");
+		for (; sb->sb_npages < n; sb->sb_npages++) {
+			memset(&sb->sb_pages[sb->sb_npages], 0,
+			    sizeof(*sb->sb_pages));
+			sb->sb_pages[sb->sb_npages].sp_domain = -1;
+			sb->sb_pages[sb->sb_npages].sp_prev = -1;
+			sb->sb_pages[sb->sb_npages].sp_stat.nbs_candidate = -1;
+		}
+	}
+	return (&sb->sb_pages[id]);
+}
+
+static struct sim_thread *
+sim_balance_thread(struct sim_balance *sb, long id)
+{
+	long n;
+
+	if (id < 0)
+		return (NULL);
+	if (id >= sb->sb_nthreads) {
+		n = MAX(id + 1, sb->sb_nthreads * 2);
+		sb->sb_threads = realloc(sb->sb_threads,
+		    n * sizeof(*sb->sb_threads));
+		if (sb->sb_threads == NULL)
+			err(1, "realloc");
+		for (; sb->sb_nthreads < n; sb->sb_nthreads++) {
+			memset(&sb->sb_threads[sb->sb_nthreads], 0,
+			    sizeof(*sb->sb_threads));
+			sb->sb_threads[sb->sb_nthreads].st_domain = -1;
+			sb->sb_threads[sb->sb_nthreads].st_stat.nbs_candidate =
+			    -1;
+		}
+	}
+	return (&sb->sb_threads[id]);
+}
+
+static void
+sim_balance_access(struct sim_balance *sb, long tid, long pid)
+{
+	struct sim_thread *st;
+	struct sim_page *sp;
+
+	st = sim_balance_thread(sb, tid);
+	sp = sim_balance_page(sb, pid);
+	if (st == NULL || sp == NULL || st->st_domain < 0)
+		return;
+	sb->sb_accesses++;
+	/* An access that finds the page unplaced is its first touch. */
+	if (sp->sp_domain < 0)
+		sp->sp_domain = st->st_domain;
+	if (sp->sp_faulted)
+		return;
+	sp->sp_faulted = 1;
+	sb->sb_faults++;
+	if (sp->sp_domain == st->st_domain)
+		sb->sb_local++;
+	numa_balance_record(&sp->sp_stat, st->st_domain);
+	numa_balance_record(&st->st_stat, sp->sp_domain);
+}
+
+static void
+sim_balance_period(struct sim_balance *sb)
+{
+	struct sim_thread *st;
+	struct sim_page *sp;
+	long i;
+	int d;
+
+	for (i = 0; i < sb->sb_npages; i++) {
+		sp = &sb->sb_pages[i];
+		sp->sp_faulted = 0;
+		if (sp->sp_domain < 0)
+			continue;
+		d = numa_balance_decide(&sp->sp_stat, sb->sb_ndomains,
+		    sp->sp_domain, &sb->sb_ptun);
+		if (d < 0)
+			continue;
+		sb->sb_moves++;
+		if (d == sp->sp_prev)
+			sb->sb_bounces++;
+		if (!sb->sb_quiet)
+			printf("period %ld: page %ld %d -> %d\n", sb->sb_period,
+			    i, sp->sp_domain, d);
+		sp->sp_prev = sp->sp_domain;
+		sp->sp_domain = d;
+	}
+	for (i = 0; i < sb->sb_nthreads; i++) {
+		st = &sb->sb_threads[i];
+		if (st->st_domain < 0)
+			continue;
+		d = numa_balance_decide(&st->st_stat, sb->sb_ndomains,
+		    st->st_domain, &sb->sb_ttun);
+		if (d < 0)
+			continue;
+		sb->sb_hints++;
+		if (!sb->sb_quiet)
+			printf("period %ld: thread %ld %d -> %d%s\n",
+			    sb->sb_period, i, st->st_domain, d,
+			    sb->sb_apply ? "" : " (hint)");
+		if (sb->sb_apply)
+			st->st_domain = d;
+	}
+	sb->sb_period++;
+}
+
+static void
+sim_balance_trace(struct sim_balance *sb, FILE *fp, const char *name)
+{
+	char line[256], cmd[16];
+	long a, b, lineno;
+	int n;
+
+	lineno = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0')
+			continue;
+		n = sscanf(line, "%15s %ld %ld", cmd, &a, &b);
+		if (strcmp(cmd, "period") == 0 && n == 1)
+			sim_balance_period(sb);
+		else if (strcmp(cmd, "access") == 0 && n == 3)
+			sim_balance_access(sb, a, b);
+		else if (strcmp(cmd, "page") == 0 && n == 3 && b >= 0 &&
+		    b < sb->sb_ndomains && sim_balance_page(sb, a) != NULL)
+			sim_balance_page(sb, a)->sp_domain = b;
+		else if (strcmp(cmd, "thread") == 0 && n == 3 && b >= 0 &&
+		    b < sb->sb_ndomains && sim_balance_thread(sb, a) != NULL)
+			sim_balance_thread(sb, a)->st_domain = b;
+		else
+			errx(1, "%s:%ld: malformed line", name, lineno);
+	}
+}
+
+static void
+sim_balance_generate(struct sim_balance *sb, long periods)
+{
+	long i, p, shift;
+	int first, t;
+
+	srandom(1);
+
+	for (t = 0; t < sb->sb_ndomains; t++)
+		sim_balance_thread(sb, t)->st_domain = t;
+	for (i = 0; i < SIM_BALANCE_PAGES; i++)
+		sim_balance_page(sb, i)->sp_domain = 0;
+	for (p = 0; p < periods; p++) {
+		shift = p < periods / 2 ? 0 : 1;
+		for (i = 0; i < SIM_BALANCE_PAGES; i++) {
+			/* Any thread may be the one to fault on a shared page. */
+			if (i % 10 == 0) {
+				first = random() % sb->sb_ndomains;
+				for (t = 0; t < sb->sb_ndomains; t++)
+					sim_balance_access(sb,
+					    (first + t) % sb->sb_ndomains, i);
+			} else
+				sim_balance_access(sb,
+				    (i + shift) % sb->sb_ndomains, i);
+		}
+		sim_balance_period(sb);
+	}
+}
+
+int
+sim_balance(int argc, char **argv)
+{
+	const struct numa_topology *t;
+	struct sim_balance sb;
+	FILE *fp;
+	long periods;
+	int ch;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.sb_ptun.nbt_min_faults = 1;
+	sb.sb_ptun.nbt_ratio = 200;
+	sb.sb_ptun.nbt_hysteresis = 2;
+	sb.sb_ttun.nbt_min_faults = 64;
+	sb.sb_ttun.nbt_ratio = 300;
+	sb.sb_ttun.nbt_hysteresis = 3;
+	periods = 0;
+	while ((ch = getopt(argc, argv, "H:M:R:S:T:af:g:m:qr:")) != -1) {
+		switch (ch) {
+		case 'H':
+			sb.sb_ptun.nbt_hysteresis = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			sb.sb_ttun.nbt_min_faults = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			sb.sb_ttun.nbt_ratio = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			if (numa_simulate(atoi(optarg), 1) == 0)
+				errx(1, "invalid domain count %s", optarg);
+			break;
+		case 'T':
+			sb.sb_ttun.nbt_hysteresis = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			sb.sb_apply = 1;
+			break;
+		case 'f':
+			if (numa_topology_load(NUMA_TOPO_FILE, optarg) == 0)
+				errx(1, "cannot load topology from %s", optarg);
+			break;
+		case 'g':
+			periods = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			sb.sb_ptun.nbt_min_faults = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			sb.sb_quiet = 1;
+			break;
+		case 'r':
+			sb.sb_ptun.nbt_ratio = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			sim_balance_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if ((t = numa_topology()) == NULL)
+		errx(1, "NUMA not available, use -S or -f");
+	sb.sb_ndomains = MIN(t->nt_ndomains, NUMA_BALANCE_MAXDOM);
+
+	if (periods > 0)
+		sim_balance_generate(&sb, periods);
+	else if (argc == 0)
+		sim_balance_trace(&sb, stdin, "stdin");
+	else {
+		if ((fp = fopen(argv[0], "r")) == NULL)
+			err(1, "%s", argv[0]);
+		sim_balance_trace(&sb, fp, argv[0]);
+		fclose(fp);
+	}
+
+	printf("periods %ld accesses %ld faults %ld local %.1f%%\n",
+	    sb.sb_period, sb.sb_accesses, sb.sb_faults,
+	    sb.sb_faults > 0 ? 100.0 * sb.sb_local / sb.sb_faults : 0.0);
+	printf("pages moved %ld bounced back %ld thread hints %ld\n",
+	    sb.sb_moves, sb.sb_bounces, sb.sb_hints);
+	free(sb.sb_pages);
+	free(sb.sb_threads);
+	return (0);
+}
@@ -0,0 +1,183 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor policy: deterministic replay of the kernel's page placement
+ * decisions.  The kernel and this harness share numa_policy_order() from
+ * freebsdnuma.h; the kernel moves a page found outside the mask of a
+ * NUMA_POLICY_NEAREST policy to the first domain of that order, taken from
+ * the page's domain.  With -p tiered the memory-only domains of the topology
+ * are tried after the other allowed ones, as numa_tier_order() orders them
+ * for new pages and for the pages the kernel moves.  An interleaved page
+ * starts at the domain its index deals it to and falls back by distance from
+ * there, as numa_policy_domains() does in the kernel.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- SIMULATION ---------- */
+
+/*
+ * The domain page n of an interleaved policy is dealt to: the (n % count)th
+ * domain of the mask, or of all ndomains if the mask is empty.  Mirrors
+ * numa_range_interleave() in kern_numa.c.
+ */
+static int
+sim_policy_interleave(const struct numa_policy *np, int ndomains, long n)
+{
+	int d, k;
+
+	if (CPU_EMPTY(&np->np_mask))
+		return (n % ndomains);
+	k = n % CPU_COUNT(&np->np_mask);
+	for (d = 0; d < ndomains; d++)
+		if (CPU_ISSET(d, &np->np_mask) && k-- == 0)
+			break;
+	return (d);
+}
+
+static void
+sim_policy_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor policy [-S domains [-s slow] | -f file] "
+	    "[-p nearest | interleave | tiered]\n"
+	    "           [-m domainlist] [-H home] [-n pages] [-q]\n");
+	exit(1);
+}
+
+int
+sim_policy(int argc, char **argv)
+{
+	const struct numa_topology *t;
+	struct numa_policy near, np;
+	u_int rr;
+	long n, pages, *hits;
+	int ch, d, home, nd, ndomains, nslow, order[NUMA_MAXDOMAINS], quiet;
+
+	np.np_policy = NUMA_POLICY_NEAREST;
+	CPU_ZERO(&np.np_mask);
+	home = 0;
+	pages = 8;
+	quiet = 0;
+	ndomains = nslow = 0;
+	while ((ch = getopt(argc, argv, "H:S:f:m:n:p:qs:")) != -1) {
+		switch (ch) {
+		case 'H':
+			home = atoi(optarg);
+			break;
+		case 'S':
+			ndomains = atoi(optarg);
+			break;
+		case 'f':
+			if (numa_topology_load(NUMA_TOPO_FILE, optarg) == 0)
+				errx(1, "cannot load topology from %s", optarg);
+			break;
+		case 'm':
+			if (!numa_parse_cpulist(optarg, &np.np_mask))
+				errx(1, "invalid domain list %s", optarg);
+			break;
+		case 'n':
+			pages = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			if (strcmp(optarg, "nearest") == 0)
+				np.np_policy = NUMA_POLICY_NEAREST;
+			else if (strcmp(optarg, "interleave") == 0)
+				np.np_policy = NUMA_POLICY_INTERLEAVE;
+			else if (strcmp(optarg, "tiered") == 0)
+				np.np_policy = NUMA_POLICY_NEAREST |
+				    NUMA_POLICY_TIERED;
+			else
+				sim_policy_usage();
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 's':
+			nslow = atoi(optarg);
+			break;
+		default:
+			sim_policy_usage();
+		}
+	}
+	if (ndomains > 0 && numa_simulate_tiered(ndomains, 1, nslow) == 0)
+		errx(1, "invalid topology of %d domains, %d without CPUs",
+		    ndomains, nslow);
+	if ((t = numa_topology()) == NULL)
+		errx(1, "NUMA not available, use -S or -f");
+	if (home < 0 || home >= t->nt_ndomains)
+		errx(1, "home domain %d out of range", home);
+	for (d = t->nt_ndomains; d < CPU_SETSIZE; d++)
+		if (CPU_ISSET(d, &np.np_mask))
+			errx(1, "domain %d out of range", d);
+	if ((hits = calloc(t->nt_ndomains, sizeof(*hits))) == NULL)
+		err(1, "calloc");
+
+	near = np;
+	if ((np.np_policy & NUMA_POLICY_MASK) == NUMA_POLICY_INTERLEAVE)
+		near.np_policy = NUMA_POLICY_NEAREST;
+	for (n = 0; n < pages; n++) {
+		if ((np.np_policy & NUMA_POLICY_MASK) == NUMA_POLICY_INTERLEAVE)
+			home = sim_policy_interleave(&np, t->nt_ndomains, n);
+		rr = 0;
+		nd = numa_policy_order(&near, t->nt_ndomains,
+		    (const short *)t->nt_weights, home, &rr, order);
+		if ((np.np_policy & NUMA_POLICY_TIERED) != 0)
+			numa_tier_order(t->nt_tier, order,
+			    CPU_EMPTY(&np.np_mask) ? nd : CPU_COUNT(&np.np_mask));
+		hits[order[0]]++;
+		if (quiet)
+			continue;
+		printf("page %ld:", n);
+		for (d = 0; d < nd; d++)
+			printf(" %d", order[d]);
+		printf("\n");
+	}
+	printf("first choice:");
+	for (d = 0; d < t->nt_ndomains; d++)
+		printf(" %d=%ld", d, hits[d]);
+	printf("\n");
+	free(hits);
+	return (0);
+}
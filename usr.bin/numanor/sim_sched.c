@@ -0,0 +1,560 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor sched: replay of a load trace through a model of ULE, once as ULE
+ * places threads today ("flat": least loaded CPU, steal from the busiest
+ * CPU) and once with the scheduling hints of freebsdnuma.h ("numa").  Every
+ * thread is treated as a process of its own, with a home domain that
+ * numa_sched_rehome() moves after its resident pages every period.
+ *
+ * A trace is a list of lines:
+ *
+ *      pages <thread> <domain> <n>     the thread has n pages on the domain
+ *      wake <thread> <ticks>           the thread needs ticks of CPU time
+ *      tick [n]                        n scheduler ticks pass
+ *
+ * A CPU runs the thread at the head of its queue for one tick and moves it
+ * to the tail.  An idle CPU steals the last thread of the busiest CPU,
+ * looking at its own domain first.  Each tick a thread runs costs the mean
+ * distance from its CPU to its pages, from the topology weights.
+ *
+ * With -g the trace is generated instead: four threads per CPU, each with
+ * its pages on one domain, waking for random bursts, with the threads of
+ * domain 0 doing twice the work and a quarter of all threads moving their
+ * pages to the next domain halfway through.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+#define SIM_SCHED_PAGES         0       /* trace events */
+#define SIM_SCHED_WAKE          1
+#define SIM_SCHED_TICK          2
+
+struct sim_event {
+	int		se_type;
+	long		se_thread;
+	long		se_a;
+	long		se_b;
+};
+
+struct sim_sthread {
+	u_long		st_pages[NUMA_MAXDOMAINS];
+	u_long		st_total;
+	int		st_home;	/* -1 without pages */
+	int		st_cpu;		/* last CPU, -1 before the first run */
+	long		st_left;	/* ticks of work queued */
+	long		st_next;	/* next in the CPU queue, -1 at the end */
+};
+
+struct sim_cpu {
+	int		sc_domain;
+	long		sc_head;
+	long		sc_tail;
+	u_int		sc_load;
+};
+
+struct sim_sched {
+	const struct numa_topology *ss_topo;
+	int		ss_hints;
+	long		ss_period;
+	struct numa_sched_tun ss_tun;
+	struct sim_cpu	*ss_cpus;
+	int		ss_ncpus;
+	struct sim_sthread *ss_threads;
+	long		ss_nthreads;
+	long		ss_ticks;
+	long		ss_busy;	/* CPU ticks spent running */
+	long		ss_home;	/* of which on the home domain */
+	double		ss_dist;	/* summed distance of the busy ticks */
+	long		ss_cross;
+	long		ss_local;
+	long		ss_left_home;
+	long		ss_returned;
+	long		ss_denied;
+	long		ss_rehomed;
+};
+
+static const char *sim_sched_names[] = { "flat", "numa" };
+
+
+/* ---------- SIMULATION ---------- */
+
+static void
+sim_sched_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor sched [-S domains [-c cpus] | -f file] "
+	    "[-g ticks] [-i imbalance]\n"
+	    "           [-p period] [-r home_ratio] [trace]\n");
+	exit(1);
+}
+
+static struct sim_sthread *
+sim_sched_thread(struct sim_sched *ss, long id)
+{
+
+	if (id < 0 || id >= ss->ss_nthreads)
+		return (NULL);
+	return (&ss->ss_threads[id]);
+}
+
+static void
+sim_sched_enqueue(struct sim_sched *ss, int cpu, long id)
+{
+	struct sim_cpu *sc;
+
+	sc = &ss->ss_cpus[cpu];
+	ss->ss_threads[id].st_next = -1;
+	if (sc->sc_tail < 0)
+		sc->sc_head = id;
+	else
+		ss->ss_threads[sc->sc_tail].st_next = id;
+	sc->sc_tail = id;
+	sc->sc_load++;
+}
+
+/*
+ * Count the move of a thread from its last CPU to cpu.
+ */
+static void
+sim_sched_migrate(struct sim_sched *ss, struct sim_sthread *st, int cpu)
+{
+	int from, to;
+
+	if (st->st_cpu < 0 || st->st_cpu == cpu)
+		return;
+	from = ss->ss_cpus[st->st_cpu].sc_domain;
+	to = ss->ss_cpus[cpu].sc_domain;
+	if (from == to) {
+		ss->ss_local++;
+		return;
+	}
+	ss->ss_cross++;
+	if (ss->ss_hints && st->st_home == from)
+		ss->ss_left_home++;
+	else if (ss->ss_hints && st->st_home == to)
+		ss->ss_returned++;
+}
+
+/*
+ * The least loaded CPU of domain, or of all domains for -1, preferring
+ * prefer on ties.
+ */
+static int
+sim_sched_lowest(struct sim_sched *ss, int domain, int prefer)
+{
+	int best, c;
+
+	best = -1;
+	for (c = 0; c < ss->ss_ncpus; c++) {
+		if (domain >= 0 && ss->ss_cpus[c].sc_domain != domain)
+			continue;
+		if (best < 0 || ss->ss_cpus[c].sc_load <
+		    ss->ss_cpus[best].sc_load)
+			best = c;
+	}
+	if (prefer >= 0 && best >= 0 &&
+	    (domain < 0 || ss->ss_cpus[prefer].sc_domain == domain) &&
+	    ss->ss_cpus[prefer].sc_load <= ss->ss_cpus[best].sc_load)
+		best = prefer;
+	return (best);
+}
+
+static void
+sim_sched_wake(struct sim_sched *ss, long id, long ticks)
+{
+	struct sim_sthread *st;
+	int cpu, home_cpu;
+
+	if ((st = sim_sched_thread(ss, id)) == NULL || ticks <= 0)
+		return;
+	if (st->st_left > 0) {
+		/* Already queued: the work adds up. */
+		st->st_left += ticks;
+		return;
+	}
+	st->st_left = ticks;
+	cpu = sim_sched_lowest(ss, -1, st->st_cpu);
+	if (ss->ss_hints && st->st_home >= 0) {
+		home_cpu = sim_sched_lowest(ss, st->st_home, st->st_cpu);
+		if (home_cpu >= 0 && !numa_sched_away(
+		    ss->ss_cpus[home_cpu].sc_load, ss->ss_cpus[cpu].sc_load,
+		    &ss->ss_tun))
+			cpu = home_cpu;
+	}
+	sim_sched_migrate(ss, st, cpu);
+	st->st_cpu = cpu;
+	sim_sched_enqueue(ss, cpu, id);
+}
+
+/*
+ * Let the idle CPU cpu steal the last thread of the busiest CPU that has
+ * one waiting, in its own domain first.
+ */
+static void
+sim_sched_steal(struct sim_sched *ss, int cpu)
+{
+	struct sim_sthread *st;
+	struct sim_cpu *src;
+	long id, prev;
+	int c, pass, victim;
+
+	for (pass = 0; pass < 2; pass++) {
+		victim = -1;
+		for (c = 0; c < ss->ss_ncpus; c++) {
+			if ((ss->ss_cpus[c].sc_domain ==
+			    ss->ss_cpus[cpu].sc_domain) != (pass == 0))
+				continue;
+			if (ss->ss_cpus[c].sc_load >= 2 && (victim < 0 ||
+			    ss->ss_cpus[c].sc_load >
+			    ss->ss_cpus[victim].sc_load))
+				victim = c;
+		}
+		if (victim >= 0)
+			break;
+	}
+	if (victim < 0)
+		return;
+	src = &ss->ss_cpus[victim];
+	id = src->sc_tail;
+	st = &ss->ss_threads[id];
+	if (ss->ss_hints && !numa_sched_may_steal(st->st_home,
+	    src->sc_domain, ss->ss_cpus[cpu].sc_domain, src->sc_load,
+	    ss->ss_cpus[cpu].sc_load, &ss->ss_tun)) {
+		ss->ss_denied++;
+		return;
+	}
+	for (prev = src->sc_head; ss->ss_threads[prev].st_next != id;
+	    prev = ss->ss_threads[prev].st_next)
+		;
+	ss->ss_threads[prev].st_next = -1;
+	src->sc_tail = prev;
+	src->sc_load--;
+	sim_sched_migrate(ss, st, cpu);
+	st->st_cpu = cpu;
+	sim_sched_enqueue(ss, cpu, id);
+}
+
+static void
+sim_sched_tick(struct sim_sched *ss)
+{
+	const struct numa_topology *t;
+	struct sim_sthread *st;
+	struct sim_cpu *sc;
+	double dist;
+	long id;
+	int c, d, home;
+
+	t = ss->ss_topo;
+	for (c = 0; c < ss->ss_ncpus; c++) {
+		sc = &ss->ss_cpus[c];
+		if ((id = sc->sc_head) < 0)
+			continue;
+		st = &ss->ss_threads[id];
+		ss->ss_busy++;
+		if (st->st_total > 0) {
+			dist = 0;
+			for (d = 0; d < t->nt_ndomains; d++)
+				dist += (double)st->st_pages[d] *
+				    t->nt_weights[sc->sc_domain *
+				    t->nt_ndomains + d];
+			ss->ss_dist += dist / st->st_total;
+		}
+		if (sc->sc_domain == st->st_home)
+			ss->ss_home++;
+		sc->sc_head = st->st_next;
+		if (sc->sc_head < 0)
+			sc->sc_tail = -1;
+		sc->sc_load--;
+		if (--st->st_left > 0)
+			sim_sched_enqueue(ss, c, id);
+	}
+	for (c = 0; c < ss->ss_ncpus; c++)
+		if (ss->ss_cpus[c].sc_load == 0)
+			sim_sched_steal(ss, c);
+	if (++ss->ss_ticks % ss->ss_period != 0)
+		return;
+	for (id = 0; id < ss->ss_nthreads; id++) {
+		st = &ss->ss_threads[id];
+		home = numa_sched_rehome(st->st_pages, t->nt_ndomains,
+		    st->st_home, &ss->ss_tun);
+		if (home >= 0 && st->st_home >= 0 && home != st->st_home)
+			ss->ss_rehomed++;
+		if (home >= 0)
+			st->st_home = home;
+	}
+}
+
+static void
+sim_sched_run(struct sim_sched *ss, const struct sim_event *ev, long nev)
+{
+	struct sim_sthread *st;
+	long i, n, pending;
+	int c;
+
+	for (c = 0; c < ss->ss_ncpus; c++) {
+		ss->ss_cpus[c].sc_head = ss->ss_cpus[c].sc_tail = -1;
+		ss->ss_cpus[c].sc_load = 0;
+	}
+	for (i = 0; i < ss->ss_nthreads; i++) {
+		memset(&ss->ss_threads[i], 0, sizeof(ss->ss_threads[i]));
+		ss->ss_threads[i].st_home = ss->ss_threads[i].st_cpu = -1;
+	}
+	for (i = 0; i < nev; i++) {
+		switch (ev[i].se_type) {
+		case SIM_SCHED_PAGES:
+			st = &ss->ss_threads[ev[i].se_thread];
+			st->st_total += ev[i].se_b - st->st_pages[ev[i].se_a];
+			st->st_pages[ev[i].se_a] = ev[i].se_b;
+			/* A new thread gets its home right away. */
+			if (st->st_home < 0)
+				st->st_home = numa_sched_rehome(st->st_pages,
+				    ss->ss_topo->nt_ndomains, -1, &ss->ss_tun);
+			break;
+		case SIM_SCHED_WAKE:
+			sim_sched_wake(ss, ev[i].se_thread, ev[i].se_a);
+			break;
+		case SIM_SCHED_TICK:
+			for (n = 0; n < ev[i].se_a; n++)
+				sim_sched_tick(ss);
+			break;
+		}
+	}
+	/* Drain the queues. */
+	for (;;) {
+		pending = 0;
+		for (c = 0; c < ss->ss_ncpus; c++)
+			pending += ss->ss_cpus[c].sc_load;
+		if (pending == 0)
+			break;
+		sim_sched_tick(ss);
+	}
+}
+
+static void
+sim_sched_add(struct sim_event **ev, long *nev, int type, long thread, long a,
+    long b)
+{
+
+	if (*nev % 1024 == 0 &&
+	    (*ev = realloc(*ev, (*nev + 1024) * sizeof(**ev))) == NULL)
+		err(1, "realloc");
+	(*ev)[*nev].se_type = type;
+	(*ev)[*nev].se_thread = thread;
+	(*ev)[*nev].se_a = a;
+	(*ev)[*nev].se_b = b;
+	(*nev)++;
+}
+
+static long
+sim_sched_trace(struct sim_sched *ss, FILE *fp, const char *name,
+    struct sim_event **ev)
+{
+	char line[256], cmd[16];
+	long a, b, c, lineno, nev;
+	int n;
+
+	lineno = nev = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0')
+			continue;
+		n = sscanf(line, "%15s %ld %ld %ld", cmd, &a, &b, &c);
+		if (strcmp(cmd, "tick") == 0 && (n == 1 || (n == 2 && a > 0)))
+			sim_sched_add(ev, &nev, SIM_SCHED_TICK, -1,
+			    n == 1 ? 1 : a, 0);
+		else if (strcmp(cmd, "wake") == 0 && n == 3 && a >= 0)
+			sim_sched_add(ev, &nev, SIM_SCHED_WAKE, a, b, 0);
+		else if (strcmp(cmd, "pages") == 0 && n == 4 && a >= 0 &&
+		    b >= 0 && b < ss->ss_topo->nt_ndomains && c >= 0)
+			sim_sched_add(ev, &nev, SIM_SCHED_PAGES, a, b, c);
+		else
+			errx(1, "%s:%ld: malformed line", name, lineno);
+		if (a >= ss->ss_nthreads && strcmp(cmd, "tick") != 0)
+			ss->ss_nthreads = a + 1;
+	}
+	return (nev);
+}
+
+static long
+sim_sched_generate(struct sim_sched *ss, long ticks, struct sim_event **ev)
+{
+	long i, nev, tick;
+	int d, nd;
+
+	srandom(1);
+	nd = ss->ss_topo->nt_ndomains;
+	ss->ss_nthreads = ss->ss_ncpus * 4;
+	nev = 0;
+	for (i = 0; i < ss->ss_nthreads; i++) {
+		d = i % nd;
+		sim_sched_add(ev, &nev, SIM_SCHED_PAGES, i, d, 900);
+		sim_sched_add(ev, &nev, SIM_SCHED_PAGES, i, (d + 1) % nd, 100);
+	}
+	for (tick = 0; tick < ticks; tick += 10) {
+		if (tick == ticks / 2)
+			for (i = 0; i < ss->ss_nthreads; i += 4) {
+				d = i % nd;
+				sim_sched_add(ev, &nev, SIM_SCHED_PAGES, i, d,
+				    100);
+				sim_sched_add(ev, &nev, SIM_SCHED_PAGES, i,
+				    (d + 1) % nd, 900);
+			}
+		for (i = 0; i < ss->ss_nthreads; i++)
+			if (random() % 4 == 0)
+				sim_sched_add(ev, &nev, SIM_SCHED_WAKE, i,
+				    (1 + random() % 8) * (i % nd == 0 ? 2 : 1),
+				    0);
+		sim_sched_add(ev, &nev, SIM_SCHED_TICK, -1, 10, 0);
+	}
+	return (nev);
+}
+
+int
+sim_sched(int argc, char **argv)
+{
+	const struct numa_topology *t;
+	struct sim_event *ev;
+	struct sim_sched ss;
+	FILE *fp;
+	long nev, ticks;
+	int c, ch, ncpus, ndomains;
+
+	memset(&ss, 0, sizeof(ss));
+	ss.ss_tun.nst_imbalance = 2;
+	ss.ss_tun.nst_home_ratio = 150;
+	ss.ss_period = 100;
+	ndomains = 0;
+	ncpus = 2;
+	ticks = 0;
+	while ((ch = getopt(argc, argv, "S:c:f:g:i:p:r:")) != -1) {
+		switch (ch) {
+		case 'S':
+			ndomains = atoi(optarg);
+			break;
+		case 'c':
+			ncpus = atoi(optarg);
+			break;
+		case 'f':
+			if (numa_topology_load(NUMA_TOPO_FILE, optarg) == 0)
+				errx(1, "cannot load topology from %s", optarg);
+			break;
+		case 'g':
+			ticks = strtol(optarg, NULL, 0);
+			break;
+		case 'i':
+			ss.ss_tun.nst_imbalance = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			ss.ss_period = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			ss.ss_tun.nst_home_ratio = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			sim_sched_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (ndomains > 0 && numa_simulate(ndomains, ncpus) == 0)
+		errx(1, "invalid topology of %d domains of %d CPUs", ndomains,
+		    ncpus);
+	if ((t = numa_topology()) == NULL)
+		errx(1, "NUMA not available, use -S or -f");
+	if (t->nt_ndomains > NUMA_MAXDOMAINS || ss.ss_period <= 0)
+		sim_sched_usage();
+	ss.ss_topo = t;
+	if ((ss.ss_cpus = calloc(t->nt_ncpus, sizeof(*ss.ss_cpus))) == NULL)
+		err(1, "calloc");
+	for (c = 0; c < t->nt_ncpus; c++)
+		if (t->nt_cpu_domain[c] >= 0)
+			ss.ss_cpus[ss.ss_ncpus++].sc_domain =
+			    t->nt_cpu_domain[c];
+	if (ss.ss_ncpus == 0)
+		errx(1, "the topology has no CPUs");
+
+	ev = NULL;
+	if (ticks > 0)
+		nev = sim_sched_generate(&ss, ticks, &ev);
+	else if (argc == 0)
+		nev = sim_sched_trace(&ss, stdin, "stdin", &ev);
+	else {
+		if ((fp = fopen(argv[0], "r")) == NULL)
+			err(1, "%s", argv[0]);
+		nev = sim_sched_trace(&ss, fp, argv[0], &ev);
+		fclose(fp);
+	}
+	if ((ss.ss_threads = calloc(MAX(ss.ss_nthreads, 1),
+	    sizeof(*ss.ss_threads))) == NULL)
+		err(1, "calloc");
+
+	printf("%d domains, %d CPUs, %ld threads, imbalance %u, "
+	    "home ratio %u\n", t->nt_ndomains, ss.ss_ncpus, ss.ss_nthreads,
+	    ss.ss_tun.nst_imbalance, ss.ss_tun.nst_home_ratio);
+	printf("%-5s %8s %6s %6s %6s %7s %7s %6s %8s %7s %7s\n", "mode",
+	    "ticks", "busy%", "home%", "dist", "cross", "local", "left",
+	    "returned", "denied", "rehomed");
+	for (ss.ss_hints = 0; ss.ss_hints <= 1; ss.ss_hints++) {
+		ss.ss_ticks = ss.ss_busy = ss.ss_home = 0;
+		ss.ss_dist = 0;
+		ss.ss_cross = ss.ss_local = ss.ss_left_home = 0;
+		ss.ss_returned = ss.ss_denied = ss.ss_rehomed = 0;
+		sim_sched_run(&ss, ev, nev);
+		printf("%-5s %8ld %6.1f %6.1f %6.2f %7ld %7ld %6ld %8ld %7ld "
+		    "%7ld\n", sim_sched_names[ss.ss_hints], ss.ss_ticks,
+		    ss.ss_ticks > 0 ?
+		    100.0 * ss.ss_busy / ss.ss_ticks / ss.ss_ncpus : 0.0,
+		    ss.ss_busy > 0 ? 100.0 * ss.ss_home / ss.ss_busy : 0.0,
+		    ss.ss_busy > 0 ? ss.ss_dist / ss.ss_busy : 0.0,
+		    ss.ss_cross, ss.ss_local, ss.ss_left_home, ss.ss_returned,
+		    ss.ss_denied, ss.ss_rehomed);
+	}
+	free(ev);
+	free(ss.ss_threads);
+	free(ss.ss_cpus);
+	return (0);
+}
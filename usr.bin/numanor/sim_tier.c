@@ -0,0 +1,408 @@
+/*-
+ * Copyright (c) 2014 EMC Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * FreeBSD NUMA project - userspace
+ *
+ * numanor tier: replay of the kernel's memory tier decisions on a topology
+ * with memory-only domains.  Every page belongs to the thread of fast
+ * domain page % fast domains and is first touched in page order, so the
+ * fast tier fills up and the rest spills to the slow tier.  A hot set of
+ * hot_pct percent of the pages takes accesses accesses per period and
+ * moves on to the next pages every quarter of the run; every other page is
+ * touched once in a period with a chance of 1 in 64.  As in numanor
+ * balance, the first access to a page within a period faults.
+ *
+ * The run is made twice: "flat" keeps the placement of NUMA_POLICY_NEAREST,
+ * "tiered" that of NUMA_POLICY_TIERED with the kernel's demotions and
+ * promotions, decided by numa_tier_decide() and numa_balance_decide() from
+ * freebsdnuma.h at the end of every period, at most moves pages per period.
+ * A fast domain is at NUMA_PRESSURE_LOW once 90% of its fast_pages share is
+ * in use and at NUMA_PRESSURE_HIGH once it is full; slow domains never
+ * fill up.  An access costs fast_ns on a fast domain and slow_ns on a slow
+ * one, scaled by the distance from the accessing domain to the page over
+ * the distance to the nearest domain of the same tier.
+ */
+
+
+/* ----------- INCLUDES ----------- */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numanor.h"
+#include "numanor_private.h"
+
+
+/* ---------- DEFINITIONS --------- */
+
+struct sim_tier_page {
+	int		stp_domain;
+	int		stp_faulted;	/* faulted in this period */
+	int		stp_move;	/* numa_tier_decide() verdict */
+	struct numa_balance_stat stp_stat;
+};
+
+struct sim_tier {
+	const struct numa_topology *sti_topo;
+	int		sti_ndomains;
+	int		sti_tiered;
+	int		sti_fast[NUMA_MAXDOMAINS];	/* fast domains */
+	int		sti_nfast;
+	long		sti_capacity;	/* pages per fast domain */
+	long		sti_used[NUMA_MAXDOMAINS];
+	int		sti_pressure[NUMA_MAXDOMAINS];
+	double		sti_ns[NUMA_MAXDOMAINS * NUMA_MAXDOMAINS];
+	struct numa_tier_tun sti_tun;
+	struct numa_balance_tun sti_btun;
+	struct sim_tier_page *sti_pages;
+	long		sti_npages;
+	long		sti_hot;	/* pages in the hot set */
+	long		sti_accesses;	/* per hot page and period */
+	long		sti_moves;	/* per period */
+	double		sti_cost;
+	long		sti_total;
+	long		sti_fast_hits;
+	long		sti_promoted;
+	long		sti_demoted;
+	long		sti_failed;
+};
+
+
+/* ---------- SIMULATION ---------- */
+
+static void
+sim_tier_usage(void)
+{
+
+	fprintf(stderr, "usage: numanor tier [-S domains [-s slow] | -f file] "
+	    "[-F fast_pages] [-g periods]\n"
+	    "           [-h hot] [-k cold] [-l fast_ns,slow_ns] [-n pages] "
+	    "[-a accesses]\n"
+	    "           [-w hot_pct] [-m moves]\n");
+	exit(1);
+}
+
+/*
+ * Cost of an access from domain d to a page on domain e: the ns of e's tier,
+ * scaled by the distance to e over the distance to the nearest domain of
+ * that tier.
+ */
+static void
+sim_tier_costs(struct sim_tier *st, double fast_ns, double slow_ns)
+{
+	const struct numa_topology *t;
+	int d, e, f, n, near;
+
+	t = st->sti_topo;
+	n = st->sti_ndomains;
+	for (d = 0; d < n; d++)
+		for (e = 0; e < n; e++) {
+			near = 0;
+			for (f = 0; f < n; f++)
+				if (t->nt_tier[f] == t->nt_tier[e] &&
+				    (near == 0 || t->nt_weights[d * n + f] < near))
+					near = t->nt_weights[d * n + f];
+			st->sti_ns[d * n + e] = (t->nt_tier[e] ==
+			    NUMA_TIER_FAST ? fast_ns : slow_ns) *
+			    t->nt_weights[d * n + e] / MAX(near, 1);
+		}
+}
+
+static int
+sim_tier_full(const struct sim_tier *st, int d)
+{
+
+	return (st->sti_topo->nt_tier[d] == NUMA_TIER_FAST &&
+	    st->sti_used[d] >= st->sti_capacity);
+}
+
+static void
+sim_tier_pressure(struct sim_tier *st)
+{
+	int d;
+
+	for (d = 0; d < st->sti_ndomains; d++) {
+		if (st->sti_topo->nt_tier[d] != NUMA_TIER_FAST)
+			st->sti_pressure[d] = NUMA_PRESSURE_NONE;
+		else if (sim_tier_full(st, d))
+			st->sti_pressure[d] = NUMA_PRESSURE_HIGH;
+		else if (st->sti_used[d] * 10 >= st->sti_capacity * 9)
+			st->sti_pressure[d] = NUMA_PRESSURE_LOW;
+		else
+			st->sti_pressure[d] = NUMA_PRESSURE_NONE;
+	}
+}
+
+/*
+ * First touch of every page from the fast domain of its thread, taking the
+ * first domain of the policy order that has room.
+ */
+static void
+sim_tier_place(struct sim_tier *st)
+{
+	struct numa_policy np;
+	u_int rr;
+	long i;
+	int j, n, order[NUMA_MAXDOMAINS];
+
+	np.np_policy = NUMA_POLICY_NEAREST;
+	if (st->sti_tiered)
+		np.np_policy |= NUMA_POLICY_TIERED;
+	CPU_ZERO(&np.np_mask);
+	rr = 0;
+	for (i = 0; i < st->sti_npages; i++) {
+		n = numa_policy_order(&np, st->sti_ndomains,
+		    (const short *)st->sti_topo->nt_weights,
+		    st->sti_fast[i % st->sti_nfast], &rr, order);
+		if ((np.np_policy & NUMA_POLICY_TIERED) != 0)
+			numa_tier_order(st->sti_topo->nt_tier, order, n);
+		for (j = 0; j < n - 1 && sim_tier_full(st, order[j]); j++)
+			;
+		st->sti_pages[i].stp_domain = order[j];
+		st->sti_pages[i].stp_stat.nbs_candidate = -1;
+		st->sti_used[order[j]]++;
+	}
+}
+
+static void
+sim_tier_access(struct sim_tier *st, long i, long count)
+{
+	struct sim_tier_page *sp;
+	int d;
+
+	sp = &st->sti_pages[i];
+	d = st->sti_fast[i % st->sti_nfast];
+	st->sti_total += count;
+	st->sti_cost += count * st->sti_ns[d * st->sti_ndomains +
+	    sp->stp_domain];
+	if (st->sti_topo->nt_tier[sp->stp_domain] == NUMA_TIER_FAST)
+		st->sti_fast_hits += count;
+	if (!sp->stp_faulted) {
+		sp->stp_faulted = 1;
+		numa_balance_record(&sp->stp_stat, d);
+	}
+}
+
+static void
+sim_tier_move(struct sim_tier *st, struct sim_tier_page *sp, int d)
+{
+
+	if (sim_tier_full(st, d)) {
+		st->sti_failed++;
+		return;
+	}
+	st->sti_used[sp->stp_domain]--;
+	st->sti_used[d]++;
+	if (st->sti_topo->nt_tier[d] == NUMA_TIER_FAST)
+		st->sti_promoted++;
+	else
+		st->sti_demoted++;
+	sp->stp_domain = d;
+}
+
+/*
+ * End of a period: judge every page against the pressure at the start of
+ * the period, then carry out the demotions ahead of the promotions so the
+ * room they free can be used at once.
+ */
+static void
+sim_tier_period(struct sim_tier *st)
+{
+	struct sim_tier_page *sp;
+	long i, moves;
+	int pass;
+
+	sim_tier_pressure(st);
+	for (i = 0; i < st->sti_npages; i++) {
+		sp = &st->sti_pages[i];
+		sp->stp_faulted = 0;
+		sp->stp_move = numa_tier_decide(&sp->stp_stat,
+		    st->sti_ndomains, st->sti_topo->nt_tier,
+		    (const short *)st->sti_topo->nt_weights, st->sti_pressure,
+		    sp->stp_domain, &st->sti_tun);
+		(void)numa_balance_decide(&sp->stp_stat, st->sti_ndomains,
+		    sp->stp_domain, &st->sti_btun);
+	}
+	moves = 0;
+	for (pass = NUMA_TIER_SLOW; pass >= NUMA_TIER_FAST; pass--)
+		for (i = 0; i < st->sti_npages && moves < st->sti_moves; i++) {
+			sp = &st->sti_pages[i];
+			if (sp->stp_move < 0 ||
+			    st->sti_topo->nt_tier[sp->stp_move] != pass)
+				continue;
+			sim_tier_move(st, sp, sp->stp_move);
+			moves++;
+		}
+}
+
+static void
+sim_tier_run(struct sim_tier *st, long periods)
+{
+	long base, i, p;
+
+	srandom(1);
+	memset(st->sti_pages, 0, st->sti_npages * sizeof(*st->sti_pages));
+	memset(st->sti_used, 0, sizeof(st->sti_used));
+	st->sti_cost = 0;
+	st->sti_total = st->sti_fast_hits = 0;
+	st->sti_promoted = st->sti_demoted = st->sti_failed = 0;
+	sim_tier_place(st);
+
+	for (p = 0; p < periods; p++) {
+		/* Start on the spilled pages, move on every quarter. */
+		base = st->sti_npages / 2 + p / MAX(periods / 4, 1) *
+		    st->sti_hot;
+		for (i = 0; i < st->sti_npages; i++) {
+			if ((i - base + st->sti_npages) % st->sti_npages <
+			    st->sti_hot)
+				sim_tier_access(st, i, st->sti_accesses);
+			else if (random() % 64 == 0)
+				sim_tier_access(st, i, 1);
+		}
+		if (st->sti_tiered)
+			sim_tier_period(st);
+	}
+	printf("%-7s mean %6.1f ns  fast tier hits %5.1f%%  "
+	    "promoted %ld demoted %ld failed %ld\n",
+	    st->sti_tiered ? "tiered" : "flat",
+	    st->sti_total > 0 ? st->sti_cost / st->sti_total : 0.0,
+	    st->sti_total > 0 ? 100.0 * st->sti_fast_hits / st->sti_total :
+	    0.0, st->sti_promoted, st->sti_demoted, st->sti_failed);
+}
+
+int
+sim_tier(int argc, char **argv)
+{
+	const struct numa_topology *t;
+	struct sim_tier st;
+	double fast_ns, slow_ns;
+	long fast_pages, periods, pct;
+	int ch, d, ndomains, nslow;
+
+	memset(&st, 0, sizeof(st));
+	st.sti_tun.ntt_hot = 2;
+	st.sti_tun.ntt_cold = 2;
+	st.sti_tun.ntt_pressure = NUMA_PRESSURE_LOW;
+	st.sti_btun.nbt_min_faults = 1;
+	st.sti_btun.nbt_ratio = 200;
+	st.sti_btun.nbt_hysteresis = 2;
+	st.sti_npages = 4096;
+	st.sti_accesses = 16;
+	st.sti_moves = 512;
+	fast_pages = 0;
+	fast_ns = 100;
+	slow_ns = 250;
+	periods = 40;
+	pct = 10;
+	ndomains = 0;
+	nslow = 1;
+	while ((ch = getopt(argc, argv, "F:S:a:f:g:h:k:l:m:n:s:w:")) != -1) {
+		switch (ch) {
+		case 'F':
+			fast_pages = strtol(optarg, NULL, 0);
+			break;
+		case 'S':
+			ndomains = atoi(optarg);
+			break;
+		case 'a':
+			st.sti_accesses = strtol(optarg, NULL, 0);
+			break;
+		case 'f':
+			if (numa_topology_load(NUMA_TOPO_FILE, optarg) == 0)
+				errx(1, "cannot load topology from %s", optarg);
+			break;
+		case 'g':
+			periods = strtol(optarg, NULL, 0);
+			break;
+		case 'h':
+			st.sti_tun.ntt_hot = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			st.sti_tun.ntt_cold = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			if (sscanf(optarg, "%lf,%lf", &fast_ns, &slow_ns) != 2 ||
+			    fast_ns <= 0 || slow_ns <= 0)
+				errx(1, "invalid latencies %s", optarg);
+			break;
+		case 'm':
+			st.sti_moves = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			st.sti_npages = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			nslow = atoi(optarg);
+			break;
+		case 'w':
+			pct = strtol(optarg, NULL, 0);
+			break;
+		default:
+			sim_tier_usage();
+		}
+	}
+	if (ndomains > 0 && numa_simulate_tiered(ndomains, 1, nslow) == 0)
+		errx(1, "invalid topology of %d domains, %d without CPUs",
+		    ndomains, nslow);
+	if ((t = numa_topology()) == NULL)
+		errx(1, "NUMA not available, use -S or -f");
+	if (st.sti_npages <= 0 || periods <= 0 || pct <= 0 || pct > 100)
+		sim_tier_usage();
+	st.sti_topo = t;
+	st.sti_ndomains = MIN(t->nt_ndomains, NUMA_BALANCE_MAXDOM);
+	for (d = 0; d < st.sti_ndomains; d++)
+		if (t->nt_tier[d] == NUMA_TIER_FAST)
+			st.sti_fast[st.sti_nfast++] = d;
+	if (st.sti_nfast == 0 || st.sti_nfast == st.sti_ndomains)
+		errx(1, "the topology needs domains with and without CPUs");
+	if (fast_pages <= 0)
+		fast_pages = st.sti_npages / 4;
+	st.sti_capacity = MAX(fast_pages / st.sti_nfast, 1);
+	st.sti_hot = MAX(st.sti_npages * pct / 100, 1);
+	sim_tier_costs(&st, fast_ns, slow_ns);
+	if ((st.sti_pages = calloc(st.sti_npages, sizeof(*st.sti_pages))) ==
+	    NULL)
+		err(1, "calloc");
+
+	printf("%d domains, %d without CPUs; %ld pages, %ld fast tier pages, "
+	    "%ld hot; %.0f/%.0f ns\n", st.sti_ndomains,
+	    st.sti_ndomains - st.sti_nfast, st.sti_npages,
+	    st.sti_capacity * st.sti_nfast, st.sti_hot, fast_ns, slow_ns);
+	st.sti_tiered = 0;
+	sim_tier_run(&st, periods);
+	st.sti_tiered = 1;
+	sim_tier_run(&st, periods);
+	free(st.sti_pages);
+	return (0);
+}